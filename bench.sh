@@ -0,0 +1,79 @@
+#!/bin/sh
+# Benchmark suite: runs the server on localhost in a temporary directory and drives it with loadgen
+# over several connection counts and rotation thresholds, one result line per run.
+#
+# Usage: ./bench.sh [loadgen options...]
+# Environment:
+#   PORT        port to listen on (default 9500)
+#   MODES       server configurations to compare, ';' separated lines of config keys joined with ','
+#               (default "server_mode=fork;server_mode=epoll;server_mode=uring;server_mode=epoll,workers=2")
+#   CONNECTIONS connection counts (default "1 16 128")
+#   THRESHOLDS  log_file_threshold values in bytes (default "1000000 64000000")
+#   MESSAGES    messages per connection (default 20000)
+#   PROTOCOLS   "tcp" and/or "udp" (default "tcp"); udp sends the batches as datagrams to udp_port,
+#               printing the server's datagram counters after the run
+# Extra arguments are passed to loadgen, e.g. "-t" for the text protocol or "-s 64-512".
+
+set -e
+cd "$(dirname "$0")"
+PORT=${PORT:-9500}
+MODES=${MODES:-"server_mode=fork;server_mode=epoll;server_mode=uring;server_mode=epoll,workers=2"}
+CONNECTIONS=${CONNECTIONS:-"1 16 128"}
+THRESHOLDS=${THRESHOLDS:-"1000000 64000000"}
+MESSAGES=${MESSAGES:-20000}
+PROTOCOLS=${PROTOCOLS:-tcp}
+
+work=$(mktemp -d)
+trap 'exec 3>&- 2>/dev/null; rm -rf "$work"' EXIT
+
+gcc -O2 server.c record_ring.c scan.c manifest.c uring.c binary_segment.c segment_compress.c segment_sidecar.c shm_ingest.c stats.c -o "$work/server" -pthread
+gcc -O2 loadgen.c manifest.c binary_segment.c -o "$work/loadgen" -pthread
+
+run()
+{
+    mode=$1 connections=$2 threshold=$3 protocol=$4
+    shift 4
+    rm -rf "$work/logs" "$work/control"
+    mkdir "$work/logs"
+    {
+        echo "port=$PORT"
+        echo "directory=$work/logs"
+        echo "ip_address=127.0.0.1"
+        echo "log_file_threshold=$threshold"
+        echo "max_log_files=5"
+        echo "$mode" | tr ',' '\n'
+        if [ "$protocol" = udp ]; then
+            echo "udp_port=$PORT"
+        fi
+    } > "$work/config.txt"
+    rm -f /dev/shm/sem.logSyncSem
+
+    # The server quits when its standard input is closed, so it reads from a fifo held open here
+    mkfifo "$work/control"
+    (cd "$work" && exec setsid ./server < control > server.out 2>&1) &
+    pid=$!
+    exec 3> "$work/control"
+    sleep 0.5
+
+    printf "mode=%s threshold=%s " "$mode" "$threshold"
+    if [ "$protocol" = udp ]; then
+        set -- -u "$@"
+    fi
+    "$work/loadgen" -p "$PORT" -c "$connections" -n "$MESSAGES" -d "$work/logs" "$@"
+
+    exec 3>&-
+    wait "$pid" || true
+    if [ "$protocol" = udp ]; then
+        grep -rh --include="server_log_*" "Datagrams:" "$work/logs" || true
+    fi
+}
+
+echo "$MODES" | tr ';' '\n' | while read -r mode; do
+    for threshold in $THRESHOLDS; do
+        for connections in $CONNECTIONS; do
+            for protocol in $PROTOCOLS; do
+                run "$mode" "$connections" "$threshold" "$protocol" "$@"
+            done
+        done
+    done
+done
@@ -0,0 +1,613 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "binary_segment.h"
+
+#define BLOCK_ENTRY_OVERHEAD 32 // Tag and varints of one entry, at most
+
+static uint32_t crcTable[256];
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+
+// Function to compute a CRC-32C 8 bytes at a time with the SSE4.2 instruction
+__attribute__((target("sse4.2"))) static uint32_t crc32cSse42(uint32_t crc, const unsigned char *data, size_t length)
+{
+    uint64_t value = ~crc;
+
+    for (; length >= 8; data += 8, length -= 8)
+    {
+        uint64_t word;
+        memcpy(&word, data, 8);
+        value = _mm_crc32_u64(value, word);
+    }
+    uint32_t rest = value;
+    for (; length > 0; data++, length--)
+    {
+        rest = _mm_crc32_u8(rest, *data);
+    }
+    return ~rest;
+}
+#endif
+
+// Function to compute a CRC-32C a byte at a time, used where the instruction is missing
+static uint32_t crc32cScalar(uint32_t crc, const unsigned char *data, size_t length)
+{
+    crc = ~crc;
+    for (size_t i = 0; i < length; i++)
+    {
+        crc = crcTable[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+// Implementation picked once at start up for the CPU we run on
+static uint32_t (*crc32cImpl)(uint32_t, const unsigned char *, size_t) = crc32cScalar;
+
+__attribute__((constructor)) static void selectCrcImplementation(void)
+{
+    for (uint32_t i = 0; i < 256; i++)
+    {
+        uint32_t crc = i;
+        for (int bit = 0; bit < 8; bit++)
+        {
+            crc = (crc & 1) ? (crc >> 1) ^ 0x82f63b78 : crc >> 1;
+        }
+        crcTable[i] = crc;
+    }
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.2"))
+    {
+        crc32cImpl = crc32cSse42;
+    }
+#endif
+}
+
+// Function to compute the CRC-32C of a buffer, also used by the compressed segment format
+uint32_t binaryCrc32c(const void *data, size_t length)
+{
+    return crc32cImpl(0, data, length);
+}
+
+static void put32(unsigned char *p, uint32_t value)
+{
+    for (int i = 0; i < 4; i++)
+    {
+        p[i] = value >> (8 * i);
+    }
+}
+
+static uint32_t get32(const unsigned char *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+// Function to append a varint: 7 bits per byte, the high bit set on every byte but the last
+static unsigned char *putVarint(unsigned char *p, uint64_t value)
+{
+    while (value >= 0x80)
+    {
+        *p++ = value | 0x80;
+        value >>= 7;
+    }
+    *p++ = value;
+    return p;
+}
+
+// Function to read a varint. It returns NULL when it runs past 'end'.
+static const unsigned char *getVarint(const unsigned char *p, const unsigned char *end, uint64_t *value)
+{
+    *value = 0;
+    for (int shift = 0; p < end && shift < 64; shift += 7)
+    {
+        *value |= (uint64_t)(*p & 0x7f) << shift;
+        if (!(*p++ & 0x80))
+        {
+            return p;
+        }
+    }
+    return NULL;
+}
+
+static uint64_t zigzag(int64_t value)
+{
+    return ((uint64_t)value << 1) ^ (uint64_t)(value >> 63);
+}
+
+static int64_t unzigzag(uint64_t value)
+{
+    return (int64_t)(value >> 1) ^ -(int64_t)(value & 1);
+}
+
+// Function to count the days from 1970-01-01 to a civil date
+static int64_t daysFromCivil(int year, unsigned month, unsigned day)
+{
+    year -= month <= 2;
+    int64_t era = (year >= 0 ? year : year - 399) / 400;
+    unsigned yearOfEra = year - era * 400;
+    unsigned dayOfYear = (153 * (month + (month > 2 ? -3 : 9)) + 2) / 5 + day - 1;
+    unsigned dayOfEra = yearOfEra * 365 + yearOfEra / 4 - yearOfEra / 100 + dayOfYear;
+    return era * 146097 + (int64_t)dayOfEra - 719468;
+}
+
+// Function to read the "[[YYYY-mm-dd HH:MM:SS]] " opening of a line as wall clock seconds.
+// It returns 0 when the line does not open with a timestamp the renderer gives back exactly.
+// Consecutive lines nearly always share their second, so the last one is cached.
+int binaryParseTimestamp(const char *line, size_t length, int64_t *seconds)
+{
+    static __thread char cachedText[BINARY_TIMESTAMP_LENGTH];
+    static __thread int64_t cachedSeconds;
+    static const char pattern[] = "[[dddd-dd-dd dd:dd:dd]] ";
+    int fields[6];
+
+    if (length < BINARY_TIMESTAMP_LENGTH)
+    {
+        return 0;
+    }
+    if (memcmp(line, cachedText, BINARY_TIMESTAMP_LENGTH) == 0)
+    {
+        *seconds = cachedSeconds;
+        return 1;
+    }
+    for (int i = 0, field = -1; i < BINARY_TIMESTAMP_LENGTH; i++)
+    {
+        if (pattern[i] != 'd')
+        {
+            if (line[i] != pattern[i])
+            {
+                return 0;
+            }
+            continue;
+        }
+        if (line[i] < '0' || line[i] > '9')
+        {
+            return 0;
+        }
+        // A field starts after every separator
+        if (pattern[i - 1] != 'd')
+        {
+            fields[++field] = 0;
+        }
+        fields[field] = fields[field] * 10 + (line[i] - '0');
+    }
+    if (fields[1] < 1 || fields[1] > 12 || fields[2] < 1 || fields[2] > 31 || fields[3] > 23 || fields[4] > 59 || fields[5] > 59)
+    {
+        return 0;
+    }
+    *seconds = daysFromCivil(fields[0], fields[1], fields[2]) * 86400 + fields[3] * 3600 + fields[4] * 60 + fields[5];
+    memcpy(cachedText, line, BINARY_TIMESTAMP_LENGTH);
+    cachedSeconds = *seconds;
+    return 1;
+}
+
+// Function to hash a connection of the dictionary (FNV-1a)
+static uint32_t hashConnection(const char *ip, size_t ipLength, const char *name, size_t nameLength)
+{
+    uint32_t hash = 2166136261u;
+
+    for (size_t i = 0; i < ipLength; i++)
+    {
+        hash = (hash ^ (unsigned char)ip[i]) * 16777619u;
+    }
+    hash = (hash ^ 0xff) * 16777619u;
+    for (size_t i = 0; i < nameLength; i++)
+    {
+        hash = (hash ^ (unsigned char)name[i]) * 16777619u;
+    }
+    return hash;
+}
+
+// Function to empty a dictionary
+void binaryDictionaryReset(struct binaryDictionary *dictionary)
+{
+    dictionary->count = 0;
+    memset(dictionary->slots, 0, sizeof(dictionary->slots));
+}
+
+// Function to find a connection in the dictionary. It returns its id, or -1 with '*slot' set to
+// the free hash slot where it would go.
+static int dictionaryFind(const struct binaryDictionary *dictionary, const char *ip, size_t ipLength,
+                          const char *name, size_t nameLength, unsigned *slot)
+{
+    unsigned i = hashConnection(ip, ipLength, name, nameLength) % BINARY_DICTIONARY_SLOTS;
+
+    while (dictionary->slots[i] != 0)
+    {
+        unsigned id = dictionary->slots[i] - 1;
+        if (strncmp(dictionary->entries[id].ip, ip, ipLength) == 0 && dictionary->entries[id].ip[ipLength] == '\0' &&
+            strncmp(dictionary->entries[id].name, name, nameLength) == 0 && dictionary->entries[id].name[nameLength] == '\0')
+        {
+            return id;
+        }
+        i = (i + 1) % BINARY_DICTIONARY_SLOTS;
+    }
+    *slot = i;
+    return -1;
+}
+
+// Function to add a connection under the next id, as read back from a segment. It returns -1
+// when the dictionary is full, the id is not the next one or a field is too long.
+int binaryDictionaryDefine(struct binaryDictionary *dictionary, unsigned id, const char *ip, size_t ipLength, const char *name, size_t nameLength)
+{
+    unsigned slot;
+
+    if (id != dictionary->count || id >= BINARY_DICTIONARY_ENTRIES || ipLength >= BINARY_IP_LENGTH || nameLength >= BINARY_NAME_LENGTH)
+    {
+        return -1;
+    }
+    if (dictionaryFind(dictionary, ip, ipLength, name, nameLength, &slot) < 0)
+    {
+        dictionary->slots[slot] = id + 1;
+    }
+    memcpy(dictionary->entries[id].ip, ip, ipLength);
+    dictionary->entries[id].ip[ipLength] = '\0';
+    memcpy(dictionary->entries[id].name, name, nameLength);
+    dictionary->entries[id].name[nameLength] = '\0';
+    dictionary->count++;
+    return 0;
+}
+
+// Function to make room for 'length' more bytes. It returns -1 when out of memory.
+int binaryBufferReserve(struct binaryBuffer *buffer, size_t length)
+{
+    if (buffer->length + length <= buffer->capacity)
+    {
+        return 0;
+    }
+    size_t capacity = (buffer->capacity > 0) ? buffer->capacity : 65536;
+    while (capacity < buffer->length + length)
+    {
+        capacity *= 2;
+    }
+    char *data = realloc(buffer->data, capacity);
+    if (data == NULL)
+    {
+        return -1;
+    }
+    buffer->data = data;
+    buffer->capacity = capacity;
+    return 0;
+}
+
+// Function to split "Client (IP) - name: payload" into its fields. It returns 0 for any other line.
+int binarySplitClientRecord(const char *line, size_t length, const char **ip, size_t *ipLength,
+                            const char **name, size_t *nameLength, const char **payload)
+{
+    const char *end = line + length;
+
+    if (length < 8 || memcmp(line, "Client (", 8) != 0)
+    {
+        return 0;
+    }
+    *ip = line + 8;
+    const char *close = memchr(*ip, ')', end - *ip);
+    if (close == NULL || end - close < 4 || memcmp(close, ") - ", 4) != 0)
+    {
+        return 0;
+    }
+    *ipLength = close - *ip;
+    *name = close + 4;
+    // The name ends at the first ": ", which is also where rendering puts it back
+    for (const char *p = *name; p + 1 < end; p++)
+    {
+        if (p[0] == ':' && p[1] == ' ')
+        {
+            *nameLength = p - *name;
+            *payload = p + 2;
+            return *ipLength < BINARY_IP_LENGTH && *nameLength < BINARY_NAME_LENGTH;
+        }
+    }
+    return 0;
+}
+
+// Function to encode newline-terminated text records as one block appended to 'out'. Connections
+// missing from the dictionary are defined in the block. It returns -1 when out of memory.
+int binaryEncodeBlock(struct binaryDictionary *dictionary, const char *text, size_t length, struct binaryBuffer *out)
+{
+    const char *end = text + length;
+    const char *firstNewline = memchr(text, '\n', length);
+    int64_t previous = 0;
+
+    // The base time is the one of the first line, when it has one
+    binaryParseTimestamp(text, (firstNewline != NULL) ? (size_t)(firstNewline - text) : length, &previous);
+    if (binaryBufferReserve(out, BINARY_BLOCK_HEADER + BLOCK_ENTRY_OVERHEAD) != 0)
+    {
+        return -1;
+    }
+    size_t blockStart = out->length;
+    out->length = (char *)putVarint((unsigned char *)out->data + blockStart + BINARY_BLOCK_HEADER, zigzag(previous)) - out->data;
+
+    while (text < end)
+    {
+        const char *newline = memchr(text, '\n', end - text);
+        const char *lineEnd = (newline != NULL) ? newline : end;
+        size_t lineLength = lineEnd - text;
+        const char *ip, *name, *payload;
+        size_t ipLength, nameLength;
+        int64_t seconds;
+
+        // Room for the line, a definition and the varints
+        if (binaryBufferReserve(out, lineLength + BINARY_IP_LENGTH + BINARY_NAME_LENGTH + 2 * BLOCK_ENTRY_OVERHEAD) != 0)
+        {
+            out->length = blockStart;
+            return -1;
+        }
+        unsigned char *p = (unsigned char *)out->data + out->length;
+
+        if (!binaryParseTimestamp(text, lineLength, &seconds))
+        {
+            *p++ = BINARY_RAW;
+            p = putVarint(p, lineLength);
+            memcpy(p, text, lineLength);
+            p += lineLength;
+        }
+        else
+        {
+            uint64_t delta = zigzag(seconds - previous);
+            previous = seconds;
+
+            const char *line = text + BINARY_TIMESTAMP_LENGTH;
+            size_t rest = lineLength - BINARY_TIMESTAMP_LENGTH;
+            int id = -1;
+            unsigned slot;
+            if (binarySplitClientRecord(line, rest, &ip, &ipLength, &name, &nameLength, &payload))
+            {
+                id = dictionaryFind(dictionary, ip, ipLength, name, nameLength, &slot);
+                if (id < 0 && dictionary->count < BINARY_DICTIONARY_ENTRIES)
+                {
+                    id = dictionary->count;
+                    binaryDictionaryDefine(dictionary, id, ip, ipLength, name, nameLength);
+                    *p++ = BINARY_DEFINE;
+                    p = putVarint(p, id);
+                    p = putVarint(p, ipLength);
+                    memcpy(p, ip, ipLength);
+                    p += ipLength;
+                    p = putVarint(p, nameLength);
+                    memcpy(p, name, nameLength);
+                    p += nameLength;
+                }
+            }
+            if (id >= 0)
+            {
+                size_t payloadLength = lineEnd - payload;
+                *p++ = BINARY_RECORD;
+                p = putVarint(p, delta);
+                p = putVarint(p, id);
+                p = putVarint(p, payloadLength);
+                memcpy(p, payload, payloadLength);
+                p += payloadLength;
+            }
+            else
+            {
+                *p++ = BINARY_TEXT;
+                p = putVarint(p, delta);
+                p = putVarint(p, rest);
+                memcpy(p, line, rest);
+                p += rest;
+            }
+        }
+        out->length = (char *)p - out->data;
+        text = lineEnd + 1;
+    }
+
+    unsigned char *header = (unsigned char *)out->data + blockStart;
+    size_t payloadLength = out->length - blockStart - BINARY_BLOCK_HEADER;
+    put32(header, BINARY_BLOCK_MAGIC);
+    put32(header + 4, payloadLength);
+    put32(header + 8, crc32cImpl(0, header + BINARY_BLOCK_HEADER, payloadLength));
+    return 0;
+}
+
+// Function to check the block at 'data'. It returns the size of the whole block when it is complete and
+// its checksum matches, 0 when it is not complete yet (zeros mean preallocated space not written yet),
+// and -1 when it is damaged.
+long binaryBlockCheck(const char *data, size_t available)
+{
+    const unsigned char *header = (const unsigned char *)data;
+
+    if (available < 4 || get32(header) == 0)
+    {
+        return 0;
+    }
+    if (get32(header) != BINARY_BLOCK_MAGIC)
+    {
+        return -1;
+    }
+    if (available < BINARY_BLOCK_HEADER || available - BINARY_BLOCK_HEADER < get32(header + 4))
+    {
+        return 0;
+    }
+    uint32_t length = get32(header + 4);
+    if (crc32cImpl(0, header + BINARY_BLOCK_HEADER, length) != get32(header + 8))
+    {
+        return -1;
+    }
+    return BINARY_BLOCK_HEADER + (long)length;
+}
+
+// Function to start decoding a block that passed binaryBlockCheck(). It returns -1 when the block is malformed.
+int binaryBlockOpen(struct binaryCursor *cursor, const char *block)
+{
+    const unsigned char *header = (const unsigned char *)block;
+    uint64_t base;
+
+    cursor->end = header + BINARY_BLOCK_HEADER + get32(header + 4);
+    cursor->p = getVarint(header + BINARY_BLOCK_HEADER, cursor->end, &base);
+    if (cursor->p == NULL)
+    {
+        cursor->p = cursor->end;
+        return -1;
+    }
+    cursor->time = unzigzag(base);
+    return 0;
+}
+
+// Function to decode the next entry of a block. It returns 1 for an entry, 0 at the end of the block
+// and -1 when the entry is malformed.
+int binaryBlockNext(struct binaryCursor *cursor, struct binaryEntry *entry)
+{
+    const unsigned char *p = cursor->p;
+    const unsigned char *end = cursor->end;
+    uint64_t value, length;
+
+    if (p == end)
+    {
+        return 0;
+    }
+    memset(entry, 0, sizeof(*entry));
+    entry->tag = *p++;
+    if (entry->tag == BINARY_RECORD || entry->tag == BINARY_TEXT)
+    {
+        if ((p = getVarint(p, end, &value)) == NULL)
+        {
+            return -1;
+        }
+        cursor->time += unzigzag(value);
+        entry->time = cursor->time;
+    }
+    if (entry->tag == BINARY_RECORD || entry->tag == BINARY_DEFINE)
+    {
+        if ((p = getVarint(p, end, &value)) == NULL)
+        {
+            return -1;
+        }
+        entry->id = value;
+    }
+    else if (entry->tag != BINARY_TEXT && entry->tag != BINARY_RAW)
+    {
+        return -1;
+    }
+    if ((p = getVarint(p, end, &length)) == NULL || length > (uint64_t)(end - p))
+    {
+        return -1;
+    }
+    entry->data = (const char *)p;
+    entry->length = length;
+    p += length;
+    if (entry->tag == BINARY_DEFINE)
+    {
+        if ((p = getVarint(p, end, &length)) == NULL || length > (uint64_t)(end - p))
+        {
+            return -1;
+        }
+        entry->name = (const char *)p;
+        entry->nameLength = length;
+        p += length;
+    }
+    cursor->p = p;
+    return 1;
+}
+
+// Function to append an entry rendered as the line a text segment would hold. Definitions extend
+// the dictionary and render nothing. It returns -1 when out of memory.
+int binaryRenderEntry(struct binaryDictionary *dictionary, const struct binaryEntry *entry, struct binaryBuffer *out)
+{
+    static __thread int64_t cachedSeconds = INT64_MIN;
+    static __thread char cachedText[BINARY_TIMESTAMP_LENGTH + 1];
+
+    if (entry->tag == BINARY_DEFINE)
+    {
+        binaryDictionaryDefine(dictionary, entry->id, entry->data, entry->length, entry->name, entry->nameLength);
+        return 0;
+    }
+    if (binaryBufferReserve(out, entry->length + BINARY_TIMESTAMP_LENGTH + BINARY_IP_LENGTH + BINARY_NAME_LENGTH + 16) != 0)
+    {
+        return -1;
+    }
+    char *p = out->data + out->length;
+    if (entry->tag != BINARY_RAW)
+    {
+        if (entry->time != cachedSeconds)
+        {
+            struct tm timeinfo;
+            time_t t = entry->time;
+            gmtime_r(&t, &timeinfo);
+            strftime(cachedText, sizeof(cachedText), "[[%Y-%m-%d %H:%M:%S]] ", &timeinfo);
+            cachedSeconds = entry->time;
+        }
+        memcpy(p, cachedText, BINARY_TIMESTAMP_LENGTH);
+        p += BINARY_TIMESTAMP_LENGTH;
+    }
+    if (entry->tag == BINARY_RECORD)
+    {
+        int known = entry->id < dictionary->count;
+        p += sprintf(p, "Client (%s) - %s: ", known ? dictionary->entries[entry->id].ip : "?", known ? dictionary->entries[entry->id].name : "?");
+    }
+    memcpy(p, entry->data, entry->length);
+    p += entry->length;
+    *p++ = '\n';
+    out->length = p - out->data;
+    return 0;
+}
+
+// Function to tell whether a segment file is in the binary format
+int binarySegmentIsBinary(int fd)
+{
+    char magic[BINARY_SEGMENT_MAGIC_LENGTH];
+
+    return pread(fd, magic, sizeof(magic), 0) == sizeof(magic) && memcmp(magic, BINARY_SEGMENT_MAGIC, sizeof(magic)) == 0;
+}
+
+// Function to read a binary segment from the start up to its last complete, intact block. The connections it
+// defines are loaded into 'dictionary' when it is not NULL. It returns the offset where the valid data ends,
+// or -1 when the file is not a binary segment.
+long binarySegmentScan(int fd, struct binaryDictionary *dictionary)
+{
+    struct binaryBuffer buffer = {0};
+    long offset = BINARY_SEGMENT_MAGIC_LENGTH;
+    size_t start = 0;
+    ssize_t n;
+
+    if (!binarySegmentIsBinary(fd))
+    {
+        return -1;
+    }
+    if (dictionary != NULL)
+    {
+        binaryDictionaryReset(dictionary);
+    }
+    // 'buffer' holds the file from 'offset' on, 'start' bytes of it already decoded
+    for (;;)
+    {
+        if (binaryBufferReserve(&buffer, 65536) != 0)
+        {
+            break;
+        }
+        n = pread(fd, buffer.data + buffer.length, buffer.capacity - buffer.length, offset + buffer.length);
+        if (n > 0)
+        {
+            buffer.length += n;
+        }
+
+        long size;
+        while ((size = binaryBlockCheck(buffer.data + start, buffer.length - start)) > 0)
+        {
+            struct binaryCursor cursor;
+            struct binaryEntry entry;
+            binaryBlockOpen(&cursor, buffer.data + start);
+            while (dictionary != NULL && binaryBlockNext(&cursor, &entry) > 0)
+            {
+                if (entry.tag == BINARY_DEFINE)
+                {
+                    binaryDictionaryDefine(dictionary, entry.id, entry.data, entry.length, entry.name, entry.nameLength);
+                }
+            }
+            start += size;
+        }
+        // A damaged block, or the end of the file
+        if (size < 0 || n <= 0)
+        {
+            break;
+        }
+        memmove(buffer.data, buffer.data + start, buffer.length - start);
+        offset += start;
+        buffer.length -= start;
+        start = 0;
+    }
+    free(buffer.data);
+    return offset + start;
+}
@@ -0,0 +1,95 @@
+#ifndef BINARY_SEGMENT_H
+#define BINARY_SEGMENT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Compact binary segment format, used with segment_format=binary. Integers are little-endian.
+//
+// A segment starts with the 8 bytes of BINARY_SEGMENT_MAGIC, followed by blocks, one per write:
+//     magic (4 bytes) | payload length (4 bytes) | CRC-32C of the payload (4 bytes) | payload
+// The payload opens with the base time of the block, then holds a sequence of entries, each opening with a tag byte:
+//     BINARY_DEFINE  id | IP length | IP | name length | name       a connection of the dictionary
+//     BINARY_RECORD  time delta | id | length | payload              "[[time]] Client (IP) - name: payload"
+//     BINARY_TEXT    time delta | length | text                      "[[time]] text", e.g. connection events
+//     BINARY_RAW     length | text                                   a line without a timestamp
+// Numbers inside the payload are varints; times are zigzag varints, each a delta from the previous record
+// of the block, the first one from the base time. Times are the wall clock seconds the server wrote (local time
+// counted as if it were UTC), so rendering them back with gmtime() gives the text of a text segment exactly.
+// The dictionary is per segment: a connection is defined once, in the block where it first appears,
+// so blocks are read in order from the start of the segment.
+#define BINARY_SEGMENT_MAGIC "LGSEGB1\n"
+#define BINARY_SEGMENT_MAGIC_LENGTH 8
+#define BINARY_BLOCK_MAGIC 0x314b4c42 // "BLK1"
+#define BINARY_BLOCK_HEADER 12
+#define BINARY_TIMESTAMP_LENGTH 24 // "[[YYYY-mm-dd HH:MM:SS]] "
+
+// Entry tags
+#define BINARY_DEFINE 1
+#define BINARY_RECORD 2
+#define BINARY_TEXT 3
+#define BINARY_RAW 4
+
+#define BINARY_DICTIONARY_ENTRIES 1024 // Connections per segment; later ones are stored as text lines
+#define BINARY_DICTIONARY_SLOTS 2048   // Hash slots, twice the entries
+#define BINARY_IP_LENGTH 48
+#define BINARY_NAME_LENGTH 256
+
+// The (IP, name) pairs of one segment. The server keeps it in shared memory so every process writing under
+// the semaphore extends the same dictionary.
+struct binaryDictionary
+{
+    unsigned long generation; // Segment the entries belong to, the server starts over on rotation
+    unsigned count;
+    unsigned slots[BINARY_DICTIONARY_SLOTS]; // Entry index + 1, 0 for an empty slot
+    struct
+    {
+        char ip[BINARY_IP_LENGTH];
+        char name[BINARY_NAME_LENGTH];
+    } entries[BINARY_DICTIONARY_ENTRIES];
+};
+
+// Growable output buffer
+struct binaryBuffer
+{
+    char *data;
+    size_t length;
+    size_t capacity;
+};
+
+// A decoded entry of a block. For BINARY_DEFINE 'data' is the IP and 'name' the name.
+struct binaryEntry
+{
+    int tag;
+    int64_t time;
+    unsigned id;
+    const char *data;
+    size_t length;
+    const char *name;
+    size_t nameLength;
+};
+
+// Position in the payload of a block being decoded
+struct binaryCursor
+{
+    const unsigned char *p;
+    const unsigned char *end;
+    int64_t time;
+};
+
+void binaryDictionaryReset(struct binaryDictionary *dictionary);
+int binaryDictionaryDefine(struct binaryDictionary *dictionary, unsigned id, const char *ip, size_t ipLength, const char *name, size_t nameLength);
+int binaryBufferReserve(struct binaryBuffer *buffer, size_t length);
+int binaryEncodeBlock(struct binaryDictionary *dictionary, const char *text, size_t length, struct binaryBuffer *out);
+long binaryBlockCheck(const char *data, size_t available);
+int binaryBlockOpen(struct binaryCursor *cursor, const char *block);
+int binaryBlockNext(struct binaryCursor *cursor, struct binaryEntry *entry);
+int binaryRenderEntry(struct binaryDictionary *dictionary, const struct binaryEntry *entry, struct binaryBuffer *out);
+long binarySegmentScan(int fd, struct binaryDictionary *dictionary);
+int binarySegmentIsBinary(int fd);
+uint32_t binaryCrc32c(const void *data, size_t length);
+int binaryParseTimestamp(const char *line, size_t length, int64_t *seconds);
+int binarySplitClientRecord(const char *line, size_t length, const char **ip, size_t *ipLength,
+                            const char **name, size_t *nameLength, const char **payload);
+
+#endif
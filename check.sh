@@ -0,0 +1,70 @@
+#!/bin/sh
+# Record size check: runs the server on localhost in a temporary directory and writes records of the largest
+# size liblogclient takes with logclient_bench, then checks each came out of the log as exactly one line, whole.
+#
+# Usage: ./check.sh
+# Environment:
+#   PORT     port to listen on (default 9510)
+#   MODES    server configurations to check, ';' separated lines of config keys joined with ','
+#            (default "server_mode=epoll;server_mode=epoll,workers=2;server_mode=epoll,workers=2,shards=3;
+#            writer_process=1;server_mode=uring;server_mode=epoll,workers=2,shm_ingest=logcheck");
+#            with shm_ingest=<name> the records go through the shared-memory ingest
+#   MESSAGES messages per thread (default 200), from 2 threads
+
+set -e
+cd "$(dirname "$0")"
+PORT=${PORT:-9510}
+MODES=${MODES:-"server_mode=epoll;server_mode=epoll,workers=2;server_mode=epoll,workers=2,shards=3;writer_process=1;server_mode=uring;server_mode=epoll,workers=2,shm_ingest=logcheck"}
+MESSAGES=${MESSAGES:-200}
+
+work=$(mktemp -d)
+trap 'exec 3>&- 2>/dev/null; rm -rf "$work"' EXIT
+
+gcc -O2 server.c record_ring.c scan.c manifest.c uring.c binary_segment.c segment_compress.c segment_sidecar.c shm_ingest.c stats.c -o "$work/server" -pthread
+gcc -O2 logclient_bench.c logclient.c record_ring.c shm_ingest.c -o "$work/logclient_bench" -pthread
+size=$(sed -n 's/^#define LOG_MAX_RECORD \([0-9]*\).*/\1/p' logclient.h)
+
+failed=0
+check()
+{
+    mode=$1
+    shm=$(echo "$mode" | tr ',' '\n' | sed -n 's/^shm_ingest=//p')
+    address=${shm:+shm:$shm}
+    rm -rf "$work/logs" "$work/control"
+    mkdir "$work/logs"
+    {
+        echo "port=$PORT"
+        echo "directory=$work/logs"
+        echo "ip_address=127.0.0.1"
+        echo "log_file_threshold=1000000000"
+        echo "$mode" | tr ',' '\n'
+    } > "$work/config.txt"
+    rm -f /dev/shm/sem.logSyncSem
+
+    # The server quits when its standard input is closed, so it reads from a fifo held open here
+    mkfifo "$work/control"
+    (cd "$work" && exec setsid ./server < control > server.out 2>&1) &
+    pid=$!
+    exec 3> "$work/control"
+    sleep 0.5
+
+    written=$("$work/logclient_bench" -a "${address:-127.0.0.1:$PORT}" -n "$MESSAGES" -s "$size" -t 2 | sed -n 's/.* written=\([0-9]*\) .*/\1/p')
+
+    exec 3>&-
+    wait "$pid" || true
+
+    # Every record of the run is one line whose message is 'size' bytes, so nothing ran into it
+    result=$(cat "$work"/logs/server_log_* "$work"/logs/shard-*/server_log_* 2>/dev/null | awk -v size="$size" -v written="$written" '
+        { at = index($0, " - bench-2: ") }
+        at > 0 { lines++; if (length($0) - at - 11 != size) bad++ }
+        END { printf "lines=%d written=%d bad=%d %s\n", lines, written, bad, (lines == written && bad == 0 && written > 0) ? "ok" : "FAILED" }')
+    echo "mode=$mode size=$size $result"
+    case "$result" in
+    *FAILED) failed=1 ;;
+    esac
+}
+
+for mode in $(echo "$MODES" | tr ';' ' '); do
+    check "$mode"
+done
+exit $failed
@@ -4,17 +4,89 @@
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <time.h>
 #include <fcntl.h>
 #include <netdb.h>
 #include <signal.h>
+#include <errno.h>
+#include <sys/select.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <sys/uio.h>
+#include "protocol.h"
 #define MAX_CONFIG_LINE_LENGTH 256
+#define SPOOL_MAGIC "LGSPOOL1"
+#define SPOOL_HEADER 4096                        // Bytes before the records: the magic, then the head and tail positions
+#define SPOOL_WRAP 0xffffffffu                    // Record length marking the end of the records before the data area wraps
+#define SPOOL_DEFAULT_SIZE (64 * 1024 * 1024)     // Bytes of records a new spool holds
+#define SPOOL_WINDOW (4 * 1024 * 1024)            // Bytes sent to the server and not synced yet
+#define SPOOL_FRAMES 32                           // Frames of records per send
+#define SPOOL_SYNC_TIMEOUT_MS 1000                // A sync not answered by then is sent again
+#define SPOOL_BACKOFF_MIN_MS 100                  // Delays between attempts to reach the server double up to the max
+#define SPOOL_BACKOFF_MAX_MS 10000
+
+// Start of a spool file. Positions count the bytes of records appended since the spool was created; a position
+// is at offset position % capacity of the data area, which follows the header.
+struct spoolHeader
+{
+    char magic[8];
+    uint64_t head; // Oldest record the server has not taken yet
+    uint64_t tail; // End of the last record
+};
+
+// A spool mapped in memory: a circular queue of records laid out as in a FRAME_RECORDS payload
+struct spool
+{
+    struct spoolHeader *header;
+    unsigned char *data;
+    uint64_t capacity;
+};
+
+// The connection of the spooling sender, and the batch of frames it is writing
+struct spoolSender
+{
+    int fd;            // -1 while the server cannot be reached
+    int version;       // Protocol version the server answered with: from 2 on, frames are let go when a sync comes back
+    uint64_t sent;     // End of the records in the frames built so far
+    struct iovec iov[2 * SPOOL_FRAMES + 1];
+    int iovCount;      // Slices of the batch still to write, from iovFirst
+    int iovFirst;
+    unsigned char headers[SPOOL_FRAMES][PROTOCOL_FRAME_HEADER];
+    unsigned char sync[PROTOCOL_FRAME_HEADER + 8];
+    unsigned char reply[PROTOCOL_FRAME_HEADER + 8]; // Sync coming back, as far as it was read
+    size_t replyLength;
+    long long syncSentAt;
+};
 
 // Declaration of the functions
 void error(const char *msg);
-int readConfig(int *port, char *ip_address);
+int readConfig(int *port, char *ip_address, int *binary);
+int connectToServer(struct hostent *server, int portNo);
+ssize_t readLine(int fd, char *line, size_t size);
+int writeAll(int fd, const void *data, size_t length);
+int binaryHandshake(int sockfd, const char *name);
+void binarySendLoop(int sockfd);
+int sendFrame(int sockfd, unsigned char *frame, uint16_t type, uint16_t count, size_t payloadLength);
+int openConnection(struct hostent *server, int portNo);
+long long monotonicMillis(void);
+void openSpool(struct spool *spool, const char *path, uint64_t size);
+int spoolAppend(struct spool *spool, uint64_t timestamp, const char *data, size_t length);
+uint64_t spoolNextRecord(struct spool *spool, uint64_t position, uint32_t *length);
+void spoolSendLoop(struct hostent *server, int portNo, const char *name);
+int spoolConnect(struct spoolSender *sender, struct hostent *server, int portNo, const char *name);
+void spoolDisconnect(struct spoolSender *sender, struct spool *spool);
+void spoolBuildBatch(struct spoolSender *sender, struct spool *spool, int syncOnly);
+int spoolWrite(struct spoolSender *sender, struct spool *spool);
+int spoolReadReplies(struct spoolSender *sender, struct spool *spool);
+// Path of the server's AF_UNIX socket, used instead of host and port when set
+char unixSocketPath[108] = "";
+// Spool file: when set, records go through it and survive the server being unreachable
+char spoolPath[256] = "";
+uint64_t spoolSize = SPOOL_DEFAULT_SIZE;
 // Global flag to indicate if the client should terminate
 volatile sig_atomic_t terminate = 0;
 // Signal handler function to handle termination signal
@@ -28,20 +100,20 @@ void handle_shutdown(int signum)
 int main(int argc, char *argv[])
 {
     int sockfd, portNo;
-    struct sockaddr_in serverAddr;
     char buffer[1024];
     struct hostent *server;
     char ip_address[100];
     char server_address[100];
     char name[256];
+    int binary = 1; // Use the binary protocol, falling back to text if the server does not speak it
 
     // Check if command line arguments are provided
-    if (argc != 3)
+    if (argc != 3 && argc != 4)
     {
         // No command line arguments, read configuration from a file
-        if (readConfig(&portNo, ip_address) == 0)
+        if (readConfig(&portNo, ip_address, &binary) == 0)
         {
-            server = gethostbyname(ip_address);
+            server = (unixSocketPath[0] == '\0') ? gethostbyname(ip_address) : NULL;
         }
         else
         {
@@ -51,36 +123,66 @@ int main(int argc, char *argv[])
     else
     {
         portNo = atoi(argv[2]);
-        // Specify server address
-        server = gethostbyname(argv[1]);
-        if (server == NULL)
+        // Specify server address: a host, or "unix:<path>" for a server on this host
+        server = NULL;
+        if (strncmp(argv[1], "unix:", 5) == 0 && strlen(argv[1] + 5) < sizeof(unixSocketPath))
+        {
+            strcpy(unixSocketPath, argv[1] + 5);
+        }
+        else if ((server = gethostbyname(argv[1])) == NULL)
         {
             error("Error in hostname!\n");
         }
+        if (argc == 4 && strncmp(argv[3], "spool:", 6) == 0 && strlen(argv[3] + 6) < sizeof(spoolPath))
+        {
+            strcpy(spoolPath, argv[3] + 6);
+        }
+        else if (argc == 4)
+        {
+            binary = strcmp(argv[3], "text") != 0;
+        }
     }
 
-    // Create socket
-    sockfd = socket(AF_INET, SOCK_STREAM, 0);
-    if (sockfd < 0)
-    {
-        error("ERROR opening socket");
-    }
     signal(SIGINT, handle_shutdown); // Handle Ctrl+C
     signal(SIGUSR2, handle_shutdown);
-    // Set up the server address structure
-    memset(&serverAddr, 0, sizeof(serverAddr));
-    serverAddr.sin_family = AF_INET;
-    serverAddr.sin_port = htons(portNo);
-    bcopy((char *)server->h_addr, (char *)&serverAddr.sin_addr.s_addr, server->h_length);
 
-    // Connect to the server
-    if (connect(sockfd, (struct sockaddr *)&serverAddr, sizeof(serverAddr)) < 0)
+    // The spooling sender connects, and connects again, on its own
+    if (spoolPath[0] != '\0')
     {
-        error("ERROR connecting");
+        printf("Enter your name: ");
+        fflush(stdout);
+        if (readLine(STDIN_FILENO, name, sizeof(name)) < 0)
+        {
+            error("Error reading name");
+        }
+        spoolSendLoop(server, portNo, name);
+        return 0;
     }
+
+    // Connect to the server
+    sockfd = connectToServer(server, portNo);
     printf("Enter your name: ");
-    fgets(name, sizeof(name), stdin);
-    name[strcspn(name, "\n")] = 0; // Remove the newline character
+    fflush(stdout);
+    // stdin is read without stdio buffering so nothing typed after the name is held back from the binary sender
+    if (readLine(STDIN_FILENO, name, sizeof(name)) < 0)
+    {
+        error("Error reading name");
+    }
+
+    if (binary)
+    {
+        if (binaryHandshake(sockfd, name) > 0)
+        {
+            binarySendLoop(sockfd);
+            printf("Closing the connection to the server...\n");
+            close(sockfd);
+            return 0;
+        }
+        // An older server took the handshake for a name; start over with the text protocol
+        printf("Server does not support the binary protocol, using text.\n");
+        close(sockfd);
+        sockfd = connectToServer(server, portNo);
+    }
 
     // Send name to the server
     write(sockfd, name, strlen(name));
@@ -155,6 +257,281 @@ int main(int argc, char *argv[])
     return 0;
 }
 
+// Function to create a socket connected to the server, exiting when it cannot be reached
+int connectToServer(struct hostent *server, int portNo)
+{
+    int sockfd = openConnection(server, portNo);
+    if (sockfd < 0)
+    {
+        error("ERROR connecting");
+    }
+    return sockfd;
+}
+
+// Function to create a socket connected to the server: its AF_UNIX socket when there is a path, TCP otherwise.
+// Connecting gives up after a second. It returns -1 when the server cannot be reached.
+int openConnection(struct hostent *server, int portNo)
+{
+    struct sockaddr_storage serverAddr;
+    socklen_t serverLength;
+    struct timeval timeout = {1, 0};
+
+    memset(&serverAddr, 0, sizeof(serverAddr));
+    if (unixSocketPath[0] != '\0')
+    {
+        struct sockaddr_un *unixAddr = (struct sockaddr_un *)&serverAddr;
+        unixAddr->sun_family = AF_UNIX;
+        strcpy(unixAddr->sun_path, unixSocketPath);
+        serverLength = sizeof(*unixAddr);
+    }
+    else
+    {
+        // Set up the server address structure
+        struct sockaddr_in *inetAddr = (struct sockaddr_in *)&serverAddr;
+        inetAddr->sin_family = AF_INET;
+        inetAddr->sin_port = htons(portNo);
+        bcopy((char *)server->h_addr, (char *)&inetAddr->sin_addr.s_addr, server->h_length);
+        serverLength = sizeof(*inetAddr);
+    }
+
+    // Create socket
+    int sockfd = socket(serverAddr.ss_family, SOCK_STREAM, 0);
+    if (sockfd < 0)
+    {
+        return -1;
+    }
+    setsockopt(sockfd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    if (connect(sockfd, (struct sockaddr *)&serverAddr, serverLength) < 0)
+    {
+        int saved = errno;
+        close(sockfd);
+        errno = saved;
+        return -1;
+    }
+    return sockfd;
+}
+
+// Function to read one line from a descriptor without buffering past it. The newline is removed.
+ssize_t readLine(int fd, char *line, size_t size)
+{
+    size_t length = 0;
+    char c;
+
+    while (length < size - 1)
+    {
+        ssize_t n = read(fd, &c, 1);
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n <= 0)
+        {
+            if (length == 0)
+            {
+                return -1;
+            }
+            break;
+        }
+        if (c == '\n')
+        {
+            break;
+        }
+        line[length++] = c;
+    }
+    line[length] = '\0';
+    return length;
+}
+
+// Function to write a whole buffer, retrying after short writes
+int writeAll(int fd, const void *data, size_t length)
+{
+    const char *p = data;
+
+    while (length > 0)
+    {
+        ssize_t w = write(fd, p, length);
+        if (w < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (w <= 0)
+        {
+            return -1;
+        }
+        p += w;
+        length -= w;
+    }
+    return 0;
+}
+
+// Function to open the binary protocol. It returns the version the server acknowledged within a second, or -1.
+int binaryHandshake(int sockfd, const char *name)
+{
+    unsigned char handshake[PROTOCOL_HANDSHAKE_HEADER + PROTOCOL_MAX_NAME];
+    unsigned char ack[PROTOCOL_ACK_LENGTH];
+    size_t nameLength = strlen(name);
+    size_t received = 0;
+
+    if (nameLength > PROTOCOL_MAX_NAME)
+    {
+        nameLength = PROTOCOL_MAX_NAME;
+    }
+    memcpy(handshake, PROTOCOL_MAGIC, PROTOCOL_MAGIC_LENGTH);
+    handshake[PROTOCOL_MAGIC_LENGTH] = PROTOCOL_VERSION;
+    protocolPut16(handshake + PROTOCOL_MAGIC_LENGTH + 1, nameLength);
+    memcpy(handshake + PROTOCOL_HANDSHAKE_HEADER, name, nameLength);
+    if (writeAll(sockfd, handshake, PROTOCOL_HANDSHAKE_HEADER + nameLength) != 0)
+    {
+        return -1;
+    }
+
+    while (received < sizeof(ack))
+    {
+        struct timeval timeout = {1, 0};
+        fd_set readfds;
+        FD_ZERO(&readfds);
+        FD_SET(sockfd, &readfds);
+        if (select(sockfd + 1, &readfds, NULL, NULL, &timeout) <= 0)
+        {
+            return -1;
+        }
+        ssize_t n = read(sockfd, ack + received, sizeof(ack) - received);
+        if (n <= 0)
+        {
+            return -1;
+        }
+        received += n;
+    }
+    if (memcmp(ack, PROTOCOL_MAGIC, PROTOCOL_MAGIC_LENGTH) != 0 || ack[PROTOCOL_MAGIC_LENGTH] < 1 ||
+        ack[PROTOCOL_MAGIC_LENGTH] > PROTOCOL_VERSION)
+    {
+        return -1;
+    }
+    return ack[PROTOCOL_MAGIC_LENGTH];
+}
+
+// Function to send stdin to the server with the binary protocol.
+// Every read of stdin becomes one frame holding all the complete lines it delivered.
+void binarySendLoop(int sockfd)
+{
+    static char input[PROTOCOL_MAX_FRAME - PROTOCOL_RECORD_HEADER]; // Bytes of stdin not sent yet
+    static unsigned char frame[PROTOCOL_FRAME_HEADER + PROTOCOL_MAX_FRAME];
+    size_t inputLength = 0;
+    char buffer[64];
+
+    while (!terminate)
+    {
+        fd_set readfds;
+        FD_ZERO(&readfds);
+        FD_SET(sockfd, &readfds);
+        FD_SET(STDIN_FILENO, &readfds);
+        int maxfd = (sockfd > STDIN_FILENO) ? sockfd : STDIN_FILENO;
+
+        if (select(maxfd + 1, &readfds, NULL, NULL, NULL) < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            error("ERROR in select");
+        }
+
+        // The server never sends data after the handshake, so a readable socket means it closed the connection
+        if (FD_ISSET(sockfd, &readfds) && read(sockfd, buffer, sizeof(buffer)) <= 0)
+        {
+            printf("Server has closed the connection. Exiting...\n");
+            return;
+        }
+        if (!FD_ISSET(STDIN_FILENO, &readfds))
+        {
+            continue;
+        }
+
+        ssize_t n = read(STDIN_FILENO, input + inputLength, sizeof(input) - inputLength);
+        int endOfInput = n <= 0;
+        if (n > 0)
+        {
+            inputLength += n;
+        }
+
+        struct timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+        uint64_t timestamp = (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+
+        // Every complete line is a record. A line filling the whole input buffer, or the last one at end of input, is sent as is.
+        size_t payloadLength = 0;
+        uint16_t count = 0;
+        size_t start = 0;
+        while (start < inputLength)
+        {
+            char *newline = memchr(input + start, '\n', inputLength - start);
+            size_t lineLength;
+            if (newline != NULL)
+            {
+                lineLength = newline - (input + start);
+            }
+            else if (endOfInput || (start == 0 && inputLength == sizeof(input)))
+            {
+                lineLength = inputLength - start;
+            }
+            else
+            {
+                break;
+            }
+
+            if (lineLength == 4 && memcmp(input + start, "quit", 4) == 0)
+            {
+                if (count > 0)
+                {
+                    sendFrame(sockfd, frame, FRAME_RECORDS, count, payloadLength);
+                }
+                sendFrame(sockfd, frame, FRAME_QUIT, 0, 0);
+                return;
+            }
+            if (payloadLength + PROTOCOL_RECORD_HEADER + lineLength > PROTOCOL_MAX_FRAME || count == UINT16_MAX)
+            {
+                if (sendFrame(sockfd, frame, FRAME_RECORDS, count, payloadLength) != 0)
+                {
+                    perror("ERROR writing to socket");
+                    return;
+                }
+                payloadLength = 0;
+                count = 0;
+            }
+            unsigned char *record = frame + PROTOCOL_FRAME_HEADER + payloadLength;
+            protocolPut64(record, timestamp);
+            protocolPut32(record + 8, lineLength);
+            memcpy(record + PROTOCOL_RECORD_HEADER, input + start, lineLength);
+            payloadLength += PROTOCOL_RECORD_HEADER + lineLength;
+            count++;
+            start += lineLength + (newline != NULL);
+        }
+        if (count > 0 && sendFrame(sockfd, frame, FRAME_RECORDS, count, payloadLength) != 0)
+        {
+            perror("ERROR writing to socket");
+            return;
+        }
+        memmove(input, input + start, inputLength - start);
+        inputLength -= start;
+
+        if (endOfInput)
+        {
+            printf("EOF reached on stdin. Exiting...\n");
+            return;
+        }
+    }
+    printf("Received termination signal. Exiting...\n");
+}
+
+// Function to fill in the header of a frame whose payload is already in place and send it
+int sendFrame(int sockfd, unsigned char *frame, uint16_t type, uint16_t count, size_t payloadLength)
+{
+    protocolPut32(frame, payloadLength);
+    protocolPut16(frame + 4, type);
+    protocolPut16(frame + 6, count);
+    return writeAll(sockfd, frame, PROTOCOL_FRAME_HEADER + payloadLength);
+}
+
 // Function for handling errors and exiting the program.
 void error(const char *msg)
 {
@@ -163,7 +540,7 @@ void error(const char *msg)
 }
 
 // Function to read server configuration from a file.
-int readConfig(int *port, char *ip_address)
+int readConfig(int *port, char *ip_address, int *binary)
 {
     // Open the configuration file in read-only mode.
     int fd = open("config.txt", O_RDONLY);
@@ -206,6 +583,22 @@ int readConfig(int *port, char *ip_address)
         {
             strcpy(ip_address, value);
         }
+        else if (strcmp(key, "protocol") == 0)
+        {
+            *binary = strcmp(value, "text") != 0;
+        }
+        else if (strcmp(key, "unix_socket") == 0 && strlen(value) < sizeof(unixSocketPath))
+        {
+            strcpy(unixSocketPath, value);
+        }
+        else if (strcmp(key, "spool_file") == 0 && strlen(value) < sizeof(spoolPath))
+        {
+            strcpy(spoolPath, value);
+        }
+        else if (strcmp(key, "spool_size") == 0)
+        {
+            spoolSize = strtoull(value, NULL, 10);
+        }
 
         line = strtok(NULL, "\n"); // Get next line
     }
@@ -214,3 +607,456 @@ int readConfig(int *port, char *ip_address)
     close(fd);
     return 0;
 }
+
+// Function to read a monotonic clock in milliseconds
+long long monotonicMillis(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+// Function to open the spool file, creating one of 'size' bytes of records if there is none, and map it.
+// A spool left by an earlier run keeps its size and its records, which are sent first.
+void openSpool(struct spool *spool, const char *path, uint64_t size)
+{
+    struct stat st;
+
+    int fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (fd < 0)
+    {
+        error("ERROR opening spool file");
+    }
+    // Two clients appending to one spool would interleave their records
+    if (flock(fd, LOCK_EX | LOCK_NB) != 0)
+    {
+        error("ERROR locking spool file");
+    }
+    if (fstat(fd, &st) != 0)
+    {
+        error("ERROR reading spool file");
+    }
+    int created = st.st_size == 0;
+    if (created)
+    {
+        // Big enough for two frames, and whole pages
+        size = (size < 2 * PROTOCOL_MAX_FRAME) ? 2 * PROTOCOL_MAX_FRAME : (size + 4095) & ~(uint64_t)4095;
+        if (ftruncate(fd, SPOOL_HEADER + size) != 0)
+        {
+            error("ERROR sizing spool file");
+        }
+        st.st_size = SPOOL_HEADER + size;
+    }
+    else if (st.st_size < SPOOL_HEADER + 2 * PROTOCOL_MAX_FRAME)
+    {
+        fprintf(stderr, "%s is not a spool file\n", path);
+        exit(1);
+    }
+    void *map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED)
+    {
+        error("ERROR mapping spool file");
+    }
+    close(fd); // The mapping and the lock stay
+
+    spool->header = map;
+    spool->data = (unsigned char *)map + SPOOL_HEADER;
+    spool->capacity = st.st_size - SPOOL_HEADER;
+    if (!created && memcmp(spool->header->magic, SPOOL_MAGIC, sizeof(spool->header->magic)) != 0)
+    {
+        fprintf(stderr, "%s is not a spool file\n", path);
+        exit(1);
+    }
+    if (created || spool->header->head > spool->header->tail || spool->header->tail - spool->header->head > spool->capacity)
+    {
+        memcpy(spool->header->magic, SPOOL_MAGIC, sizeof(spool->header->magic));
+        spool->header->head = 0;
+        spool->header->tail = 0;
+    }
+    else if (spool->header->tail > spool->header->head)
+    {
+        printf("Sending %llu bytes spooled by an earlier run first.\n", (unsigned long long)(spool->header->tail - spool->header->head));
+    }
+}
+
+// Function to append a record to the spool. A record that does not fit before the end of the data area starts over
+// at its beginning, the rest being skipped. It returns -1 when the spool is full.
+int spoolAppend(struct spool *spool, uint64_t timestamp, const char *data, size_t length)
+{
+    uint64_t tail = spool->header->tail;
+    uint64_t offset = tail % spool->capacity;
+    uint64_t needed = PROTOCOL_RECORD_HEADER + length;
+    uint64_t skipped = (spool->capacity - offset < needed) ? spool->capacity - offset : 0;
+
+    if (tail + skipped + needed - spool->header->head > spool->capacity)
+    {
+        return -1;
+    }
+    if (skipped >= PROTOCOL_RECORD_HEADER)
+    {
+        protocolPut32(spool->data + offset + 8, SPOOL_WRAP);
+    }
+    if (skipped > 0)
+    {
+        tail += skipped;
+        offset = 0;
+    }
+    unsigned char *record = spool->data + offset;
+    protocolPut64(record, timestamp);
+    protocolPut32(record + 8, length);
+    memcpy(record + PROTOCOL_RECORD_HEADER, data, length);
+    // The record is in place before the tail covers it, should the client be killed in between
+    __atomic_store_n(&spool->header->tail, tail + needed, __ATOMIC_RELEASE);
+    return 0;
+}
+
+// Function to find the record at a position of the spool, past the end of the data area if it wrapped there.
+// It returns the position of the record and sets its length.
+uint64_t spoolNextRecord(struct spool *spool, uint64_t position, uint32_t *length)
+{
+    uint64_t offset = position % spool->capacity;
+
+    if (spool->capacity - offset < PROTOCOL_RECORD_HEADER || protocolGet32(spool->data + offset + 8) == SPOOL_WRAP)
+    {
+        position += spool->capacity - offset;
+        offset = 0;
+    }
+    *length = protocolGet32(spool->data + offset + 8);
+    return position;
+}
+
+// Function to send stdin to the server through the spool. Input is read in bulk and appended to the spool as records,
+// which are sent from there in batches of frames, each batch followed by a FRAME_SYNC. Records are let go once the
+// server echoes a sync sent after them, with SPOOL_WINDOW bytes at most waiting for it. While the server cannot be
+// reached, or after it went away, records pile up in the spool and are sent again, oldest first, from the first one
+// not synced, once it is back: attempts to reach it are spaced out from SPOOL_BACKOFF_MIN_MS to SPOOL_BACKOFF_MAX_MS.
+// When the spool is full stdin is no longer read until there is room.
+void spoolSendLoop(struct hostent *server, int portNo, const char *name)
+{
+    static char input[PROTOCOL_MAX_FRAME - PROTOCOL_RECORD_HEADER]; // Bytes of stdin not spooled yet
+    static struct spoolSender sender;
+    struct spool spool;
+    size_t inputLength = 0;
+    int endOfInput = 0;
+    int quit = 0;
+    int backoff = SPOOL_BACKOFF_MIN_MS;
+    long long nextAttempt = 0;
+    int reported = 0;
+
+    // A server going away mid-write must not kill the client
+    signal(SIGPIPE, SIG_IGN);
+    openSpool(&spool, spoolPath, spoolSize);
+    sender.fd = -1;
+
+    while (!terminate)
+    {
+        long long now = monotonicMillis();
+
+        // Done once the input ended and the server took every record
+        if (endOfInput && inputLength == 0 && spool.header->head == spool.header->tail)
+        {
+            printf("EOF reached on stdin. Exiting...\n");
+            if (sender.fd >= 0)
+            {
+                if (quit)
+                {
+                    unsigned char frame[PROTOCOL_FRAME_HEADER];
+                    sendFrame(sender.fd, frame, FRAME_QUIT, 0, 0);
+                }
+                close(sender.fd);
+            }
+            return;
+        }
+
+        if (sender.fd < 0 && now >= nextAttempt)
+        {
+            if (spoolConnect(&sender, server, portNo, name) == 0)
+            {
+                backoff = SPOOL_BACKOFF_MIN_MS;
+                if (reported)
+                {
+                    printf("Server is back, sending %llu spooled bytes.\n",
+                           (unsigned long long)(spool.header->tail - spool.header->head));
+                    reported = 0;
+                }
+                sender.sent = spool.header->head;
+            }
+            else
+            {
+                if (!reported)
+                {
+                    printf("Server cannot be reached, spooling to %s.\n", spoolPath);
+                    reported = 1;
+                }
+                nextAttempt = now + backoff;
+                backoff = (backoff * 2 < SPOOL_BACKOFF_MAX_MS) ? backoff * 2 : SPOOL_BACKOFF_MAX_MS;
+            }
+        }
+
+        // Start the next batch: records not sent yet, within the window, or a sync again when the last one went unanswered
+        if (sender.fd >= 0 && sender.iovCount == 0)
+        {
+            if (sender.sent < spool.header->tail && sender.sent - spool.header->head < SPOOL_WINDOW)
+            {
+                spoolBuildBatch(&sender, &spool, 0);
+            }
+            else if (sender.version >= 2 && spool.header->head < sender.sent && now - sender.syncSentAt >= SPOOL_SYNC_TIMEOUT_MS)
+            {
+                spoolBuildBatch(&sender, &spool, 1);
+            }
+        }
+        if (sender.fd >= 0 && sender.iovCount > 0 && spoolWrite(&sender, &spool) != 0)
+        {
+            spoolDisconnect(&sender, &spool);
+            nextAttempt = now + backoff;
+            continue;
+        }
+
+        fd_set readfds, writefds;
+        FD_ZERO(&readfds);
+        FD_ZERO(&writefds);
+        int maxfd = STDIN_FILENO;
+        if (!endOfInput && inputLength < sizeof(input))
+        {
+            FD_SET(STDIN_FILENO, &readfds);
+        }
+        if (sender.fd >= 0)
+        {
+            FD_SET(sender.fd, &readfds);
+            if (sender.iovCount > 0)
+            {
+                FD_SET(sender.fd, &writefds);
+            }
+            maxfd = (sender.fd > maxfd) ? sender.fd : maxfd;
+        }
+        // Wake up for the next attempt to reach the server, or to sync again
+        long long wait = -1;
+        if (sender.fd < 0)
+        {
+            wait = (nextAttempt > now) ? nextAttempt - now : 0;
+        }
+        else if (spool.header->head < sender.sent && sender.iovCount == 0)
+        {
+            wait = SPOOL_SYNC_TIMEOUT_MS;
+        }
+        struct timeval timeout = {wait / 1000, (wait % 1000) * 1000};
+        if (select(maxfd + 1, &readfds, &writefds, NULL, (wait >= 0) ? &timeout : NULL) < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            error("ERROR in select");
+        }
+
+        if (sender.fd >= 0 && FD_ISSET(sender.fd, &readfds) && spoolReadReplies(&sender, &spool) != 0)
+        {
+            spoolDisconnect(&sender, &spool);
+            nextAttempt = monotonicMillis() + backoff;
+        }
+
+        if (FD_ISSET(STDIN_FILENO, &readfds))
+        {
+            ssize_t n = read(STDIN_FILENO, input + inputLength, sizeof(input) - inputLength);
+            if (n > 0)
+            {
+                inputLength += n;
+            }
+            else if (n == 0 || errno != EINTR)
+            {
+                endOfInput = 1;
+            }
+        }
+
+        // Every complete line is a record, stamped with the time it was read. A line filling the whole input buffer,
+        // or the last one at end of input, is spooled as is.
+        struct timespec realNow;
+        clock_gettime(CLOCK_REALTIME, &realNow);
+        uint64_t timestamp = (uint64_t)realNow.tv_sec * 1000000 + realNow.tv_nsec / 1000;
+        size_t start = 0;
+        while (start < inputLength && !quit)
+        {
+            char *newline = memchr(input + start, '\n', inputLength - start);
+            size_t lineLength;
+            if (newline != NULL)
+            {
+                lineLength = newline - (input + start);
+            }
+            else if (endOfInput || (start == 0 && inputLength == sizeof(input)))
+            {
+                lineLength = inputLength - start;
+            }
+            else
+            {
+                break;
+            }
+            if (lineLength == 4 && memcmp(input + start, "quit", 4) == 0)
+            {
+                quit = 1;
+                endOfInput = 1;
+                start = inputLength;
+                break;
+            }
+            if (spoolAppend(&spool, timestamp, input + start, lineLength) != 0)
+            {
+                break;
+            }
+            start += lineLength + (newline != NULL);
+        }
+        memmove(input, input + start, inputLength - start);
+        inputLength -= start;
+    }
+    printf("Received termination signal. Exiting...\n");
+    if (sender.fd >= 0)
+    {
+        close(sender.fd);
+    }
+}
+
+// Function to connect to the server and open the binary protocol. It returns -1 when the server cannot be reached
+// or does not speak the binary protocol.
+int spoolConnect(struct spoolSender *sender, struct hostent *server, int portNo, const char *name)
+{
+    int sockfd = openConnection(server, portNo);
+    if (sockfd < 0)
+    {
+        return -1;
+    }
+    sender->version = binaryHandshake(sockfd, name);
+    if (sender->version < 0)
+    {
+        close(sockfd);
+        return -1;
+    }
+    fcntl(sockfd, F_SETFL, O_NONBLOCK);
+    sender->fd = sockfd;
+    sender->iovCount = 0;
+    sender->replyLength = 0;
+    return 0;
+}
+
+// Function to drop the connection. What was not synced is sent again on the next one.
+void spoolDisconnect(struct spoolSender *sender, struct spool *spool)
+{
+    close(sender->fd);
+    sender->fd = -1;
+    sender->iovCount = 0;
+    sender->sent = spool->header->head;
+    printf("Connection to the server lost, spooling to %s.\n", spoolPath);
+}
+
+// Function to lay out the next batch: up to SPOOL_FRAMES frames of the records from the last one sent, straight from
+// the spool, and a sync carrying the position they end at. 'syncOnly' sends the sync alone.
+void spoolBuildBatch(struct spoolSender *sender, struct spool *spool, int syncOnly)
+{
+    uint64_t tail = spool->header->tail;
+    int frames = 0;
+
+    sender->iovFirst = 0;
+    sender->iovCount = 0;
+    while (!syncOnly && frames < SPOOL_FRAMES && sender->sent < tail && sender->sent - spool->header->head < SPOOL_WINDOW)
+    {
+        uint32_t length;
+        uint64_t position = spoolNextRecord(spool, sender->sent, &length);
+        uint64_t start = position;
+        size_t payloadLength = 0;
+        uint16_t count = 0;
+
+        // A frame takes consecutive records up to the end of the data area
+        while (position < tail && count < UINT16_MAX)
+        {
+            uint64_t next = spoolNextRecord(spool, position, &length);
+            if (next != position || (count > 0 && position % spool->capacity == 0) ||
+                payloadLength + PROTOCOL_RECORD_HEADER + length > PROTOCOL_MAX_FRAME)
+            {
+                break;
+            }
+            payloadLength += PROTOCOL_RECORD_HEADER + length;
+            position += PROTOCOL_RECORD_HEADER + length;
+            count++;
+        }
+        protocolPut32(sender->headers[frames], payloadLength);
+        protocolPut16(sender->headers[frames] + 4, FRAME_RECORDS);
+        protocolPut16(sender->headers[frames] + 6, count);
+        sender->iov[sender->iovCount].iov_base = sender->headers[frames];
+        sender->iov[sender->iovCount++].iov_len = PROTOCOL_FRAME_HEADER;
+        sender->iov[sender->iovCount].iov_base = spool->data + start % spool->capacity;
+        sender->iov[sender->iovCount++].iov_len = payloadLength;
+        sender->sent = position;
+        frames++;
+    }
+    // Servers before version 2 do not answer syncs: records are let go once written
+    if (sender->version >= 2)
+    {
+        protocolPut32(sender->sync, 8);
+        protocolPut16(sender->sync + 4, FRAME_SYNC);
+        protocolPut16(sender->sync + 6, 0);
+        protocolPut64(sender->sync + PROTOCOL_FRAME_HEADER, sender->sent);
+        sender->iov[sender->iovCount].iov_base = sender->sync;
+        sender->iov[sender->iovCount++].iov_len = sizeof(sender->sync);
+        sender->syncSentAt = monotonicMillis();
+    }
+}
+
+// Function to write as much of the batch as the socket takes. It returns -1 when the connection is lost.
+int spoolWrite(struct spoolSender *sender, struct spool *spool)
+{
+    struct msghdr message = {0};
+
+    message.msg_iov = sender->iov + sender->iovFirst;
+    message.msg_iovlen = sender->iovCount;
+    ssize_t written = sendmsg(sender->fd, &message, MSG_NOSIGNAL);
+    if (written < 0)
+    {
+        return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ? 0 : -1;
+    }
+    while (sender->iovCount > 0 && (size_t)written >= sender->iov[sender->iovFirst].iov_len)
+    {
+        written -= sender->iov[sender->iovFirst].iov_len;
+        sender->iovFirst++;
+        sender->iovCount--;
+    }
+    if (sender->iovCount > 0)
+    {
+        sender->iov[sender->iovFirst].iov_base = (char *)sender->iov[sender->iovFirst].iov_base + written;
+        sender->iov[sender->iovFirst].iov_len -= written;
+    }
+    else if (sender->version < 2)
+    {
+        spool->header->head = sender->sent;
+    }
+    return 0;
+}
+
+// Function to read the syncs the server echoed and let go of the records they cover.
+// It returns -1 when the server closed the connection or broke the protocol.
+int spoolReadReplies(struct spoolSender *sender, struct spool *spool)
+{
+    while (1)
+    {
+        ssize_t n = read(sender->fd, sender->reply + sender->replyLength, sizeof(sender->reply) - sender->replyLength);
+        if (n < 0)
+        {
+            return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ? 0 : -1;
+        }
+        if (n == 0)
+        {
+            return -1;
+        }
+        sender->replyLength += n;
+        if (sender->replyLength < sizeof(sender->reply))
+        {
+            continue;
+        }
+        if (protocolGet32(sender->reply) != 8 || protocolGet16(sender->reply + 4) != FRAME_SYNC)
+        {
+            return -1;
+        }
+        uint64_t synced = protocolGet64(sender->reply + PROTOCOL_FRAME_HEADER);
+        if (synced > spool->header->head && synced <= sender->sent)
+        {
+            spool->header->head = synced;
+        }
+        sender->replyLength = 0;
+    }
+}
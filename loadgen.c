@@ -0,0 +1,897 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <getopt.h>
+#include <stdatomic.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/inotify.h>
+#include <sys/un.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include "protocol.h"
+#include "manifest.h"
+#include "binary_segment.h"
+
+#define MAX_SENDER_THREADS 16
+#define MAX_TAILED_FILES 4096
+#define HISTOGRAM_SUB_BUCKETS 64 // Values are kept with 1/64 relative precision
+#define HISTOGRAM_BUCKETS 40     // Powers of two above the sub-buckets, enough for hours in microseconds
+#define MESSAGE_TAG "lg:"        // Marks generated messages in the log so the tailer can find their send time
+
+// Latency histogram: log-linear buckets in microseconds, merged from the tailer at the end
+struct histogram
+{
+    unsigned long counts[HISTOGRAM_BUCKETS][HISTOGRAM_SUB_BUCKETS];
+    unsigned long total;
+    unsigned long max;
+};
+
+// One sender thread drives a share of the connections round-robin
+struct sender
+{
+    int firstConnection;
+    int numberOfConnections;
+    int *sockets;
+    unsigned long sent;
+    unsigned long bytes;
+    unsigned long traced;
+    unsigned int seed;
+    pthread_t thread;
+};
+
+// One log file followed by the tailer
+struct tailedFile
+{
+    char name[256];
+    int fd;
+    char partial[4096]; // Incomplete last line
+    size_t partialLength;
+    int format;                 // -1 until the first bytes are read, then 0 for text and 1 for binary segments
+    off_t offset;               // Binary segments: where the next block starts
+    struct binaryBuffer blocks; // Binary segments: bytes read past 'offset'
+};
+
+// Settings, from the command line
+const char *host = "127.0.0.1";
+int port = 0;
+int connections = 1;
+long messagesPerConnection = 10000;
+double duration = 0;  // Seconds to run instead of a message count when non-zero
+double rate = 0;      // Messages per second over all connections, 0 sends flat out
+int minSize = 64;     // Payload sizes are uniform between minSize and maxSize
+int maxSize = 64;
+int batch = 64;       // Records per binary frame
+int textProtocol = 0; // Send newline-terminated lines instead of binary frames
+int datagrams = 0;    // Send UDP datagrams to the server's udp_port instead of frames over connections
+const char *unixSocket = NULL; // Path of the server's AF_UNIX socket to use instead of host and port
+const char *logDirectory = NULL;
+int idleConnections = 0; // Connections opened before the run and left silent
+pid_t serverPid = 0;     // Server whose memory is measured around the idle connections
+long traceEvery = 0;     // Binary frames: have one record in this many traced by the server, 0 for none
+
+unsigned int runId; // Tags this run's messages, so lines left by earlier runs are not timed
+atomic_int sendersDone;
+struct histogram latencies;
+unsigned long observed = 0;
+long long lastObserved = 0; // When the last generated message was read back
+
+// Declaration of the functions
+void error(const char *msg);
+void usage(const char *program);
+int connectToServer(const struct sockaddr *serverAddr, socklen_t serverLength, int id);
+int writeAll(int fd, const void *data, size_t length);
+long long monotonicNanos(void);
+void *senderThread(void *arg);
+size_t formatMessage(char *out, struct sender *sender, int connection, unsigned long sequence);
+void *tailerThread(void *arg);
+void followLogFile(const char *shard, const char *name, struct tailedFile *files, int *numberOfFiles);
+void readTailedFile(struct tailedFile *file);
+void readTailedBlocks(struct tailedFile *file);
+void observeMessage(const char *data, size_t length, long long now);
+void recordLatency(struct histogram *h, unsigned long value);
+unsigned long histogramPercentile(struct histogram *h, double percentile);
+void raiseFileLimit(void);
+long processMemory(pid_t pid);
+
+int main(int argc, char *argv[])
+{
+    struct sockaddr_storage serverAddr;
+    socklen_t serverLength;
+    struct hostent *server;
+    struct sender senders[MAX_SENDER_THREADS];
+    pthread_t tailer;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "h:p:c:n:T:r:s:b:d:tuU:i:P:x:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'h':
+            host = optarg;
+            break;
+        case 'p':
+            port = atoi(optarg);
+            break;
+        case 'c':
+            connections = atoi(optarg);
+            break;
+        case 'n':
+            messagesPerConnection = atol(optarg);
+            break;
+        case 'T':
+            duration = atof(optarg);
+            break;
+        case 'r':
+            rate = atof(optarg);
+            break;
+        case 's':
+            if (sscanf(optarg, "%d-%d", &minSize, &maxSize) != 2)
+            {
+                maxSize = minSize;
+            }
+            break;
+        case 'b':
+            batch = atoi(optarg);
+            break;
+        case 'd':
+            logDirectory = optarg;
+            break;
+        case 't':
+            textProtocol = 1;
+            break;
+        case 'u':
+            datagrams = 1;
+            break;
+        case 'U':
+            unixSocket = optarg;
+            break;
+        case 'i':
+            idleConnections = atoi(optarg);
+            break;
+        case 'P':
+            serverPid = atoi(optarg);
+            break;
+        case 'x':
+            traceEvery = atol(optarg);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if ((port <= 0 && unixSocket == NULL) || connections <= 0 || batch <= 0 || minSize < 40 || maxSize < minSize || maxSize > 1000 ||
+        idleConnections < 0 || (idleConnections > 0 && datagrams) || traceEvery < 0 || (traceEvery > 0 && (textProtocol || datagrams)))
+    {
+        usage(argv[0]);
+    }
+    // A datagram has to hold a whole batch, after its header and a name of up to 32 bytes
+    if (datagrams && (textProtocol || PROTOCOL_DATAGRAM_HEADER + 32 + 2 + batch * (PROTOCOL_RECORD_HEADER + maxSize) > PROTOCOL_MAX_DATAGRAM))
+    {
+        usage(argv[0]);
+    }
+
+    memset(&serverAddr, 0, sizeof(serverAddr));
+    if (unixSocket != NULL)
+    {
+        struct sockaddr_un *unixAddr = (struct sockaddr_un *)&serverAddr;
+        unixAddr->sun_family = AF_UNIX;
+        snprintf(unixAddr->sun_path, sizeof(unixAddr->sun_path), "%s", unixSocket);
+        serverLength = sizeof(*unixAddr);
+    }
+    else
+    {
+        struct sockaddr_in *inetAddr = (struct sockaddr_in *)&serverAddr;
+        server = gethostbyname(host);
+        if (server == NULL)
+        {
+            error("Error in hostname!\n");
+        }
+        inetAddr->sin_family = AF_INET;
+        inetAddr->sin_port = htons(port);
+        memcpy(&inetAddr->sin_addr.s_addr, server->h_addr, server->h_length);
+        serverLength = sizeof(*inetAddr);
+    }
+
+    raiseFileLimit();
+
+    // Idle connections are opened and named first, with the server's memory measured before and after
+    long memoryBefore = (serverPid > 0) ? processMemory(serverPid) : -1;
+    int *idleSockets = malloc((idleConnections + 1) * sizeof(int));
+    if (idleSockets == NULL)
+    {
+        error("ERROR allocating sockets");
+    }
+    for (int i = 0; i < idleConnections; i++)
+    {
+        idleSockets[i] = connectToServer((struct sockaddr *)&serverAddr, serverLength, connections + i);
+    }
+    long memoryAfter = -1;
+    if (serverPid > 0)
+    {
+        // Text clients get no acknowledgement: give the server a moment to take in the last names
+        sleep(1);
+        memoryAfter = processMemory(serverPid);
+    }
+
+    // Connections are spread over at most MAX_SENDER_THREADS threads
+    int numberOfSenders = connections < MAX_SENDER_THREADS ? connections : MAX_SENDER_THREADS;
+    for (int i = 0; i < numberOfSenders; i++)
+    {
+        senders[i].firstConnection = connections * i / numberOfSenders;
+        senders[i].numberOfConnections = connections * (i + 1) / numberOfSenders - senders[i].firstConnection;
+        senders[i].sockets = malloc(senders[i].numberOfConnections * sizeof(int));
+        senders[i].sent = 0;
+        senders[i].bytes = 0;
+        senders[i].traced = 0;
+        senders[i].seed = i + 1;
+        if (senders[i].sockets == NULL)
+        {
+            error("ERROR allocating sockets");
+        }
+        for (int c = 0; c < senders[i].numberOfConnections; c++)
+        {
+            senders[i].sockets[c] = connectToServer((struct sockaddr *)&serverAddr, serverLength, senders[i].firstConnection + c);
+        }
+    }
+
+    runId = (unsigned int)getpid() ^ (unsigned int)monotonicNanos();
+    if (logDirectory != NULL && pthread_create(&tailer, NULL, tailerThread, NULL) != 0)
+    {
+        error("ERROR creating tailer thread");
+    }
+
+    long long start = monotonicNanos();
+    for (int i = 0; i < numberOfSenders; i++)
+    {
+        if (pthread_create(&senders[i].thread, NULL, senderThread, &senders[i]) != 0)
+        {
+            error("ERROR creating sender thread");
+        }
+    }
+    unsigned long sent = 0, bytes = 0, traced = 0;
+    for (int i = 0; i < numberOfSenders; i++)
+    {
+        pthread_join(senders[i].thread, NULL);
+        sent += senders[i].sent;
+        bytes += senders[i].bytes;
+        traced += senders[i].traced;
+    }
+    double elapsed = (monotonicNanos() - start) / 1e9;
+    atomic_store(&sendersDone, 1);
+
+    for (int i = 0; i < numberOfSenders; i++)
+    {
+        for (int c = 0; c < senders[i].numberOfConnections; c++)
+        {
+            close(senders[i].sockets[c]);
+        }
+        free(senders[i].sockets);
+    }
+    for (int i = 0; i < idleConnections; i++)
+    {
+        close(idleSockets[i]);
+    }
+    free(idleSockets);
+
+    printf("connections=%d protocol=%s%s sent=%lu elapsed=%.3fs msgs/s=%.0f MB/s=%.2f", connections,
+           datagrams ? "datagram" : textProtocol ? "text" : "binary", (unixSocket != NULL) ? "/unix" : datagrams ? "/udp" : "",
+           sent, elapsed, sent / elapsed, bytes / elapsed / 1e6);
+    if (logDirectory != NULL)
+    {
+        pthread_join(tailer, NULL);
+        double persistElapsed = lastObserved > start ? (lastObserved - start) / 1e9 : elapsed;
+        printf(" persisted=%lu persisted_msgs/s=%.0f p50_us=%lu p99_us=%lu p999_us=%lu max_us=%lu",
+               observed, observed / persistElapsed, histogramPercentile(&latencies, 50), histogramPercentile(&latencies, 99),
+               histogramPercentile(&latencies, 99.9), latencies.max);
+    }
+    if (traceEvery > 0)
+    {
+        printf(" traced=%lu", traced);
+    }
+    if (idleConnections > 0)
+    {
+        printf(" idle=%d", idleConnections);
+    }
+    if (memoryBefore >= 0 && memoryAfter >= 0)
+    {
+        printf(" server_kb=%ld->%ld", memoryBefore, memoryAfter);
+        if (idleConnections > 0)
+        {
+            printf(" bytes_per_idle=%ld", (memoryAfter - memoryBefore) * 1024 / idleConnections);
+        }
+    }
+    printf("\n");
+    return 0;
+}
+
+// Function for handling errors and exiting the program.
+void error(const char *msg)
+{
+    perror(msg); // Print the error message passed to the function along with the system error message.
+    exit(1);     // Exit the program with a non-zero status, indicating that an error occurred.
+}
+
+// Function to print the command line options and exit
+void usage(const char *program)
+{
+    fprintf(stderr,
+            "Usage: %s -p <port> [-h <host>] [-c <connections>] [-n <messages_per_connection> | -T <seconds>]\n"
+            "          [-r <messages_per_second>] [-s <size>|<min>-<max>] [-b <records_per_frame>] [-t] [-d <log_directory>]\n"
+            "          [-u] [-U <unix_socket>] [-i <idle_connections>] [-P <server_pid>] [-x <trace_every>]\n"
+            "  -r 0 (default) sends flat out, -t uses the text protocol, sizes are 40 to 1000 bytes.\n"
+            "  -u sends each batch as a UDP datagram to the port instead, one socket per connection.\n"
+            "  -U connects to the server's AF_UNIX socket (or, with -u, sends to its datagram socket) instead of host and port.\n"
+            "  -d follows the server's log files and reports send-to-persist latency.\n"
+            "  -i opens that many more connections before the run and leaves them idle; -P reports the server's\n"
+            "     memory (PSS, with the processes it forked) before and after they opened, and what each one took.\n"
+            "  -x has one record in that many traced from its send to the disk, reported in the server's stats_file\n"
+            "     (binary frames only, at most one per frame).\n",
+            program);
+    exit(1);
+}
+
+// Function to connect and introduce one load generator connection
+int connectToServer(const struct sockaddr *serverAddr, socklen_t serverLength, int id)
+{
+    unsigned char handshake[PROTOCOL_HANDSHAKE_HEADER + 32];
+    unsigned char ack[PROTOCOL_ACK_LENGTH];
+    char name[32];
+    int optval = 1;
+
+    // A connected datagram socket only fixes where send() goes; the name travels in every datagram
+    int sockfd = socket(serverAddr->sa_family, datagrams ? SOCK_DGRAM : SOCK_STREAM, 0);
+    if (sockfd < 0)
+    {
+        error("ERROR opening socket");
+    }
+    if (connect(sockfd, serverAddr, serverLength) < 0)
+    {
+        error("ERROR connecting");
+    }
+    if (datagrams)
+    {
+        return sockfd;
+    }
+    if (serverAddr->sa_family == AF_INET)
+    {
+        setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, &optval, sizeof(optval));
+    }
+
+    int nameLength = snprintf(name, sizeof(name), "loadgen-%d", id);
+    if (textProtocol)
+    {
+        name[nameLength++] = '\n';
+        if (writeAll(sockfd, name, nameLength) != 0)
+        {
+            error("ERROR sending name");
+        }
+        return sockfd;
+    }
+
+    memcpy(handshake, PROTOCOL_MAGIC, PROTOCOL_MAGIC_LENGTH);
+    handshake[PROTOCOL_MAGIC_LENGTH] = PROTOCOL_VERSION;
+    protocolPut16(handshake + PROTOCOL_MAGIC_LENGTH + 1, nameLength);
+    memcpy(handshake + PROTOCOL_HANDSHAKE_HEADER, name, nameLength);
+    if (writeAll(sockfd, handshake, PROTOCOL_HANDSHAKE_HEADER + nameLength) != 0)
+    {
+        error("ERROR sending handshake");
+    }
+    size_t received = 0;
+    while (received < sizeof(ack))
+    {
+        ssize_t n = read(sockfd, ack + received, sizeof(ack) - received);
+        if (n <= 0)
+        {
+            error("ERROR: the server did not acknowledge the binary protocol");
+        }
+        received += n;
+    }
+    return sockfd;
+}
+
+// Function to write a whole buffer, retrying after short writes
+int writeAll(int fd, const void *data, size_t length)
+{
+    const char *p = data;
+
+    while (length > 0)
+    {
+        ssize_t w = write(fd, p, length);
+        if (w < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (w <= 0)
+        {
+            return -1;
+        }
+        p += w;
+        length -= w;
+    }
+    return 0;
+}
+
+// Function to get a monotonic time in nanoseconds, comparable with the tailer's
+long long monotonicNanos(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Function to build one message: the tag with the connection, sequence and send time, padded to a random size
+size_t formatMessage(char *out, struct sender *sender, int connection, unsigned long sequence)
+{
+    int size = minSize + (maxSize > minSize ? rand_r(&sender->seed) % (maxSize - minSize + 1) : 0);
+    int length = snprintf(out, size + 1, MESSAGE_TAG "%08x:%d:%lu:%lld ", runId, connection, sequence, monotonicNanos());
+
+    memset(out + length, 'x', size - length);
+    return size;
+}
+
+// Function run by each sender thread. Every round sends one frame (or one line per record with text, or one datagram)
+// on each of its connections.
+void *senderThread(void *arg)
+{
+    struct sender *sender = arg;
+    // Room for a FRAME_TRACE frame in front of the frame of records
+    static __thread unsigned char buffer[PROTOCOL_FRAME_HEADER + PROTOCOL_TRACE_PAYLOAD + PROTOCOL_FRAME_HEADER + PROTOCOL_MAX_FRAME];
+    unsigned char *frame = buffer + PROTOCOL_FRAME_HEADER + PROTOCOL_TRACE_PAYLOAD;
+    char name[32];
+    int recordsPerSend = textProtocol ? 1 : batch;
+    double senderRate = rate * sender->numberOfConnections / connections;
+    long long start = monotonicNanos();
+    long long end = start + (long long)(duration * 1e9);
+    unsigned long sequence = 0;
+
+    while (1)
+    {
+        if (duration > 0 ? monotonicNanos() >= end : (long)sequence >= messagesPerConnection)
+        {
+            break;
+        }
+        for (int c = 0; c < sender->numberOfConnections; c++)
+        {
+            // Keep to the requested rate by sleeping until this message is due
+            if (senderRate > 0)
+            {
+                long long due = start + (long long)(sender->sent * 1e9 / senderRate);
+                long long wait = due - monotonicNanos();
+                if (wait > 0)
+                {
+                    struct timespec ts = {wait / 1000000000, wait % 1000000000};
+                    nanosleep(&ts, NULL);
+                }
+            }
+
+            int count = recordsPerSend;
+            if (duration == 0 && (long)(messagesPerConnection - sequence) < count)
+            {
+                count = messagesPerConnection - sequence;
+            }
+            // Records follow the frame header, or the datagram header with the connection's name
+            size_t header = PROTOCOL_FRAME_HEADER;
+            if (datagrams)
+            {
+                int nameLength = snprintf(name, sizeof(name), "loadgen-%d", sender->firstConnection + c);
+                memcpy(frame, PROTOCOL_DATAGRAM_MAGIC, PROTOCOL_MAGIC_LENGTH);
+                frame[PROTOCOL_MAGIC_LENGTH] = PROTOCOL_VERSION;
+                protocolPut16(frame + PROTOCOL_MAGIC_LENGTH + 1, nameLength);
+                memcpy(frame + PROTOCOL_DATAGRAM_HEADER, name, nameLength);
+                protocolPut16(frame + PROTOCOL_DATAGRAM_HEADER + nameLength, count);
+                header = PROTOCOL_DATAGRAM_HEADER + nameLength + 2;
+            }
+            size_t length = 0;
+            for (int r = 0; r < count; r++)
+            {
+                if (textProtocol)
+                {
+                    length += formatMessage((char *)frame + length, sender, sender->firstConnection + c, sequence + r);
+                    frame[length++] = '\n';
+                    continue;
+                }
+                unsigned char *record = frame + header + length;
+                struct timespec now;
+                clock_gettime(CLOCK_REALTIME, &now);
+                size_t size = formatMessage((char *)record + PROTOCOL_RECORD_HEADER, sender, sender->firstConnection + c, sequence + r);
+                protocolPut64(record, (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000);
+                protocolPut32(record + 8, size);
+                length += PROTOCOL_RECORD_HEADER + size;
+                sender->bytes += size;
+            }
+            if (textProtocol)
+            {
+                sender->bytes += length;
+            }
+            else if (!datagrams)
+            {
+                protocolPut32(frame, length);
+                protocolPut16(frame + 4, FRAME_RECORDS);
+                protocolPut16(frame + 6, count);
+            }
+            length += textProtocol ? 0 : header;
+
+            // The first record of the frame whose sequence is a multiple of traceEvery, stamped as it is sent
+            unsigned char *start = frame;
+            long traced = (traceEvery > 0) ? (traceEvery - (long)(sequence % traceEvery)) % traceEvery : count;
+            if (traced < count)
+            {
+                start = buffer;
+                protocolPut32(start, PROTOCOL_TRACE_PAYLOAD);
+                protocolPut16(start + 4, FRAME_TRACE);
+                protocolPut16(start + 6, 0);
+                protocolPut64(start + PROTOCOL_FRAME_HEADER, sequence + traced);
+                protocolPut64(start + PROTOCOL_FRAME_HEADER + 8, monotonicNanos());
+                protocolPut16(start + PROTOCOL_FRAME_HEADER + 16, traced);
+                length += PROTOCOL_FRAME_HEADER + PROTOCOL_TRACE_PAYLOAD;
+                sender->traced++;
+            }
+            if (datagrams ? send(sender->sockets[c], frame, length, 0) != (ssize_t)length : writeAll(sender->sockets[c], start, length) != 0)
+            {
+                error("ERROR writing to socket");
+            }
+            sender->sent += count;
+        }
+        sequence += recordsPerSend;
+    }
+    return NULL;
+}
+
+// Function run by the tailer thread: follow the log files the server writes to and time each generated message
+// from its send to the moment it can be read back from the file. Files are picked up from the directory's
+// inotify events, so a directory with many old segments costs nothing. Each shard of a sharded log directory
+// is watched alike.
+void *tailerThread(void *arg)
+{
+    static struct tailedFile files[MAX_TAILED_FILES];
+    int numberOfFiles = 0;
+    char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    long long quietSince = 0;
+
+    (void)arg;
+    int inotifyFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (inotifyFd < 0)
+    {
+        error("ERROR watching the log directory");
+    }
+    int shards = manifestShards(logDirectory);
+    int numberOfWatches = (shards > 0) ? shards : 1;
+    struct
+    {
+        int wd;
+        char shard[32]; // "shard-<i>/", or "" for an unsharded directory
+    } *watches = calloc(numberOfWatches, sizeof(*watches));
+    if (watches == NULL)
+    {
+        error("ERROR allocating the watches");
+    }
+    for (int i = 0; i < numberOfWatches; i++)
+    {
+        char directory[512];
+        snprintf(directory, sizeof(directory), "%s", logDirectory);
+        if (shards > 0)
+        {
+            snprintf(watches[i].shard, sizeof(watches[i].shard), SHARD_DIRECTORY "/", i);
+            snprintf(directory, sizeof(directory), "%s/" SHARD_DIRECTORY, logDirectory, i);
+        }
+        watches[i].wd = inotify_add_watch(inotifyFd, directory, IN_MODIFY | IN_CREATE);
+        if (watches[i].wd < 0)
+        {
+            error("ERROR watching the log directory");
+        }
+        // The active segment already exists and may be written through a mapping without any event
+        int rebuilt;
+        struct segmentIndex *segments = manifestLoad(directory, &rebuilt);
+        if (segments != NULL && segments->count > 0)
+        {
+            followLogFile(watches[i].shard, segmentIndexNewest(segments), files, &numberOfFiles);
+        }
+        free(segments);
+    }
+
+    while (1)
+    {
+        // Writes through a mapping (mmap_segments) raise no event, so the followed files are also polled every millisecond
+        struct pollfd wake = {.fd = inotifyFd, .events = POLLIN};
+        unsigned long observedBefore = observed;
+        if (poll(&wake, 1, 1) > 0)
+        {
+            ssize_t length;
+            while ((length = read(inotifyFd, events, sizeof(events))) > 0)
+            {
+                for (char *p = events; p < events + length; p += sizeof(struct inotify_event) + ((struct inotify_event *)p)->len)
+                {
+                    struct inotify_event *event = (struct inotify_event *)p;
+                    for (int i = 0; i < numberOfWatches && event->len > 0; i++)
+                    {
+                        if (watches[i].wd == event->wd)
+                        {
+                            followLogFile(watches[i].shard, event->name, files, &numberOfFiles);
+                        }
+                    }
+                }
+            }
+        }
+        for (int i = 0; i < numberOfFiles; i++)
+        {
+            readTailedFile(&files[i]);
+        }
+
+        if (observed != observedBefore || !atomic_load(&sendersDone))
+        {
+            quietSince = 0;
+        }
+        else if (quietSince == 0)
+        {
+            quietSince = monotonicNanos();
+        }
+        else if (monotonicNanos() - quietSince > 2000000000LL)
+        {
+            // Nothing new for two seconds since the senders finished: the server wrote what it will
+            break;
+        }
+    }
+    for (int i = 0; i < numberOfFiles; i++)
+    {
+        close(files[i].fd);
+        free(files[i].blocks.data);
+    }
+    close(inotifyFd);
+    free(watches);
+    return NULL;
+}
+
+// Function to start following a log file of a shard ("" when unsharded) from its beginning, unless it is followed already
+void followLogFile(const char *shard, const char *name, struct tailedFile *files, int *numberOfFiles)
+{
+    char path[512];
+    char shardName[256];
+
+    if (strncmp(name, "server_log_", 11) != 0 || *numberOfFiles >= MAX_TAILED_FILES)
+    {
+        return;
+    }
+    snprintf(shardName, sizeof(shardName), "%s%s", shard, name);
+    for (int i = *numberOfFiles - 1; i >= 0; i--)
+    {
+        if (strcmp(files[i].name, shardName) == 0)
+        {
+            return;
+        }
+    }
+    snprintf(path, sizeof(path), "%s/%s", logDirectory, shardName);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        return; // Already removed by retention
+    }
+    struct tailedFile *file = &files[(*numberOfFiles)++];
+    snprintf(file->name, sizeof(file->name), "%s", shardName);
+    file->fd = fd;
+    file->partialLength = 0;
+    file->format = -1;
+    file->offset = BINARY_SEGMENT_MAGIC_LENGTH;
+    file->blocks.length = 0;
+}
+
+// Function to read the new lines of a followed file and record the latency of the generated ones
+void readTailedFile(struct tailedFile *file)
+{
+    char buffer[65536];
+    ssize_t n;
+
+    // The format is known once the file holds more than the zeros of preallocated space
+    if (file->format == -1)
+    {
+        char magic[BINARY_SEGMENT_MAGIC_LENGTH];
+        if (pread(file->fd, magic, sizeof(magic), 0) != sizeof(magic) || magic[0] == '\0')
+        {
+            return;
+        }
+        file->format = (memcmp(magic, BINARY_SEGMENT_MAGIC, sizeof(magic)) == 0);
+    }
+    if (file->format == 1)
+    {
+        readTailedBlocks(file);
+        return;
+    }
+
+    while ((n = read(file->fd, buffer, sizeof(buffer))) > 0)
+    {
+        long long now = monotonicNanos();
+        for (ssize_t i = 0; i < n; i++)
+        {
+            // Space preallocated by mmap_segments reads as zeros: come back for it once it is written
+            if (buffer[i] == '\0')
+            {
+                lseek(file->fd, i - n, SEEK_CUR);
+                return;
+            }
+            if (buffer[i] != '\n')
+            {
+                if (file->partialLength < sizeof(file->partial) - 1)
+                {
+                    file->partial[file->partialLength++] = buffer[i];
+                }
+                continue;
+            }
+            observeMessage(file->partial, file->partialLength, now);
+            file->partialLength = 0;
+        }
+    }
+}
+
+// Function to read the new complete blocks of a binary segment and time the generated messages they hold.
+// A block is only used once its checksum matches, which also skips one being copied into a mapping.
+void readTailedBlocks(struct tailedFile *file)
+{
+    struct binaryBuffer *blocks = &file->blocks;
+    ssize_t n;
+
+    do
+    {
+        if (binaryBufferReserve(blocks, 65536) != 0)
+        {
+            break;
+        }
+        n = pread(file->fd, blocks->data + blocks->length, blocks->capacity - blocks->length, file->offset + blocks->length);
+        if (n > 0)
+        {
+            blocks->length += n;
+        }
+
+        long long now = monotonicNanos();
+        size_t start = 0;
+        long size;
+        while ((size = binaryBlockCheck(blocks->data + start, blocks->length - start)) > 0)
+        {
+            struct binaryCursor cursor;
+            struct binaryEntry entry;
+            binaryBlockOpen(&cursor, blocks->data + start);
+            while (binaryBlockNext(&cursor, &entry) > 0)
+            {
+                if (entry.tag != BINARY_DEFINE)
+                {
+                    observeMessage(entry.data, entry.length, now);
+                }
+            }
+            start += size;
+        }
+        memmove(blocks->data, blocks->data + start, blocks->length - start);
+        blocks->length -= start;
+        file->offset += start;
+    } while (n > 0);
+    // What is left is preallocated zeros or a block still being written: it is read again next time
+    blocks->length = 0;
+}
+
+// Function to record the latency of a generated message of this run found in a log line or payload
+void observeMessage(const char *data, size_t length, long long now)
+{
+    char tag[96];
+    unsigned int run;
+    int connection;
+    unsigned long sequence;
+    long long sentAt;
+
+    const char *found = memmem(data, length, MESSAGE_TAG, strlen(MESSAGE_TAG));
+    if (found == NULL)
+    {
+        return;
+    }
+    size_t tagLength = data + length - found;
+    tagLength = (tagLength < sizeof(tag) - 1) ? tagLength : sizeof(tag) - 1;
+    memcpy(tag, found, tagLength);
+    tag[tagLength] = '\0';
+    if (sscanf(tag + strlen(MESSAGE_TAG), "%x:%d:%lu:%lld", &run, &connection, &sequence, &sentAt) == 4 && run == runId && now >= sentAt)
+    {
+        recordLatency(&latencies, (now - sentAt) / 1000);
+        observed++;
+        lastObserved = now;
+    }
+}
+
+// Function to add a value to a histogram
+void recordLatency(struct histogram *h, unsigned long value)
+{
+    int bucket = 0;
+
+    // Values below HISTOGRAM_SUB_BUCKETS are exact; above, each power of two is split into HISTOGRAM_SUB_BUCKETS
+    while ((value >> bucket) >= HISTOGRAM_SUB_BUCKETS && bucket < HISTOGRAM_BUCKETS - 1)
+    {
+        bucket++;
+    }
+    h->counts[bucket][(value >> bucket) & (HISTOGRAM_SUB_BUCKETS - 1)]++;
+    h->total++;
+    if (value > h->max)
+    {
+        h->max = value;
+    }
+}
+
+// Function to get the value below which the given percentage of the recorded values fall
+unsigned long histogramPercentile(struct histogram *h, double percentile)
+{
+    unsigned long target = (unsigned long)(h->total * percentile / 100.0);
+    unsigned long seen = 0;
+
+    for (int bucket = 0; bucket < HISTOGRAM_BUCKETS; bucket++)
+    {
+        for (int sub = 0; sub < HISTOGRAM_SUB_BUCKETS; sub++)
+        {
+            seen += h->counts[bucket][sub];
+            if (seen > target)
+            {
+                return (unsigned long)sub << bucket;
+            }
+        }
+    }
+    return h->max;
+}
+
+// Function to raise the soft limit on open descriptors to the hard limit, for thousands of connections
+void raiseFileLimit(void)
+{
+    struct rlimit limit;
+
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max)
+    {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+}
+
+// Function to measure the memory of a process and of every process it forked, like the client processes of
+// the server's fork mode, in kB. Proportional set sizes are summed so pages the processes share count once.
+// It returns -1 when the process cannot be read.
+long processMemory(pid_t pid)
+{
+    char path[64];
+    char line[256];
+    long total = -1;
+    long kb;
+    int child;
+
+    snprintf(path, sizeof(path), "/proc/%d/smaps_rollup", (int)pid);
+    FILE *file = fopen(path, "r");
+    if (file == NULL)
+    {
+        return -1;
+    }
+    while (total < 0 && fgets(line, sizeof(line), file) != NULL)
+    {
+        if (sscanf(line, "Pss: %ld kB", &kb) == 1)
+        {
+            total = kb;
+        }
+    }
+    fclose(file);
+    if (total < 0)
+    {
+        return -1;
+    }
+
+    snprintf(path, sizeof(path), "/proc/%d/task/%d/children", (int)pid, (int)pid);
+    file = fopen(path, "r");
+    if (file != NULL)
+    {
+        while (fscanf(file, "%d", &child) == 1)
+        {
+            kb = processMemory(child);
+            total += (kb > 0) ? kb : 0;
+        }
+        fclose(file);
+    }
+    return total;
+}
@@ -0,0 +1,406 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include "binary_segment.h"
+#include "manifest.h"
+#include "segment_compress.h"
+
+// Prints log segments as text. Binary segments (segment_format=binary) are rendered back to the lines
+// a text segment would hold, text segments are copied as they are. Compressed segments (compress_workers)
+// are decompressed first, then printed like the segment they replaced. The shards of a sharded log
+// directory (shards=N) are merged into one sequence of lines, in the order of their timestamps.
+
+// A shard being merged: the text of its current segment and where its next line starts
+struct shardCursor
+{
+    char directory[512];
+    struct segmentIndex *index;
+    unsigned long next;       // Next segment of the index to load
+    struct binaryBuffer text; // Text of the current segment
+    size_t position;
+    size_t lineLength;        // Length of the next line, 0 once the shard is exhausted
+    int64_t time;             // Time of the next line; a line without one keeps the time of the line before it
+};
+
+// Declaration of the functions
+void usage(const char *program);
+int catPath(const char *path);
+int catDirectory(const char *directory);
+int mergeShards(const char *directory, int shards);
+int nextShardLine(struct shardCursor *cursor);
+int catSegment(const char *path, struct binaryBuffer *capture);
+int decompressSegment(int fd, const char *path);
+int catBinarySegment(int fd, const char *path, struct binaryBuffer *capture);
+int catTextSegment(int fd, struct binaryBuffer *capture);
+int writeOutput(const char *data, size_t length, struct binaryBuffer *capture);
+int flushOutput(struct binaryBuffer *out, struct binaryBuffer *capture);
+
+int main(int argc, char *argv[])
+{
+    int status = 0;
+
+    if (argc < 2)
+    {
+        usage(argv[0]);
+    }
+    for (int i = 1; i < argc; i++)
+    {
+        if (catPath(argv[i]) != 0)
+        {
+            status = 1;
+        }
+    }
+    return status;
+}
+
+// Function to print the command line and exit
+void usage(const char *program)
+{
+    fprintf(stderr,
+            "Usage: %s <segment_file|log_directory>...\n"
+            "  A directory prints every segment of its manifest, oldest first. The shards of a sharded\n"
+            "  directory are merged by the time of their records.\n",
+            program);
+    exit(1);
+}
+
+// Function to print a segment, or every segment of a log directory. It returns -1 on failure.
+int catPath(const char *path)
+{
+    struct stat st;
+
+    if (stat(path, &st) != 0)
+    {
+        perror(path);
+        return -1;
+    }
+    return S_ISDIR(st.st_mode) ? catDirectory(path) : catSegment(path, NULL);
+}
+
+// Function to print the segments of a log directory in the order of its manifest
+int catDirectory(const char *directory)
+{
+    char path[512];
+    int rebuilt, status = 0;
+    int shards = manifestShards(directory);
+    if (shards > 0)
+    {
+        return mergeShards(directory, shards);
+    }
+    struct segmentIndex *index = manifestLoad(directory, &rebuilt);
+
+    if (index == NULL)
+    {
+        perror(directory);
+        return -1;
+    }
+    for (unsigned long i = 0; i < index->count; i++)
+    {
+        snprintf(path, sizeof(path), "%s/%s", directory, segmentIndexName(index, i));
+        if (catSegment(path, NULL) != 0)
+        {
+            status = -1;
+        }
+    }
+    free(index);
+    return status;
+}
+
+// Function to print the shards of a sharded log directory as one log: each shard is read in the order of
+// its manifest, one segment at a time, and the next line printed is always the earliest of the shards'
+// next lines. Records of the same second keep the order of their shard, shards are taken lowest first.
+int mergeShards(const char *directory, int shards)
+{
+    char shard[32];
+    int rebuilt, status = 0;
+    struct shardCursor *cursors = calloc(shards, sizeof(struct shardCursor));
+
+    if (cursors == NULL)
+    {
+        perror("logcat");
+        return -1;
+    }
+    for (int i = 0; i < shards; i++)
+    {
+        snprintf(shard, sizeof(shard), SHARD_DIRECTORY, i);
+        snprintf(cursors[i].directory, sizeof(cursors[i].directory), "%s/%s", directory, shard);
+        cursors[i].index = manifestLoad(cursors[i].directory, &rebuilt);
+        if (cursors[i].index == NULL)
+        {
+            perror(cursors[i].directory);
+            status = -1;
+        }
+        cursors[i].time = INT64_MIN;
+        if (nextShardLine(&cursors[i]) != 0)
+        {
+            status = -1;
+        }
+    }
+
+    while (1)
+    {
+        struct shardCursor *earliest = NULL;
+        for (int i = 0; i < shards; i++)
+        {
+            if (cursors[i].lineLength > 0 && (earliest == NULL || cursors[i].time < earliest->time))
+            {
+                earliest = &cursors[i];
+            }
+        }
+        if (earliest == NULL)
+        {
+            break;
+        }
+        if (writeOutput(earliest->text.data + earliest->position, earliest->lineLength, NULL) != 0)
+        {
+            status = -1;
+            break;
+        }
+        earliest->position += earliest->lineLength;
+        if (nextShardLine(earliest) != 0)
+        {
+            status = -1;
+        }
+    }
+
+    for (int i = 0; i < shards; i++)
+    {
+        free(cursors[i].index);
+        free(cursors[i].text.data);
+    }
+    free(cursors);
+    return status;
+}
+
+// Function to find the next line of a shard, loading its next segments as needed. 'lineLength' is left at 0
+// once the shard is exhausted. It returns -1 when a segment could not be read; its lines up to the damage are kept.
+int nextShardLine(struct shardCursor *cursor)
+{
+    char path[1024];
+    int status = 0;
+
+    cursor->lineLength = 0;
+    while (cursor->position >= cursor->text.length)
+    {
+        if (cursor->index == NULL || cursor->next >= cursor->index->count)
+        {
+            return status;
+        }
+        cursor->text.length = 0;
+        cursor->position = 0;
+        snprintf(path, sizeof(path), "%s/%s", cursor->directory, segmentIndexName(cursor->index, cursor->next++));
+        if (catSegment(path, &cursor->text) != 0)
+        {
+            status = -1;
+        }
+    }
+
+    const char *line = cursor->text.data + cursor->position;
+    size_t left = cursor->text.length - cursor->position;
+    const char *newline = memchr(line, '\n', left);
+    cursor->lineLength = (newline != NULL) ? (size_t)(newline - line) + 1 : left;
+    int64_t seconds;
+    if (binaryParseTimestamp(line, cursor->lineLength, &seconds))
+    {
+        cursor->time = seconds;
+    }
+    return status;
+}
+
+// Function to print one segment in whichever format it is, or to append its text to 'capture' when not NULL
+int catSegment(const char *path, struct binaryBuffer *capture)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+    {
+        perror(path);
+        return -1;
+    }
+    if (compressedSegmentIsCompressed(fd))
+    {
+        int original = decompressSegment(fd, path);
+        close(fd);
+        if (original < 0)
+        {
+            return -1;
+        }
+        fd = original;
+    }
+    int result = binarySegmentIsBinary(fd) ? catBinarySegment(fd, path, capture) : catTextSegment(fd, capture);
+    close(fd);
+    return result;
+}
+
+// Function to decompress a compressed segment into an anonymous file, which then reads like the original.
+// It returns the descriptor of that file, or -1 when the segment is damaged.
+int decompressSegment(int fd, const char *path)
+{
+    struct compressedSegment segment;
+
+    if (compressedSegmentOpen(&segment, fd) != 0)
+    {
+        fprintf(stderr, "logcat: %s: incomplete compressed segment or codec not built in\n", path);
+        return -1;
+    }
+    int original = memfd_create("segment", 0);
+    char *block = malloc(segment.blockSize);
+    int status = (original >= 0 && block != NULL) ? 0 : -1;
+    if (status != 0)
+    {
+        perror("logcat");
+    }
+    for (uint32_t i = 0; i < segment.blockCount && status == 0; i++)
+    {
+        long length = compressedSegmentReadBlock(&segment, i, block);
+        if (length < 0)
+        {
+            fprintf(stderr, "logcat: %s: damaged compressed block %u\n", path, i);
+            status = -1;
+        }
+        else if (write(original, block, length) != length)
+        {
+            perror("logcat");
+            status = -1;
+        }
+    }
+    free(block);
+    compressedSegmentClose(&segment);
+    if (status != 0)
+    {
+        if (original >= 0)
+        {
+            close(original);
+        }
+        return -1;
+    }
+    lseek(original, 0, SEEK_SET);
+    return original;
+}
+
+// Function to render the blocks of a binary segment in order, up to its end or its first damaged block
+int catBinarySegment(int fd, const char *path, struct binaryBuffer *capture)
+{
+    struct binaryDictionary *dictionary = malloc(sizeof(struct binaryDictionary));
+    struct binaryBuffer in = {0};
+    struct binaryBuffer out = {0};
+    long offset = BINARY_SEGMENT_MAGIC_LENGTH; // File offset of in.data
+    size_t start = 0;                          // Bytes of 'in' already rendered
+    long size = 0;
+    int status = 0;
+    ssize_t n;
+
+    if (dictionary == NULL)
+    {
+        perror("malloc");
+        return -1;
+    }
+    binaryDictionaryReset(dictionary);
+    do
+    {
+        if (start > 0)
+        {
+            memmove(in.data, in.data + start, in.length - start);
+            offset += start;
+            in.length -= start;
+            start = 0;
+        }
+        if (binaryBufferReserve(&in, 65536) != 0)
+        {
+            status = -1;
+            break;
+        }
+        n = pread(fd, in.data + in.length, in.capacity - in.length, offset + in.length);
+        if (n > 0)
+        {
+            in.length += n;
+        }
+
+        while ((size = binaryBlockCheck(in.data + start, in.length - start)) > 0)
+        {
+            struct binaryCursor cursor;
+            struct binaryEntry entry;
+            int result = binaryBlockOpen(&cursor, in.data + start);
+            while (result == 0 && (result = binaryBlockNext(&cursor, &entry)) > 0)
+            {
+                binaryRenderEntry(dictionary, &entry, &out);
+                result = 0;
+            }
+            if (result < 0)
+            {
+                size = -1;
+                break;
+            }
+            start += size;
+            if (out.length >= 65536 && flushOutput(&out, capture) != 0)
+            {
+                status = -1;
+            }
+        }
+    } while (size >= 0 && n > 0 && status == 0);
+
+    if (flushOutput(&out, capture) != 0)
+    {
+        status = -1;
+    }
+    // Trailing zeros are preallocated space, anything else is damage
+    if (size < 0 || (start < in.length && in.data[start] != '\0'))
+    {
+        fprintf(stderr, "logcat: %s: damaged block at offset %ld\n", path, offset + (long)start);
+        status = -1;
+    }
+    free(in.data);
+    free(out.data);
+    free(dictionary);
+    return status;
+}
+
+// Function to copy a text segment, without the zeros of preallocated space
+int catTextSegment(int fd, struct binaryBuffer *capture)
+{
+    char buffer[65536];
+    ssize_t n;
+
+    while ((n = read(fd, buffer, sizeof(buffer))) > 0)
+    {
+        char *zero = memchr(buffer, '\0', n);
+        size_t length = (zero != NULL) ? (size_t)(zero - buffer) : (size_t)n;
+        if (writeOutput(buffer, length, capture) != 0)
+        {
+            return -1;
+        }
+        if (zero != NULL)
+        {
+            break;
+        }
+    }
+    return (n < 0) ? -1 : 0;
+}
+
+// Function to write out text, to stdout or appended to 'capture' when not NULL
+int writeOutput(const char *data, size_t length, struct binaryBuffer *capture)
+{
+    if (capture == NULL)
+    {
+        return (fwrite(data, 1, length, stdout) == length) ? 0 : -1;
+    }
+    if (binaryBufferReserve(capture, length) != 0)
+    {
+        return -1;
+    }
+    memcpy(capture->data + capture->length, data, length);
+    capture->length += length;
+    return 0;
+}
+
+// Function to write out rendered lines
+int flushOutput(struct binaryBuffer *out, struct binaryBuffer *capture)
+{
+    int result = writeOutput(out->data, out->length, capture);
+    out->length = 0;
+    return result;
+}
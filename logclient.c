@@ -0,0 +1,678 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <poll.h>
+#include <stdatomic.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include <sys/mman.h>
+#include "logclient.h"
+#include "record_ring.h"
+#include "protocol.h"
+#include "shm_ingest.h"
+
+#define LOG_BUFFER_SLOTS 1024                          // Records a thread may have waiting, a power of two
+#define LOG_BATCH_BYTES (4 * PROTOCOL_MAX_FRAME)        // Frames sent before waiting for the server to sync them
+#define LOG_IDLE_MIN_US 100                            // The flusher's naps when there is nothing to send double
+#define LOG_IDLE_MAX_US 10000                          // up to this long
+#define LOG_BACKOFF_MIN_MS 100                         // Delays between attempts to reach the server double
+#define LOG_BACKOFF_MAX_MS 5000                        // up to this long
+#define LOG_IO_TIMEOUT_S 5                             // A send or a sync taking longer drops the connection
+#define LOG_SHARED_POLL_US 100                         // How often log_flush() looks at a shared-memory lane
+#define LOG_TRACE_LENGTH 16                            // Sequence and send time of a traced record, after it in its slot
+
+// The ring of one writing thread
+struct logBuffer
+{
+    struct recordRing *ring;
+    atomic_int abandoned; // The thread exited: the buffer is freed once drained
+    unsigned int untraced; // Records the thread wrote since the last one traced
+    struct logBuffer *next;
+};
+
+// A connection to the server and what the background thread needs to feed it
+struct logClient
+{
+    char name[PROTOCOL_MAX_NAME + 1];
+    struct sockaddr_storage address;
+    socklen_t addressLength;
+    int fd;               // -1 while the server cannot be reached
+    int version;          // Protocol version the server answered with: from 2 on batches are synced
+    pthread_key_t key;    // The logBuffer of the calling thread
+    pthread_mutex_t lock; // Guards the list of buffers and the flush requests
+    pthread_cond_t wake;  // Wakes the flusher for a flush request or for closing
+    pthread_cond_t flushed;
+    struct logBuffer *buffers;
+    unsigned long flushRequests; // Bumped by every log_flush()
+    unsigned long flushesDone;   // The last request answered
+    int flushResult;             // How it was answered: 0, or -1 when the server could not be reached
+    int closing;
+    atomic_ulong dropped; // Records log_write() refused because a ring was full
+    atomic_uint traceEvery; // Each thread has one record in this many traced, 0 for none
+    atomic_ulong traced;    // Sequence number of the traced records
+    unsigned char *batch; // Frames sent and not synced yet
+    size_t batchLength;
+    uint64_t batches;     // Sequence number of the batches, echoed in their syncs
+    pthread_t flusher;
+    struct shmIngestHeader *ingest; // "shm:<name>": the server's shared-memory ingest, written to directly
+    size_t ingestSize;
+    int lane;
+};
+
+static void *flusherThread(void *arg);
+static void abandonBuffer(void *value);
+static struct logBuffer *registerBuffer(struct logClient *client);
+static int drainBuffers(struct logClient *client);
+static int sendBatch(struct logClient *client);
+static int connectToServer(struct logClient *client);
+static struct logClient *openShared(struct logClient *client, const char *name);
+static int writeAll(int fd, const void *data, size_t length);
+static int readAll(int fd, void *data, size_t length);
+
+// Function to parse the address of the server, "host:port" or "unix:<path>", and start the background thread.
+// Connecting is left to that thread, so the server does not need to be up yet. It returns NULL on a bad address.
+// With "shm:<name>" records go straight to a lane of the server's shared-memory ingest, which must be up.
+struct logClient *log_open(const char *address, const char *name)
+{
+    struct logClient *client = calloc(1, sizeof(struct logClient));
+    if (client == NULL)
+    {
+        return NULL;
+    }
+    snprintf(client->name, sizeof(client->name), "%s", name);
+    client->fd = -1;
+
+    if (strncmp(address, "shm:", 4) == 0)
+    {
+        return openShared(client, address + 4);
+    }
+    if (strncmp(address, "unix:", 5) == 0)
+    {
+        struct sockaddr_un *unixAddr = (struct sockaddr_un *)&client->address;
+        if (strlen(address + 5) >= sizeof(unixAddr->sun_path))
+        {
+            free(client);
+            errno = ENAMETOOLONG;
+            return NULL;
+        }
+        unixAddr->sun_family = AF_UNIX;
+        strcpy(unixAddr->sun_path, address + 5);
+        client->addressLength = sizeof(*unixAddr);
+    }
+    else
+    {
+        char host[256];
+        const char *colon = strrchr(address, ':');
+        struct addrinfo hints = {.ai_family = AF_INET, .ai_socktype = SOCK_STREAM}, *result;
+        if (colon == NULL || (size_t)(colon - address) >= sizeof(host))
+        {
+            free(client);
+            errno = EINVAL;
+            return NULL;
+        }
+        memcpy(host, address, colon - address);
+        host[colon - address] = '\0';
+        if (getaddrinfo(host, colon + 1, &hints, &result) != 0)
+        {
+            free(client);
+            errno = EINVAL;
+            return NULL;
+        }
+        memcpy(&client->address, result->ai_addr, result->ai_addrlen);
+        client->addressLength = result->ai_addrlen;
+        freeaddrinfo(result);
+    }
+
+    client->batch = malloc(LOG_BATCH_BYTES + PROTOCOL_FRAME_HEADER + 8);
+    if (client->batch == NULL || pthread_key_create(&client->key, abandonBuffer) != 0)
+    {
+        free(client->batch);
+        free(client);
+        return NULL;
+    }
+    pthread_mutex_init(&client->lock, NULL);
+    pthread_cond_init(&client->wake, NULL);
+    pthread_cond_init(&client->flushed, NULL);
+    atomic_init(&client->dropped, 0);
+    atomic_init(&client->traceEvery, 0);
+    atomic_init(&client->traced, 0);
+    if (pthread_create(&client->flusher, NULL, flusherThread, client) != 0)
+    {
+        pthread_key_delete(client->key);
+        free(client->batch);
+        free(client);
+        return NULL;
+    }
+    return client;
+}
+
+// Function to log one message: it is stamped with the time and queued in the calling thread's ring.
+// It returns -1 with errno EAGAIN when the ring is full, and EMSGSIZE when the message is over LOG_MAX_RECORD bytes.
+int log_write(struct logClient *client, const char *message, size_t length)
+{
+    struct logBuffer *buffer = NULL;
+    unsigned char header[PROTOCOL_RECORD_HEADER];
+    struct timespec now;
+
+    if (length > LOG_MAX_RECORD)
+    {
+        errno = EMSGSIZE;
+        return -1;
+    }
+    if (client->ingest == NULL && (buffer = pthread_getspecific(client->key)) == NULL && (buffer = registerBuffer(client)) == NULL)
+    {
+        return -1;
+    }
+    clock_gettime(CLOCK_REALTIME, &now);
+    protocolPut64(header, (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000);
+    protocolPut32(header + 8, length);
+    // The slot holds the record as it goes on the wire
+    struct iovec slices[2] = {{.iov_base = header, .iov_len = sizeof(header)}, {.iov_base = (void *)message, .iov_len = length}};
+    if (client->ingest != NULL)
+    {
+        // Every thread shares the lane of the process; EPIPE tells the server is gone
+        if (shmIngestPush(client->ingest, client->lane, slices, 2) != 0)
+        {
+            if (errno == EAGAIN)
+            {
+                atomic_fetch_add_explicit(&client->dropped, 1, memory_order_relaxed);
+            }
+            return -1;
+        }
+        return 0;
+    }
+    // A traced record carries its sequence number and send time after it, for the flusher
+    unsigned int every = atomic_load_explicit(&client->traceEvery, memory_order_relaxed);
+    unsigned char trace[LOG_TRACE_LENGTH];
+    int traced = every > 0 && ++buffer->untraced >= every && length + LOG_TRACE_LENGTH <= LOG_MAX_RECORD;
+    if (traced)
+    {
+        struct timespec sent;
+        clock_gettime(CLOCK_MONOTONIC, &sent);
+        protocolPut64(trace, atomic_fetch_add_explicit(&client->traced, 1, memory_order_relaxed) + 1);
+        protocolPut64(trace + 8, (uint64_t)sent.tv_sec * 1000000000 + sent.tv_nsec);
+        buffer->untraced = 0;
+    }
+    struct iovec tracedSlices[3] = {slices[0], slices[1], {.iov_base = trace, .iov_len = sizeof(trace)}};
+    if (traced ? recordRingPushTagged(buffer->ring, tracedSlices, 3, 1) != 0 : recordRingPushSlices(buffer->ring, slices, 2) != 0)
+    {
+        atomic_fetch_add_explicit(&client->dropped, 1, memory_order_relaxed);
+        errno = EAGAIN;
+        return -1;
+    }
+    return 0;
+}
+
+// Function to wait until every record written before the call, by any thread, was taken by the server.
+// It returns -1 when the server cannot be reached; the records then stay queued.
+int log_flush(struct logClient *client)
+{
+    if (client->ingest != NULL)
+    {
+        // The lane is empty once the server has drained it
+        struct recordRing *ring = shmIngestRing(shmIngestLane(client->ingest, client->lane));
+        struct timespec pause = {0, LOG_SHARED_POLL_US * 1000};
+        for (long waited = 0; recordRingPeek(ring, 0) != NULL; waited += LOG_SHARED_POLL_US)
+        {
+            if (atomic_load(&client->ingest->closed) || waited >= LOG_IO_TIMEOUT_S * 1000000L)
+            {
+                return -1;
+            }
+            nanosleep(&pause, NULL);
+        }
+        return 0;
+    }
+    pthread_mutex_lock(&client->lock);
+    unsigned long request = ++client->flushRequests;
+    pthread_cond_signal(&client->wake);
+    while (client->flushesDone < request)
+    {
+        pthread_cond_wait(&client->flushed, &client->lock);
+    }
+    int result = client->flushResult;
+    pthread_mutex_unlock(&client->lock);
+    return result;
+}
+
+// Function to send what is queued, stop the background thread and free the client. No thread may use it any more.
+// Records still queued when the server cannot be reached are lost.
+void log_close(struct logClient *client)
+{
+    if (client->ingest != NULL)
+    {
+        // The server logs what is left in the lane before it frees it
+        shmIngestDetach(client->ingest, client->lane);
+        munmap(client->ingest, client->ingestSize);
+        free(client);
+        return;
+    }
+    pthread_mutex_lock(&client->lock);
+    client->closing = 1;
+    pthread_cond_signal(&client->wake);
+    pthread_mutex_unlock(&client->lock);
+    pthread_join(client->flusher, NULL);
+
+    pthread_key_delete(client->key);
+    while (client->buffers != NULL)
+    {
+        struct logBuffer *buffer = client->buffers;
+        client->buffers = buffer->next;
+        free(buffer->ring);
+        free(buffer);
+    }
+    pthread_mutex_destroy(&client->lock);
+    pthread_cond_destroy(&client->wake);
+    pthread_cond_destroy(&client->flushed);
+    free(client->batch);
+    free(client);
+}
+
+// Function to tell how many records log_write() refused so far because a ring was full
+unsigned long log_dropped(struct logClient *client)
+{
+    return atomic_load_explicit(&client->dropped, memory_order_relaxed);
+}
+
+// Function to have the server trace one record in 'every' written by each thread, 0 to stop
+void log_trace(struct logClient *client, unsigned int every)
+{
+    atomic_store_explicit(&client->traceEvery, every, memory_order_relaxed);
+}
+
+// Function to attach to the shared-memory ingest of a server on this host: no thread, no connection
+static struct logClient *openShared(struct logClient *client, const char *name)
+{
+    client->ingest = shmIngestOpen(name, &client->ingestSize);
+    if (client->ingest == NULL)
+    {
+        free(client);
+        return NULL;
+    }
+    client->lane = shmIngestAttach(client->ingest, client->name, strlen(client->name));
+    if (client->lane < 0)
+    {
+        int attachError = errno;
+        munmap(client->ingest, client->ingestSize);
+        free(client);
+        errno = attachError;
+        return NULL;
+    }
+    atomic_init(&client->dropped, 0);
+    return client;
+}
+
+// Function to give the calling thread its ring, on its first write
+static struct logBuffer *registerBuffer(struct logClient *client)
+{
+    struct logBuffer *buffer = malloc(sizeof(struct logBuffer));
+    if (buffer == NULL)
+    {
+        return NULL;
+    }
+    buffer->ring = malloc(recordRingSize(LOG_BUFFER_SLOTS));
+    if (buffer->ring == NULL)
+    {
+        free(buffer);
+        return NULL;
+    }
+    recordRingInit(buffer->ring, LOG_BUFFER_SLOTS);
+    atomic_init(&buffer->abandoned, 0);
+    buffer->untraced = 0;
+
+    pthread_mutex_lock(&client->lock);
+    buffer->next = client->buffers;
+    client->buffers = buffer;
+    pthread_mutex_unlock(&client->lock);
+    pthread_setspecific(client->key, buffer);
+    return buffer;
+}
+
+// Function run when a thread that wrote exits: the flusher frees its ring once it has sent what is left
+static void abandonBuffer(void *value)
+{
+    struct logBuffer *buffer = value;
+    atomic_store_explicit(&buffer->abandoned, 1, memory_order_release);
+}
+
+// Function run by the background thread: drain the rings into a batch, send it and have it synced, answer flush
+// requests, reconnect with a backoff when the server goes away, and nap when there is nothing to do
+static void *flusherThread(void *arg)
+{
+    struct logClient *client = arg;
+    unsigned int idle = LOG_IDLE_MIN_US;
+    int backoff = LOG_BACKOFF_MIN_MS;
+
+    while (1)
+    {
+        // Records written before a request are in the rings by now, so draining them all answers it
+        pthread_mutex_lock(&client->lock);
+        unsigned long request = client->flushRequests;
+        int closing = client->closing;
+        pthread_mutex_unlock(&client->lock);
+
+        int drainedAll = 1;
+        if (client->batchLength == 0)
+        {
+            drainedAll = drainBuffers(client);
+        }
+        int pending = client->batchLength > 0;
+
+        if (pending && client->fd < 0 && connectToServer(client) != 0)
+        {
+            // A flush, or closing, does not wait for the server to come back
+            pthread_mutex_lock(&client->lock);
+            if (client->flushesDone < request)
+            {
+                client->flushesDone = request;
+                client->flushResult = -1;
+                pthread_cond_broadcast(&client->flushed);
+            }
+            if (!client->closing)
+            {
+                struct timespec until;
+                clock_gettime(CLOCK_REALTIME, &until);
+                until.tv_sec += backoff / 1000;
+                until.tv_nsec += (backoff % 1000) * 1000000L;
+                if (until.tv_nsec >= 1000000000L)
+                {
+                    until.tv_sec++;
+                    until.tv_nsec -= 1000000000L;
+                }
+                pthread_cond_timedwait(&client->wake, &client->lock, &until);
+            }
+            closing = client->closing;
+            pthread_mutex_unlock(&client->lock);
+            backoff = (backoff * 2 < LOG_BACKOFF_MAX_MS) ? backoff * 2 : LOG_BACKOFF_MAX_MS;
+            if (closing)
+            {
+                break;
+            }
+            continue;
+        }
+        backoff = LOG_BACKOFF_MIN_MS;
+        if (pending && sendBatch(client) != 0)
+        {
+            // The batch stays and goes again on the next connection
+            close(client->fd);
+            client->fd = -1;
+            continue;
+        }
+
+        if (drainedAll && !pending)
+        {
+            pthread_mutex_lock(&client->lock);
+            if (client->flushesDone < request)
+            {
+                client->flushesDone = request;
+                client->flushResult = 0;
+                pthread_cond_broadcast(&client->flushed);
+            }
+            if (closing)
+            {
+                pthread_mutex_unlock(&client->lock);
+                break;
+            }
+            // Nothing to send: nap, longer and longer, unless a flush or closing comes in
+            if (client->flushRequests == request && !client->closing)
+            {
+                struct timespec until;
+                clock_gettime(CLOCK_REALTIME, &until);
+                until.tv_nsec += idle * 1000L;
+                if (until.tv_nsec >= 1000000000L)
+                {
+                    until.tv_sec++;
+                    until.tv_nsec -= 1000000000L;
+                }
+                pthread_cond_timedwait(&client->wake, &client->lock, &until);
+                idle = (idle * 2 < LOG_IDLE_MAX_US) ? idle * 2 : LOG_IDLE_MAX_US;
+            }
+            pthread_mutex_unlock(&client->lock);
+        }
+        else
+        {
+            idle = LOG_IDLE_MIN_US;
+        }
+    }
+
+    if (client->fd >= 0)
+    {
+        unsigned char quit[PROTOCOL_FRAME_HEADER] = {0};
+        protocolPut16(quit + 4, FRAME_QUIT);
+        writeAll(client->fd, quit, sizeof(quit));
+        close(client->fd);
+    }
+    return NULL;
+}
+
+// Function to move the records of every ring into frames of the batch, freeing the rings of threads that exited
+// once they are empty. It returns 1 when every ring was emptied, 0 when the batch filled up first.
+static int drainBuffers(struct logClient *client)
+{
+    size_t frameStart = 0;
+    size_t payloadLength = 0;
+    uint16_t count = 0;
+    int drainedAll = 1;
+
+    pthread_mutex_lock(&client->lock);
+    struct logBuffer **link = &client->buffers;
+    pthread_mutex_unlock(&client->lock);
+
+    client->batchLength = PROTOCOL_FRAME_HEADER;
+    while (1)
+    {
+        pthread_mutex_lock(&client->lock);
+        struct logBuffer *buffer = *link;
+        pthread_mutex_unlock(&client->lock);
+        if (buffer == NULL)
+        {
+            break;
+        }
+        // Read before the ring is: a thread that exited wrote nothing after the flag was set
+        int abandoned = atomic_load_explicit(&buffer->abandoned, memory_order_acquire);
+
+        unsigned long taken = 0;
+        struct recordSlot *slot;
+        while ((slot = recordRingPeek(buffer->ring, taken)) != NULL)
+        {
+            size_t length = slot->length - ((slot->tag != 0) ? LOG_TRACE_LENGTH : 0);
+            size_t traceLength = (slot->tag != 0) ? 2 * PROTOCOL_FRAME_HEADER + PROTOCOL_TRACE_PAYLOAD : 0;
+            if (client->batchLength + traceLength + length > LOG_BATCH_BYTES)
+            {
+                drainedAll = 0;
+                break;
+            }
+            if (slot->tag != 0 || payloadLength + length > PROTOCOL_MAX_FRAME || count == UINT16_MAX)
+            {
+                // Close the frame, unless it is still empty, and open the next one
+                if (count > 0)
+                {
+                    protocolPut32(client->batch + frameStart, payloadLength);
+                    protocolPut16(client->batch + frameStart + 4, FRAME_RECORDS);
+                    protocolPut16(client->batch + frameStart + 6, count);
+                    frameStart = client->batchLength;
+                    client->batchLength += PROTOCOL_FRAME_HEADER;
+                }
+                // A traced record opens its frame, after the trace naming it
+                if (slot->tag != 0)
+                {
+                    unsigned char *trace = client->batch + frameStart;
+                    protocolPut32(trace, PROTOCOL_TRACE_PAYLOAD);
+                    protocolPut16(trace + 4, FRAME_TRACE);
+                    protocolPut16(trace + 6, 0);
+                    memcpy(trace + PROTOCOL_FRAME_HEADER, slot->data + length, LOG_TRACE_LENGTH);
+                    protocolPut16(trace + PROTOCOL_FRAME_HEADER + LOG_TRACE_LENGTH, 0);
+                    frameStart += PROTOCOL_FRAME_HEADER + PROTOCOL_TRACE_PAYLOAD;
+                    client->batchLength += PROTOCOL_FRAME_HEADER + PROTOCOL_TRACE_PAYLOAD;
+                }
+                payloadLength = 0;
+                count = 0;
+            }
+            memcpy(client->batch + client->batchLength, slot->data, length);
+            client->batchLength += length;
+            payloadLength += length;
+            count++;
+            taken++;
+        }
+        recordRingRelease(buffer->ring, taken);
+        if (!drainedAll)
+        {
+            break;
+        }
+
+        if (abandoned && recordRingPeek(buffer->ring, 0) == NULL)
+        {
+            pthread_mutex_lock(&client->lock);
+            // Threads registering meanwhile went in at the head, before it
+            while (*link != buffer)
+            {
+                link = &(*link)->next;
+            }
+            *link = buffer->next;
+            pthread_mutex_unlock(&client->lock);
+            free(buffer->ring);
+            free(buffer);
+            continue;
+        }
+        link = &buffer->next;
+    }
+
+    if (count == 0)
+    {
+        // The last frame is empty
+        client->batchLength -= PROTOCOL_FRAME_HEADER;
+        return drainedAll;
+    }
+    protocolPut32(client->batch + frameStart, payloadLength);
+    protocolPut16(client->batch + frameStart + 4, FRAME_RECORDS);
+    protocolPut16(client->batch + frameStart + 6, count);
+    return drainedAll;
+}
+
+// Function to send the batch and, when the server syncs, wait for it to echo the sync. It returns -1 when the
+// connection broke, the batch being left to send again.
+static int sendBatch(struct logClient *client)
+{
+    unsigned char sync[PROTOCOL_FRAME_HEADER + 8];
+    unsigned char reply[PROTOCOL_FRAME_HEADER + 8];
+
+    if (writeAll(client->fd, client->batch, client->batchLength) != 0)
+    {
+        return -1;
+    }
+    // Servers before version 2 do not answer syncs: the batch is let go once written
+    if (client->version >= 2)
+    {
+        client->batches++;
+        protocolPut32(sync, 8);
+        protocolPut16(sync + 4, FRAME_SYNC);
+        protocolPut16(sync + 6, 0);
+        protocolPut64(sync + PROTOCOL_FRAME_HEADER, client->batches);
+        if (writeAll(client->fd, sync, sizeof(sync)) != 0)
+        {
+            return -1;
+        }
+        // Syncs of batches sent before a reconnection do not come back, so the first reply is this one
+        if (readAll(client->fd, reply, sizeof(reply)) != 0 || protocolGet16(reply + 4) != FRAME_SYNC ||
+            protocolGet64(reply + PROTOCOL_FRAME_HEADER) != client->batches)
+        {
+            return -1;
+        }
+    }
+    client->batchLength = 0;
+    return 0;
+}
+
+// Function to connect to the server and open the binary protocol. It returns -1 when the server cannot be reached.
+static int connectToServer(struct logClient *client)
+{
+    unsigned char handshake[PROTOCOL_HANDSHAKE_HEADER + PROTOCOL_MAX_NAME];
+    unsigned char ack[PROTOCOL_ACK_LENGTH];
+    struct timeval timeout = {LOG_IO_TIMEOUT_S, 0};
+    size_t nameLength = strlen(client->name);
+    int optval = 1;
+
+    int fd = socket(client->address.ss_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+    {
+        return -1;
+    }
+    // Blocking, but nothing waits on the server for longer than the timeout
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    if (client->address.ss_family == AF_INET)
+    {
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &optval, sizeof(optval));
+    }
+    if (connect(fd, (struct sockaddr *)&client->address, client->addressLength) != 0)
+    {
+        close(fd);
+        return -1;
+    }
+
+    memcpy(handshake, PROTOCOL_MAGIC, PROTOCOL_MAGIC_LENGTH);
+    handshake[PROTOCOL_MAGIC_LENGTH] = PROTOCOL_VERSION;
+    protocolPut16(handshake + PROTOCOL_MAGIC_LENGTH + 1, nameLength);
+    memcpy(handshake + PROTOCOL_HANDSHAKE_HEADER, client->name, nameLength);
+    if (writeAll(fd, handshake, PROTOCOL_HANDSHAKE_HEADER + nameLength) != 0 || readAll(fd, ack, sizeof(ack)) != 0 ||
+        memcmp(ack, PROTOCOL_MAGIC, PROTOCOL_MAGIC_LENGTH) != 0 || ack[PROTOCOL_MAGIC_LENGTH] < 1 ||
+        ack[PROTOCOL_MAGIC_LENGTH] > PROTOCOL_VERSION)
+    {
+        close(fd);
+        return -1;
+    }
+    client->version = ack[PROTOCOL_MAGIC_LENGTH];
+    client->fd = fd;
+    return 0;
+}
+
+// Function to write a whole buffer, retrying after short writes. A server going away must not kill the process.
+static int writeAll(int fd, const void *data, size_t length)
+{
+    const char *p = data;
+
+    while (length > 0)
+    {
+        ssize_t w = send(fd, p, length, MSG_NOSIGNAL);
+        if (w < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (w <= 0)
+        {
+            return -1;
+        }
+        p += w;
+        length -= w;
+    }
+    return 0;
+}
+
+// Function to read exactly 'length' bytes
+static int readAll(int fd, void *data, size_t length)
+{
+    char *p = data;
+
+    while (length > 0)
+    {
+        ssize_t n = read(fd, p, length);
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n <= 0)
+        {
+            return -1;
+        }
+        p += n;
+        length -= n;
+    }
+    return 0;
+}
@@ -0,0 +1,42 @@
+#ifndef LOGCLIENT_H
+#define LOGCLIENT_H
+
+#include <stddef.h>
+
+// Library for services that log to the server from their own process, with the binary protocol of protocol.h.
+//
+//     struct logClient *client = log_open("127.0.0.1:8080", "my-service");   // or "unix:/run/log.sock"
+//     log_write(client, message, length);                                    // from any thread
+//     log_flush(client);                                                     // wait until the server took it all
+//     log_close(client);
+//
+// log_write() stamps a record with the time and copies it into a ring of the calling thread, then returns: it takes
+// no lock and makes no system call. A background thread drains the rings of every thread, packs their records into
+// frames and sends them in batches, each one kept until the server syncs it and sent again after a reconnection.
+// Records of a thread reach the server in the order that thread wrote them; those of different threads are interleaved
+// as they are drained. While the server cannot be reached records wait in the rings, and log_write() fails once the
+// ring of its thread is full. Every thread that writes gets a ring of LOG_BUFFER_SLOTS records of up to
+// LOG_MAX_RECORD bytes, about 2 MB, freed once the thread has exited and its records are sent.
+// With "shm:<name>" there is no thread and no connection: log_write() appends to the lane of the process in the
+// server's shared-memory ingest (shm_ingest.h), and log_flush() waits until the server has drained it.
+// log_trace(client, N) has one record in N of each thread traced by a server with a stats_file, from the call to
+// log_write() to the disk; the records also carry their send time by the monotonic clock, so the first stage only
+// means something for a server on the same host. It does nothing with "shm:<name>".
+//
+// Build: gcc -c logclient.c record_ring.c shm_ingest.c && ar rcs liblogclient.a logclient.o record_ring.o shm_ingest.o,
+// and link with -pthread.
+
+// A slot of the ring of a thread, less the record header of the protocol. The server takes records up to a frame,
+// its writer rings spread a longer one over several slots, so one at this size is logged whole as one line: check.sh
+#define LOG_MAX_RECORD 2036
+
+struct logClient;
+
+struct logClient *log_open(const char *address, const char *name);
+int log_write(struct logClient *client, const char *message, size_t length);
+int log_flush(struct logClient *client);
+void log_close(struct logClient *client);
+unsigned long log_dropped(struct logClient *client);
+void log_trace(struct logClient *client, unsigned int every);
+
+#endif
@@ -0,0 +1,281 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <getopt.h>
+#include "logclient.h"
+
+#define MAX_PRODUCER_THREADS 64
+#define MAX_RUNS 8
+#define HISTOGRAM_SUB_BUCKETS 64 // Values are kept with 1/64 relative precision
+#define HISTOGRAM_BUCKETS 40     // Powers of two above the sub-buckets, in nanoseconds
+
+// Latency histogram: log-linear buckets in nanoseconds, one per producer, merged at the end
+struct histogram
+{
+    unsigned long counts[HISTOGRAM_BUCKETS][HISTOGRAM_SUB_BUCKETS];
+    unsigned long total;
+    unsigned long max;
+};
+
+// One producer thread calls log_write() in a loop and times every call
+struct producer
+{
+    int id;
+    unsigned long written;
+    unsigned long refused;
+    struct histogram latency;
+    pthread_t thread;
+};
+
+// Settings, from the command line
+const char *address = "127.0.0.1:8080";
+long messagesPerThread = 1000000;
+double rate = 0; // Messages per second per thread, 0 writes flat out
+int size = 64;
+unsigned int traceEvery = 0; // Have one record in this many of each thread traced by the server, 0 for none
+int threadCounts[MAX_RUNS] = {1, 4, 16};
+int numberOfRuns = 3;
+
+struct logClient *client;
+
+void error(const char *msg);
+void usage(const char *program);
+void *producerThread(void *arg);
+long long monotonicNanos(void);
+void recordLatency(struct histogram *h, unsigned long value);
+void mergeHistogram(struct histogram *into, const struct histogram *from);
+unsigned long histogramPercentile(struct histogram *h, double percentile);
+
+int main(int argc, char *argv[])
+{
+    static struct producer producers[MAX_PRODUCER_THREADS];
+    static struct histogram latency;
+    char name[32];
+    int opt;
+
+    while ((opt = getopt(argc, argv, "a:n:r:s:t:x:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'a':
+            address = optarg;
+            break;
+        case 'n':
+            messagesPerThread = atol(optarg);
+            break;
+        case 'r':
+            rate = atof(optarg);
+            break;
+        case 's':
+            size = atoi(optarg);
+            break;
+        case 'x':
+            traceEvery = atoi(optarg);
+            break;
+        case 't':
+        {
+            char *list = optarg;
+            numberOfRuns = 0;
+            while (numberOfRuns < MAX_RUNS && *list != '\0')
+            {
+                threadCounts[numberOfRuns++] = strtol(list, &list, 10);
+                if (*list == ',')
+                {
+                    list++;
+                }
+            }
+            break;
+        }
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (messagesPerThread <= 0 || size < 32 || size > LOG_MAX_RECORD || numberOfRuns == 0)
+    {
+        usage(argv[0]);
+    }
+    for (int run = 0; run < numberOfRuns; run++)
+    {
+        if (threadCounts[run] <= 0 || threadCounts[run] > MAX_PRODUCER_THREADS)
+        {
+            usage(argv[0]);
+        }
+    }
+
+    for (int run = 0; run < numberOfRuns; run++)
+    {
+        int threads = threadCounts[run];
+
+        // Each run gets its own client, and its own name in the log
+        snprintf(name, sizeof(name), "bench-%d", threads);
+        client = log_open(address, name);
+        if (client == NULL)
+        {
+            error("ERROR opening the log client");
+        }
+        log_trace(client, traceEvery);
+
+        long long start = monotonicNanos();
+        for (int i = 0; i < threads; i++)
+        {
+            memset(&producers[i], 0, sizeof(producers[i]));
+            producers[i].id = i;
+            if (pthread_create(&producers[i].thread, NULL, producerThread, &producers[i]) != 0)
+            {
+                error("ERROR creating producer thread");
+            }
+        }
+        memset(&latency, 0, sizeof(latency));
+        unsigned long written = 0;
+        unsigned long refused = 0;
+        for (int i = 0; i < threads; i++)
+        {
+            pthread_join(producers[i].thread, NULL);
+            written += producers[i].written;
+            refused += producers[i].refused;
+            mergeHistogram(&latency, &producers[i].latency);
+        }
+        long long writtenAt = monotonicNanos();
+        int flushed = log_flush(client);
+        long long end = monotonicNanos();
+        log_close(client);
+
+        double writeSeconds = (writtenAt - start) / 1e9;
+        printf("threads=%d written=%lu refused=%lu write_rate=%.0f/s delivered_rate=%.0f/s call_ns p50=%lu p99=%lu p999=%lu "
+               "max=%lu flush_ms=%.1f%s\n",
+               threads, written, refused, (written + refused) / writeSeconds, written / ((end - start) / 1e9),
+               histogramPercentile(&latency, 50), histogramPercentile(&latency, 99), histogramPercentile(&latency, 99.9),
+               latency.max, (end - writtenAt) / 1e6, flushed == 0 ? "" : " (flush failed)");
+    }
+    return 0;
+}
+
+// Function for handling errors and exiting the program.
+void error(const char *msg)
+{
+    perror(msg); // Print the error message passed to the function along with the system error message.
+    exit(1);     // Exit the program with a non-zero status, indicating that an error occurred.
+}
+
+// Function to print the command line options and exit
+void usage(const char *program)
+{
+    fprintf(stderr,
+            "Usage: %s [-a <host:port>|unix:<path>|shm:<name>] [-n <messages_per_thread>] [-r <messages_per_second_per_thread>]\n"
+            "          [-s <size>] [-t <threads>[,<threads>...]] [-x <trace_every>]\n"
+            "  Runs once per thread count (default 1,4,16) and reports the time log_write() took, as seen by the caller.\n"
+            "  -x has one record in that many of each thread traced by the server, reported in its stats_file.\n"
+            "  -r 0 (default) writes flat out; writes refused because a thread's ring was full are counted, not retried.\n"
+            "  Sizes are 32 to %d bytes.\n",
+            program, LOG_MAX_RECORD);
+    exit(1);
+}
+
+// Function run by each producer: write messages, timing each call, at the given rate or flat out
+void *producerThread(void *arg)
+{
+    struct producer *producer = arg;
+    char message[LOG_MAX_RECORD];
+    long long start = monotonicNanos();
+    double interval = (rate > 0) ? 1e9 / rate : 0;
+
+    memset(message, 'x', size);
+    for (long i = 0; i < messagesPerThread; i++)
+    {
+        if (interval > 0)
+        {
+            long long due = start + (long long)(i * interval);
+            long long now = monotonicNanos();
+            if (due > now)
+            {
+                struct timespec pause = {(due - now) / 1000000000LL, (due - now) % 1000000000LL};
+                nanosleep(&pause, NULL);
+            }
+        }
+        int length = snprintf(message, size, "bench p%d seq-%ld ", producer->id, i);
+        message[length] = 'x';
+
+        long long before = monotonicNanos();
+        int result = log_write(client, message, size);
+        long long after = monotonicNanos();
+
+        recordLatency(&producer->latency, after - before);
+        if (result == 0)
+        {
+            producer->written++;
+        }
+        else
+        {
+            producer->refused++;
+        }
+    }
+    return NULL;
+}
+
+// Function to read the monotonic clock in nanoseconds
+long long monotonicNanos(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long)now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+// Function to count one value in a histogram
+void recordLatency(struct histogram *h, unsigned long value)
+{
+    int bucket = 0;
+
+    // Values below HISTOGRAM_SUB_BUCKETS are exact; above, each power of two is split into HISTOGRAM_SUB_BUCKETS
+    while ((value >> bucket) >= HISTOGRAM_SUB_BUCKETS && bucket < HISTOGRAM_BUCKETS - 1)
+    {
+        bucket++;
+    }
+    h->counts[bucket][(value >> bucket) & (HISTOGRAM_SUB_BUCKETS - 1)]++;
+    h->total++;
+    if (value > h->max)
+    {
+        h->max = value;
+    }
+}
+
+// Function to add the counts of one histogram to another
+void mergeHistogram(struct histogram *into, const struct histogram *from)
+{
+    for (int bucket = 0; bucket < HISTOGRAM_BUCKETS; bucket++)
+    {
+        for (int sub = 0; sub < HISTOGRAM_SUB_BUCKETS; sub++)
+        {
+            into->counts[bucket][sub] += from->counts[bucket][sub];
+        }
+    }
+    into->total += from->total;
+    if (from->max > into->max)
+    {
+        into->max = from->max;
+    }
+}
+
+// Function to get the value below which the given percentage of the recorded values fall
+unsigned long histogramPercentile(struct histogram *h, double percentile)
+{
+    unsigned long target = (unsigned long)(h->total * percentile / 100.0);
+    unsigned long seen = 0;
+
+    for (int bucket = 0; bucket < HISTOGRAM_BUCKETS; bucket++)
+    {
+        for (int sub = 0; sub < HISTOGRAM_SUB_BUCKETS; sub++)
+        {
+            seen += h->counts[bucket][sub];
+            if (seen > target)
+            {
+                return (unsigned long)sub << bucket;
+            }
+        }
+    }
+    return h->max;
+}
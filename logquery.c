@@ -0,0 +1,802 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include "binary_segment.h"
+#include "manifest.h"
+#include "scan.h"
+#include "segment_compress.h"
+#include "segment_sidecar.h"
+
+// Answers "what did client X send between two times" over a log directory, and searches it for a substring.
+// The segments are taken from the manifest, and their sidecar indexes rule out what cannot match: a segment
+// whose Bloom filter lacks the client or whose spans all miss the time range is never opened, and in the others
+// only the spans overlapping the range are read, through a mapping of the segment or the blocks of a compressed one.
+// What is left is cut into chunks searched by a pool of threads; their output is printed in segment order.
+// The shards of a sharded log directory (shards=N) are queried alike, and their output merged by time like logcat does.
+
+#define QUERY_CHUNK 4194304        // Bytes of a segment one task reads
+#define QUERY_RECORD_SLACK 262144 // A task reads this far past its chunk for the record crossing its end
+
+// Byte range of a segment to read
+struct queryRange
+{
+    uint64_t start;
+    uint64_t end;
+};
+
+// A segment opened for reading: mapped, or compressed and decompressed block by block
+struct querySegment
+{
+    int fd;
+    const char *map;
+    uint64_t length; // Bytes of the segment as written
+    int compressed;
+    struct compressedSegment blocks;
+    struct binaryBuffer buffer; // Decompressed blocks of the range being read
+};
+
+// A piece of work for the thread pool: the records of a segment starting in [start, end), which belongs to the
+// range [rangeStart, rangeEnd). A binary segment is one task holding all its ranges, as it is decoded from its start.
+struct queryTask
+{
+    const char *directory; // Log directory of the segment, a shard of a sharded one
+    const char *shard;     // "shard-<i>/" in a sharded log directory, "" otherwise
+    const char *name;
+    uint64_t start;
+    uint64_t end;
+    uint64_t rangeStart;
+    uint64_t rangeEnd;
+    struct queryRange *ranges; // Binary segments only
+    int rangeCount;
+    struct binaryBuffer output;
+    int done;
+};
+
+int64_t fromTime = INT64_MIN;
+int64_t toTime = INT64_MAX;
+const char *client = NULL;
+const char *needle = NULL; // -s: text the records must hold
+size_t needleLength = 0;
+int threads = 0;
+int verbose = 0;
+unsigned long segmentsSkipped = 0, segmentsRead = 0;
+atomic_ullong bytesRead = 0;
+
+struct queryTask *tasks = NULL;
+int numberOfTasks = 0;
+int tasksCapacity = 0;
+atomic_int nextTask = 0;
+pthread_mutex_t tasksLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t taskDone = PTHREAD_COND_INITIALIZER;
+
+// Output of the tasks of one shard being merged, and where its next line starts
+struct shardOutput
+{
+    int task;  // Task being read, up to 'end'
+    int end;
+    size_t position;
+    size_t lineLength; // 0 once the shard is exhausted
+    int64_t time;      // Time of the next line; a line without one keeps the time of the line before it
+};
+
+// Declaration of the functions
+void usage(const char *program);
+int parseTime(const char *text, int64_t *seconds);
+int planSegment(const char *directory, const char *shard, const char *name);
+int planRanges(const struct sidecarIndex *index, int complete, uint64_t length, struct queryRange *ranges);
+struct queryTask *addTask(const char *directory, const char *shard, const char *name);
+void *queryThread(void *arg);
+void waitForTask(int i);
+void printTasks(void);
+void mergeShardOutputs(int *firstTasks, int shards);
+void nextOutputLine(struct shardOutput *output);
+void runTask(struct queryTask *task);
+int openSegment(struct querySegment *segment, const char *path);
+void closeSegment(struct querySegment *segment);
+const char *readRange(struct querySegment *segment, uint64_t start, uint64_t end);
+void filterRecords(struct queryTask *task, const char *p, const char *lastStart, const char *end, const char *base, uint64_t offset);
+void emitRecord(struct queryTask *task, const char *line, size_t length, uint64_t offset);
+void queryBinarySegment(struct queryTask *task, struct querySegment *segment);
+int matchRecord(const char *line, size_t length);
+
+int main(int argc, char *argv[])
+{
+    int opt, status = 0;
+
+    while ((opt = getopt(argc, argv, "f:t:c:s:j:v")) != -1)
+    {
+        switch (opt)
+        {
+        case 'f':
+            if (!parseTime(optarg, &fromTime))
+            {
+                usage(argv[0]);
+            }
+            break;
+        case 't':
+            if (!parseTime(optarg, &toTime))
+            {
+                usage(argv[0]);
+            }
+            break;
+        case 'c':
+            client = optarg;
+            break;
+        case 's':
+            needle = optarg;
+            needleLength = strlen(optarg);
+            break;
+        case 'j':
+            threads = atoi(optarg);
+            break;
+        case 'v':
+            verbose = 1;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (optind != argc - 1 || (needle != NULL && needleLength == 0))
+    {
+        usage(argv[0]);
+    }
+    if (threads <= 0)
+    {
+        threads = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = (threads > 0) ? threads : 1;
+    }
+
+    // A sharded log directory is queried shard by shard, each a log directory of its own
+    const char *directory = argv[optind];
+    int shards = manifestShards(directory);
+    int numberOfDirectories = (shards > 0) ? shards : 1;
+    struct segmentIndex **segments = calloc(numberOfDirectories, sizeof(struct segmentIndex *));
+    char (*directories)[512] = calloc(numberOfDirectories, sizeof(*directories));
+    char (*prefixes)[32] = calloc(numberOfDirectories, sizeof(*prefixes));
+    int *firstTasks = calloc(numberOfDirectories + 1, sizeof(int));
+    unsigned long numberOfSegments = 0;
+    if (segments == NULL || directories == NULL || prefixes == NULL || firstTasks == NULL)
+    {
+        perror("malloc");
+        return 1;
+    }
+    for (int s = 0; s < numberOfDirectories; s++)
+    {
+        int rebuilt;
+        snprintf(directories[s], sizeof(directories[s]), "%s", directory);
+        if (shards > 0)
+        {
+            snprintf(prefixes[s], sizeof(prefixes[s]), SHARD_DIRECTORY "/", s);
+            snprintf(directories[s], sizeof(directories[s]), "%s/" SHARD_DIRECTORY, directory, s);
+        }
+        segments[s] = manifestLoad(directories[s], &rebuilt);
+        if (segments[s] == NULL)
+        {
+            perror(directories[s]);
+            return 1;
+        }
+        firstTasks[s] = numberOfTasks;
+        for (unsigned long i = 0; i < segments[s]->count; i++)
+        {
+            if (planSegment(directories[s], prefixes[s], segmentIndexName(segments[s], i)) != 0)
+            {
+                status = 1;
+            }
+        }
+        numberOfSegments += segments[s]->count;
+    }
+    firstTasks[numberOfDirectories] = numberOfTasks;
+
+    pthread_t *pool = malloc(threads * sizeof(pthread_t));
+    if (pool == NULL)
+    {
+        perror("malloc");
+        return 1;
+    }
+    for (int i = 0; i < threads; i++)
+    {
+        if (pthread_create(&pool[i], NULL, queryThread, NULL) != 0)
+        {
+            perror("pthread_create");
+            return 1;
+        }
+    }
+    if (shards > 1)
+    {
+        mergeShardOutputs(firstTasks, shards);
+    }
+    else
+    {
+        printTasks();
+    }
+    for (int i = 0; i < threads; i++)
+    {
+        pthread_join(pool[i], NULL);
+    }
+
+    if (verbose)
+    {
+        fprintf(stderr, "segments=%lu read=%lu skipped=%lu tasks=%d threads=%d bytes_read=%llu\n", numberOfSegments,
+                segmentsRead, segmentsSkipped, numberOfTasks, threads, (unsigned long long)bytesRead);
+    }
+    for (int s = 0; s < numberOfDirectories; s++)
+    {
+        free(segments[s]);
+    }
+    free(pool);
+    free(tasks);
+    free(segments);
+    free(directories);
+    free(prefixes);
+    free(firstTasks);
+    return status;
+}
+
+// Function to print the command line and exit
+void usage(const char *program)
+{
+    fprintf(stderr,
+            "Usage: %s [-f <from>] [-t <to>] [-c <client_name|client_ip>] [-s <text>] [-j <threads>] [-v] <log_directory>\n"
+            "  Prints the records of the log directory within [from, to] (\"YYYY-mm-dd HH:MM:SS\", the time the\n"
+            "  records show), from the given client. -s only prints records holding the text, each preceded by\n"
+            "  \"<segment>:<offset>:\". -j defaults to one thread per core, -v reports what was read.\n"
+            "  The records of a sharded directory are merged by time, segments named after their shard.\n",
+            program);
+    exit(1);
+}
+
+// Function to read a "YYYY-mm-dd HH:MM:SS" time the way the records show it. It returns 0 when malformed.
+int parseTime(const char *text, int64_t *seconds)
+{
+    char record[BINARY_TIMESTAMP_LENGTH + 1];
+
+    if (strlen(text) != BINARY_TIMESTAMP_LENGTH - 5)
+    {
+        return 0;
+    }
+    snprintf(record, sizeof(record), "[[%s]] ", text);
+    return binaryParseTimestamp(record, BINARY_TIMESTAMP_LENGTH, seconds);
+}
+
+// Function to queue the tasks reading one segment of a log directory, if its index does not rule it out.
+// 'shard' prefixes the segment name in the output. It returns -1 when the segment cannot be read.
+int planSegment(const char *directory, const char *shard, const char *name)
+{
+    char path[512];
+    struct sidecarIndex index;
+    struct querySegment segment;
+
+    sidecarPath(path, sizeof(path), directory, name);
+    int indexed = (sidecarLoad(&index, path) == 0);
+    // The client may appear anywhere in a segment, the filter tells whether it appears at all
+    if (indexed && index.hasBloom && client != NULL && !sidecarBloomMayContain(index.bloom, client, strlen(client)))
+    {
+        sidecarFree(&index);
+        segmentsSkipped++;
+        return 0;
+    }
+    // A closed segment's index covers it to its end, so its spans alone may rule it out without opening it
+    struct queryRange *ranges = malloc((2 * index.count + 1) * sizeof(struct queryRange));
+    if (ranges == NULL)
+    {
+        sidecarFree(&index);
+        return -1;
+    }
+    if (indexed && index.hasBloom && planRanges(&index, 1, 0, ranges) == 0)
+    {
+        free(ranges);
+        sidecarFree(&index);
+        segmentsSkipped++;
+        return 0;
+    }
+
+    snprintf(path, sizeof(path), "%s/%s", directory, name);
+    if (openSegment(&segment, path) != 0)
+    {
+        free(ranges);
+        sidecarFree(&index);
+        return -1;
+    }
+    // Without an index the whole segment is read
+    int count = planRanges(&index, indexed && index.hasBloom, segment.length, ranges);
+    const char *magic = (segment.length >= BINARY_SEGMENT_MAGIC_LENGTH) ? readRange(&segment, 0, BINARY_SEGMENT_MAGIC_LENGTH) : NULL;
+    int binary = (magic != NULL && memcmp(magic, BINARY_SEGMENT_MAGIC, BINARY_SEGMENT_MAGIC_LENGTH) == 0);
+    closeSegment(&segment);
+    sidecarFree(&index);
+    segmentsRead++;
+
+    if (binary && count > 0)
+    {
+        struct queryTask *task = addTask(directory, shard, name);
+        task->ranges = ranges;
+        task->rangeCount = count;
+        return 0;
+    }
+    for (int i = 0; i < count; i++)
+    {
+        for (uint64_t start = ranges[i].start; start < ranges[i].end; start += QUERY_CHUNK)
+        {
+            struct queryTask *task = addTask(directory, shard, name);
+            task->start = start;
+            task->end = (ranges[i].end - start > QUERY_CHUNK) ? start + QUERY_CHUNK : ranges[i].end;
+            task->rangeStart = ranges[i].start;
+            task->rangeEnd = ranges[i].end;
+        }
+    }
+    free(ranges);
+    return 0;
+}
+
+// Function to list the byte ranges of a segment that may hold matching records: the spans overlapping the
+// time range, and whatever no span covers. 'complete' says the spans run to the end of the segment,
+// otherwise 'length' bytes are assumed. 'ranges' holds two per span plus one. It returns the number of ranges.
+int planRanges(const struct sidecarIndex *index, int complete, uint64_t length, struct queryRange *ranges)
+{
+    uint64_t covered = 0;
+    int count = 0;
+
+    for (uint32_t i = 0; i < index->count; i++)
+    {
+        const struct sidecarSpan *span = &index->spans[i];
+        if (span->offset > covered)
+        {
+            ranges[count++] = (struct queryRange){covered, span->offset};
+        }
+        // A span without timestamps only matters to queries without a time range
+        int overlaps = (span->minTime <= span->maxTime) ? (span->minTime <= toTime && span->maxTime >= fromTime)
+                                                        : (fromTime == INT64_MIN && toTime == INT64_MAX);
+        if (overlaps && span->end > span->offset)
+        {
+            ranges[count++] = (struct queryRange){span->offset, span->end};
+        }
+        covered = (span->end > covered) ? span->end : covered;
+    }
+    if (!complete && length > covered)
+    {
+        ranges[count++] = (struct queryRange){covered, length};
+    }
+
+    // Clip to the segment, e.g. after a crash cut it back, and merge neighbours
+    int merged = 0;
+    for (int i = 0; i < count; i++)
+    {
+        if (!complete && ranges[i].end > length)
+        {
+            ranges[i].end = length;
+        }
+        if (ranges[i].start >= ranges[i].end)
+        {
+            continue;
+        }
+        if (merged > 0 && ranges[merged - 1].end == ranges[i].start)
+        {
+            ranges[merged - 1].end = ranges[i].end;
+        }
+        else
+        {
+            ranges[merged++] = ranges[i];
+        }
+    }
+    return merged;
+}
+
+// Function to append a task for a segment, before the thread pool starts
+struct queryTask *addTask(const char *directory, const char *shard, const char *name)
+{
+    if (numberOfTasks == tasksCapacity)
+    {
+        tasksCapacity = (tasksCapacity > 0) ? tasksCapacity * 2 : 256;
+        tasks = realloc(tasks, tasksCapacity * sizeof(struct queryTask));
+        if (tasks == NULL)
+        {
+            perror("malloc");
+            exit(1);
+        }
+    }
+    struct queryTask *task = &tasks[numberOfTasks++];
+    memset(task, 0, sizeof(*task));
+    task->directory = directory;
+    task->shard = shard;
+    task->name = name;
+    return task;
+}
+
+// Function run by the threads of the pool: take the next task until none is left
+void *queryThread(void *arg)
+{
+    int i;
+
+    (void)arg;
+    while ((i = atomic_fetch_add(&nextTask, 1)) < numberOfTasks)
+    {
+        runTask(&tasks[i]);
+        pthread_mutex_lock(&tasksLock);
+        tasks[i].done = 1;
+        pthread_cond_broadcast(&taskDone);
+        pthread_mutex_unlock(&tasksLock);
+    }
+    return NULL;
+}
+
+// Function to wait until a task is done
+void waitForTask(int i)
+{
+    pthread_mutex_lock(&tasksLock);
+    while (!tasks[i].done)
+    {
+        pthread_cond_wait(&taskDone, &tasksLock);
+    }
+    pthread_mutex_unlock(&tasksLock);
+}
+
+// Function to print the output of the tasks in order. Tasks finish in any order, their output is printed
+// as soon as it is ready.
+void printTasks(void)
+{
+    for (int i = 0; i < numberOfTasks; i++)
+    {
+        waitForTask(i);
+        fwrite(tasks[i].output.data, 1, tasks[i].output.length, stdout);
+        free(tasks[i].output.data);
+        free(tasks[i].ranges);
+    }
+}
+
+// Function to print the output of the tasks of several shards as one sequence of records, the earliest first.
+// The tasks of shard i are firstTasks[i] to firstTasks[i + 1]; records of the same second are taken lowest shard first.
+void mergeShardOutputs(int *firstTasks, int shards)
+{
+    struct shardOutput *outputs = calloc(shards, sizeof(struct shardOutput));
+
+    if (outputs == NULL)
+    {
+        perror("malloc");
+        exit(1);
+    }
+    for (int i = 0; i < shards; i++)
+    {
+        outputs[i].task = firstTasks[i];
+        outputs[i].end = firstTasks[i + 1];
+        outputs[i].time = INT64_MIN;
+        nextOutputLine(&outputs[i]);
+    }
+    while (1)
+    {
+        struct shardOutput *earliest = NULL;
+        for (int i = 0; i < shards; i++)
+        {
+            if (outputs[i].lineLength > 0 && (earliest == NULL || outputs[i].time < earliest->time))
+            {
+                earliest = &outputs[i];
+            }
+        }
+        if (earliest == NULL)
+        {
+            break;
+        }
+        fwrite(tasks[earliest->task].output.data + earliest->position, 1, earliest->lineLength, stdout);
+        earliest->position += earliest->lineLength;
+        nextOutputLine(earliest);
+    }
+    free(outputs);
+}
+
+// Function to find the next line of a shard's output, waiting for its tasks in order and releasing those read
+void nextOutputLine(struct shardOutput *output)
+{
+    output->lineLength = 0;
+    while (output->task < output->end)
+    {
+        struct queryTask *task = &tasks[output->task];
+        waitForTask(output->task);
+        if (output->position < task->output.length)
+        {
+            break;
+        }
+        free(task->output.data);
+        free(task->ranges);
+        task->output.data = NULL;
+        task->ranges = NULL;
+        output->task++;
+        output->position = 0;
+    }
+    if (output->task == output->end)
+    {
+        return;
+    }
+
+    const struct queryTask *task = &tasks[output->task];
+    const char *line = task->output.data + output->position;
+    size_t left = task->output.length - output->position;
+    const char *newline = memchr(line, '\n', left);
+    output->lineLength = (newline != NULL) ? (size_t)(newline - line) + 1 : left;
+    // With -s the record follows "<shard>/<segment>:<offset>:"
+    const char *record = line;
+    if (needle != NULL)
+    {
+        size_t prefix = strlen(task->shard) + strlen(task->name) + 1;
+        const char *colon = (prefix < output->lineLength) ? memchr(line + prefix, ':', output->lineLength - prefix) : NULL;
+        record = (colon != NULL) ? colon + 1 : line;
+    }
+    int64_t seconds;
+    if (binaryParseTimestamp(record, output->lineLength - (record - line), &seconds))
+    {
+        output->time = seconds;
+    }
+}
+
+// Function to gather the matching records of a task into its output
+void runTask(struct queryTask *task)
+{
+    char path[512];
+    struct querySegment segment;
+
+    snprintf(path, sizeof(path), "%s/%s", task->directory, task->name);
+    if (openSegment(&segment, path) != 0)
+    {
+        return;
+    }
+    if (task->ranges != NULL)
+    {
+        queryBinarySegment(task, &segment);
+        closeSegment(&segment);
+        return;
+    }
+
+    // From the byte before the chunk, to tell whether a record starts right at it, to far enough after it
+    // for the record crossing its end, which is this task's
+    uint64_t from = (task->start > task->rangeStart) ? task->start - 1 : task->start;
+    uint64_t to = (task->rangeEnd - task->end > QUERY_RECORD_SLACK) ? task->end + QUERY_RECORD_SLACK : task->rangeEnd;
+    const char *data = readRange(&segment, from, to);
+    if (data == NULL)
+    {
+        fprintf(stderr, "logquery: %s: damaged compressed block\n", path);
+        closeSegment(&segment);
+        return;
+    }
+    const char *end = data + (to - from);
+    const char *p = data + (task->start - from);
+    const char *lastStart = data + (task->end - from); // Records starting from here belong to the next task
+    if (task->start > task->rangeStart && p[-1] != '\n')
+    {
+        const char *newline = scanNewline(p, end - p);
+        p = (newline != NULL) ? newline + 1 : end;
+    }
+    const char *newline = scanNewline(lastStart - 1, end - (lastStart - 1));
+    end = (newline != NULL) ? newline + 1 : end;
+    filterRecords(task, p, lastStart, end, data, from);
+    closeSegment(&segment);
+}
+
+// Function to open a segment: map it, or read the block index of a compressed one. It returns -1 on failure.
+int openSegment(struct querySegment *segment, const char *path)
+{
+    struct stat st;
+
+    memset(segment, 0, sizeof(*segment));
+    segment->fd = open(path, O_RDONLY);
+    if (segment->fd < 0 || fstat(segment->fd, &st) != 0)
+    {
+        perror(path);
+        if (segment->fd >= 0)
+        {
+            close(segment->fd);
+        }
+        return -1;
+    }
+    if (compressedSegmentIsCompressed(segment->fd))
+    {
+        if (compressedSegmentOpen(&segment->blocks, segment->fd) != 0)
+        {
+            fprintf(stderr, "logquery: %s: incomplete compressed segment or codec not built in\n", path);
+            close(segment->fd);
+            return -1;
+        }
+        segment->compressed = 1;
+        segment->length = segment->blocks.length;
+        return 0;
+    }
+    segment->length = st.st_size;
+    if (st.st_size > 0)
+    {
+        segment->map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, segment->fd, 0);
+        if (segment->map == MAP_FAILED)
+        {
+            perror(path);
+            close(segment->fd);
+            return -1;
+        }
+        // Chunks are read front to back, once
+        madvise((void *)segment->map, st.st_size, MADV_SEQUENTIAL);
+    }
+    return 0;
+}
+
+// Function to release an opened segment
+void closeSegment(struct querySegment *segment)
+{
+    if (segment->map != NULL)
+    {
+        munmap((void *)segment->map, segment->length);
+    }
+    if (segment->compressed)
+    {
+        compressedSegmentClose(&segment->blocks);
+    }
+    free(segment->buffer.data);
+    close(segment->fd);
+}
+
+// Function to get the bytes [start, end) of a segment. For a compressed segment only the blocks holding
+// them are decompressed, and the bytes stay valid until the next call. It returns NULL for a damaged block.
+const char *readRange(struct querySegment *segment, uint64_t start, uint64_t end)
+{
+    atomic_fetch_add_explicit(&bytesRead, end - start, memory_order_relaxed);
+    if (!segment->compressed)
+    {
+        return segment->map + start;
+    }
+    if (end <= start)
+    {
+        return "";
+    }
+    struct compressedSegment *blocks = &segment->blocks;
+    uint32_t first = compressedSegmentFindBlock(blocks, start);
+    uint32_t last = compressedSegmentFindBlock(blocks, end - 1);
+    segment->buffer.length = 0;
+    if (binaryBufferReserve(&segment->buffer, (size_t)(last - first + 1) * blocks->blockSize) != 0)
+    {
+        return NULL;
+    }
+    for (uint32_t i = first; i <= last; i++)
+    {
+        long n = compressedSegmentReadBlock(blocks, i, segment->buffer.data + segment->buffer.length);
+        if (n < 0)
+        {
+            return NULL;
+        }
+        segment->buffer.length += n;
+    }
+    return segment->buffer.data + (start - blocks->offsets[2 * first + 1]);
+}
+
+// Function to gather the matching newline-terminated records starting in [p, lastStart), which end by 'end'.
+// With -s the vectorized substring scan jumps from match to match, and only the records holding one are looked at.
+// Offsets are counted from 'base', at 'offset' in the segment; without a base every record is at 'offset'.
+// Preallocated zeros end the records.
+void filterRecords(struct queryTask *task, const char *p, const char *lastStart, const char *end, const char *base, uint64_t offset)
+{
+    while (p < lastStart && *p != '\0')
+    {
+        const char *line = p;
+        if (needle != NULL)
+        {
+            const char *match = scanSubstring(p, end - p, needle, needleLength);
+            if (match == NULL)
+            {
+                return;
+            }
+            const char *previous = memrchr(p, '\n', match - p);
+            line = (previous != NULL) ? previous + 1 : p;
+            if (line >= lastStart)
+            {
+                return;
+            }
+            p = match;
+        }
+        const char *newline = scanNewline(p, end - p);
+        const char *next = (newline != NULL) ? newline + 1 : end;
+        if (matchRecord(line, next - line))
+        {
+            emitRecord(task, line, next - line, (base != NULL) ? offset + (line - base) : offset);
+        }
+        p = next;
+    }
+}
+
+// Function to add a matching record to the output of a task, with its segment and offset when searching
+void emitRecord(struct queryTask *task, const char *line, size_t length, uint64_t offset)
+{
+    char location[600];
+    int locationLength = 0;
+
+    if (needle != NULL)
+    {
+        locationLength = snprintf(location, sizeof(location), "%s%s:%llu:", task->shard, task->name, (unsigned long long)offset);
+    }
+    if (binaryBufferReserve(&task->output, locationLength + length) != 0)
+    {
+        return;
+    }
+    memcpy(task->output.data + task->output.length, location, locationLength);
+    memcpy(task->output.data + task->output.length + locationLength, line, length);
+    task->output.length += locationLength + length;
+}
+
+// Function to gather the matching records of a binary segment. Its dictionary is built by the blocks in order,
+// so the blocks before and between the ranges are still walked for their definitions, but not rendered.
+// The records of a block are reported at the offset of the block.
+void queryBinarySegment(struct queryTask *task, struct querySegment *segment)
+{
+    struct binaryDictionary *dictionary = malloc(sizeof(struct binaryDictionary));
+    struct binaryBuffer rendered = {0};
+    const struct queryRange *ranges = task->ranges;
+    int count = task->rangeCount;
+    uint64_t offset = BINARY_SEGMENT_MAGIC_LENGTH;
+    int range = 0;
+
+    if (dictionary == NULL)
+    {
+        return;
+    }
+    binaryDictionaryReset(dictionary);
+    // Only the end of the last range is needed, everything up to it is read anyway
+    const char *data = readRange(segment, 0, ranges[count - 1].end);
+    long size;
+    while (data != NULL && offset < ranges[count - 1].end &&
+           (size = binaryBlockCheck(data + offset, ranges[count - 1].end - offset)) > 0)
+    {
+        struct binaryCursor cursor;
+        struct binaryEntry entry;
+        while (range < count && ranges[range].end <= offset)
+        {
+            range++;
+        }
+        int wanted = (range < count && ranges[range].start <= offset);
+        int result = binaryBlockOpen(&cursor, data + offset);
+        rendered.length = 0;
+        while (result == 0 && (result = binaryBlockNext(&cursor, &entry)) > 0)
+        {
+            if (wanted || entry.tag == BINARY_DEFINE)
+            {
+                binaryRenderEntry(dictionary, &entry, &rendered);
+            }
+            result = 0;
+        }
+        if (result < 0)
+        {
+            break;
+        }
+        if (rendered.length > 0)
+        {
+            filterRecords(task, rendered.data, rendered.data + rendered.length, rendered.data + rendered.length, NULL, offset);
+        }
+        offset += size;
+    }
+    free(rendered.data);
+    free(dictionary);
+}
+
+// Function to tell whether a record is within the time range and from the client asked for
+int matchRecord(const char *line, size_t length)
+{
+    int64_t seconds;
+    int timed = binaryParseTimestamp(line, length, &seconds);
+
+    if ((fromTime != INT64_MIN || toTime != INT64_MAX) && (!timed || seconds < fromTime || seconds > toTime))
+    {
+        return 0;
+    }
+    if (client == NULL)
+    {
+        return 1;
+    }
+    const char *ip, *name, *payload;
+    size_t ipLength, nameLength, clientLength = strlen(client);
+    if (!timed || !binarySplitClientRecord(line + BINARY_TIMESTAMP_LENGTH, length - BINARY_TIMESTAMP_LENGTH, &ip, &ipLength,
+                                           &name, &nameLength, &payload))
+    {
+        return 0;
+    }
+    return (nameLength == clientLength && memcmp(name, client, clientLength) == 0) ||
+           (ipLength == clientLength && memcmp(ip, client, clientLength) == 0);
+}
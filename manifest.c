@@ -0,0 +1,285 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include "manifest.h"
+
+// Function to get the number of bytes needed by an index of the given capacity
+size_t segmentIndexSize(unsigned long capacity)
+{
+    return sizeof(struct segmentIndex) + capacity * SEGMENT_NAME_LENGTH;
+}
+
+// Function to copy an index into memory of segmentIndexSize(capacity) bytes. 'capacity' must hold every segment of 'from'.
+void segmentIndexCopy(struct segmentIndex *index, unsigned long capacity, const struct segmentIndex *from)
+{
+    index->capacity = capacity;
+    index->first = 0;
+    index->count = 0;
+    index->journalEntries = from->journalEntries;
+    for (unsigned long i = 0; i < from->count; i++)
+    {
+        segmentIndexAppend(index, segmentIndexName(from, i));
+    }
+}
+
+// Function to get the name of the i-th segment, 0 being the oldest
+const char *segmentIndexName(const struct segmentIndex *index, unsigned long i)
+{
+    return index->names[(index->first + i) % index->capacity];
+}
+
+// Function to get the name of the newest segment, NULL when there is none
+const char *segmentIndexNewest(const struct segmentIndex *index)
+{
+    return (index->count > 0) ? segmentIndexName(index, index->count - 1) : NULL;
+}
+
+// Function to add the newest segment. The caller makes sure the index is not full.
+void segmentIndexAppend(struct segmentIndex *index, const char *name)
+{
+    char *slot = index->names[(index->first + index->count) % index->capacity];
+
+    snprintf(slot, SEGMENT_NAME_LENGTH, "%s", name);
+    index->count++;
+}
+
+// Function to forget the oldest segment
+void segmentIndexRemoveOldest(struct segmentIndex *index)
+{
+    if (index->count > 0)
+    {
+        index->first = (index->first + 1) % index->capacity;
+        index->count--;
+    }
+}
+
+// Function to append a name to an index being loaded, growing it when needed. Loaded indexes never wrap around.
+static struct segmentIndex *appendLoaded(struct segmentIndex *index, const char *name)
+{
+    if (index->first + index->count == index->capacity)
+    {
+        if (index->first > 0)
+        {
+            memmove(index->names[0], index->names[index->first], index->count * SEGMENT_NAME_LENGTH);
+            index->first = 0;
+        }
+        else
+        {
+            struct segmentIndex *grown = realloc(index, segmentIndexSize(index->capacity * 2));
+            if (grown == NULL)
+            {
+                return index;
+            }
+            index = grown;
+            index->capacity *= 2;
+        }
+    }
+    segmentIndexAppend(index, name);
+    return index;
+}
+
+// Function to remove a name from an index being loaded. Deletions are nearly always of the oldest segment.
+static void removeLoaded(struct segmentIndex *index, const char *name)
+{
+    for (unsigned long i = 0; i < index->count; i++)
+    {
+        if (strcmp(segmentIndexName(index, i), name) == 0)
+        {
+            unsigned long slot = index->first + i;
+            memmove(index->names[slot], index->names[slot + 1], (index->count - i - 1) * SEGMENT_NAME_LENGTH);
+            index->count--;
+            return;
+        }
+    }
+}
+
+// Function to compare segment names by the time and sequence number they carry:
+// server_log_<date>|<time>.txt, then server_log_<date>|<time>.1.txt and so on for segments created within the same second.
+// strftime() pads every field, so the times compare as text.
+int segmentNameCompare(const char *a, const char *b)
+{
+    size_t timeLength = strlen("server_log_YYYY-mm-dd|HH:MM:SS");
+    int sequenceA = 0, sequenceB = 0;
+
+    int result = strncmp(a, b, timeLength);
+    if (result != 0 || strlen(a) < timeLength || strlen(b) < timeLength)
+    {
+        return result;
+    }
+    sscanf(a + timeLength, ".%d.txt", &sequenceA);
+    sscanf(b + timeLength, ".%d.txt", &sequenceB);
+    if (sequenceA != sequenceB)
+    {
+        return (sequenceA < sequenceB) ? -1 : 1;
+    }
+    return strcmp(a, b);
+}
+
+// qsort() callback ordering segment names
+static int compareNames(const void *a, const void *b)
+{
+    return segmentNameCompare(a, b);
+}
+
+// Function to load the segment index of a directory from its manifest. Without a manifest the directory is
+// scanned once and '*rebuilt' is set, the caller should then write one. It returns a malloc()ed index or NULL.
+struct segmentIndex *manifestLoad(const char *directory, int *rebuilt)
+{
+    char path[512];
+    char line[256];
+    struct segmentIndex *index = malloc(segmentIndexSize(64));
+
+    if (index == NULL)
+    {
+        return NULL;
+    }
+    index->capacity = 64;
+    index->first = 0;
+    index->count = 0;
+    index->journalEntries = 0;
+
+    snprintf(path, sizeof(path), "%s/%s", directory, MANIFEST_FILE);
+    FILE *manifest = fopen(path, "r");
+    if (manifest != NULL)
+    {
+        while (fgets(line, sizeof(line), manifest) != NULL)
+        {
+            size_t length = strlen(line);
+            // A line cut short by a crash during an append is ignored
+            if (length < 4 || line[length - 1] != '\n' || line[1] != ' ' || length - 3 >= SEGMENT_NAME_LENGTH)
+            {
+                continue;
+            }
+            line[length - 1] = '\0';
+            index->journalEntries++;
+            if (line[0] == '+')
+            {
+                index = appendLoaded(index, line + 2);
+            }
+            else if (line[0] == '-')
+            {
+                removeLoaded(index, line + 2);
+            }
+        }
+        fclose(manifest);
+        *rebuilt = 0;
+        return index;
+    }
+
+    // No manifest yet: one scan of the directory, ordered by the times in the names
+    DIR *dir = opendir(directory);
+    struct dirent *entry;
+    if (dir == NULL)
+    {
+        free(index);
+        return NULL;
+    }
+    while ((entry = readdir(dir)) != NULL)
+    {
+        if (entry->d_type == DT_REG && strstr(entry->d_name, "server_log_") == entry->d_name && strlen(entry->d_name) < SEGMENT_NAME_LENGTH)
+        {
+            index = appendLoaded(index, entry->d_name);
+        }
+    }
+    closedir(dir);
+    qsort(index->names, index->count, SEGMENT_NAME_LENGTH, compareNames);
+    *rebuilt = 1;
+    return index;
+}
+
+// Function to journal a rotation in the manifest with a single append. Either name may be NULL.
+// With 'sync' the manifest is flushed to disk before returning. It returns -1 on failure.
+int manifestRecord(struct segmentIndex *index, const char *directory, const char *removed, const char *added, int sync)
+{
+    char path[512];
+    char entries[2 * (SEGMENT_NAME_LENGTH + 3)];
+    int length = 0;
+
+    if (removed != NULL)
+    {
+        length += snprintf(entries + length, sizeof(entries) - length, "- %s\n", removed);
+        index->journalEntries++;
+    }
+    if (added != NULL)
+    {
+        length += snprintf(entries + length, sizeof(entries) - length, "+ %s\n", added);
+        index->journalEntries++;
+    }
+
+    snprintf(path, sizeof(path), "%s/%s", directory, MANIFEST_FILE);
+    int fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (fd < 0)
+    {
+        return -1;
+    }
+    int result = (write(fd, entries, length) == length && (!sync || fdatasync(fd) == 0)) ? 0 : -1;
+    close(fd);
+    return result;
+}
+
+// Function to replace the manifest with one "+" line per segment: written to a temporary file,
+// synced, then renamed over the old manifest so readers only ever see a complete one. It returns -1 on failure.
+int manifestRewrite(struct segmentIndex *index, const char *directory)
+{
+    char path[512];
+    char temporaryPath[512];
+
+    snprintf(path, sizeof(path), "%s/%s", directory, MANIFEST_FILE);
+    snprintf(temporaryPath, sizeof(temporaryPath), "%s/%s.tmp", directory, MANIFEST_FILE);
+    FILE *manifest = fopen(temporaryPath, "w");
+    if (manifest == NULL)
+    {
+        return -1;
+    }
+    for (unsigned long i = 0; i < index->count; i++)
+    {
+        fprintf(manifest, "+ %s\n", segmentIndexName(index, i));
+    }
+    if (fflush(manifest) != 0 || fsync(fileno(manifest)) != 0)
+    {
+        fclose(manifest);
+        unlink(temporaryPath);
+        return -1;
+    }
+    fclose(manifest);
+    if (rename(temporaryPath, path) != 0)
+    {
+        unlink(temporaryPath);
+        return -1;
+    }
+
+    // Make the rename itself durable
+    int dirFd = open(directory, O_RDONLY | O_DIRECTORY);
+    if (dirFd >= 0)
+    {
+        fsync(dirFd);
+        close(dirFd);
+    }
+    index->journalEntries = index->count;
+    return 0;
+}
+
+// Function to count the shard directories of a sharded log directory: shard-0, shard-1 and so on, each a log
+// directory of its own. It returns 0 for a log directory holding its segments itself.
+int manifestShards(const char *directory)
+{
+    char path[512];
+    char shard[32];
+    struct stat st;
+    int count = 0;
+
+    while (1)
+    {
+        snprintf(shard, sizeof(shard), SHARD_DIRECTORY, count);
+        snprintf(path, sizeof(path), "%s/%s", directory, shard);
+        if (stat(path, &st) != 0 || !S_ISDIR(st.st_mode))
+        {
+            return count;
+        }
+        count++;
+    }
+}
@@ -0,0 +1,39 @@
+#ifndef MANIFEST_H
+#define MANIFEST_H
+
+#include <stddef.h>
+
+#define SEGMENT_NAME_LENGTH 64
+#define MANIFEST_FILE ".segments" // Kept in the log directory, hidden from "server_log_" scans
+#define SHARD_DIRECTORY "shard-%d" // With shards=N the log directory holds N such log directories, one per stream
+
+// Ordered index of the segments of a log directory, oldest first. It is a circular array so
+// adding the newest segment and removing the oldest one are constant time.
+//
+// The manifest file mirrors it as a journal of lines:
+//     "+ <name>" a segment was created, it is the newest
+//     "- <name>" a segment was deleted
+// Rotation appends one write to it; once the journal grows to a few times the number of segments
+// it is rewritten to a temporary file and renamed over the old one, so it is always complete.
+struct segmentIndex
+{
+    unsigned long capacity;
+    unsigned long first;          // Slot of the oldest segment
+    unsigned long count;
+    unsigned long journalEntries; // Lines in the manifest file
+    char names[][SEGMENT_NAME_LENGTH];
+};
+
+size_t segmentIndexSize(unsigned long capacity);
+void segmentIndexCopy(struct segmentIndex *index, unsigned long capacity, const struct segmentIndex *from);
+const char *segmentIndexName(const struct segmentIndex *index, unsigned long i);
+const char *segmentIndexNewest(const struct segmentIndex *index);
+void segmentIndexAppend(struct segmentIndex *index, const char *name);
+void segmentIndexRemoveOldest(struct segmentIndex *index);
+struct segmentIndex *manifestLoad(const char *directory, int *rebuilt);
+int manifestRecord(struct segmentIndex *index, const char *directory, const char *removed, const char *added, int sync);
+int manifestRewrite(struct segmentIndex *index, const char *directory);
+int segmentNameCompare(const char *a, const char *b);
+int manifestShards(const char *directory);
+
+#endif
@@ -0,0 +1,82 @@
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#include <stdint.h>
+
+// Binary protocol shared by the client and the server. Integers are in network byte order.
+//
+// The client opens the connection with a handshake:
+//     "LGB" | version (1 byte) | name length (2 bytes) | name
+// and the server accepts it by answering "LGB" | version, the lower of the client's and its own. Every message after that is a frame:
+//     payload length (4 bytes) | type (2 bytes) | record count (2 bytes) | payload
+// The payload of a FRAME_RECORDS frame holds 'record count' records:
+//     timestamp (8 bytes, microseconds since the epoch on the client) | length (4 bytes) | bytes
+// From version 2 the server echoes every FRAME_SYNC frame back once the frames sent before it were handed to the log,
+// so a client may let go of them. Its payload is up to PROTOCOL_MAX_SYNC bytes of the client's choosing.
+// A client may have some of its records traced from its send to the disk with a FRAME_TRACE frame, whose payload
+//     sequence (8 bytes) | send time (8 bytes, CLOCK_MONOTONIC nanoseconds on the client) | record (2 bytes)
+// names the record at index 'record' of the next FRAME_RECORDS frame. Servers that keep no stats, and older ones,
+// skip it. The send time only compares with the server's clock for a client on the same host.
+// A client that does not open with the magic is served with the text protocol, where the first
+// read is its name and every later read is one message.
+//
+// With udp_port set the server also takes datagrams, which need no handshake: each one names its sender
+// and carries records laid out as in a FRAME_RECORDS payload, and is logged whole or not at all:
+//     "LGD" | version (1 byte) | name length (2 bytes) | name | record count (2 bytes) | records
+#define PROTOCOL_MAGIC "LGB"
+#define PROTOCOL_MAGIC_LENGTH 3
+#define PROTOCOL_VERSION 2 // 2 adds FRAME_SYNC
+#define PROTOCOL_HANDSHAKE_HEADER 6 // Magic, version and name length
+#define PROTOCOL_ACK_LENGTH 4       // Magic and version
+#define PROTOCOL_FRAME_HEADER 8
+#define PROTOCOL_RECORD_HEADER 12
+#define PROTOCOL_MAX_FRAME 65536 // Largest payload of a frame
+#define PROTOCOL_MAX_NAME 255
+#define PROTOCOL_MAX_SYNC 16 // Largest payload of a FRAME_SYNC frame the server echoes
+#define PROTOCOL_TRACE_PAYLOAD 18 // Payload of a FRAME_TRACE frame
+#define PROTOCOL_DATAGRAM_MAGIC "LGD"
+#define PROTOCOL_DATAGRAM_HEADER 6 // Magic, version and name length, followed by the name and the record count
+#define PROTOCOL_MAX_DATAGRAM 65507 // Largest UDP payload over IPv4
+
+// Frame types
+#define FRAME_RECORDS 1 // A batch of log records
+#define FRAME_QUIT 2    // The client is leaving, same as sending "quit" with the text protocol
+#define FRAME_SYNC 3    // Asks the server to echo the frame once the frames before it were handed to the log
+#define FRAME_TRACE 4   // Has a record of the next FRAME_RECORDS frame traced
+
+static inline void protocolPut16(unsigned char *p, uint16_t value)
+{
+    p[0] = value >> 8;
+    p[1] = value;
+}
+
+static inline void protocolPut32(unsigned char *p, uint32_t value)
+{
+    p[0] = value >> 24;
+    p[1] = value >> 16;
+    p[2] = value >> 8;
+    p[3] = value;
+}
+
+static inline void protocolPut64(unsigned char *p, uint64_t value)
+{
+    protocolPut32(p, value >> 32);
+    protocolPut32(p + 4, value);
+}
+
+static inline uint16_t protocolGet16(const unsigned char *p)
+{
+    return (uint16_t)(p[0] << 8 | p[1]);
+}
+
+static inline uint32_t protocolGet32(const unsigned char *p)
+{
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+static inline uint64_t protocolGet64(const unsigned char *p)
+{
+    return (uint64_t)protocolGet32(p) << 32 | protocolGet32(p + 4);
+}
+
+#endif
@@ -0,0 +1,176 @@
+#include <string.h>
+#include "record_ring.h"
+
+// Function to get the number of bytes needed by a ring with the given number of slots
+size_t recordRingSize(unsigned long numberOfSlots)
+{
+    return sizeof(struct recordRing) + numberOfSlots * sizeof(struct recordSlot);
+}
+
+// Function to initialize a ring in memory of recordRingSize() bytes. numberOfSlots must be a power of two.
+void recordRingInit(struct recordRing *ring, unsigned long numberOfSlots)
+{
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->truncated, 0);
+    ring->tail = 0;
+    ring->mask = numberOfSlots - 1;
+    for (unsigned long i = 0; i < numberOfSlots; i++)
+    {
+        // A slot is free for the producer at position p when its sequence equals p
+        atomic_init(&ring->slots[i].sequence, i);
+    }
+}
+
+// Function to append a record to the ring. It returns 0 on success and -1 if the ring is full.
+// A record longer than a slot takes several; one longer than the ring can hold is truncated.
+int recordRingPush(struct recordRing *ring, const char *record, size_t length)
+{
+    struct iovec slice = {.iov_base = (void *)record, .iov_len = length};
+    return recordRingPushSlices(ring, &slice, 1);
+}
+
+// Function to append a record made of several slices, copied one after the other into its slots.
+// It returns 0 on success and -1 if the ring is full.
+int recordRingPushSlices(struct recordRing *ring, const struct iovec *slices, int count)
+{
+    return recordRingPushTagged(ring, slices, count, 0);
+}
+
+// Function to append a record made of slices, like recordRingPushSlices(), with a tag the consumer finds in its slot.
+// A record longer than RECORD_MAX_SLOTS slots, or than the whole ring, keeps what fits and its last byte, and is counted.
+int recordRingPushTagged(struct recordRing *ring, const struct iovec *slices, int count, unsigned int tag)
+{
+    struct recordSlot *slot;
+    unsigned long capacity = (ring->mask < RECORD_MAX_SLOTS) ? ring->mask + 1 : RECORD_MAX_SLOTS;
+    size_t length = 0;
+
+    for (int i = 0; i < count; i++)
+    {
+        length += slices[i].iov_len;
+    }
+    int truncated = length > capacity * RECORD_SLOT_SIZE;
+    if (truncated)
+    {
+        length = capacity * RECORD_SLOT_SIZE;
+    }
+    unsigned long needed = (length > RECORD_SLOT_SIZE) ? (length + RECORD_SLOT_SIZE - 1) / RECORD_SLOT_SIZE : 1;
+
+    unsigned long pos = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    while (1)
+    {
+        slot = &ring->slots[pos & ring->mask];
+        unsigned long seq = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+        long diff = (long)(seq - pos);
+        if (diff == 0 && needed > 1)
+        {
+            // The consumer frees slots in order: the others are free when the last one the record needs is
+            unsigned long last = pos + needed - 1;
+            diff = (long)(atomic_load_explicit(&ring->slots[last & ring->mask].sequence, memory_order_acquire) - last);
+        }
+        if (diff == 0)
+        {
+            // The slots are free, try to reserve them
+            if (atomic_compare_exchange_weak_explicit(&ring->head, &pos, pos + needed, memory_order_relaxed, memory_order_relaxed))
+            {
+                break;
+            }
+        }
+        else if (diff < 0)
+        {
+            // The consumer has not released this slot yet: the ring is full
+            return -1;
+        }
+        else
+        {
+            // Another producer took the slot, retry with the new head
+            pos = atomic_load_explicit(&ring->head, memory_order_relaxed);
+        }
+    }
+
+    size_t at = 0; // Offset of the next byte in the record
+    for (int i = 0; i < count && at < length; i++)
+    {
+        const char *from = slices[i].iov_base;
+        size_t left = slices[i].iov_len;
+        while (left > 0 && at < length)
+        {
+            size_t part = RECORD_SLOT_SIZE - at % RECORD_SLOT_SIZE;
+            part = (part < left) ? part : left;
+            part = (part < length - at) ? part : length - at;
+            memcpy(ring->slots[(pos + at / RECORD_SLOT_SIZE) & ring->mask].data + at % RECORD_SLOT_SIZE, from, part);
+            from += part;
+            left -= part;
+            at += part;
+        }
+    }
+    if (truncated)
+    {
+        // The end of a record is its newline: losing it would run the next record into this one
+        for (int i = count - 1; i >= 0; i--)
+        {
+            if (slices[i].iov_len > 0)
+            {
+                ring->slots[(pos + needed - 1) & ring->mask].data[RECORD_SLOT_SIZE - 1] =
+                    ((const char *)slices[i].iov_base)[slices[i].iov_len - 1];
+                break;
+            }
+        }
+        atomic_fetch_add_explicit(&ring->truncated, 1, memory_order_relaxed);
+    }
+
+    // Publish the slots after the first one, then the first: the consumer takes the record once it sees the first
+    for (unsigned long i = needed - 1; i > 0; i--)
+    {
+        struct recordSlot *next = &ring->slots[(pos + i) & ring->mask];
+        next->length = (i == needed - 1) ? length - i * RECORD_SLOT_SIZE : RECORD_SLOT_SIZE;
+        next->tag = 0;
+        atomic_store_explicit(&next->sequence, pos + i + 1, memory_order_release);
+    }
+    slot->length = length;
+    slot->tag = tag;
+    atomic_store_explicit(&slot->sequence, pos + 1, memory_order_release);
+    return 0;
+}
+
+// Function to look at the record 'offset' positions after the tail without consuming it.
+// It returns NULL if that record has not been published yet. Only the consumer may call it.
+struct recordSlot *recordRingPeek(struct recordRing *ring, unsigned long offset)
+{
+    unsigned long pos = ring->tail + offset;
+    struct recordSlot *slot = &ring->slots[pos & ring->mask];
+
+    if (atomic_load_explicit(&slot->sequence, memory_order_acquire) != pos + 1)
+    {
+        return NULL;
+    }
+    return slot;
+}
+
+// Function to get the bytes of the record 'offset' slots after the tail, which recordRingPeek() returned, as one
+// part per slot it takes. It returns the number of parts, at most RECORD_MAX_SLOTS. Only the consumer may call it.
+int recordRingParts(struct recordRing *ring, unsigned long offset, struct iovec *parts)
+{
+    size_t left = ring->slots[(ring->tail + offset) & ring->mask].length;
+    int count = 0;
+
+    // A record is never longer than its slots, but the length of a shared ring comes from another process
+    do
+    {
+        parts[count].iov_base = ring->slots[(ring->tail + offset + count) & ring->mask].data;
+        parts[count].iov_len = (left < RECORD_SLOT_SIZE) ? left : RECORD_SLOT_SIZE;
+        left -= parts[count].iov_len;
+        count++;
+    } while (left > 0 && count < RECORD_MAX_SLOTS && (unsigned long)count <= ring->mask);
+    return count;
+}
+
+// Function to hand 'count' consumed slots back to the producers
+void recordRingRelease(struct recordRing *ring, unsigned long count)
+{
+    for (unsigned long i = 0; i < count; i++)
+    {
+        unsigned long pos = ring->tail + i;
+        atomic_store_explicit(&ring->slots[pos & ring->mask].sequence, pos + ring->mask + 1, memory_order_release);
+    }
+    ring->tail += count;
+}
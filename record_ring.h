@@ -0,0 +1,44 @@
+#ifndef RECORD_RING_H
+#define RECORD_RING_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <sys/uio.h>
+
+// Bytes of a slot. A longer record takes consecutive slots, up to RECORD_MAX_SLOTS of them: a frame of protocol.h
+// and the prefix the server gives its records fit.
+#define RECORD_SLOT_SIZE 2048
+#define RECORD_MAX_SLOTS 64
+
+// One fixed-size slot of the ring. 'sequence' tells producers and the consumer whose turn it is.
+struct recordSlot
+{
+    atomic_ulong sequence;
+    unsigned int length; // In the first slot of a record, the length of the whole record
+    unsigned int tag; // Opaque to the ring: set by the producer along with the record
+    char data[RECORD_SLOT_SIZE];
+};
+
+// Bounded lock-free ring of log records with many producers and one consumer.
+// Producers reserve a slot with a compare-and-swap on 'head', so the ring can be shared
+// by threads or, when it lives in a MAP_SHARED mapping, by processes.
+struct recordRing
+{
+    atomic_ulong head;      // Next slot to reserve, shared by producers
+    atomic_ulong truncated; // Records cut to what the ring can hold, their last byte kept
+    char pad[48];           // Keep producers and the consumer on different cache lines
+    unsigned long tail; // Next slot to consume, owned by the consumer
+    unsigned long mask; // Number of slots - 1, the number of slots is a power of two
+    struct recordSlot slots[];
+};
+
+size_t recordRingSize(unsigned long numberOfSlots);
+void recordRingInit(struct recordRing *ring, unsigned long numberOfSlots);
+int recordRingPush(struct recordRing *ring, const char *record, size_t length);
+int recordRingPushSlices(struct recordRing *ring, const struct iovec *slices, int count);
+int recordRingPushTagged(struct recordRing *ring, const struct iovec *slices, int count, unsigned int tag);
+struct recordSlot *recordRingPeek(struct recordRing *ring, unsigned long offset);
+int recordRingParts(struct recordRing *ring, unsigned long offset, struct iovec *parts);
+void recordRingRelease(struct recordRing *ring, unsigned long count);
+
+#endif
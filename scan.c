@@ -0,0 +1,143 @@
+#define _GNU_SOURCE
+#include <string.h>
+#include "scan.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+
+// Function to find the first newline 16 bytes at a time with SSE2, which every x86-64 CPU has
+__attribute__((target("sse2"))) static const char *scanNewlineSse2(const char *data, size_t length)
+{
+    const __m128i newline = _mm_set1_epi8('\n');
+    size_t i = 0;
+
+    for (; i + 16 <= length; i += 16)
+    {
+        __m128i chunk = _mm_loadu_si128((const __m128i *)(data + i));
+        unsigned int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, newline));
+        if (mask != 0)
+        {
+            return data + i + __builtin_ctz(mask);
+        }
+    }
+    return memchr(data + i, '\n', length - i);
+}
+
+// Function to find the first newline 32 bytes at a time with AVX2
+__attribute__((target("avx2"))) static const char *scanNewlineAvx2(const char *data, size_t length)
+{
+    const __m256i newline = _mm256_set1_epi8('\n');
+    size_t i = 0;
+
+    for (; i + 32 <= length; i += 32)
+    {
+        __m256i chunk = _mm256_loadu_si256((const __m256i *)(data + i));
+        unsigned int mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, newline));
+        if (mask != 0)
+        {
+            return data + i + __builtin_ctz(mask);
+        }
+    }
+    return scanNewlineSse2(data + i, length - i);
+}
+
+// Function to find a substring 16 positions at a time with SSE2: positions where both the first and the last
+// byte of the needle match are candidates, and only those are compared in full
+__attribute__((target("sse2"))) static const char *scanSubstringSse2(const char *data, size_t length, const char *needle, size_t needleLength)
+{
+    const __m128i first = _mm_set1_epi8(needle[0]);
+    const __m128i last = _mm_set1_epi8(needle[needleLength - 1]);
+    size_t i = 0;
+
+    for (; i + needleLength - 1 + 16 <= length; i += 16)
+    {
+        __m128i head = _mm_loadu_si128((const __m128i *)(data + i));
+        __m128i tail = _mm_loadu_si128((const __m128i *)(data + i + needleLength - 1));
+        unsigned int mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(head, first), _mm_cmpeq_epi8(tail, last)));
+        while (mask != 0)
+        {
+            size_t candidate = i + __builtin_ctz(mask);
+            if (needleLength < 3 || memcmp(data + candidate + 1, needle + 1, needleLength - 2) == 0)
+            {
+                return data + candidate;
+            }
+            mask &= mask - 1;
+        }
+    }
+    return memmem(data + i, length - i, needle, needleLength);
+}
+
+// Function to find a substring 32 positions at a time with AVX2, like scanSubstringSse2()
+__attribute__((target("avx2"))) static const char *scanSubstringAvx2(const char *data, size_t length, const char *needle, size_t needleLength)
+{
+    const __m256i first = _mm256_set1_epi8(needle[0]);
+    const __m256i last = _mm256_set1_epi8(needle[needleLength - 1]);
+    size_t i = 0;
+
+    for (; i + needleLength - 1 + 32 <= length; i += 32)
+    {
+        __m256i head = _mm256_loadu_si256((const __m256i *)(data + i));
+        __m256i tail = _mm256_loadu_si256((const __m256i *)(data + i + needleLength - 1));
+        unsigned int mask = _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(head, first), _mm256_cmpeq_epi8(tail, last)));
+        while (mask != 0)
+        {
+            size_t candidate = i + __builtin_ctz(mask);
+            if (needleLength < 3 || memcmp(data + candidate + 1, needle + 1, needleLength - 2) == 0)
+            {
+                return data + candidate;
+            }
+            mask &= mask - 1;
+        }
+    }
+    return scanSubstringSse2(data + i, length - i, needle, needleLength);
+}
+#endif
+
+// Function to find the first newline with plain C, used where no vector unit is known
+static const char *scanNewlineScalar(const char *data, size_t length)
+{
+    return memchr(data, '\n', length);
+}
+
+// Function to find a substring with plain C
+static const char *scanSubstringScalar(const char *data, size_t length, const char *needle, size_t needleLength)
+{
+    return memmem(data, length, needle, needleLength);
+}
+
+// Implementations picked once at start up for the CPU we run on
+static const char *(*scanNewlineImpl)(const char *, size_t) = scanNewlineScalar;
+static const char *(*scanSubstringImpl)(const char *, size_t, const char *, size_t) = scanSubstringScalar;
+
+__attribute__((constructor)) static void selectScanImplementation(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+    {
+        scanNewlineImpl = scanNewlineAvx2;
+        scanSubstringImpl = scanSubstringAvx2;
+    }
+    else if (__builtin_cpu_supports("sse2"))
+    {
+        scanNewlineImpl = scanNewlineSse2;
+        scanSubstringImpl = scanSubstringSse2;
+    }
+#endif
+}
+
+// Function to find the first newline in a buffer. It returns NULL if there is none.
+const char *scanNewline(const char *data, size_t length)
+{
+    return scanNewlineImpl(data, length);
+}
+
+// Function to find the first occurrence of a non-empty substring in a buffer. It returns NULL if there is none.
+const char *scanSubstring(const char *data, size_t length, const char *needle, size_t needleLength)
+{
+    if (needleLength == 0 || needleLength > length)
+    {
+        return (needleLength == 0) ? data : NULL;
+    }
+    return scanSubstringImpl(data, length, needle, needleLength);
+}
@@ -0,0 +1,9 @@
+#ifndef SCAN_H
+#define SCAN_H
+
+#include <stddef.h>
+
+const char *scanNewline(const char *data, size_t length);
+const char *scanSubstring(const char *data, size_t length, const char *needle, size_t needleLength);
+
+#endif
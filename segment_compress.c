@@ -0,0 +1,493 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include "segment_compress.h"
+#include "binary_segment.h"
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+#define LZ_HASH_BITS 14
+#define LZ_MIN_MATCH 4
+#define LZ_LAST_LITERALS 5 // Matches stop this far from the end of a block, which always ends with literals
+#define LZ_MAX_OFFSET 65535
+
+static void put32(unsigned char *p, uint32_t value)
+{
+    for (int i = 0; i < 4; i++)
+    {
+        p[i] = value >> (8 * i);
+    }
+}
+
+static uint32_t get32(const unsigned char *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static void put64(unsigned char *p, uint64_t value)
+{
+    for (int i = 0; i < 8; i++)
+    {
+        p[i] = value >> (8 * i);
+    }
+}
+
+static uint64_t get64(const unsigned char *p)
+{
+    return get32(p) | ((uint64_t)get32(p + 4) << 32);
+}
+
+// Function to write a whole buffer. It returns -1 on failure.
+static int writeFully(int fd, const void *data, size_t length)
+{
+    const char *p = data;
+
+    while (length > 0)
+    {
+        ssize_t written = write(fd, p, length);
+        if (written < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (written <= 0)
+        {
+            return -1;
+        }
+        p += written;
+        length -= written;
+    }
+    return 0;
+}
+
+// Function to read up to 'length' bytes, stopping early only at the end of the file. It returns -1 on failure.
+static ssize_t readFully(int fd, void *data, size_t length)
+{
+    char *p = data;
+    size_t total = 0;
+
+    while (total < length)
+    {
+        ssize_t n = read(fd, p + total, length - total);
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n < 0)
+        {
+            return -1;
+        }
+        if (n == 0)
+        {
+            break;
+        }
+        total += n;
+    }
+    return total;
+}
+
+// Function to get the largest output of the LZ codec for 'length' input bytes
+static size_t lzBound(size_t length)
+{
+    return length + length / 255 + 16;
+}
+
+// Function to append a length to a sequence: 15 in the token, then bytes of 255 and the remainder
+static unsigned char *lzPutLength(unsigned char *p, size_t length)
+{
+    for (length -= 15; length >= 255; length -= 255)
+    {
+        *p++ = 255;
+    }
+    *p++ = length;
+    return p;
+}
+
+// Function to append one sequence: literals, then a match unless 'matchLength' is 0
+static unsigned char *lzPutSequence(unsigned char *p, const unsigned char *literals, size_t literalLength,
+                                    size_t offset, size_t matchLength)
+{
+    unsigned char *token = p++;
+    size_t matchCode = (matchLength > 0) ? matchLength - LZ_MIN_MATCH : 0;
+
+    *token = ((literalLength < 15) ? literalLength : 15) << 4 | ((matchCode < 15) ? matchCode : 15);
+    if (literalLength >= 15)
+    {
+        p = lzPutLength(p, literalLength);
+    }
+    memcpy(p, literals, literalLength);
+    p += literalLength;
+    if (matchLength > 0)
+    {
+        *p++ = offset;
+        *p++ = offset >> 8;
+        if (matchCode >= 15)
+        {
+            p = lzPutLength(p, matchCode);
+        }
+    }
+    return p;
+}
+
+// Function to compress a block with the LZ codec: greedy matching through a hash table of 4-byte prefixes,
+// skipping faster through data that does not compress. 'out' holds lzBound(length) bytes. It returns the output size.
+static size_t lzCompress(const unsigned char *in, size_t length, unsigned char *out)
+{
+    uint32_t table[1 << LZ_HASH_BITS] = {0}; // Position + 1 of the last occurrence of each hashed prefix
+    unsigned char *p = out;
+    size_t anchor = 0, i = 0;
+    unsigned misses = 0;
+
+    while (length >= LZ_MIN_MATCH + LZ_LAST_LITERALS && i + LZ_MIN_MATCH + LZ_LAST_LITERALS <= length)
+    {
+        uint32_t prefix;
+        memcpy(&prefix, in + i, 4);
+        uint32_t hash = (prefix * 2654435761u) >> (32 - LZ_HASH_BITS);
+        size_t candidate = table[hash];
+        table[hash] = i + 1;
+
+        if (candidate == 0 || i - (candidate - 1) > LZ_MAX_OFFSET || memcmp(in + candidate - 1, in + i, 4) != 0)
+        {
+            i += 1 + (misses++ >> 6);
+            continue;
+        }
+        size_t match = candidate - 1;
+        size_t matchLength = LZ_MIN_MATCH;
+        while (i + matchLength < length - LZ_LAST_LITERALS && in[match + matchLength] == in[i + matchLength])
+        {
+            matchLength++;
+        }
+        p = lzPutSequence(p, in + anchor, i - anchor, i - match, matchLength);
+        i += matchLength;
+        anchor = i;
+        misses = 0;
+    }
+    p = lzPutSequence(p, in + anchor, length - anchor, 0, 0);
+    return p - out;
+}
+
+// Function to read an extended length. It returns NULL when it runs past 'end'.
+static const unsigned char *lzGetLength(const unsigned char *p, const unsigned char *end, size_t *length)
+{
+    unsigned char byte;
+
+    do
+    {
+        if (p >= end)
+        {
+            return NULL;
+        }
+        byte = *p++;
+        *length += byte;
+    } while (byte == 255);
+    return p;
+}
+
+// Function to decompress a block of the LZ codec into 'out' of 'capacity' bytes.
+// It returns the output size, or -1 when the block is malformed.
+static long lzDecompress(const unsigned char *in, size_t length, unsigned char *out, size_t capacity)
+{
+    const unsigned char *p = in, *end = in + length;
+    unsigned char *o = out, *outEnd = out + capacity;
+
+    while (p < end)
+    {
+        unsigned token = *p++;
+        size_t literalLength = token >> 4;
+        if (literalLength == 15 && (p = lzGetLength(p, end, &literalLength)) == NULL)
+        {
+            return -1;
+        }
+        if (literalLength > (size_t)(end - p) || literalLength > (size_t)(outEnd - o))
+        {
+            return -1;
+        }
+        memcpy(o, p, literalLength);
+        p += literalLength;
+        o += literalLength;
+        // The last sequence has no match
+        if (p == end)
+        {
+            break;
+        }
+
+        if (end - p < 2)
+        {
+            return -1;
+        }
+        size_t offset = p[0] | (p[1] << 8);
+        p += 2;
+        size_t matchLength = token & 15;
+        if (matchLength == 15 && (p = lzGetLength(p, end, &matchLength)) == NULL)
+        {
+            return -1;
+        }
+        matchLength += LZ_MIN_MATCH;
+        if (offset == 0 || offset > (size_t)(o - out) || matchLength > (size_t)(outEnd - o))
+        {
+            return -1;
+        }
+        // The match may overlap what it produces
+        const unsigned char *from = o - offset;
+        for (size_t i = 0; i < matchLength; i++)
+        {
+            o[i] = from[i];
+        }
+        o += matchLength;
+    }
+    return o - out;
+}
+
+// Function to tell whether a codec can be used by this build
+int compressedCodecAvailable(int codec)
+{
+#ifdef HAVE_ZLIB
+    if (codec == CODEC_ZLIB)
+    {
+        return 1;
+    }
+#endif
+    return codec == CODEC_LZ;
+}
+
+// Function to tell whether a segment file has already been compressed
+int compressedSegmentIsCompressed(int fd)
+{
+    char magic[COMPRESSED_MAGIC_LENGTH];
+
+    return pread(fd, magic, sizeof(magic), 0) == sizeof(magic) && memcmp(magic, COMPRESSED_SEGMENT_MAGIC, sizeof(magic)) == 0;
+}
+
+// Function to compress a segment read from 'in' into 'out', block by block. '*cancel' is checked between
+// blocks so a worker can stop quickly. It returns the size of the compressed file, or -1 on failure or when cancelled.
+long long compressedSegmentWrite(int in, int out, int codec, volatile sig_atomic_t *cancel)
+{
+    unsigned char header[COMPRESSED_HEADER] = {0};
+    size_t capacity = lzBound(COMPRESSED_BLOCK_SIZE) + COMPRESSED_BLOCK_HEADER;
+    uint64_t fileOffset = COMPRESSED_HEADER, originalOffset = 0;
+    uint64_t *offsets = NULL;
+    uint32_t blocks = 0, indexCapacity = 0;
+    long long result = -1;
+    ssize_t n;
+
+#ifdef HAVE_ZLIB
+    if (compressBound(COMPRESSED_BLOCK_SIZE) + COMPRESSED_BLOCK_HEADER > capacity)
+    {
+        capacity = compressBound(COMPRESSED_BLOCK_SIZE) + COMPRESSED_BLOCK_HEADER;
+    }
+#endif
+    unsigned char *original = malloc(COMPRESSED_BLOCK_SIZE);
+    unsigned char *compressed = malloc(capacity);
+    if (original == NULL || compressed == NULL || !compressedCodecAvailable(codec))
+    {
+        goto done;
+    }
+
+    memcpy(header, COMPRESSED_SEGMENT_MAGIC, COMPRESSED_MAGIC_LENGTH);
+    header[8] = codec;
+    put32(header + 12, COMPRESSED_BLOCK_SIZE);
+    if (writeFully(out, header, sizeof(header)) != 0)
+    {
+        goto done;
+    }
+
+    while ((n = readFully(in, original, COMPRESSED_BLOCK_SIZE)) > 0)
+    {
+        if (*cancel)
+        {
+            goto done;
+        }
+        size_t length = capacity - COMPRESSED_BLOCK_HEADER;
+#ifdef HAVE_ZLIB
+        if (codec == CODEC_ZLIB)
+        {
+            uLongf zlibLength = length;
+            if (compress2(compressed + COMPRESSED_BLOCK_HEADER, &zlibLength, original, n, Z_DEFAULT_COMPRESSION) != Z_OK)
+            {
+                goto done;
+            }
+            length = zlibLength;
+        }
+#endif
+        if (codec == CODEC_LZ)
+        {
+            length = lzCompress(original, n, compressed + COMPRESSED_BLOCK_HEADER);
+        }
+        put32(compressed, length);
+        put32(compressed + 4, n);
+        put32(compressed + 8, binaryCrc32c(original, n));
+        if (writeFully(out, compressed, COMPRESSED_BLOCK_HEADER + length) != 0)
+        {
+            goto done;
+        }
+
+        if (blocks == indexCapacity)
+        {
+            indexCapacity = (indexCapacity > 0) ? indexCapacity * 2 : 64;
+            uint64_t *grown = realloc(offsets, indexCapacity * 2 * sizeof(uint64_t));
+            if (grown == NULL)
+            {
+                goto done;
+            }
+            offsets = grown;
+        }
+        offsets[2 * blocks] = fileOffset;
+        offsets[2 * blocks + 1] = originalOffset;
+        blocks++;
+        fileOffset += COMPRESSED_BLOCK_HEADER + length;
+        originalOffset += n;
+    }
+    if (n < 0)
+    {
+        goto done;
+    }
+
+    // The index and the trailer, in the buffer of the blocks when they fit
+    size_t tailLength = (size_t)blocks * 16 + COMPRESSED_TRAILER;
+    unsigned char *tail = (tailLength <= capacity) ? compressed : malloc(tailLength);
+    if (tail == NULL)
+    {
+        goto done;
+    }
+    for (uint32_t i = 0; i < blocks; i++)
+    {
+        put64(tail + 16 * i, offsets[2 * i]);
+        put64(tail + 16 * i + 8, offsets[2 * i + 1]);
+    }
+    unsigned char *trailer = tail + (size_t)blocks * 16;
+    put64(trailer, fileOffset);
+    put32(trailer + 8, blocks);
+    put32(trailer + 12, 0);
+    put64(trailer + 16, originalOffset);
+    memcpy(trailer + 24, COMPRESSED_TRAILER_MAGIC, COMPRESSED_MAGIC_LENGTH);
+    if (writeFully(out, tail, tailLength) == 0)
+    {
+        result = fileOffset + tailLength;
+    }
+    if (tail != compressed)
+    {
+        free(tail);
+    }
+
+done:
+    free(original);
+    free(compressed);
+    free(offsets);
+    return result;
+}
+
+// Function to open a compressed segment: read its trailer and block index. It returns -1 when the file
+// is not a complete compressed segment or its codec is not available in this build.
+int compressedSegmentOpen(struct compressedSegment *segment, int fd)
+{
+    unsigned char header[COMPRESSED_HEADER];
+    unsigned char trailer[COMPRESSED_TRAILER];
+    off_t size = lseek(fd, 0, SEEK_END);
+
+    memset(segment, 0, sizeof(*segment));
+    if (size < COMPRESSED_HEADER + COMPRESSED_TRAILER || pread(fd, header, sizeof(header), 0) != sizeof(header) ||
+        pread(fd, trailer, sizeof(trailer), size - COMPRESSED_TRAILER) != sizeof(trailer) ||
+        memcmp(header, COMPRESSED_SEGMENT_MAGIC, COMPRESSED_MAGIC_LENGTH) != 0 ||
+        memcmp(trailer + 24, COMPRESSED_TRAILER_MAGIC, COMPRESSED_MAGIC_LENGTH) != 0 || !compressedCodecAvailable(header[8]))
+    {
+        return -1;
+    }
+    segment->fd = fd;
+    segment->codec = header[8];
+    segment->blockSize = get32(header + 12);
+    segment->blockCount = get32(trailer + 8);
+    segment->length = get64(trailer + 16);
+    uint64_t indexOffset = get64(trailer);
+    if (segment->blockSize == 0 || indexOffset + (uint64_t)segment->blockCount * 16 + COMPRESSED_TRAILER != (uint64_t)size)
+    {
+        return -1;
+    }
+
+    size_t indexLength = (size_t)segment->blockCount * 16;
+    unsigned char *index = malloc(indexLength + 1);
+    segment->offsets = malloc(segment->blockCount * 2 * sizeof(uint64_t) + 1);
+    if (index == NULL || segment->offsets == NULL || pread(fd, index, indexLength, indexOffset) != (ssize_t)indexLength)
+    {
+        free(index);
+        compressedSegmentClose(segment);
+        return -1;
+    }
+    for (uint32_t i = 0; i < 2 * segment->blockCount; i++)
+    {
+        segment->offsets[i] = get64(index + 8 * i);
+    }
+    free(index);
+    return 0;
+}
+
+// Function to decompress one block into 'out', which holds segment->blockSize bytes.
+// It returns the number of original bytes, or -1 when the block is damaged.
+long compressedSegmentReadBlock(struct compressedSegment *segment, uint32_t block, char *out)
+{
+    unsigned char header[COMPRESSED_BLOCK_HEADER];
+    long result = -1;
+
+    if (block >= segment->blockCount || pread(segment->fd, header, sizeof(header), segment->offsets[2 * block]) != sizeof(header))
+    {
+        return -1;
+    }
+    uint32_t length = get32(header);
+    uint32_t originalLength = get32(header + 4);
+    unsigned char *compressed = malloc(length + 1);
+    if (compressed == NULL || originalLength > segment->blockSize ||
+        pread(segment->fd, compressed, length, segment->offsets[2 * block] + COMPRESSED_BLOCK_HEADER) != (ssize_t)length)
+    {
+        free(compressed);
+        return -1;
+    }
+#ifdef HAVE_ZLIB
+    if (segment->codec == CODEC_ZLIB)
+    {
+        uLongf zlibLength = segment->blockSize;
+        if (uncompress((unsigned char *)out, &zlibLength, compressed, length) == Z_OK)
+        {
+            result = zlibLength;
+        }
+    }
+#endif
+    if (segment->codec == CODEC_LZ)
+    {
+        result = lzDecompress(compressed, length, (unsigned char *)out, segment->blockSize);
+    }
+    free(compressed);
+    if (result != (long)originalLength || binaryCrc32c(out, result) != get32(header + 8))
+    {
+        return -1;
+    }
+    return result;
+}
+
+// Function to find the block holding a given offset of the original segment
+uint32_t compressedSegmentFindBlock(const struct compressedSegment *segment, uint64_t offset)
+{
+    uint32_t low = 0, high = segment->blockCount;
+
+    // Last block whose original offset is at most 'offset'
+    while (high - low > 1)
+    {
+        uint32_t middle = low + (high - low) / 2;
+        if (segment->offsets[2 * middle + 1] <= offset)
+        {
+            low = middle;
+        }
+        else
+        {
+            high = middle;
+        }
+    }
+    return low;
+}
+
+// Function to release what compressedSegmentOpen() allocated. The file descriptor stays open.
+void compressedSegmentClose(struct compressedSegment *segment)
+{
+    free(segment->offsets);
+    segment->offsets = NULL;
+}
@@ -0,0 +1,49 @@
+#ifndef SEGMENT_COMPRESS_H
+#define SEGMENT_COMPRESS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <signal.h>
+
+// Compressed segment file, written by the compression workers over a rotated segment. Integers are little-endian.
+//
+//     header:  COMPRESSED_SEGMENT_MAGIC (8 bytes) | codec (1 byte) | 3 zero bytes | block size (4 bytes)
+//     blocks:  compressed length (4 bytes) | original length (4 bytes) | CRC-32C of the original bytes (4 bytes) | data
+//     index:   per block, its file offset (8 bytes) and the offset of its first original byte (8 bytes)
+//     trailer: index offset (8 bytes) | block count (4 bytes) | 4 zero bytes | original length (8 bytes)
+//              | COMPRESSED_TRAILER_MAGIC (8 bytes)
+// Every block but the last holds 'block size' original bytes and is compressed on its own, so a reader
+// can go straight to the block holding any offset of the original segment through the index.
+// The original is a text or binary segment, which decompresses to exactly the bytes it held.
+#define COMPRESSED_SEGMENT_MAGIC "LGSEGZ1\n"
+#define COMPRESSED_TRAILER_MAGIC "LGZEND1\n"
+#define COMPRESSED_MAGIC_LENGTH 8
+#define COMPRESSED_HEADER 16
+#define COMPRESSED_BLOCK_HEADER 12
+#define COMPRESSED_TRAILER 32
+#define COMPRESSED_BLOCK_SIZE 262144
+
+// Codecs
+#define CODEC_LZ 1   // Built in LZ77 codec in the style of LZ4: fast, about 3-5x on log text
+#define CODEC_ZLIB 2 // zlib deflate, smaller files; only available when built with -DHAVE_ZLIB -lz
+
+// A compressed segment opened for reading
+struct compressedSegment
+{
+    int fd;
+    int codec;
+    uint32_t blockSize;
+    uint32_t blockCount;
+    uint64_t length;   // Bytes of the original segment
+    uint64_t *offsets; // Per block: file offset, then original offset
+};
+
+int compressedSegmentIsCompressed(int fd);
+int compressedCodecAvailable(int codec);
+long long compressedSegmentWrite(int in, int out, int codec, volatile sig_atomic_t *cancel);
+int compressedSegmentOpen(struct compressedSegment *segment, int fd);
+long compressedSegmentReadBlock(struct compressedSegment *segment, uint32_t block, char *out);
+uint32_t compressedSegmentFindBlock(const struct compressedSegment *segment, uint64_t offset);
+void compressedSegmentClose(struct compressedSegment *segment);
+
+#endif
@@ -0,0 +1,303 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include "segment_sidecar.h"
+#include "binary_segment.h"
+
+static void put32(unsigned char *p, uint32_t value)
+{
+    for (int i = 0; i < 4; i++)
+    {
+        p[i] = value >> (8 * i);
+    }
+}
+
+static uint32_t get32(const unsigned char *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static void put64(unsigned char *p, uint64_t value)
+{
+    put32(p, value);
+    put32(p + 4, value >> 32);
+}
+
+static uint64_t get64(const unsigned char *p)
+{
+    return get32(p) | ((uint64_t)get32(p + 4) << 32);
+}
+
+// Function to build the path of the index of a segment
+void sidecarPath(char *path, size_t size, const char *directory, const char *segmentName)
+{
+    snprintf(path, size, "%s/.%s.idx", directory, segmentName);
+}
+
+// Function to start a new span at 'offset'. The Bloom filter starts over too, and is complete only
+// when the segment is still empty.
+void sidecarReset(struct sidecarState *state, uint64_t offset)
+{
+    state->spanStart = offset;
+    state->records = 0;
+    state->minTime = INT64_MAX;
+    state->maxTime = INT64_MIN;
+    state->bloomComplete = (offset == 0);
+    memset(state->bloom, 0, sizeof(state->bloom));
+}
+
+// Function to take over the Bloom filter of a segment appended to again after a restart. Without one,
+// e.g. after a crash, the filter stays incomplete and the segment is not given one.
+int sidecarResume(struct sidecarState *state, const char *path)
+{
+    struct sidecarIndex index;
+
+    if (sidecarLoad(&index, path) != 0)
+    {
+        return -1;
+    }
+    if (index.hasBloom)
+    {
+        memcpy(state->bloom, index.bloom, sizeof(state->bloom));
+        state->bloomComplete = 1;
+    }
+    sidecarFree(&index);
+    return 0;
+}
+
+// Function to compute the bit positions of a key (FNV-1a, double hashing)
+static void bloomPositions(const char *key, size_t length, uint32_t positions[SIDECAR_BLOOM_HASHES])
+{
+    uint64_t hash = 14695981039346656037ull;
+
+    for (size_t i = 0; i < length; i++)
+    {
+        hash = (hash ^ (unsigned char)key[i]) * 1099511628211ull;
+    }
+    uint32_t h1 = hash, h2 = (hash >> 32) | 1;
+    for (int i = 0; i < SIDECAR_BLOOM_HASHES; i++)
+    {
+        positions[i] = (h1 + i * h2) % (SIDECAR_BLOOM_BYTES * 8);
+    }
+}
+
+// Function to add a client name or IP to a Bloom filter
+void sidecarBloomAdd(unsigned char *bloom, const char *key, size_t length)
+{
+    uint32_t positions[SIDECAR_BLOOM_HASHES];
+
+    bloomPositions(key, length, positions);
+    for (int i = 0; i < SIDECAR_BLOOM_HASHES; i++)
+    {
+        bloom[positions[i] / 8] |= 1 << (positions[i] % 8);
+    }
+}
+
+// Function to tell whether a client name or IP may be in a Bloom filter. 0 means it certainly is not.
+int sidecarBloomMayContain(const unsigned char *bloom, const char *key, size_t length)
+{
+    uint32_t positions[SIDECAR_BLOOM_HASHES];
+
+    bloomPositions(key, length, positions);
+    for (int i = 0; i < SIDECAR_BLOOM_HASHES; i++)
+    {
+        if ((bloom[positions[i] / 8] & (1 << (positions[i] % 8))) == 0)
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Function to account a batch of newline-terminated records about to be written: their count, the range
+// of their timestamps and their clients. A record may be split across slices anywhere but in its timestamp
+// and in its "Client (IP) - name: " prefix, which is how every writer hands them over.
+void sidecarObserve(struct sidecarState *state, const struct iovec *iov, int count)
+{
+    int i = 0;
+    size_t offset = 0; // Start of the next record in iov[i]
+
+    while (i < count)
+    {
+        if (offset == iov[i].iov_len)
+        {
+            i++;
+            offset = 0;
+            continue;
+        }
+        const char *p = (const char *)iov[i].iov_base + offset;
+        int64_t seconds;
+        state->records++;
+        if (binaryParseTimestamp(p, iov[i].iov_len - offset, &seconds))
+        {
+            state->minTime = (seconds < state->minTime) ? seconds : state->minTime;
+            state->maxTime = (seconds > state->maxTime) ? seconds : state->maxTime;
+            offset += BINARY_TIMESTAMP_LENGTH;
+            if (offset == iov[i].iov_len && i + 1 < count)
+            {
+                i++;
+                offset = 0;
+            }
+            const char *line = (const char *)iov[i].iov_base + offset;
+            const char *newline = memchr(line, '\n', iov[i].iov_len - offset);
+            size_t length = (newline != NULL) ? (size_t)(newline - line) : iov[i].iov_len - offset;
+            const char *ip, *name, *payload;
+            size_t ipLength, nameLength;
+            if (binarySplitClientRecord(line, length, &ip, &ipLength, &name, &nameLength, &payload))
+            {
+                sidecarBloomAdd(state->bloom, ip, ipLength);
+                sidecarBloomAdd(state->bloom, name, nameLength);
+            }
+        }
+
+        // Move past the newline ending the record
+        while (i < count)
+        {
+            const char *base = iov[i].iov_base;
+            const char *newline = memchr(base + offset, '\n', iov[i].iov_len - offset);
+            if (newline != NULL)
+            {
+                offset = newline - base + 1;
+                break;
+            }
+            i++;
+            offset = 0;
+        }
+    }
+}
+
+// Function to append the current span, ending at 'end', to the index of the segment, and start the next one.
+// 'final' closes the segment: its Bloom filter is appended too, when it is complete. It returns -1 on failure.
+int sidecarWrite(struct sidecarState *state, const char *path, uint64_t end, int final)
+{
+    unsigned char entries[SIDECAR_MAGIC_LENGTH + 2 * SIDECAR_ENTRY_HEADER + SIDECAR_SPAN_LENGTH + SIDECAR_BLOOM_BYTES];
+    unsigned char *p = entries;
+    struct stat st;
+    int result = 0;
+
+    int fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (fd < 0)
+    {
+        return -1;
+    }
+    if (fstat(fd, &st) == 0 && st.st_size == 0)
+    {
+        memcpy(p, SIDECAR_MAGIC, SIDECAR_MAGIC_LENGTH);
+        p += SIDECAR_MAGIC_LENGTH;
+    }
+    if (end > state->spanStart)
+    {
+        put32(p, SIDECAR_SPAN);
+        put32(p + 4, SIDECAR_SPAN_LENGTH);
+        put64(p + 8, state->spanStart);
+        put64(p + 16, end);
+        put64(p + 24, state->minTime);
+        put64(p + 32, state->maxTime);
+        put32(p + 40, state->records);
+        put32(p + 44, 0);
+        p += SIDECAR_ENTRY_HEADER + SIDECAR_SPAN_LENGTH;
+    }
+    if (final && state->bloomComplete)
+    {
+        put32(p, SIDECAR_BLOOM);
+        put32(p + 4, SIDECAR_BLOOM_BYTES);
+        memcpy(p + SIDECAR_ENTRY_HEADER, state->bloom, SIDECAR_BLOOM_BYTES);
+        p += SIDECAR_ENTRY_HEADER + SIDECAR_BLOOM_BYTES;
+    }
+    // One write, so a crash leaves at most the last entry torn, which readers ignore
+    if (p > entries && write(fd, entries, p - entries) != p - entries)
+    {
+        result = -1;
+    }
+    close(fd);
+
+    state->spanStart = end;
+    state->records = 0;
+    state->minTime = INT64_MAX;
+    state->maxTime = INT64_MIN;
+    return result;
+}
+
+// Function to read the index of a segment. It returns -1 when there is none; a torn or unknown
+// entry ends it.
+int sidecarLoad(struct sidecarIndex *index, const char *path)
+{
+    struct stat st;
+    uint32_t capacity = 0;
+
+    memset(index, 0, sizeof(*index));
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+    {
+        return -1;
+    }
+    unsigned char *data = NULL;
+    if (fstat(fd, &st) != 0 || st.st_size < SIDECAR_MAGIC_LENGTH || (data = malloc(st.st_size)) == NULL ||
+        pread(fd, data, st.st_size, 0) != st.st_size || memcmp(data, SIDECAR_MAGIC, SIDECAR_MAGIC_LENGTH) != 0)
+    {
+        free(data);
+        close(fd);
+        return -1;
+    }
+    close(fd);
+
+    const unsigned char *p = data + SIDECAR_MAGIC_LENGTH, *end = data + st.st_size;
+    while (end - p >= SIDECAR_ENTRY_HEADER)
+    {
+        uint32_t type = get32(p), length = get32(p + 4);
+        const unsigned char *body = p + SIDECAR_ENTRY_HEADER;
+        if ((size_t)(end - body) < length)
+        {
+            break;
+        }
+        if (type == SIDECAR_SPAN && length == SIDECAR_SPAN_LENGTH)
+        {
+            if (index->count == capacity)
+            {
+                capacity = (capacity > 0) ? capacity * 2 : 64;
+                struct sidecarSpan *spans = realloc(index->spans, capacity * sizeof(struct sidecarSpan));
+                if (spans == NULL)
+                {
+                    break;
+                }
+                index->spans = spans;
+            }
+            struct sidecarSpan *span = &index->spans[index->count++];
+            span->offset = get64(body);
+            span->end = get64(body + 8);
+            span->minTime = get64(body + 16);
+            span->maxTime = get64(body + 24);
+            span->records = get32(body + 32);
+            index->hasBloom = 0;
+        }
+        else if (type == SIDECAR_BLOOM && length == SIDECAR_BLOOM_BYTES)
+        {
+            memcpy(index->bloom, body, SIDECAR_BLOOM_BYTES);
+            index->hasBloom = 1;
+        }
+        else
+        {
+            break;
+        }
+        p = body + length;
+    }
+    // Whatever ended the index may have held clients the filter lacks
+    if (p < end)
+    {
+        index->hasBloom = 0;
+    }
+    free(data);
+    return 0;
+}
+
+// Function to release what sidecarLoad() allocated
+void sidecarFree(struct sidecarIndex *index)
+{
+    free(index->spans);
+    index->spans = NULL;
+    index->count = 0;
+}
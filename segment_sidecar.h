@@ -0,0 +1,72 @@
+#ifndef SEGMENT_SIDECAR_H
+#define SEGMENT_SIDECAR_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+// Sparse index written next to each segment as ".<segment name>.idx", appended to by the writer. Integers are little-endian.
+//
+//     header:  SIDECAR_MAGIC (8 bytes)
+//     entries: type (4 bytes) | body length (4 bytes) | body
+//     SIDECAR_SPAN   offset (8 bytes) | end (8 bytes) | earliest time (8 bytes) | latest time (8 bytes) | records (4 bytes) | 4 zero bytes
+//     SIDECAR_BLOOM  Bloom filter of the client names and IPs of the whole segment
+// A span covers the records written between two offsets of the segment, every index_interval records, and the range
+// of their timestamps; times are the wall clock seconds of binary_segment.h. Offsets are those of the segment as
+// written, which a compressed segment still answers through its block index. A Bloom filter is only valid as the
+// last entry: the writer adds one when it closes a segment and spans appended after it, by a restart, void it
+// until the next one. Bytes no span covers, like the tail left by a crash, are simply not indexed.
+#define SIDECAR_MAGIC "LGIDX01\n"
+#define SIDECAR_MAGIC_LENGTH 8
+#define SIDECAR_ENTRY_HEADER 8
+#define SIDECAR_SPAN_LENGTH 40
+
+// Entry types
+#define SIDECAR_SPAN 1
+#define SIDECAR_BLOOM 2
+
+#define SIDECAR_BLOOM_BYTES 4096 // 32768 bits: about 0.1% false positives for 1024 clients, each with a name and an IP
+#define SIDECAR_BLOOM_HASHES 6
+
+// A span of the index
+struct sidecarSpan
+{
+    uint64_t offset;
+    uint64_t end;
+    int64_t minTime; // INT64_MAX when no record of the span has a timestamp
+    int64_t maxTime;
+    uint32_t records;
+};
+
+// What the writer gathers for the index of the active segment. The server keeps it in shared memory
+// next to the segment state, so every process writing under the semaphore extends the same span.
+struct sidecarState
+{
+    uint64_t spanStart;
+    uint32_t records;
+    int64_t minTime;
+    int64_t maxTime;
+    int bloomComplete; // The filter holds every client of the segment, so it may be written
+    unsigned char bloom[SIDECAR_BLOOM_BYTES];
+};
+
+// The index of a segment, as read back
+struct sidecarIndex
+{
+    struct sidecarSpan *spans;
+    uint32_t count;
+    int hasBloom;
+    unsigned char bloom[SIDECAR_BLOOM_BYTES];
+};
+
+void sidecarPath(char *path, size_t size, const char *directory, const char *segmentName);
+void sidecarReset(struct sidecarState *state, uint64_t offset);
+int sidecarResume(struct sidecarState *state, const char *path);
+void sidecarObserve(struct sidecarState *state, const struct iovec *iov, int count);
+int sidecarWrite(struct sidecarState *state, const char *path, uint64_t end, int final);
+void sidecarBloomAdd(unsigned char *bloom, const char *key, size_t length);
+int sidecarBloomMayContain(const unsigned char *bloom, const char *key, size_t length);
+int sidecarLoad(struct sidecarIndex *index, const char *path);
+void sidecarFree(struct sidecarIndex *index);
+
+#endif
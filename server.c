@@ -1,6 +1,8 @@
+#define _GNU_SOURCE
 #include <sys/types.h>
 #include <netinet/in.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <arpa/inet.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -18,33 +20,431 @@
 #include <limits.h>
 #include <getopt.h>
 #include <dirent.h>
+#include <sys/epoll.h>
+#include <sys/uio.h>
+#include <sys/ioctl.h>
+#include <sys/eventfd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <sys/file.h>
+#include <sys/prctl.h>
+#include <sys/resource.h>
+#include "record_ring.h"
+#include "protocol.h"
+#include "scan.h"
+#include "manifest.h"
+#include "uring.h"
+#include "binary_segment.h"
+#include "segment_compress.h"
+#include "segment_sidecar.h"
+#include "shm_ingest.h"
+#include "stats.h"
 #define MAX_CONFIG_LINE_LENGTH 1000
+#define MAX_EPOLL_EVENTS 256
+#define CONNECTION_BUFFER_SIZE (PROTOCOL_FRAME_HEADER + PROTOCOL_MAX_FRAME) // Holds one complete binary frame
+#define TEXT_READ_SIZE 16384                                                 // Room for new data in a text connection buffer
+#define CONNECTION_PREFIX_SIZE (CLIENT_ADDRESS_LENGTH + PROTOCOL_MAX_NAME + 16) // "Client (IP) - name: " at its longest
+#define RECORD_PREFIX_ROOM (CONNECTION_PREFIX_SIZE + 64)                        // Timestamp, prefix and newline of a record
+#define CONNECTIONS_PER_SLAB 256 // Connection states a reactor allocates at a time
+#define BUFFER_POOL_KEEP 64      // Free read buffers of each size a reactor keeps for the next busy connections
+
+// How much of a text connection's buffer processLines() may consume
+#define PARSE_MORE 0    // More data is on its way: keep an incomplete last line
+#define PARSE_DRAINED 1 // The socket is drained: a legacy client's pending bytes are one message
+#define PARSE_EOF 2     // The client closed the connection: whatever is left is the last line
+
+// Values of the server_mode configuration key
+#define SERVER_MODE_FORK 0  // One child process per client (default)
+#define SERVER_MODE_EPOLL 1 // One process serving every client from an epoll event loop
+#define SERVER_MODE_URING 2 // One thread serving every client and writing the log through io_uring
+
+// Values of the ring_full_policy configuration key
+#define RING_FULL_BLOCK 0 // Wait until the writer frees a slot (default)
+#define RING_FULL_DROP 1  // Discard the record
+#define RING_FULL_COUNT 2 // Discard the record and log how many were discarded
+
+// Values of the fsync_policy configuration key
+#define FSYNC_NONE 0     // Leave write-back to the kernel (default)
+#define FSYNC_BATCH 1    // fdatasync() after every batch
+#define FSYNC_INTERVAL 2 // fdatasync() at most every fsync_interval_ms while there is unsynced data
+
+// Values of the segment_format configuration key
+#define SEGMENT_FORMAT_TEXT 0   // One formatted line per record (default)
+#define SEGMENT_FORMAT_BINARY 1 // Checksummed blocks of dictionary encoded records, see binary_segment.h
+
+#define UDP_BATCH 32 // Datagrams pulled by one recvmmsg()
+
+#define SHM_INGEST_BATCH 256    // Records taken from a lane of the shared-memory ingest before the sockets get their turn
+#define SHM_INGEST_SWEEP_MS 1000 // How often lanes are checked for processes that died without detaching
+#define SHM_INGEST_LINGER_MS 10  // After the last record the lanes are polled this long before producers have to ring
+#define SHM_INGEST_NAP_MS 1      // in naps of this long
+
+// Datagram sockets of a reactor
+#define DATAGRAM_UDP 0  // udp_port
+#define DATAGRAM_UNIX 1 // unix_datagram_socket
+#define DATAGRAM_SOCKETS 2
+
+#define CLIENT_ADDRESS_LENGTH 32 // An IPv4 address, or "uid=<uid>,pid=<pid>" for a client on an AF_UNIX socket
+
+#define SEGMENT_HEADROOM 65536 // Preallocated beyond log_file_threshold, since the last batch of a segment may cross it
+
+// user_data of the uring mode's requests that are not connection reads, which carry the connection pointer
+#define URING_ACCEPT 1
+#define URING_CONTROL 2
+#define URING_WRITE 3
+#define URING_DATAGRAMS 4 // Plus the index of the datagram socket
+#define URING_UNIX_ACCEPT 6
+#define URING_SHM_INGEST 7
+#define URING_ENTRIES 256
 
 // Set global variables to default values
 int LOG_FILE_THRESHOLD = 1048576; // 1 MB
 int MAX_LOG_FILES = 4;
+int SERVER_MODE = SERVER_MODE_FORK;
+int MAX_LINE_LENGTH = 1024; // Longest text protocol line, longer lines are split into several records
+int WORKERS = 0;      // Reactor threads of the epoll mode, 0 serves everything from the main thread
+int RING_SLOTS = 1024; // Slots of each ring handing records to the writer stage
+int WRITER_PROCESS = 0; // In the fork mode, hand records to a dedicated log writer process through a shared ring
+int MMAP_SEGMENTS = 0;  // Preallocate each segment and copy records into a shared mapping of it instead of write()
+int URING_CONNECTIONS = 256; // Connections of the uring mode that read into registered buffers, others use plain receives
+int RING_FULL_POLICY = RING_FULL_BLOCK;
+int BATCH_RECORDS = IOV_MAX;  // The writer stage flushes once a batch holds this many records...
+int BATCH_BYTES = 1048576;    // ...or this many bytes...
+int FLUSH_INTERVAL_MS = 0;    // ...or its first record waited this long, 0 flushes as soon as the rings are empty
+int FSYNC_POLICY = FSYNC_NONE;
+int FSYNC_INTERVAL_MS = 1000;
+int SEGMENT_FORMAT = SEGMENT_FORMAT_TEXT;
+int COMPRESS_WORKERS = 0; // Processes compressing rotated segments in the background, 0 keeps them as they are
+#ifdef HAVE_ZLIB
+int COMPRESS_CODEC = CODEC_ZLIB;
+#else
+int COMPRESS_CODEC = CODEC_LZ;
+#endif
+int INDEX_INTERVAL = 1024; // Records per span of the sidecar index of each segment, 0 writes no index
+long long MAX_LOG_BYTES = 0; // Retention also removes the oldest segments once the rotated ones hold this many bytes, 0 for no limit
+int SHARDS = 1; // Independent streams the log is split into, each in a shard-<i> subdirectory when more than one
+int UDP_PORT = 0; // Port of the datagram listener next to the TCP one, 0 for none
+char UNIX_SOCKET[108] = "";          // Path of the AF_UNIX stream listener next to the TCP one, empty for none
+char UNIX_DATAGRAM_SOCKET[108] = ""; // Path of the AF_UNIX datagram listener, empty for none
+char SHM_INGEST[64] = "";  // Name of the shared-memory ingest object, see shm_ingest.h, empty for none
+int SHM_INGEST_LANES = 16;  // Producer processes it takes at once
+int SHM_INGEST_SLOTS = 1024;// Records each of them may have waiting, a power of two
+char STATS_FILE[256] = "";  // Where SIGHUP writes a snapshot of the instrumentation, see stats.h, empty turns it off
 #define SEM_NAME "logSyncSem"
 
 sem_t *sem_ptr; // Global semaphore pointer
 
+// State of the active log segment of a stream. It lives in an anonymous shared mapping
+// created before the first fork(), so every client process sees the same
+// segment name, size and generation while it holds the stream's semaphore.
+struct logSegmentState
+{
+    char activeFile[128];     // File name of the active segment
+    off_t activeSize;         // Bytes written to the active segment
+    unsigned long generation; // Bumped on every rotation
+    struct segmentIndex *segments; // Every segment oldest first, in its own shared mapping
+    off_t preallocatedSize;   // mmap_segments: size the active segment is preallocated to, 0 before its first write
+    atomic_llong storedBytes; // Bytes of the rotated segments on disk, compressed or not
+    sem_t lock;               // Serializes the writers of the streams after the first, which uses sem_ptr
+};
+
+// One stream of the log: a log directory with its own active segment, rotation, retention and index.
+// The log is a single stream unless shards=N splits it, and streams never wait on each other.
+// The array lives in private memory, so each process keeps its own descriptor and mapping of every stream.
+struct logStream
+{
+    int number;
+    char directory[256];
+    sem_t *sem;                          // Held while writing directly to the stream
+    struct logSegmentState *state;       // Shared segment state
+    struct binaryDictionary *dictionary; // segment_format=binary: connections of the active segment, shared
+    struct sidecarState *sidecar;        // Index of the active segment being gathered, shared; NULL without index
+    struct writerStage *writer;          // Writer process fed by logHandlerSlices() in the fork mode, NULL to write directly
+    int fd;                    // This process' descriptor of the active segment
+    unsigned long fdGeneration; // Generation fd was opened for
+    int dirty;                 // This process wrote to fd since its last fdatasync()
+    long long lastSync;        // Monotonic time of that fdatasync(), in milliseconds
+    char *map;                 // mmap_segments: this process' mapping of the active segment
+    size_t mapLength;
+    int writtenTraces;         // Traced records this process wrote and did not sync yet, first in 'traces'
+    int numberOfTraces;        // With those of the batch it writes next
+    int traces[STATS_TRACE_PENDING];
+};
+
+// Entry of the compression queue: a rotated segment of a stream
+struct compressionEntry
+{
+    int stream;
+    char name[SEGMENT_NAME_LENGTH];
+};
+
+struct logStream *logStreams; // SHARDS streams
+int compressionQueueFd = -1;      // Write end of the pipe queueing rotated segment names for the compression workers
+pid_t *compressionWorkers = NULL; // Compression worker processes, forked by the main process
+volatile sig_atomic_t compressionStop = 0; // Set in a compression worker asked to exit
+
+// Per-connection state of the epoll event loop. Idle connections cost only this struct.
+struct connection
+{
+    int fd;
+    int named;           // Set once the client name is known
+    int binary;          // Set when the client opened with the binary protocol handshake
+    int lineMode;        // Text clients: set once a newline was seen, lines are then split on '\n' only
+    int local;           // Set for a client of an AF_UNIX socket
+    int stream;          // Stream its records go to when written directly, picked from the client once named
+    char *buffer;        // Bytes received but not parsed yet. The epoll mode lends it only while some are pending.
+    size_t bufferLength;
+    size_t bufferCapacity;
+    char *prefix;        // "Client (IP) - name: ", built once the client is named
+    unsigned short prefixLength;
+    unsigned short nameOffset; // The client name, within the prefix
+    unsigned short nameLength;
+    unsigned short traceIndex; // The record of the next frame 'trace' is for
+    char clientIP[CLIENT_ADDRESS_LENGTH]; // Its credentials for a local client
+    struct statsClient *statsClient; // Where its records are counted, NULL while stats are off
+    unsigned int statsRecords;       // Records not counted there yet
+    int trace;                       // Trace of a record of the next frame of records, 0 for none
+    struct connection *prev;
+    struct connection *next;
+};
+
+// A slab of connection states. A reactor carves its connections out of slabs and keeps the closed ones for the next clients.
+struct connectionSlab
+{
+    struct connectionSlab *next;
+    struct connection connections[CONNECTIONS_PER_SLAB];
+};
+
+// Read buffers of a reactor not lent to a connection: text line buffers and binary frame buffers.
+// A free buffer holds the pointer to the next one.
+struct bufferPool
+{
+    char *free[2];
+    int count[2];
+};
+
+// A datagram socket, UDP or AF_UNIX, and the buffers one recvmmsg() fills, a datagram each
+struct datagramReceiver
+{
+    int fd;
+    int local;     // AF_UNIX: senders are known by the credentials coming with each datagram
+    char *buffers; // UDP_BATCH buffers of PROTOCOL_MAX_DATAGRAM bytes
+    struct mmsghdr messages[UDP_BATCH];
+    struct iovec iov[UDP_BATCH];
+    struct sockaddr_in senders[UDP_BATCH];
+    char control[UDP_BATCH][CMSG_SPACE(sizeof(uint32_t)) + CMSG_SPACE(sizeof(struct ucred))];
+    uint32_t overflows; // Datagrams the kernel dropped on this socket so far, as SO_RXQ_OVFL last reported
+};
+
+// Counters of the datagram listener, in shared memory since the fork mode receives in a child process.
+// They are logged when the server shuts down.
+struct datagramCounters
+{
+    atomic_ulong received;  // Datagrams read from the sockets
+    atomic_ulong malformed; // Datagrams discarded: truncated, or not laid out as protocol.h describes
+    atomic_ulong dropped;   // Datagrams the kernel discarded because a socket buffer was full
+};
+
+struct datagramCounters *datagramCounters = NULL;
+
+// The shared-memory ingest as the server sees it: the mapping, and the state of the client of each lane.
+// It is drained by the first reactor, or by a child process of its own in the fork mode.
+struct sharedIngest
+{
+    struct shmIngestHeader *header;
+    size_t size;
+    struct connection *lanes; // Named when the server first sees their lane attached
+    int wakeFd;               // eventfd rung by the waker thread when a producer rang the doorbell
+    long long lastRecord;     // When records were last drained, in milliseconds
+    pthread_t waker;
+};
+
+struct sharedIngest *sharedIngest = NULL;
+
+// State of one epoll event loop. The epoll mode runs one on the main thread, workers=N runs one per thread.
+struct reactor
+{
+    int epollFd;
+    int serverSocket;
+    int controlFd;                  // stdin on the main thread, an eventfd waking the worker on shutdown otherwise
+    struct connection *connections; // Open connections, closed on shutdown
+    struct connectionSlab *slabs;   // Where the connections live, freed with the reactor
+    struct connection *freeConnections; // Closed connections, linked through 'next'
+    struct bufferPool buffers;
+    struct recordRing **rings;      // Hand-off to the writer stage, one ring per stream, NULL to write the log directly
+    struct writerStage *writers;    // The writer of each stream
+    struct uringLoop *uring;        // uring mode: records are staged for its asynchronous log writes
+    int unixSocket;                 // AF_UNIX listening socket, shared by every reactor, -1 without one
+    struct datagramReceiver *datagrams[DATAGRAM_SOCKETS]; // The reactor's datagram sockets, NULL when not configured
+    struct sharedIngest *ingest;    // Drained by this reactor, NULL for none
+    int cpu;                        // Core the worker thread is pinned to
+    pthread_t thread;
+};
+
+// The writer stage owns the active segment and drains the rings filled by the reactors.
+// It is allocated in shared memory so the flags can also be shared with forked processes.
+struct writerStage
+{
+    struct recordRing **rings;
+    int numberOfRings;
+    int wakeFd;          // eventfd the writer sleeps on when every ring is empty
+    atomic_int sleeping; // Set while the writer is about to sleep, producers then post wakeFd
+    atomic_int stop;     // Set once no producer is left, the writer exits when the rings are empty
+    atomic_ulong dropped; // Records discarded by the RING_FULL_COUNT policy, not logged yet
+    int lifelineFd;       // Writer process only: read end of a pipe that hangs up when every producer has exited
+    struct logStream *stream; // The stream it owns
+    pthread_t thread;
+};
+
+// State of the uring mode. Connection reads and log writes are io_uring requests, submitted and reaped
+// with one io_uring_enter() per loop. Reads target registered buffers, writes a registered buffer and file.
+struct uringLoop
+{
+    struct uring ring;
+    struct reactor reactor;       // Connections, shared with the epoll code paths
+    struct logStream *stream;     // The uring mode writes a single stream
+    char *slots;                  // URING_CONNECTIONS connection buffers, registered as one buffer
+    size_t slotSize;
+    int *freeSlots;
+    int numberOfFreeSlots;
+    char *staging[2];             // Registered buffers collecting formatted records: one fills while the other is written
+    size_t stagingLength[2];
+    size_t stagingSize;
+    int filling;                  // Staging buffer new records go to
+    int writing;                  // Staging buffer being written, -1 when no write is in flight
+    size_t written;               // Bytes of it written so far
+    struct io_uring_cqe *deferred; // Completions set aside while waiting for a write
+    int numberOfDeferred;
+    int deferredCapacity;
+    struct sockaddr_in clientAddr; // Filled by the pending accept
+    socklen_t clientLen;
+    char control[1024];           // Filled by the pending read of stdin
+    long long writeStarted;       // When the write in flight was queued, 0 when it is not timed
+    int traces[2][STATS_TRACE_PENDING]; // Traced records of each staging buffer
+    int numberOfTraces[2];
+};
+
+int lifelineWriteFd = -1; // Write end of the writer processes' lifeline, held by the parent and every client process
+int unixServerSocket = -1; // AF_UNIX listening socket of unix_socket, -1 without one
+
 // Declaration of the functions
 void error(const char *msg);
 off_t getFileSize(const char *filename);
-void deleteOldestLogFile(const char *directory);
-int findMostRecentLogFile(const char *directory, char *mostRecentFile, size_t len);
-int openMostRecentLogFile(const char *directory);
-int findNumberOfLogFiles(const char *directory);
 int readConfig(int *port, char *directory);
-int createLogFile(const char *directory);
-int rotateLog(const char *directory);
-void clientHandler(int clientSocket, struct sockaddr_in clientAddr, const char *directory);
-void logHandler(const char *message, const char *directory);
-void serverListenLoop(int serverSocket, const char *logFileDirectory);
+int createLogFile(struct logStream *stream);
+int rotateLog(struct logStream *stream);
+void initLogStreams(const char *directory);
+void initLogSegmentState(struct logStream *stream);
+void setActiveLogFile(struct logStream *stream, int log_fd, const char *fileName);
+int copyToMappedSegment(struct logStream *stream, const struct iovec *iov, int count);
+void closeLogSegment(struct logStream *stream);
+void recoverSegmentEnd(struct logStream *stream, const char *filePath);
+void writeLogSidecar(struct logStream *stream, int final);
+int clientStream(const char *clientIP, const char *clientName, size_t nameLength);
+void startCompressionWorkers(void);
+void stopCompressionWorkers(void);
+void queueCompression(struct logStream *stream, const char *fileName);
+void compressionWorker(int queueFd, int number);
+void compressSegmentFile(struct logStream *stream, const char *fileName, const char *tempPath);
+off_t removeSegmentFile(const char *filePath);
+long long rotatedSegmentBytes(struct logStream *stream);
+void clientHandler(int clientSocket, const struct sockaddr_in *clientAddr);
+void logHandler(struct logStream *stream, const char *message);
+void logHandlerSlices(struct logStream *stream, struct iovec *slices, int count);
+int writeLogRecord(struct logStream *stream, const char *record, size_t length);
+int openActiveLogFile(struct logStream *stream);
+int writeLogBatch(struct logStream *stream, struct iovec *iov, int count);
+int encodeBinaryBatch(struct logStream *stream, struct iovec **iov, int *count);
+void syncLogSegment(struct logStream *stream);
+void traceLogRecord(struct logStream *stream, int trace);
+void logTracesWritten(struct logStream *stream);
+void cancelLogTraces(struct logStream *stream);
+int logSyncDueIn(struct logStream *stream);
+long long currentTimeMillis(void);
+void *allocateShared(size_t size);
+int openListeningSocket(int portNo);
+void raiseFileLimit(void);
+void serverListenLoop(int serverSocket);
+void serverEpollLoop(int serverSocket);
+void serverWorkersLoop(int serverSocket, int portNo);
+void serverUringLoop(int serverSocket);
+struct io_uring_sqe *uringSqe(struct uringLoop *loop);
+void uringArmAccept(struct uringLoop *loop, int local);
+void uringArmControl(struct uringLoop *loop);
+void uringArmRead(struct uringLoop *loop, struct connection *conn);
+void uringHandleCompletion(struct uringLoop *loop, const struct io_uring_cqe *cqe);
+void uringAcceptDone(struct uringLoop *loop, int clientSocket, int local);
+void uringReadDone(struct uringLoop *loop, struct connection *conn, int result);
+void uringCloseConnection(struct uringLoop *loop, struct connection *conn);
+void uringQueueRecord(struct uringLoop *loop, const struct iovec *slices, int count);
+void uringFlush(struct uringLoop *loop);
+void uringTraceRecord(struct uringLoop *loop, int trace);
+void uringHandOverTraces(struct uringLoop *loop, int buffer);
+void uringSubmitWrite(struct uringLoop *loop);
+void uringWriteDone(struct uringLoop *loop, int result);
+void uringWaitForWrite(struct uringLoop *loop);
+void *reactorThread(void *arg);
+void runReactor(struct reactor *reactor);
+void acceptConnections(struct reactor *reactor, int listeningSocket);
+int readConnection(struct reactor *reactor, struct connection *conn);
+void closeConnection(struct reactor *reactor, struct connection *conn);
+struct connection *allocateConnection(struct reactor *reactor);
+char *borrowBuffer(struct reactor *reactor, size_t capacity);
+void returnBuffer(struct reactor *reactor, char *buffer, size_t capacity);
+void freeReactorMemory(struct reactor *reactor);
+int receiveData(struct reactor *reactor, struct connection *conn, ssize_t bytesRead);
+int parseReceivedData(struct reactor *reactor, struct connection *conn, ssize_t bytesRead);
+int isBinaryHandshake(const char *data, size_t length);
+int startBinaryConnection(struct reactor *reactor, struct connection *conn);
+int processFrames(struct reactor *reactor, struct connection *conn);
+int processLines(struct reactor *reactor, struct connection *conn, int mode);
+int handleLine(struct reactor *reactor, struct connection *conn, const char *line, size_t length);
+void setConnectionPeer(struct connection *conn, const struct sockaddr_in *clientAddr);
+void formatCredentials(char *clientIP, size_t size, const struct ucred *credentials);
+int setConnectionName(struct connection *conn, const char *name, size_t length);
+void logClientRecord(struct reactor *reactor, struct connection *conn, time_t t, const char *payload, size_t length);
+void logConnectionEvent(struct reactor *reactor, struct connection *conn, const char *event);
+int openUnixSocket(const char *path, int type);
+struct datagramReceiver *openDatagramReceiver(int portNo);
+struct datagramReceiver *newDatagramReceiver(int fd, int local);
+void openDatagramReceivers(struct datagramReceiver **receivers, int first);
+void closeDatagramReceiver(struct datagramReceiver *receiver);
+void receiveDatagrams(struct reactor *reactor, struct datagramReceiver *receiver);
+int logDatagram(struct reactor *reactor, const unsigned char *data, size_t length, const char *clientIP, int local);
+void datagramHandler(struct datagramReceiver **receivers);
+void logDatagramCounters(void);
+void uringArmDatagrams(struct uringLoop *loop, int socket);
+void openSharedIngest(void);
+void closeSharedIngest(void);
+void startIngestWaker(struct reactor *reactor);
+void stopIngestWaker(struct reactor *reactor);
+void *ingestWakerThread(void *arg);
+int drainSharedIngest(struct reactor *reactor);
+int sharedIngestTimeout(struct reactor *reactor);
+void releaseIngestLane(struct reactor *reactor, int lane);
+int sweepSharedIngest(struct sharedIngest *ingest);
+void sharedIngestHandler(void);
+void uringArmIngest(struct uringLoop *loop);
+void submitLogMessage(struct reactor *reactor, int stream, const char *logMessage);
+void submitLogSlices(struct reactor *reactor, int stream, struct iovec *slices, int count);
+void *writerThread(void *arg);
+void wakeWriter(struct writerStage *writer);
+void pushLogRecord(struct writerStage *writer, struct recordRing *ring, const struct iovec *slices, int count);
+void startWriterProcesses(void);
+void fitLinesToRing(void);
 void getCurrentTime(char *timeStr);
+void formatTime(char *timeStr, time_t t);
+const char *cachedTimestamp(time_t t, size_t *length);
 void handleSigchild(int sig);
 void handleSigUser1(int sig);
 void handleSigUser2(int sig);
 void handleSigINT(int sig);
+void handleSigTerm(int sig);
+void handleSigHup(int sig);
+void checkStatsRequest(void);
+void writeStatsFile(void);
 
 volatile int n_connections = 0;
 volatile int husr2 = 1;
@@ -52,11 +452,12 @@ volatile int husr2 = 1;
 // Declare a volatile flag for safely handling the termination of the program.
 // 'volatile' tells the compiler the value of the variable can change at any time even in the presence of asynchronous interrupts made by signals.
 volatile sig_atomic_t terminate = 0;
+volatile sig_atomic_t statsRequested = 0; // Set by SIGHUP, the main loops write the stats file
 
 int main(int argc, char *argv[])
 {
     int serverSocket, clientSocket, portNo;
-    struct sockaddr_in serverAddr, clientAddr;
+    struct sockaddr_in clientAddr;
     socklen_t clientLen = sizeof(clientAddr);
     char logFileDirectory[128];
     char shutDownServer[128];
@@ -64,9 +465,9 @@ int main(int argc, char *argv[])
     char startCloseMsg[256];
 
     // define the signls
-    struct sigaction sigUsr1Action;
-    struct sigaction sigchldAction;
-    struct sigaction sigINTaction;
+    struct sigaction sigUsr1Action = {0};
+    struct sigaction sigchldAction = {0};
+    struct sigaction sigINTaction = {0};
     sigUsr1Action.sa_handler = &handleSigUser1;
     sigchldAction.sa_handler = &handleSigchild;
     sigINTaction.sa_handler = &handleSigINT;
@@ -99,58 +500,107 @@ int main(int argc, char *argv[])
         strcpy(logFileDirectory, argv[2]);
     }
 
-    // Create a TCP socket
-    serverSocket = socket(AF_INET, SOCK_STREAM, 0);
-    if (serverSocket < 0)
+    // Counters of every stage, shared with the processes forked from now on; SIGHUP writes them out
+    if (STATS_FILE[0] != '\0')
     {
-        error("ERROR opening socket");
+        if (statsInit() != 0)
+        {
+            error("Error mapping the stats");
+        }
+        statsAttach("main");
+        struct sigaction sigHupAction = {0};
+        sigHupAction.sa_handler = &handleSigHup;
+        sigaction(SIGHUP, &sigHupAction, NULL);
     }
-
-    // Set up the server address structure
-    memset(&serverAddr, 0, sizeof(serverAddr));
-    serverAddr.sin_family = AF_INET;
-    serverAddr.sin_addr.s_addr = INADDR_ANY;
-    serverAddr.sin_port = htons(portNo);
-
-    // Set socket option to allow immediate reuse of the address and port
-    // This option enables the server to restart immediately after shutdown
-    // without waiting for the TIME_WAIT period to expire.
-    int optval = 1;
-    setsockopt(serverSocket, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval));
-    // Bind socket to an address
-
-    if (bind(serverSocket, (struct sockaddr *)&serverAddr, sizeof(serverAddr)) < 0)
+    // The uring mode stages every record for one registered file
+    if (SERVER_MODE == SERVER_MODE_URING && SHARDS > 1)
     {
-        error("ERROR on binding");
+        fprintf(stderr, "Warning: the uring mode writes a single stream, ignoring shards=%d\n", SHARDS);
+        SHARDS = 1;
+    }
+    // Find the active segment of each stream once; from now on it is tracked in memory
+    initLogStreams(logFileDirectory);
+    // Forked before the listening socket exists, so the workers hold nothing but the queue
+    startCompressionWorkers();
+    // The datagram counters are updated by whichever thread or process receives, and logged at shut down
+    if (UDP_PORT > 0 || UNIX_DATAGRAM_SOCKET[0] != '\0')
+    {
+        datagramCounters = allocateShared(sizeof(struct datagramCounters));
+    }
+    // Local producers may also append to shared memory, named like the semaphore in /dev/shm
+    if (SHM_INGEST[0] != '\0')
+    {
+        openSharedIngest();
     }
 
-    // Listen for connections
-    int listenfd = listen(serverSocket, 100);
-    if (listenfd < 0)
+    // One process holds every connection outside the fork mode: allow as many descriptors as the hard limit does
+    if (SERVER_MODE != SERVER_MODE_FORK)
     {
-        error("Listen error");
+        raiseFileLimit();
     }
+    // Create the TCP socket and listen for connections
+    serverSocket = openListeningSocket(portNo);
     // get the current time of starting up the server
     getCurrentTime(startUpServer);
     snprintf(startCloseMsg, sizeof(startCloseMsg), "[%s] Server start up.\n", startUpServer);
     // Write on the log file.
-    logHandler(startCloseMsg, logFileDirectory);
+    logHandler(&logStreams[0], startCloseMsg);
 
     // Set server socket to non-blocking
     int flags = fcntl(serverSocket, F_GETFL, 0);
     // Make the socket non-blocking
     fcntl(serverSocket, F_SETFL, flags | O_NONBLOCK);
+    // Clients on the same host may skip TCP/IP and connect to a path instead
+    if (UNIX_SOCKET[0] != '\0')
+    {
+        unixServerSocket = openUnixSocket(UNIX_SOCKET, SOCK_STREAM);
+    }
     // The main loop of the server
-    serverListenLoop(serverSocket, logFileDirectory);
+    if (SERVER_MODE == SERVER_MODE_EPOLL && WORKERS > 0)
+    {
+        serverWorkersLoop(serverSocket, portNo);
+    }
+    else if (SERVER_MODE == SERVER_MODE_EPOLL)
+    {
+        serverEpollLoop(serverSocket);
+    }
+    else if (SERVER_MODE == SERVER_MODE_URING)
+    {
+        serverUringLoop(serverSocket);
+    }
+    else
+    {
+        serverListenLoop(serverSocket);
+    }
+    logDatagramCounters();
+    if (unixServerSocket != -1)
+    {
+        close(unixServerSocket);
+        unlink(UNIX_SOCKET);
+    }
+    if (UNIX_DATAGRAM_SOCKET[0] != '\0')
+    {
+        unlink(UNIX_DATAGRAM_SOCKET);
+    }
+    closeSharedIngest();
     // Get the current time of shutting down the server
     getCurrentTime(shutDownServer);
     snprintf(startCloseMsg, sizeof(startCloseMsg), "[%s] Server shut down.\n", shutDownServer);
     // Write on the log file.
-    logHandler(startCloseMsg, logFileDirectory);
+    logHandler(&logStreams[0], startCloseMsg);
+    // Give the active segments back their real length, and their indexes their last span
+    for (int i = 0; i < SHARDS; i++)
+    {
+        writeLogSidecar(&logStreams[i], 1);
+        closeLogSegment(&logStreams[i]);
+    }
+    stopCompressionWorkers();
+    // The last snapshot holds every client that came and went
+    writeStatsFile();
     return 0;
 }
 
-void serverListenLoop(int serverSocket, const char *logFileDirectory)
+void serverListenLoop(int serverSocket)
 {
     struct sockaddr_in clientAddr;
     socklen_t clientLen = sizeof(clientAddr);
@@ -160,6 +610,54 @@ void serverListenLoop(int serverSocket, const char *logFileDirectory)
     char buffer[1024];
     pid_t id = 0;
 
+    // Client processes publish their records to a shared ring drained by one writer process per stream
+    if (WRITER_PROCESS)
+    {
+        startWriterProcesses();
+    }
+    // Datagrams are received by a child process of their own, which writes them like a client process
+    if (datagramCounters != NULL)
+    {
+        struct datagramReceiver *receivers[DATAGRAM_SOCKETS];
+        openDatagramReceivers(receivers, 1);
+        id = fork();
+        if (id == -1)
+        {
+            error("ERROR forking the datagram receiver");
+        }
+        if (id == 0)
+        {
+            signal(SIGUSR1, SIG_IGN);
+            signal(SIGINT, SIG_IGN);
+            struct sigaction sigUsr2Action = {0};
+            sigUsr2Action.sa_handler = &handleSigUser2;
+            sigaction(SIGUSR2, &sigUsr2Action, NULL);
+            datagramHandler(receivers);
+        }
+        for (int i = 0; i < DATAGRAM_SOCKETS; i++)
+        {
+            closeDatagramReceiver(receivers[i]);
+        }
+    }
+    // So is the shared-memory ingest
+    if (sharedIngest != NULL)
+    {
+        id = fork();
+        if (id == -1)
+        {
+            error("ERROR forking the shared-memory ingest");
+        }
+        if (id == 0)
+        {
+            signal(SIGUSR1, SIG_IGN);
+            signal(SIGINT, SIG_IGN);
+            struct sigaction sigUsr2Action = {0};
+            sigUsr2Action.sa_handler = &handleSigUser2;
+            sigaction(SIGUSR2, &sigUsr2Action, NULL);
+            sharedIngestHandler();
+        }
+    }
+
     while (!terminate)
     {
         FD_ZERO(&readfds);
@@ -173,9 +671,15 @@ void serverListenLoop(int serverSocket, const char *logFileDirectory)
         {
             max_sd = STDIN_FILENO;
         }
+        if (unixServerSocket != -1)
+        {
+            FD_SET(unixServerSocket, &readfds);
+            max_sd = (unixServerSocket > max_sd) ? unixServerSocket : max_sd;
+        }
 
         // Wait for an activity on one of the sockets, timeout is NULL, so wait indefinitely
         int activity = select(max_sd + 1, &readfds, NULL, NULL, NULL);
+        checkStatsRequest();
 
         if ((activity < 0) && (errno != EINTR))
         {
@@ -202,15 +706,24 @@ void serverListenLoop(int serverSocket, const char *logFileDirectory)
                 }
             }
 
-            // If something happened on the server socket, then it's an incoming connection
-            if (FD_ISSET(serverSocket, &readfds))
+            // If something happened on a listening socket, then it's an incoming connection, over TCP
+            // or from a local client over the AF_UNIX socket
+            for (int local = 0; local <= (unixServerSocket != -1); local++)
             {
-                clientSocket = accept(serverSocket, (struct sockaddr *)&clientAddr, &clientLen);
+                int listeningSocket = local ? unixServerSocket : serverSocket;
+                if (!FD_ISSET(listeningSocket, &readfds))
+                {
+                    continue;
+                }
+                clientLen = sizeof(clientAddr);
+                long long acceptStarted = statsStart(STATS_STAGE_ACCEPT);
+                clientSocket = accept(listeningSocket, (struct sockaddr *)&clientAddr, &clientLen);
                 if (clientSocket < 0)
                 {
                     perror("ERROR on accept");
                     continue;
                 }
+                statsStop(STATS_STAGE_ACCEPT, acceptStarted, 0);
                 if (clientSocket != -1)
                 {
                     id = fork();
@@ -225,12 +738,12 @@ void serverListenLoop(int serverSocket, const char *logFileDirectory)
                         signal(SIGINT, SIG_IGN);
 
                         // redefining the default behavior when a child receive a SIGUSR2 signal.
-                        struct sigaction sigUsr2Action;
+                        struct sigaction sigUsr2Action = {0};
                         sigUsr2Action.sa_handler = &handleSigUser2;
                         sigaction(SIGUSR2, &sigUsr2Action, NULL);
 
                         // This is the child process
-                        clientHandler(clientSocket, clientAddr, logFileDirectory);
+                        clientHandler(clientSocket, local ? NULL : &clientAddr);
                     }
                     else
                     {
@@ -245,6 +758,19 @@ void serverListenLoop(int serverSocket, const char *logFileDirectory)
     // the server ignore every SIGCHLD signal
     signal(SIGCHLD, SIG_IGN);
     int kchild = kill(0, SIGUSR2);
+    // The signal may land just before the shared-memory ingest process waits on its doorbell: ring it too
+    if (sharedIngest != NULL)
+    {
+        shmIngestClose(sharedIngest->header);
+    }
+    // The compression workers are children too: they leave a half written file behind, picked up again on the next start
+    stopCompressionWorkers();
+    // The writer processes drain their ring and exit once the parent and every client process dropped the lifeline
+    if (lifelineWriteFd != -1)
+    {
+        close(lifelineWriteFd);
+        lifelineWriteFd = -1;
+    }
     // waiting for all the children to quit the process
     while (1)
     {
@@ -261,6 +787,11 @@ void serverListenLoop(int serverSocket, const char *logFileDirectory)
             --n_connections;
         }
     }
+    // The writer processes are gone, the parent writes the last messages itself
+    for (int i = 0; i < SHARDS; i++)
+    {
+        logStreams[i].writer = NULL;
+    }
     write(STDOUT_FILENO, "Server is closed.\n", 19);
     // Clean up
     sem_destroy(sem_ptr);
@@ -268,302 +799,3282 @@ void serverListenLoop(int serverSocket, const char *logFileDirectory)
     close(serverSocket);
     sem_unlink(SEM_NAME);
 }
-// Function for handling errors and exiting the program.
-void error(const char *msg)
-{
-    perror(msg); // Print the error message passed to the function along with the system error message.
-    exit(1);     // Exit the program with a non-zero status, indicating that an error occurred.
-}
-
-// Function to get the size of a file.
-off_t getFileSize(const char *filename)
+// Function to raise the soft limit on open descriptors to the hard limit, so an event loop can hold thousands of clients
+void raiseFileLimit(void)
 {
-    struct stat st; // Declare a stat struct to store file information.
+    struct rlimit limit;
 
-    // Call 'stat' on the filename. If successful, 'stat' fills in 'st' with file details.
-    if (stat(filename, &st) == 0)
-    {
-        return st.st_size; // Return the size of the file (in bytes)
-    }
-    else
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max)
     {
-        return -1; // Error occurred
+        limit.rlim_cur = limit.rlim_max;
+        if (setrlimit(RLIMIT_NOFILE, &limit) != 0)
+        {
+            perror("Warning: cannot raise the descriptor limit");
+        }
     }
 }
 
-// Function to find and delete the oldest log file in a given directory
-void deleteOldestLogFile(const char *directory)
+// Function to create a TCP socket bound to the given port and listening for connections
+int openListeningSocket(int portNo)
 {
-    DIR *dir;
-    struct dirent *entry;
-    struct tm oldestTime;
-    char oldestFile[128];
-    int firstFile = 1;
+    struct sockaddr_in serverAddr;
 
-    dir = opendir(directory);
-    if (!dir)
+    int serverSocket = socket(AF_INET, SOCK_STREAM, 0);
+    if (serverSocket < 0)
     {
-        perror("Error opening directory");
-        return;
+        error("ERROR opening socket");
     }
 
-    while ((entry = readdir(dir)) != NULL)
+    // Set up the server address structure
+    memset(&serverAddr, 0, sizeof(serverAddr));
+    serverAddr.sin_family = AF_INET;
+    serverAddr.sin_addr.s_addr = INADDR_ANY;
+    serverAddr.sin_port = htons(portNo);
+
+    // Set socket option to allow immediate reuse of the address and port
+    // This option enables the server to restart immediately after shutdown
+    // without waiting for the TIME_WAIT period to expire.
+    int optval = 1;
+    setsockopt(serverSocket, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval));
+    // With worker threads every reactor binds its own socket to the port and the kernel balances connections between them
+    if (WORKERS > 0 && setsockopt(serverSocket, SOL_SOCKET, SO_REUSEPORT, &optval, sizeof(optval)) < 0)
     {
-        if (entry->d_type == DT_REG && strstr(entry->d_name, "server_log_") == entry->d_name)
-        {
-            struct tm fileTime = {0};
-            sscanf(entry->d_name, "server_log_%d-%d-%d|%d:%d:%d",
-                   &fileTime.tm_year, &fileTime.tm_mon, &fileTime.tm_mday,
-                   &fileTime.tm_hour, &fileTime.tm_min, &fileTime.tm_sec);
-            fileTime.tm_year -= 1900;
-            fileTime.tm_mon -= 1;
+        error("ERROR setting SO_REUSEPORT");
+    }
 
-            if (firstFile || difftime(mktime(&fileTime), mktime(&oldestTime)) < 0)
-            {
-                strncpy(oldestFile, entry->d_name, sizeof(oldestFile));
-                oldestTime = fileTime;
-                firstFile = 0;
-            }
-        }
+    // Bind socket to an address
+    if (bind(serverSocket, (struct sockaddr *)&serverAddr, sizeof(serverAddr)) < 0)
+    {
+        error("ERROR on binding");
     }
 
-    closedir(dir);
+    // Listen for connections
+    if (listen(serverSocket, 100) < 0)
+    {
+        error("Listen error");
+    }
+    return serverSocket;
+}
 
-    // Delete the oldest file
-    if (!firstFile)
+// Function to allocate zeroed memory that stays shared with the processes forked afterwards
+void *allocateShared(size_t size)
+{
+    void *memory = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED)
     {
-        char filePath[256];
-        snprintf(filePath, sizeof(filePath), "%s/%s", directory, oldestFile);
-        if (unlink(filePath) != 0)
-        {
-            perror("Error deleting oldest file");
-        }
+        error("Error mapping shared memory");
     }
+    return memory;
 }
-// Function to find the most recent log file in a given directory
 
-int findMostRecentLogFile(const char *directory, char *mostRecentFile, size_t len)
+// Function to write a snapshot of the stats to stats_file. It goes to a temporary file renamed over the last one,
+// so a reader never sees half of it.
+void writeStatsFile(void)
 {
-    DIR *dir;                   // Directory stream
-    struct dirent *entry;       // Structure representing directory entry
-    struct tm latestTime = {0}; // Store the time of the latest file found
-    int firstFile = 1;          // Flag to check if it's the first file
-    int flag = 0;
+    char temporaryPath[sizeof(STATS_FILE) + 8];
 
-    dir = opendir(directory); // Open the specified directory
-    if (!dir)
+    if (!statsEnabled())
     {
-        perror("Error opening directory");
-        return -1;
+        return;
     }
-    int x = 0;
-    while ((entry = readdir(dir)) != NULL)
+    snprintf(temporaryPath, sizeof(temporaryPath), "%s.tmp", STATS_FILE);
+    FILE *out = fopen(temporaryPath, "w");
+    if (out == NULL)
     {
-        // Check if entry is a regular file and starts with "server_log_"
-        if (entry->d_type == DT_REG && strstr(entry->d_name, "server_log_") == entry->d_name)
-        {
-            flag = 1;
-            struct tm fileTime = {0}; // Temporarily store the file's timestamp
-            // Parse the timestamp from the file name
-            sscanf(entry->d_name, "server_log_%d-%d-%d|%d:%d:%d",
-                   &fileTime.tm_year, &fileTime.tm_mon, &fileTime.tm_mday,
-                   &fileTime.tm_hour, &fileTime.tm_min, &fileTime.tm_sec);
-            fileTime.tm_year -= 1900; // Adjust year
-            fileTime.tm_mon -= 1;     // Adjust month
-
-            // Compare the parsed time with the latest time found
-            if (firstFile || difftime(mktime(&fileTime), mktime(&latestTime)) > 0)
-            {
-                strncpy(mostRecentFile, entry->d_name, len); // Update the most recent file
-                latestTime = fileTime;                       // Update the latest time
-                firstFile = 0;                               // Clear the first file flag
-            }
-        }
+        perror("Error writing the stats file");
+        return;
+    }
+    statsWrite(out);
+    if (fclose(out) != 0 || rename(temporaryPath, STATS_FILE) != 0)
+    {
+        perror("Error writing the stats file");
+        unlink(temporaryPath);
     }
-
-    closedir(dir);
-    return (flag);
 }
 
-// Function to open the most recent log file in a given directory
-int openMostRecentLogFile(const char *directory)
+// Function run by the main loops whenever they wake up: write the stats file if SIGHUP asked for it
+void checkStatsRequest(void)
 {
-    char mostRecentFile[128];
-    int isRecFileExist = findMostRecentLogFile(directory, mostRecentFile, sizeof(mostRecentFile));
-
-    if (isRecFileExist)
+    if (statsRequested)
     {
-        char filePath[256];
-        snprintf(filePath, sizeof(filePath), "%s/%s", directory, mostRecentFile);
-        int fd = open(filePath, O_WRONLY | O_CREAT | O_APPEND, 0644);
-        if (fd < 0)
-        {
-            perror("Error opening most recent log file");
-            return -1; // Error occurred
-        }
-        return fd; // Return the file descriptor
+        statsRequested = 0;
+        writeStatsFile();
     }
-    return -1; // No recent file found
 }
 
-// Function to find the number of log files in a given directory
-int findNumberOfLogFiles(const char *directory)
+// Function to serve every client from a single process with an edge-triggered epoll event loop
+void serverEpollLoop(int serverSocket)
 {
-    DIR *dir;             // Directory stream
-    struct dirent *entry; // Structure representing directory entry
-    int numberOfLogFiles = 0;
-
-    dir = opendir(directory); // Open the specified directory
-    if (!dir)
-    {
-        perror("Error opening directory");
-        return -1;
-    }
+    struct reactor reactor = {0};
 
-    while ((entry = readdir(dir)) != NULL)
+    reactor.serverSocket = serverSocket;
+    reactor.controlFd = STDIN_FILENO;
+    reactor.unixSocket = unixServerSocket;
+    openDatagramReceivers(reactor.datagrams, 1);
+    startIngestWaker(&reactor);
+    runReactor(&reactor);
+    stopIngestWaker(&reactor);
+    for (int i = 0; i < DATAGRAM_SOCKETS; i++)
     {
-        // Check if entry is a regular file and starts with "server_log_"
-        if (entry->d_type == DT_REG && strstr(entry->d_name, "server_log_") == entry->d_name)
-        {
-            numberOfLogFiles++;
-        }
+        closeDatagramReceiver(reactor.datagrams[i]);
     }
 
-    closedir(dir);
-    return numberOfLogFiles;
+    write(STDOUT_FILENO, "Server is closed.\n", 19);
+    // Clean up
+    sem_destroy(sem_ptr);
+    shutdown(serverSocket, SHUT_RDWR);
+    close(serverSocket);
+    sem_unlink(SEM_NAME);
 }
 
-// Function to read server configuration from a file.
-int readConfig(int *port, char *directory)
+// Function to serve clients from WORKERS reactor threads, each with its own SO_REUSEPORT socket and pinned to a core.
+// Reactors only parse and format; records go through rings to a writer thread that owns the segment. There is one
+// writer thread per stream, and each reactor has a ring to each of them, so a record goes to the writer of the stream
+// of its connection and the records of a connection stay in order.
+void serverWorkersLoop(int serverSocket, int portNo)
 {
-    // Open the configuration file in read-only mode.
-    int fd = open("config.txt", O_RDONLY);
-    char buffer[MAX_CONFIG_LINE_LENGTH];
-    ssize_t bytes_read;
-    char *line;
-    char key[MAX_CONFIG_LINE_LENGTH];
-    char value[MAX_CONFIG_LINE_LENGTH];
+    struct reactor *reactors = calloc(WORKERS, sizeof(struct reactor));
+    struct writerStage *writers = allocateShared(SHARDS * sizeof(struct writerStage));
+    long numberOfCpus = sysconf(_SC_NPROCESSORS_ONLN);
+    sigset_t blocked, previous;
+    char buffer[1024];
 
-    // Check if the file was successfully opened.
-    if (fd < 0)
+    if (reactors == NULL)
     {
-        error("Error opening config file");
+        error("ERROR allocating reactors");
     }
-
-    // Read the contents of the file into 'buffer'.
-    bytes_read = read(fd, buffer, sizeof(buffer) - 1);
-
-    // Check if the read operation was successful.
-    if (bytes_read <= 0)
+    if (RING_SLOTS < 2 || (RING_SLOTS & (RING_SLOTS - 1)) != 0)
     {
-        close(fd);
-        error("Error reading config file");
+        fprintf(stderr, "ring_slots must be a power of two, using 1024.\n");
+        RING_SLOTS = 1024;
     }
+    fitLinesToRing();
 
-    buffer[bytes_read] = '\0'; // Null-terminate the buffer to create a valid C string.
-
-    line = strtok(buffer, "\n"); // Tokenize the buffer to read it line by line.
-
-    while (line != NULL)
+    for (int i = 0; i < SHARDS; i++)
     {
+        writers[i].lifelineFd = -1;
+        writers[i].stream = &logStreams[i];
+        writers[i].rings = calloc(WORKERS, sizeof(struct recordRing *));
+        writers[i].wakeFd = eventfd(0, EFD_CLOEXEC);
+        if (writers[i].rings == NULL || writers[i].wakeFd < 0)
+        {
+            error("ERROR setting up the writer stage");
+        }
+    }
 
-        sscanf(line, "%[^=]=%s", key, value); // Parse key=value
-        // If the key is "port", convert the value to integer and store it in 'port'.
-        if (strcmp(key, "port") == 0)
+    for (int i = 0; i < WORKERS; i++)
+    {
+        reactors[i].serverSocket = (i == 0) ? serverSocket : openListeningSocket(portNo);
+        fcntl(reactors[i].serverSocket, F_SETFL, fcntl(reactors[i].serverSocket, F_GETFL, 0) | O_NONBLOCK);
+        reactors[i].unixSocket = unixServerSocket;
+        openDatagramReceivers(reactors[i].datagrams, i == 0);
+        if (i == 0)
         {
-            *port = atoi(value);
+            startIngestWaker(&reactors[i]);
         }
-        // If the key is "directory", copy the value to 'directory'
-        else if (strcmp(key, "directory") == 0)
+        reactors[i].controlFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (reactors[i].controlFd < 0)
         {
-            strcpy(directory, value);
+            error("ERROR creating eventfd");
         }
-        else if (strcmp(key, "log_file_threshold") == 0)
+        reactors[i].rings = calloc(SHARDS, sizeof(struct recordRing *));
+        if (reactors[i].rings == NULL)
         {
-            LOG_FILE_THRESHOLD = atoi(value);
+            error("ERROR allocating ring");
         }
-        else if (strcmp(key, "max_log_files") == 0)
+        for (int j = 0; j < SHARDS; j++)
         {
-            MAX_LOG_FILES = atoi(value);
+            reactors[i].rings[j] = malloc(recordRingSize(RING_SLOTS));
+            if (reactors[i].rings[j] == NULL)
+            {
+                error("ERROR allocating ring");
+            }
+            recordRingInit(reactors[i].rings[j], RING_SLOTS);
+            writers[j].rings[writers[j].numberOfRings++] = reactors[i].rings[j];
         }
-        line = strtok(NULL, "\n"); // Move to the next line.
+        reactors[i].writers = writers;
+        reactors[i].cpu = (numberOfCpus > 0) ? i % numberOfCpus : 0;
     }
 
-    // Close the file descriptor.
-    close(fd);
-
-    return 0;
-}
-
-// Function to create a new log file in the specified directory.It returns a file descriptor to the opened log file.
-int createLogFile(const char *directory)
-{
-    char filename[40];
-    char filepath[100];
-
-    // Get the current time.
-    time_t now = time(NULL);
-    struct tm *tm_info = localtime(&now);
-
-    // Format the log file name with the current timestamp.
-    strftime(filename, 40, "server_log_%Y-%m-%d|%H:%M:%S.txt", tm_info);
-
-    // Construct the full path to the log file.
-    snprintf(filepath, sizeof(filepath), "%s/%s", directory, filename);
-
-    // Open the log file for writing; create it if it doesn't exist; append if it does.
-    int log_fd = open(filename, O_WRONLY | O_CREAT | O_APPEND, 0644);
-    if (log_fd < 0)
+    // Threads inherit the signal mask: block the signals while creating them so only the main thread handles them
+    sigemptyset(&blocked);
+    sigaddset(&blocked, SIGINT);
+    sigaddset(&blocked, SIGUSR1);
+    sigaddset(&blocked, SIGCHLD);
+    sigaddset(&blocked, SIGHUP);
+    pthread_sigmask(SIG_BLOCK, &blocked, &previous);
+    for (int i = 0; i < SHARDS; i++)
     {
-        error("Error opening log file");
+        if (pthread_create(&writers[i].thread, NULL, writerThread, &writers[i]) != 0)
+        {
+            error("ERROR creating writer thread");
+        }
     }
-    return log_fd;
-}
-
-// Function to perform log rotation
-int rotateLog(const char *directory)
-{
-    if (findNumberOfLogFiles(directory) >= MAX_LOG_FILES)
+    for (int i = 0; i < WORKERS; i++)
     {
-        deleteOldestLogFile(directory);
+        if (pthread_create(&reactors[i].thread, NULL, reactorThread, &reactors[i]) != 0)
+        {
+            error("ERROR creating reactor thread");
+        }
     }
-    int log_fd = createLogFile(directory);
-    return log_fd;
-}
+    pthread_sigmask(SIG_SETMASK, &previous, NULL);
 
-// Function to handle new clients
-void clientHandler(int clientSocket, struct sockaddr_in clientAddr, const char *directory)
+    // The main thread only waits for the quit command or a signal
+    while (!terminate)
+    {
+        fd_set readfds;
+        FD_ZERO(&readfds);
+        FD_SET(STDIN_FILENO, &readfds);
+        int ready = select(STDIN_FILENO + 1, &readfds, NULL, NULL, NULL);
+        checkStatsRequest();
+        if (ready > 0)
+        {
+            int readMsg = read(STDIN_FILENO, buffer, sizeof(buffer));
+            // ctrl+d perfomed or quit typed, the server has to quit
+            if (readMsg <= 0 || strncmp(buffer, "quit", 4) == 0)
+            {
+                break;
+            }
+        }
+    }
+    terminate = 1;
+
+    // Wake every reactor so it sees the flag, then let the writers drain what they left in the rings
+    for (int i = 0; i < WORKERS; i++)
+    {
+        uint64_t one = 1;
+        write(reactors[i].controlFd, &one, sizeof(one));
+    }
+    for (int i = 0; i < WORKERS; i++)
+    {
+        pthread_join(reactors[i].thread, NULL);
+    }
+    stopIngestWaker(&reactors[0]);
+    for (int i = 0; i < SHARDS; i++)
+    {
+        atomic_store(&writers[i].stop, 1);
+        wakeWriter(&writers[i]);
+        pthread_join(writers[i].thread, NULL);
+    }
+
+    write(STDOUT_FILENO, "Server is closed.\n", 19);
+    // Clean up
+    for (int i = 0; i < WORKERS; i++)
+    {
+        close(reactors[i].controlFd);
+        for (int j = 0; j < SHARDS; j++)
+        {
+            free(reactors[i].rings[j]);
+        }
+        free(reactors[i].rings);
+        shutdown(reactors[i].serverSocket, SHUT_RDWR);
+        close(reactors[i].serverSocket);
+        for (int j = 0; j < DATAGRAM_SOCKETS; j++)
+        {
+            closeDatagramReceiver(reactors[i].datagrams[j]);
+        }
+    }
+    for (int i = 0; i < SHARDS; i++)
+    {
+        close(writers[i].wakeFd);
+        free(writers[i].rings);
+    }
+    free(reactors);
+    sem_destroy(sem_ptr);
+    sem_unlink(SEM_NAME);
+}
+
+// Function run by each reactor thread
+void *reactorThread(void *arg)
+{
+    struct reactor *reactor = arg;
+    cpu_set_t cpus;
+
+    CPU_ZERO(&cpus);
+    CPU_SET(reactor->cpu, &cpus);
+    if (pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) != 0)
+    {
+        fprintf(stderr, "Warning: cannot pin reactor to cpu %d\n", reactor->cpu);
+    }
+    statsAttach("reactor");
+    runReactor(reactor);
+    statsDetach();
+    return NULL;
+}
+
+// Function to run an epoll event loop until the server terminates
+void runReactor(struct reactor *reactor)
+{
+    struct epoll_event event;
+    struct epoll_event events[MAX_EPOLL_EVENTS];
+    char buffer[1024];
+
+    reactor->epollFd = epoll_create1(EPOLL_CLOEXEC);
+    if (reactor->epollFd < 0)
+    {
+        error("ERROR creating epoll instance");
+    }
+
+    // Events carry the connection pointer: NULL for the listening socket, markers for the other descriptors.
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN | EPOLLET;
+    event.data.ptr = NULL;
+    if (epoll_ctl(reactor->epollFd, EPOLL_CTL_ADD, reactor->serverSocket, &event) < 0)
+    {
+        error("ERROR adding server socket to epoll");
+    }
+    struct connection controlMarker = {.fd = reactor->controlFd};
+    event.events = EPOLLIN;
+    event.data.ptr = &controlMarker;
+    if (epoll_ctl(reactor->epollFd, EPOLL_CTL_ADD, reactor->controlFd, &event) < 0)
+    {
+        // stdin is a regular file or /dev/null, the server is stopped with a signal only
+        perror("Warning: stdin cannot be watched");
+    }
+    // Every reactor waits on the AF_UNIX listening socket; EPOLLEXCLUSIVE wakes one of them per connection
+    struct connection unixMarker = {.fd = reactor->unixSocket};
+    if (reactor->unixSocket != -1)
+    {
+        event.events = EPOLLIN | EPOLLET | EPOLLEXCLUSIVE;
+        event.data.ptr = &unixMarker;
+        if (epoll_ctl(reactor->epollFd, EPOLL_CTL_ADD, reactor->unixSocket, &event) < 0)
+        {
+            error("ERROR adding unix socket to epoll");
+        }
+    }
+    struct connection datagramMarkers[DATAGRAM_SOCKETS];
+    for (int i = 0; i < DATAGRAM_SOCKETS; i++)
+    {
+        datagramMarkers[i].fd = -1;
+        if (reactor->datagrams[i] != NULL)
+        {
+            event.events = EPOLLIN | EPOLLET;
+            event.data.ptr = &datagramMarkers[i];
+            if (epoll_ctl(reactor->epollFd, EPOLL_CTL_ADD, reactor->datagrams[i]->fd, &event) < 0)
+            {
+                error("ERROR adding datagram socket to epoll");
+            }
+        }
+    }
+    struct connection ingestMarker = {.fd = -1};
+    if (reactor->ingest != NULL)
+    {
+        event.events = EPOLLIN;
+        event.data.ptr = &ingestMarker;
+        if (epoll_ctl(reactor->epollFd, EPOLL_CTL_ADD, reactor->ingest->wakeFd, &event) < 0)
+        {
+            error("ERROR adding the shared-memory ingest to epoll");
+        }
+    }
+
+    while (!terminate)
+    {
+        // The shared-memory ingest is drained on every turn
+        int timeout = (reactor->ingest != NULL) ? sharedIngestTimeout(reactor) : -1;
+        int n = epoll_wait(reactor->epollFd, events, MAX_EPOLL_EVENTS, timeout);
+        if (reactor->ingest != NULL)
+        {
+            atomic_store(&reactor->ingest->header->sleeping, 0);
+        }
+        // Only the main thread takes SIGHUP
+        if (reactor->controlFd == STDIN_FILENO)
+        {
+            checkStatsRequest();
+        }
+        if (n < 0)
+        {
+            if (errno != EINTR)
+            {
+                perror("epoll_wait error");
+            }
+            continue;
+        }
+        for (int i = 0; i < n; i++)
+        {
+            struct connection *conn = events[i].data.ptr;
+            if (conn == NULL)
+            {
+                acceptConnections(reactor, reactor->serverSocket);
+            }
+            else if (conn == &unixMarker)
+            {
+                acceptConnections(reactor, reactor->unixSocket);
+            }
+            else if (conn == &controlMarker)
+            {
+                // On stdin, ctrl+d perfomed or quit typed means the server has to quit.
+                // The eventfd of a worker only wakes it up to see the terminate flag.
+                int readMsg = read(reactor->controlFd, buffer, sizeof(buffer));
+                if (reactor->controlFd == STDIN_FILENO && (readMsg <= 0 || strncmp(buffer, "quit", 4) == 0))
+                {
+                    terminate = 1;
+                }
+            }
+            else if (conn >= datagramMarkers && conn < datagramMarkers + DATAGRAM_SOCKETS)
+            {
+                receiveDatagrams(reactor, reactor->datagrams[conn - datagramMarkers]);
+            }
+            else if (conn == &ingestMarker)
+            {
+                // The lanes are drained at the top of the loop
+                uint64_t count;
+                read(reactor->ingest->wakeFd, &count, sizeof(count));
+            }
+            else if (readConnection(reactor, conn) != 0)
+            {
+                closeConnection(reactor, conn);
+            }
+        }
+    }
+
+    // Producers are turned away, then what they appended is logged
+    if (reactor->ingest != NULL)
+    {
+        shmIngestClose(reactor->ingest->header);
+        while (drainSharedIngest(reactor))
+        {
+        }
+    }
+    while (reactor->connections != NULL)
+    {
+        closeConnection(reactor, reactor->connections);
+    }
+    freeReactorMemory(reactor);
+    close(reactor->epollFd);
+}
+
+// Function to accept every pending connection of a listening socket, TCP or AF_UNIX, and register it with the event loop
+void acceptConnections(struct reactor *reactor, int listeningSocket)
+{
+    struct sockaddr_in clientAddr;
+    socklen_t clientLen;
+    struct epoll_event event;
+
+    // Edge-triggered: drain the accept queue until it is empty
+    while (1)
+    {
+        clientLen = sizeof(clientAddr);
+        long long acceptStarted = statsStart(STATS_STAGE_ACCEPT);
+        int clientSocket = accept4(listeningSocket, (struct sockaddr *)&clientAddr, &clientLen, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (clientSocket < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+            {
+                perror("ERROR on accept");
+            }
+            return;
+        }
+        statsStop(STATS_STAGE_ACCEPT, acceptStarted, 0);
+
+        struct connection *conn = allocateConnection(reactor);
+        if (conn == NULL)
+        {
+            close(clientSocket);
+            continue;
+        }
+        conn->fd = clientSocket;
+        setConnectionPeer(conn, (listeningSocket == reactor->unixSocket) ? NULL : &clientAddr);
+
+        memset(&event, 0, sizeof(event));
+        event.events = EPOLLIN | EPOLLRDHUP | EPOLLET;
+        event.data.ptr = conn;
+        if (epoll_ctl(reactor->epollFd, EPOLL_CTL_ADD, clientSocket, &event) < 0)
+        {
+            perror("ERROR adding client to epoll");
+            close(clientSocket);
+            conn->next = reactor->freeConnections;
+            reactor->freeConnections = conn;
+            continue;
+        }
+        conn->next = reactor->connections;
+        if (reactor->connections != NULL)
+        {
+            reactor->connections->prev = conn;
+        }
+        reactor->connections = conn;
+    }
+}
+
+// Function to read everything pending on a client socket.
+// It returns non-zero when the connection has to be closed.
+int readConnection(struct reactor *reactor, struct connection *conn)
+{
+    // A buffer is borrowed for as long as bytes are pending. Text connections start with a line buffer;
+    // a binary handshake swaps it for a frame buffer.
+    if (conn->buffer == NULL)
+    {
+        conn->bufferCapacity = conn->binary ? CONNECTION_BUFFER_SIZE : MAX_LINE_LENGTH + TEXT_READ_SIZE;
+        conn->buffer = borrowBuffer(reactor, conn->bufferCapacity);
+        if (conn->buffer == NULL)
+        {
+            return 1;
+        }
+    }
+
+    // Edge-triggered: keep reading until the socket is drained
+    while (1)
+    {
+        long long readStarted = statsStart(STATS_STAGE_READ);
+        ssize_t bytesRead = read(conn->fd, conn->buffer + conn->bufferLength, conn->bufferCapacity - conn->bufferLength);
+        if (bytesRead < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                int closing = conn->binary ? 0 : processLines(reactor, conn, PARSE_DRAINED);
+                // Everything received was parsed: an idle connection holds no buffer
+                if (!closing && conn->bufferLength == 0)
+                {
+                    returnBuffer(reactor, conn->buffer, conn->bufferCapacity);
+                    conn->buffer = NULL;
+                }
+                return closing;
+            }
+            perror("ERROR reading from client");
+            return 1;
+        }
+        statsStop(STATS_STAGE_READ, readStarted, bytesRead);
+        if (receiveData(reactor, conn, bytesRead) != 0)
+        {
+            return 1;
+        }
+    }
+}
+
+// Function to parse the bytes a read just appended to a connection buffer. A zero count means end of stream.
+// It returns non-zero when the connection has to be closed.
+int receiveData(struct reactor *reactor, struct connection *conn, ssize_t bytesRead)
+{
+    long long started = statsStart(STATS_STAGE_FORMAT);
+    int closing = parseReceivedData(reactor, conn, bytesRead);
+
+    statsStop(STATS_STAGE_FORMAT, started, bytesRead);
+    statsCountClient(conn->statsClient, conn->statsRecords, bytesRead);
+    conn->statsRecords = 0;
+    return closing;
+}
+
+// Function to parse the bytes of a read, for receiveData()
+int parseReceivedData(struct reactor *reactor, struct connection *conn, ssize_t bytesRead)
+{
+    if (bytesRead == 0)
+    {
+        if (!conn->binary)
+        {
+            processLines(reactor, conn, PARSE_EOF);
+        }
+        if (conn->named)
+        {
+            logConnectionEvent(reactor, conn, "is disconnected");
+        }
+        return 1;
+    }
+    conn->bufferLength += bytesRead;
+
+    // The first bytes of a client are its name, or the binary protocol handshake
+    if (!conn->named && !conn->binary && isBinaryHandshake(conn->buffer, conn->bufferLength))
+    {
+        if (startBinaryConnection(reactor, conn) != 0)
+        {
+            return 1;
+        }
+    }
+    if (conn->binary)
+    {
+        return processFrames(reactor, conn);
+    }
+    return processLines(reactor, conn, PARSE_MORE);
+}
+
+// Function to tell whether the first bytes of a connection are the binary protocol handshake
+int isBinaryHandshake(const char *data, size_t length)
+{
+    return length >= PROTOCOL_MAGIC_LENGTH + 1 && memcmp(data, PROTOCOL_MAGIC, PROTOCOL_MAGIC_LENGTH) == 0 && data[PROTOCOL_MAGIC_LENGTH] >= 1;
+}
+
+// Function to switch a connection to the binary protocol, keeping the bytes already received
+int startBinaryConnection(struct reactor *reactor, struct connection *conn)
+{
+    // Registered buffers of the uring mode are already large enough for a frame
+    if (conn->bufferCapacity >= CONNECTION_BUFFER_SIZE)
+    {
+        conn->binary = 1;
+        return 0;
+    }
+    char *buffer = borrowBuffer(reactor, CONNECTION_BUFFER_SIZE);
+    if (buffer == NULL)
+    {
+        return -1;
+    }
+    memcpy(buffer, conn->buffer, conn->bufferLength);
+    returnBuffer(reactor, conn->buffer, conn->bufferCapacity);
+    conn->buffer = buffer;
+    conn->bufferCapacity = CONNECTION_BUFFER_SIZE;
+    conn->binary = 1;
+    return 0;
+}
+
+// Function to log every complete frame in the buffer of a binary connection and keep the incomplete rest.
+// It returns non-zero when the connection has to be closed: the client quit or broke the protocol.
+int processFrames(struct reactor *reactor, struct connection *conn)
+{
+    const unsigned char *data = (const unsigned char *)conn->buffer;
+    size_t offset = 0;
+
+    // The handshake carries the client name and is answered with the version the server speaks
+    if (!conn->named)
+    {
+        if (conn->bufferLength < PROTOCOL_HANDSHAKE_HEADER)
+        {
+            return 0;
+        }
+        size_t nameLength = protocolGet16(data + PROTOCOL_MAGIC_LENGTH + 1);
+        if (nameLength > PROTOCOL_MAX_NAME)
+        {
+            return 1;
+        }
+        if (conn->bufferLength < PROTOCOL_HANDSHAKE_HEADER + nameLength)
+        {
+            return 0;
+        }
+        if (setConnectionName(conn, (const char *)data + PROTOCOL_HANDSHAKE_HEADER, nameLength) != 0)
+        {
+            return 1;
+        }
+        // A client newer than the server gets the version the server speaks, an older one its own
+        int version = (data[PROTOCOL_MAGIC_LENGTH] < PROTOCOL_VERSION) ? data[PROTOCOL_MAGIC_LENGTH] : PROTOCOL_VERSION;
+        unsigned char ack[PROTOCOL_ACK_LENGTH] = {'L', 'G', 'B', version};
+        if (write(conn->fd, ack, sizeof(ack)) != sizeof(ack))
+        {
+            return 1;
+        }
+        logConnectionEvent(reactor, conn, "is connected");
+        offset = PROTOCOL_HANDSHAKE_HEADER + nameLength;
+    }
+
+    while (conn->bufferLength - offset >= PROTOCOL_FRAME_HEADER)
+    {
+        const unsigned char *frame = data + offset;
+        uint32_t payloadLength = protocolGet32(frame);
+        uint16_t type = protocolGet16(frame + 4);
+        uint16_t count = protocolGet16(frame + 6);
+        if (payloadLength > PROTOCOL_MAX_FRAME)
+        {
+            logConnectionEvent(reactor, conn, "sent an oversized frame, connection closed");
+            return 1;
+        }
+        if (conn->bufferLength - offset - PROTOCOL_FRAME_HEADER < payloadLength)
+        {
+            break;
+        }
+
+        if (type == FRAME_QUIT)
+        {
+            logConnectionEvent(reactor, conn, "sent quit command");
+            return 1;
+        }
+        if (type == FRAME_RECORDS)
+        {
+            const unsigned char *record = frame + PROTOCOL_FRAME_HEADER;
+            const unsigned char *end = record + payloadLength;
+            for (int i = 0; i < count; i++)
+            {
+                if (end - record < PROTOCOL_RECORD_HEADER || end - record - PROTOCOL_RECORD_HEADER < protocolGet32(record + 8))
+                {
+                    logConnectionEvent(reactor, conn, "sent a malformed frame, connection closed");
+                    return 1;
+                }
+                uint64_t timestamp = protocolGet64(record);
+                uint32_t length = protocolGet32(record + 8);
+                // A traced record takes its trace along to the log
+                int traced = conn->trace != 0 && i == conn->traceIndex;
+                if (traced)
+                {
+                    statsTracing = conn->trace;
+                    conn->trace = 0;
+                }
+                // The record keeps the time the client stamped it with
+                logClientRecord(reactor, conn, timestamp / 1000000, (const char *)record + PROTOCOL_RECORD_HEADER, length);
+                if (traced)
+                {
+                    statsTracing = 0;
+                }
+                record += PROTOCOL_RECORD_HEADER + length;
+            }
+            // The frame had no such record
+            if (conn->trace != 0)
+            {
+                statsTraceCancel(conn->trace);
+                conn->trace = 0;
+            }
+        }
+        // The trace is for a record of the next frame of records
+        if (type == FRAME_TRACE && payloadLength >= PROTOCOL_TRACE_PAYLOAD && statsEnabled())
+        {
+            const unsigned char *payload = frame + PROTOCOL_FRAME_HEADER;
+            statsTraceCancel(conn->trace);
+            conn->trace = statsTraceBegin(conn->statsClient, protocolGet64(payload), (long long)protocolGet64(payload + 8));
+            conn->traceIndex = protocolGet16(payload + 16);
+        }
+        // Every frame before it was handed to the log, so the client may let go of them. A reply lost to a full
+        // socket buffer is made up for by the next one.
+        if (type == FRAME_SYNC && payloadLength <= PROTOCOL_MAX_SYNC &&
+            send(conn->fd, frame, PROTOCOL_FRAME_HEADER + payloadLength, MSG_NOSIGNAL) < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+        {
+            return 1;
+        }
+        // Unknown frame types are skipped so newer clients can add them
+        offset += PROTOCOL_FRAME_HEADER + payloadLength;
+    }
+
+    memmove(conn->buffer, conn->buffer + offset, conn->bufferLength - offset);
+    conn->bufferLength -= offset;
+    return 0;
+}
+
+// Function to log every line in the buffer of a text connection and keep the incomplete rest.
+// The stream is split on '\n' however TCP segmented it, and lines over max_line_length are cut into several records.
+// Clients that never send a newline, like the original text client, keep the old framing: each drained read is one message.
+// It returns non-zero when the client quit.
+int processLines(struct reactor *reactor, struct connection *conn, int mode)
+{
+    size_t start = 0;
+
+    while (start < conn->bufferLength)
+    {
+        const char *line = conn->buffer + start;
+        size_t available = conn->bufferLength - start;
+        const char *newline = scanNewline(line, available);
+        size_t length;
+
+        if (newline != NULL)
+        {
+            length = newline - line;
+            conn->lineMode = 1;
+        }
+        else if (available >= (size_t)MAX_LINE_LENGTH || mode == PARSE_EOF || (mode == PARSE_DRAINED && !conn->lineMode))
+        {
+            length = available;
+        }
+        else
+        {
+            // Wait for the rest of the line
+            break;
+        }
+
+        size_t consumed = length + (newline != NULL);
+        if (length > (size_t)MAX_LINE_LENGTH)
+        {
+            // The rest of an overlong line stays for the next record
+            length = MAX_LINE_LENGTH;
+            consumed = length;
+        }
+        start += consumed;
+        if (handleLine(reactor, conn, line, length) != 0)
+        {
+            return 1;
+        }
+    }
+
+    memmove(conn->buffer, conn->buffer + start, conn->bufferLength - start);
+    conn->bufferLength -= start;
+    return 0;
+}
+
+// Function to log one text protocol line: the client name first, then messages. It returns non-zero on "quit".
+int handleLine(struct reactor *reactor, struct connection *conn, const char *line, size_t length)
+{
+    // Lines typed in telnet-like tools end with "\r\n"
+    if (length > 0 && line[length - 1] == '\r')
+    {
+        length--;
+    }
+
+    if (!conn->named)
+    {
+        if (length > PROTOCOL_MAX_NAME)
+        {
+            length = PROTOCOL_MAX_NAME;
+        }
+        if (setConnectionName(conn, line, length) != 0)
+        {
+            return 1;
+        }
+        logConnectionEvent(reactor, conn, "is connected");
+        return 0;
+    }
+    if (length == 4 && memcmp(line, "quit", 4) == 0)
+    {
+        logConnectionEvent(reactor, conn, "sent quit command");
+        return 1;
+    }
+
+    logClientRecord(reactor, conn, time(NULL), line, length);
+    return 0;
+}
+
+// Function to fill in the address of a new connection's client: its IP, or for a client of the AF_UNIX socket
+// (no address) the credentials the kernel vouches for, which stand in for the IP in its records
+void setConnectionPeer(struct connection *conn, const struct sockaddr_in *clientAddr)
+{
+    struct ucred credentials;
+    socklen_t length = sizeof(credentials);
+
+    if (clientAddr != NULL)
+    {
+        inet_ntop(AF_INET, &clientAddr->sin_addr, conn->clientIP, INET_ADDRSTRLEN);
+        return;
+    }
+    conn->local = 1;
+    if (getsockopt(conn->fd, SOL_SOCKET, SO_PEERCRED, &credentials, &length) == 0)
+    {
+        formatCredentials(conn->clientIP, sizeof(conn->clientIP), &credentials);
+    }
+    else
+    {
+        snprintf(conn->clientIP, sizeof(conn->clientIP), "local");
+    }
+}
+
+// Function to write the credentials of a local client the way its records show them
+void formatCredentials(char *clientIP, size_t size, const struct ucred *credentials)
+{
+    snprintf(clientIP, size, "uid=%u,pid=%d", (unsigned)credentials->uid, (int)credentials->pid);
+}
+
+// Function to name a client: build the part of its records that never changes, which holds the name, and pick their
+// stream. The prefix goes to the buffer of CONNECTION_PREFIX_SIZE bytes the connection already has, if any,
+// otherwise to memory of its own sized to fit. It returns -1 when that cannot be allocated.
+int setConnectionName(struct connection *conn, const char *name, size_t length)
+{
+    char prefix[CONNECTION_PREFIX_SIZE];
+
+    // The name ends at its first NUL, if any, as it always has
+    length = strnlen(name, length);
+    int prefixLength = snprintf(prefix, sizeof(prefix), "Client (%s) - %.*s: ", conn->clientIP, (int)length, name);
+    if (conn->prefix == NULL && (conn->prefix = malloc(prefixLength + 1)) == NULL)
+    {
+        perror("ERROR allocating connection prefix");
+        return -1;
+    }
+    memcpy(conn->prefix, prefix, prefixLength + 1);
+    conn->prefixLength = prefixLength;
+    conn->nameOffset = prefixLength - length - 2;
+    conn->nameLength = length;
+    conn->named = 1;
+    conn->stream = clientStream(conn->clientIP, name, length);
+    conn->statsClient = statsFindClient(conn->prefix, prefixLength - 2);
+    return 0;
+}
+
+// Function to pick the stream of a client from its IP and name (FNV-1a), so its records stay in one stream, in order
+int clientStream(const char *clientIP, const char *clientName, size_t nameLength)
+{
+    uint32_t hash = 2166136261u;
+
+    for (const char *p = clientIP; *p != '\0'; p++)
+    {
+        hash = (hash ^ (unsigned char)*p) * 16777619u;
+    }
+    hash = (hash ^ ' ') * 16777619u;
+    for (size_t i = 0; i < nameLength; i++)
+    {
+        hash = (hash ^ (unsigned char)clientName[i]) * 16777619u;
+    }
+    return hash % SHARDS;
+}
+
+// Function to log one client message. The record is handed over as slices: the cached timestamp,
+// the connection prefix and the payload where it was received, so nothing is formatted or copied here.
+void logClientRecord(struct reactor *reactor, struct connection *conn, time_t t, const char *payload, size_t length)
+{
+    struct iovec slices[4];
+
+    slices[0].iov_base = (void *)cachedTimestamp(t, &slices[0].iov_len);
+    slices[1].iov_base = conn->prefix;
+    slices[1].iov_len = conn->prefixLength;
+    slices[2].iov_base = (void *)payload;
+    slices[2].iov_len = length;
+    slices[3].iov_base = "\n";
+    slices[3].iov_len = 1;
+    submitLogSlices(reactor, conn->stream, slices, 4);
+    conn->statsRecords++;
+}
+
+// Function to log a connection event, e.g. "is connected", with the client IP and name
+void logConnectionEvent(struct reactor *reactor, struct connection *conn, const char *event)
+{
+    char logMessage[1024];
+    char timeStr[128];
+
+    getCurrentTime(timeStr);
+    snprintf(logMessage, sizeof(logMessage), "[%s] Client (%s: %s, name: %.*s) %s.\n", timeStr, conn->local ? "local" : "IP",
+             conn->clientIP, conn->nameLength, conn->named ? conn->prefix + conn->nameOffset : "", event);
+    submitLogMessage(reactor, conn->stream, logMessage);
+}
+
+// Function to unregister a client from the event loop and keep its state for the next one
+void closeConnection(struct reactor *reactor, struct connection *conn)
+{
+    epoll_ctl(reactor->epollFd, EPOLL_CTL_DEL, conn->fd, NULL);
+    close(conn->fd);
+    if (conn->prev != NULL)
+    {
+        conn->prev->next = conn->next;
+    }
+    else
+    {
+        reactor->connections = conn->next;
+    }
+    if (conn->next != NULL)
+    {
+        conn->next->prev = conn->prev;
+    }
+    if (conn->buffer != NULL)
+    {
+        returnBuffer(reactor, conn->buffer, conn->bufferCapacity);
+    }
+    free(conn->prefix);
+    statsTraceCancel(conn->trace);
+    conn->next = reactor->freeConnections;
+    reactor->freeConnections = conn;
+}
+
+// Function to take a connection state from the reactor's slabs, cleared, adding a slab when every one is taken
+struct connection *allocateConnection(struct reactor *reactor)
+{
+    if (reactor->freeConnections == NULL)
+    {
+        struct connectionSlab *slab = malloc(sizeof(struct connectionSlab));
+        if (slab == NULL)
+        {
+            perror("ERROR allocating connections");
+            return NULL;
+        }
+        slab->next = reactor->slabs;
+        reactor->slabs = slab;
+        for (int i = 0; i < CONNECTIONS_PER_SLAB; i++)
+        {
+            slab->connections[i].next = reactor->freeConnections;
+            reactor->freeConnections = &slab->connections[i];
+        }
+    }
+    struct connection *conn = reactor->freeConnections;
+    reactor->freeConnections = conn->next;
+    memset(conn, 0, sizeof(*conn));
+    return conn;
+}
+
+// Function to lend a read buffer of 'capacity' bytes, a text line buffer or a binary frame buffer, from the reactor's pool
+char *borrowBuffer(struct reactor *reactor, size_t capacity)
+{
+    int size = (capacity == CONNECTION_BUFFER_SIZE);
+    char *buffer = reactor->buffers.free[size];
+
+    if (buffer != NULL)
+    {
+        memcpy(&reactor->buffers.free[size], buffer, sizeof(char *));
+        reactor->buffers.count[size]--;
+        return buffer;
+    }
+    buffer = malloc(capacity);
+    if (buffer == NULL)
+    {
+        perror("ERROR allocating connection buffer");
+    }
+    return buffer;
+}
+
+// Function to give a read buffer back to the reactor's pool, which keeps BUFFER_POOL_KEEP of each size
+void returnBuffer(struct reactor *reactor, char *buffer, size_t capacity)
+{
+    int size = (capacity == CONNECTION_BUFFER_SIZE);
+
+    if ((capacity != (size_t)MAX_LINE_LENGTH + TEXT_READ_SIZE && capacity != CONNECTION_BUFFER_SIZE) ||
+        reactor->buffers.count[size] >= BUFFER_POOL_KEEP)
+    {
+        free(buffer);
+        return;
+    }
+    memcpy(buffer, &reactor->buffers.free[size], sizeof(char *));
+    reactor->buffers.free[size] = buffer;
+    reactor->buffers.count[size]++;
+}
+
+// Function to free the slabs and pooled buffers of a reactor whose connections are all closed
+void freeReactorMemory(struct reactor *reactor)
+{
+    while (reactor->slabs != NULL)
+    {
+        struct connectionSlab *slab = reactor->slabs;
+        reactor->slabs = slab->next;
+        free(slab);
+    }
+    reactor->freeConnections = NULL;
+    for (int size = 0; size < 2; size++)
+    {
+        while (reactor->buffers.free[size] != NULL)
+        {
+            char *buffer = reactor->buffers.free[size];
+            memcpy(&reactor->buffers.free[size], buffer, sizeof(char *));
+            free(buffer);
+        }
+        reactor->buffers.count[size] = 0;
+    }
+}
+
+// Function to create a non-blocking AF_UNIX socket bound to a path, replacing the one a previous run left there.
+// A stream socket listens; a datagram socket gets the credentials of the sender with each datagram.
+int openUnixSocket(const char *path, int type)
+{
+    struct sockaddr_un address;
+    int optval = 1;
+
+    int fd = socket(AF_UNIX, type | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+    {
+        error("ERROR opening unix socket");
+    }
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    snprintf(address.sun_path, sizeof(address.sun_path), "%s", path);
+    unlink(path);
+    if (bind(fd, (struct sockaddr *)&address, sizeof(address)) < 0)
+    {
+        error("ERROR on binding the unix socket");
+    }
+    if (type == SOCK_STREAM && listen(fd, 100) < 0)
+    {
+        error("Listen error");
+    }
+    if (type == SOCK_DGRAM)
+    {
+        setsockopt(fd, SOL_SOCKET, SO_PASSCRED, &optval, sizeof(optval));
+    }
+    return fd;
+}
+
+// Function to create a UDP socket bound to the given port, with the buffers its datagrams are received into
+struct datagramReceiver *openDatagramReceiver(int portNo)
+{
+    struct sockaddr_in serverAddr;
+    int optval = 1;
+    int bufferSize = 4194304;
+
+    int fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+    {
+        error("ERROR opening UDP socket");
+    }
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval));
+    // With worker threads every reactor binds its own socket to the port and the kernel spreads the senders between them
+    if (WORKERS > 0 && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &optval, sizeof(optval)) < 0)
+    {
+        error("ERROR setting SO_REUSEPORT");
+    }
+    // Every datagram comes with the number the socket dropped so far for lack of room
+    setsockopt(fd, SOL_SOCKET, SO_RXQ_OVFL, &optval, sizeof(optval));
+    // Senders do not wait for us: a larger buffer absorbs their bursts, as far as net.core.rmem_max allows
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &bufferSize, sizeof(bufferSize));
+
+    memset(&serverAddr, 0, sizeof(serverAddr));
+    serverAddr.sin_family = AF_INET;
+    serverAddr.sin_addr.s_addr = INADDR_ANY;
+    serverAddr.sin_port = htons(portNo);
+    if (bind(fd, (struct sockaddr *)&serverAddr, sizeof(serverAddr)) < 0)
+    {
+        error("ERROR on binding the UDP port");
+    }
+    return newDatagramReceiver(fd, 0);
+}
+
+// Function to set up the buffers the datagrams of a socket are received into
+struct datagramReceiver *newDatagramReceiver(int fd, int local)
+{
+    struct datagramReceiver *receiver = calloc(1, sizeof(struct datagramReceiver));
+    if (receiver == NULL || (receiver->buffers = malloc((size_t)UDP_BATCH * PROTOCOL_MAX_DATAGRAM)) == NULL)
+    {
+        error("ERROR allocating the datagram buffers");
+    }
+    receiver->fd = fd;
+    receiver->local = local;
+    for (int i = 0; i < UDP_BATCH; i++)
+    {
+        receiver->iov[i].iov_base = receiver->buffers + (size_t)i * PROTOCOL_MAX_DATAGRAM;
+        receiver->iov[i].iov_len = PROTOCOL_MAX_DATAGRAM;
+    }
+    return receiver;
+}
+
+// Function to open the datagram sockets a reactor receives from: its own UDP socket, and the AF_UNIX one,
+// which only the first reactor owns
+void openDatagramReceivers(struct datagramReceiver **receivers, int first)
+{
+    receivers[DATAGRAM_UDP] = (UDP_PORT > 0) ? openDatagramReceiver(UDP_PORT) : NULL;
+    receivers[DATAGRAM_UNIX] = NULL;
+    if (first && UNIX_DATAGRAM_SOCKET[0] != '\0')
+    {
+        receivers[DATAGRAM_UNIX] = newDatagramReceiver(openUnixSocket(UNIX_DATAGRAM_SOCKET, SOCK_DGRAM), 1);
+    }
+}
+
+// Function to close a UDP socket and release its buffers
+void closeDatagramReceiver(struct datagramReceiver *receiver)
+{
+    if (receiver == NULL)
+    {
+        return;
+    }
+    close(receiver->fd);
+    free(receiver->buffers);
+    free(receiver);
+}
+
+// Function to log every datagram pending on a datagram socket, pulling up to UDP_BATCH of them per recvmmsg()
+void receiveDatagrams(struct reactor *reactor, struct datagramReceiver *receiver)
+{
+    while (1)
+    {
+        for (int i = 0; i < UDP_BATCH; i++)
+        {
+            struct msghdr *header = &receiver->messages[i].msg_hdr;
+            header->msg_name = receiver->local ? NULL : &receiver->senders[i];
+            header->msg_namelen = receiver->local ? 0 : sizeof(receiver->senders[i]);
+            header->msg_iov = &receiver->iov[i];
+            header->msg_iovlen = 1;
+            header->msg_control = receiver->control[i];
+            header->msg_controllen = sizeof(receiver->control[i]);
+            header->msg_flags = 0;
+        }
+        int n = recvmmsg(receiver->fd, receiver->messages, UDP_BATCH, MSG_DONTWAIT, NULL);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+            {
+                perror("ERROR receiving datagrams");
+            }
+            return;
+        }
+        atomic_fetch_add(&datagramCounters->received, n);
+
+        for (int i = 0; i < n; i++)
+        {
+            struct msghdr *header = &receiver->messages[i].msg_hdr;
+            char clientIP[CLIENT_ADDRESS_LENGTH] = "local";
+            if (!receiver->local)
+            {
+                inet_ntop(AF_INET, &receiver->senders[i].sin_addr, clientIP, INET_ADDRSTRLEN);
+            }
+            for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(header); cmsg != NULL; cmsg = CMSG_NXTHDR(header, cmsg))
+            {
+                if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SO_RXQ_OVFL)
+                {
+                    uint32_t overflows;
+                    memcpy(&overflows, CMSG_DATA(cmsg), sizeof(overflows));
+                    atomic_fetch_add(&datagramCounters->dropped, overflows - receiver->overflows);
+                    receiver->overflows = overflows;
+                }
+                else if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_CREDENTIALS)
+                {
+                    struct ucred credentials;
+                    memcpy(&credentials, CMSG_DATA(cmsg), sizeof(credentials));
+                    formatCredentials(clientIP, sizeof(clientIP), &credentials);
+                }
+            }
+            if ((header->msg_flags & (MSG_TRUNC | MSG_CTRUNC)) != 0 ||
+                logDatagram(reactor, header->msg_iov->iov_base, receiver->messages[i].msg_len, clientIP, receiver->local) != 0)
+            {
+                atomic_fetch_add(&datagramCounters->malformed, 1);
+            }
+        }
+        // A short batch emptied the socket; datagrams arriving since then raise a new event
+        if (n < UDP_BATCH)
+        {
+            return;
+        }
+    }
+}
+
+// Function to log the records of one datagram, like those of a binary frame from a connection named after
+// its sender. It returns -1, logging nothing, when the datagram is malformed.
+int logDatagram(struct reactor *reactor, const unsigned char *data, size_t length, const char *clientIP, int local)
+{
+    char prefix[CONNECTION_PREFIX_SIZE];
+    struct connection conn = {.fd = -1, .local = local, .prefix = prefix};
+
+    if (length < PROTOCOL_DATAGRAM_HEADER || memcmp(data, PROTOCOL_DATAGRAM_MAGIC, PROTOCOL_MAGIC_LENGTH) != 0 ||
+        data[PROTOCOL_MAGIC_LENGTH] < 1)
+    {
+        return -1;
+    }
+    size_t nameLength = protocolGet16(data + PROTOCOL_MAGIC_LENGTH + 1);
+    if (nameLength > PROTOCOL_MAX_NAME || length - PROTOCOL_DATAGRAM_HEADER < nameLength + 2)
+    {
+        return -1;
+    }
+    int count = protocolGet16(data + PROTOCOL_DATAGRAM_HEADER + nameLength);
+    const unsigned char *records = data + PROTOCOL_DATAGRAM_HEADER + nameLength + 2;
+    const unsigned char *end = data + length;
+
+    // Every record must fit, and nothing may follow them
+    const unsigned char *record = records;
+    for (int i = 0; i < count; i++)
+    {
+        if (end - record < PROTOCOL_RECORD_HEADER || end - record - PROTOCOL_RECORD_HEADER < protocolGet32(record + 8))
+        {
+            return -1;
+        }
+        record += PROTOCOL_RECORD_HEADER + protocolGet32(record + 8);
+    }
+    if (record != end)
+    {
+        return -1;
+    }
+
+    snprintf(conn.clientIP, sizeof(conn.clientIP), "%s", clientIP);
+    setConnectionName(&conn, (const char *)data + PROTOCOL_DATAGRAM_HEADER, nameLength);
+    record = records;
+    for (int i = 0; i < count; i++)
+    {
+        uint32_t recordLength = protocolGet32(record + 8);
+        // The record keeps the time the client stamped it with
+        logClientRecord(reactor, &conn, protocolGet64(record) / 1000000, (const char *)record + PROTOCOL_RECORD_HEADER, recordLength);
+        record += PROTOCOL_RECORD_HEADER + recordLength;
+    }
+    statsCountClient(conn.statsClient, conn.statsRecords, length);
+    return 0;
+}
+
+// Function run by the datagram receiver process of the fork mode until the server shuts down
+void datagramHandler(struct datagramReceiver **receivers)
+{
+    struct reactor sink = {0}; // No ring: records go through logHandlerSlices()
+    struct pollfd wake[DATAGRAM_SOCKETS];
+    sigset_t blocked, waiting;
+
+    // A socket that is not configured is left out of the poll with a negative descriptor
+    for (int i = 0; i < DATAGRAM_SOCKETS; i++)
+    {
+        wake[i].fd = (receivers[i] != NULL) ? receivers[i]->fd : -1;
+        wake[i].events = POLLIN;
+    }
+
+    // SIGUSR2 is only let in while waiting, so it cannot slip in between the check and the wait
+    sigemptyset(&blocked);
+    sigaddset(&blocked, SIGUSR2);
+    sigprocmask(SIG_BLOCK, &blocked, &waiting);
+    sigdelset(&waiting, SIGUSR2);
+    statsAttach("datagrams");
+    while (husr2)
+    {
+        if (ppoll(wake, DATAGRAM_SOCKETS, NULL, &waiting) <= 0)
+        {
+            continue;
+        }
+        for (int i = 0; i < DATAGRAM_SOCKETS; i++)
+        {
+            if (wake[i].revents != 0)
+            {
+                receiveDatagrams(&sink, receivers[i]);
+            }
+        }
+    }
+    for (int i = 0; i < DATAGRAM_SOCKETS; i++)
+    {
+        closeDatagramReceiver(receivers[i]);
+    }
+    statsDetach();
+    exit(EXIT_SUCCESS);
+}
+
+// Function to log the counters of the datagram listener, when there is one
+void logDatagramCounters(void)
+{
+    char message[256];
+    char timeStr[128];
+
+    if (datagramCounters == NULL)
+    {
+        return;
+    }
+    getCurrentTime(timeStr);
+    snprintf(message, sizeof(message), "[%s] Datagrams: %lu received, %lu malformed, %lu dropped.\n", timeStr,
+             atomic_load(&datagramCounters->received), atomic_load(&datagramCounters->malformed),
+             atomic_load(&datagramCounters->dropped));
+    logHandler(&logStreams[0], message);
+}
+
+// Function to create the shared-memory ingest and the client state of its lanes
+void openSharedIngest(void)
+{
+    if (SHM_INGEST_SLOTS < 2 || (SHM_INGEST_SLOTS & (SHM_INGEST_SLOTS - 1)) != 0)
+    {
+        fprintf(stderr, "shm_ingest_slots must be a power of two, using 1024.\n");
+        SHM_INGEST_SLOTS = 1024;
+    }
+    if (SHM_INGEST_LANES < 1)
+    {
+        fprintf(stderr, "shm_ingest_lanes must be at least 1, using 16.\n");
+        SHM_INGEST_LANES = 16;
+    }
+    sharedIngest = calloc(1, sizeof(struct sharedIngest));
+    if (sharedIngest == NULL || (sharedIngest->lanes = calloc(SHM_INGEST_LANES, sizeof(struct connection))) == NULL)
+    {
+        error("ERROR allocating the shared-memory ingest");
+    }
+    sharedIngest->header = shmIngestCreate(SHM_INGEST, SHM_INGEST_LANES, SHM_INGEST_SLOTS, &sharedIngest->size);
+    if (sharedIngest->header == NULL)
+    {
+        error("ERROR creating the shared-memory ingest");
+    }
+    sharedIngest->wakeFd = -1;
+}
+
+// Function to remove the shared-memory ingest when the server shuts down, once its records were logged
+void closeSharedIngest(void)
+{
+    if (sharedIngest == NULL)
+    {
+        return;
+    }
+    shmIngestClose(sharedIngest->header);
+    munmap(sharedIngest->header, sharedIngest->size);
+    shmIngestRemove(SHM_INGEST);
+    for (int i = 0; i < SHM_INGEST_LANES; i++)
+    {
+        free(sharedIngest->lanes[i].prefix);
+    }
+    free(sharedIngest->lanes);
+    free(sharedIngest);
+    sharedIngest = NULL;
+}
+
+// Function to hand the shared-memory ingest, if there is one, to a reactor, with a thread that turns the rings
+// of its doorbell into an eventfd the reactor waits on
+void startIngestWaker(struct reactor *reactor)
+{
+    sigset_t blocked, previous;
+
+    if (sharedIngest == NULL)
+    {
+        return;
+    }
+    reactor->ingest = sharedIngest;
+    sharedIngest->wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (sharedIngest->wakeFd < 0)
+    {
+        error("ERROR creating eventfd");
+    }
+    // Signals are left to the threads that handle them
+    sigfillset(&blocked);
+    pthread_sigmask(SIG_BLOCK, &blocked, &previous);
+    if (pthread_create(&sharedIngest->waker, NULL, ingestWakerThread, sharedIngest) != 0)
+    {
+        error("ERROR creating the shared-memory ingest thread");
+    }
+    pthread_sigmask(SIG_SETMASK, &previous, NULL);
+}
+
+// Function to stop the waker thread of a reactor's shared-memory ingest
+void stopIngestWaker(struct reactor *reactor)
+{
+    if (reactor->ingest == NULL)
+    {
+        return;
+    }
+    shmIngestClose(reactor->ingest->header);
+    pthread_join(reactor->ingest->waker, NULL);
+    close(reactor->ingest->wakeFd);
+    reactor->ingest->wakeFd = -1;
+}
+
+// Function run by the waker thread: pass every ring of the doorbell on to the reactor's eventfd, and look for
+// lanes whose process died now and then, which the reactor then frees like the lanes that were left
+void *ingestWakerThread(void *arg)
+{
+    struct sharedIngest *ingest = arg;
+    unsigned int seen = atomic_load(&ingest->header->doorbell);
+    long long lastSweep = currentTimeMillis();
+    uint64_t one = 1;
+
+    while (!atomic_load(&ingest->header->closed))
+    {
+        unsigned int doorbell = shmIngestWait(ingest->header, seen, SHM_INGEST_SWEEP_MS);
+        int ring = doorbell != seen;
+        seen = doorbell;
+        if (currentTimeMillis() - lastSweep >= SHM_INGEST_SWEEP_MS)
+        {
+            lastSweep = currentTimeMillis();
+            ring |= sweepSharedIngest(ingest);
+        }
+        if (ring)
+        {
+            write(ingest->wakeFd, &one, sizeof(one));
+        }
+    }
+    return NULL;
+}
+
+// Function to log what the lanes of the shared-memory ingest hold, at most SHM_INGEST_BATCH records of a lane per call,
+// and free the lanes that were left once they are empty. It returns 1 when some records are left for the next call.
+int drainSharedIngest(struct reactor *reactor)
+{
+    struct sharedIngest *ingest = reactor->ingest;
+    int more = 0;
+
+    for (unsigned int i = 0; i < ingest->header->lanes; i++)
+    {
+        struct shmIngestLane *lane = shmIngestLane(ingest->header, i);
+        struct connection *conn = &ingest->lanes[i];
+        int state = atomic_load_explicit(&lane->state, memory_order_acquire);
+        if (state != SHM_LANE_ATTACHED && state != SHM_LANE_DETACHED)
+        {
+            continue;
+        }
+        if (!conn->named)
+        {
+            // Records are attributed to the process that claimed the lane, with the uid /proc gives it
+            struct ucred credentials = {.pid = atomic_load(&lane->owner), .uid = (uid_t)-1, .gid = (gid_t)-1};
+            char path[32];
+            struct stat st;
+            snprintf(path, sizeof(path), "/proc/%d", (int)credentials.pid);
+            if (stat(path, &st) == 0)
+            {
+                credentials.uid = st.st_uid;
+            }
+            conn->fd = -1;
+            conn->local = 1;
+            formatCredentials(conn->clientIP, sizeof(conn->clientIP), &credentials);
+            if (setConnectionName(conn, lane->name, lane->nameLength) != 0)
+            {
+                continue;
+            }
+            logConnectionEvent(reactor, conn, "is connected through shared memory");
+        }
+
+        // A lane that was left gets no more records: it is emptied at once
+        struct recordRing *ring = shmIngestRing(lane);
+        struct recordSlot *slot;
+        unsigned long taken = 0;
+        unsigned long bytes = 0;
+        while ((state == SHM_LANE_DETACHED || taken < SHM_INGEST_BATCH) && (slot = recordRingPeek(ring, taken)) != NULL)
+        {
+            // The slot holds a record as protocol.h lays it out, which keeps the time the client stamped it with.
+            // shmIngestPush() takes records of one slot at most; a longer length is not trusted past the slot.
+            uint32_t held = (slot->length < RECORD_SLOT_SIZE) ? slot->length : RECORD_SLOT_SIZE;
+            if (held >= PROTOCOL_RECORD_HEADER)
+            {
+                const unsigned char *record = (const unsigned char *)slot->data;
+                uint32_t length = protocolGet32(record + 8);
+                if (length > held - PROTOCOL_RECORD_HEADER)
+                {
+                    length = held - PROTOCOL_RECORD_HEADER;
+                }
+                logClientRecord(reactor, conn, protocolGet64(record) / 1000000, slot->data + PROTOCOL_RECORD_HEADER, length);
+            }
+            bytes += held;
+            taken++;
+        }
+        recordRingRelease(ring, taken);
+        statsCountClient(conn->statsClient, conn->statsRecords, bytes);
+        conn->statsRecords = 0;
+        if (taken > 0)
+        {
+            ingest->lastRecord = currentTimeMillis();
+        }
+        if (state == SHM_LANE_DETACHED)
+        {
+            releaseIngestLane(reactor, i);
+        }
+        else if (recordRingPeek(ring, 0) != NULL)
+        {
+            more = 1;
+        }
+    }
+    return more;
+}
+
+// Function to drain the shared-memory ingest and tell how long the reactor may then wait for other events, in
+// milliseconds: not at all while records are left, in naps for a while after the last one so that busy producers
+// need not ring, then, once producers know it sleeps, until the doorbell rings (-1)
+int sharedIngestTimeout(struct reactor *reactor)
+{
+    if (drainSharedIngest(reactor))
+    {
+        return 0;
+    }
+    if (currentTimeMillis() - reactor->ingest->lastRecord < SHM_INGEST_LINGER_MS)
+    {
+        return SHM_INGEST_NAP_MS;
+    }
+    return shmIngestSleep(reactor->ingest->header) ? -1 : 0;
+}
+
+// Function to free a lane that was left, once it is empty, for the next process to claim
+void releaseIngestLane(struct reactor *reactor, int lane)
+{
+    struct shmIngestLane *shared = shmIngestLane(reactor->ingest->header, lane);
+    struct connection *conn = &reactor->ingest->lanes[lane];
+
+    if (conn->named)
+    {
+        logConnectionEvent(reactor, conn, "is disconnected");
+        free(conn->prefix);
+    }
+    memset(conn, 0, sizeof(*conn));
+    // A process that died may have reserved a slot it never filled: the ring starts over
+    recordRingInit(shmIngestRing(shared), reactor->ingest->header->slots);
+    atomic_store(&shared->owner, 0);
+    atomic_store(&shared->state, SHM_LANE_FREE);
+}
+
+// Function to mark the lanes of processes that died without detaching as left. It returns 1 when it found some.
+int sweepSharedIngest(struct sharedIngest *ingest)
+{
+    int found = 0;
+
+    for (unsigned int i = 0; i < ingest->header->lanes; i++)
+    {
+        struct shmIngestLane *lane = shmIngestLane(ingest->header, i);
+        int attached = SHM_LANE_ATTACHED;
+        if (atomic_load(&lane->state) == SHM_LANE_ATTACHED && kill(atomic_load(&lane->owner), 0) != 0 && errno == ESRCH &&
+            atomic_compare_exchange_strong(&lane->state, &attached, SHM_LANE_DETACHED))
+        {
+            found = 1;
+        }
+    }
+    return found;
+}
+
+// Function run by the shared-memory ingest process of the fork mode until the server shuts down.
+// It waits on the doorbell itself, without a waker thread.
+void sharedIngestHandler(void)
+{
+    struct reactor sink = {.ingest = sharedIngest}; // No ring: records go through logHandlerSlices()
+    struct shmIngestHeader *header = sharedIngest->header;
+    long long lastSweep = currentTimeMillis();
+
+    statsAttach("shm_ingest");
+    while (husr2 && !atomic_load(&header->closed))
+    {
+        // Read before announcing the sleep, so a ring in between is not missed
+        unsigned int seen = atomic_load(&header->doorbell);
+        if (currentTimeMillis() - lastSweep >= SHM_INGEST_SWEEP_MS)
+        {
+            lastSweep = currentTimeMillis();
+            sweepSharedIngest(sharedIngest);
+        }
+        int timeout = sharedIngestTimeout(&sink);
+        if (timeout == 0)
+        {
+            continue;
+        }
+        // Without announcing a sleep, the wait is just a nap
+        shmIngestWait(header, seen, (timeout > 0) ? timeout : SHM_INGEST_SWEEP_MS);
+        atomic_store(&header->sleeping, 0);
+    }
+    // Producers are turned away, then what they appended is logged
+    shmIngestClose(header);
+    while (drainSharedIngest(&sink))
+    {
+    }
+    statsDetach();
+    exit(EXIT_SUCCESS);
+}
+
+// Function to serve every client from one thread with io_uring: accepts, socket reads and log writes are
+// asynchronous requests. It falls back to the epoll loop when the kernel lacks io_uring or an operation it needs.
+void serverUringLoop(int serverSocket)
+{
+    static const int neededOps[] = {IORING_OP_ACCEPT, IORING_OP_READ_FIXED, IORING_OP_WRITE_FIXED, IORING_OP_RECV, IORING_OP_READ,
+                                    IORING_OP_POLL_ADD};
+    struct uringLoop *loop = calloc(1, sizeof(struct uringLoop));
+    struct stat st;
+
+    if (loop == NULL)
+    {
+        error("ERROR allocating the uring loop");
+    }
+    if (uringInit(&loop->ring, URING_ENTRIES) != 0 || !(loop->ring.features & IORING_FEAT_EXT_ARG) ||
+        !uringSupports(&loop->ring, neededOps, sizeof(neededOps) / sizeof(neededOps[0])))
+    {
+        fprintf(stderr, "io_uring is not available, using the epoll mode.\n");
+        if (loop->ring.fd > 0)
+        {
+            uringExit(&loop->ring);
+        }
+        free(loop);
+        serverEpollLoop(serverSocket);
+        return;
+    }
+
+    // Registered buffers: the two staging buffers, then every connection slot as one buffer
+    loop->slotSize = (CONNECTION_BUFFER_SIZE > MAX_LINE_LENGTH + TEXT_READ_SIZE) ? CONNECTION_BUFFER_SIZE : MAX_LINE_LENGTH + TEXT_READ_SIZE;
+    loop->stagingSize = (BATCH_BYTES > CONNECTION_BUFFER_SIZE + 1024) ? BATCH_BYTES : CONNECTION_BUFFER_SIZE + 1024;
+    URING_CONNECTIONS = (URING_CONNECTIONS > 0) ? URING_CONNECTIONS : 1;
+    loop->slots = malloc((size_t)URING_CONNECTIONS * loop->slotSize);
+    loop->freeSlots = malloc(URING_CONNECTIONS * sizeof(int));
+    loop->staging[0] = malloc(loop->stagingSize);
+    loop->staging[1] = malloc(loop->stagingSize);
+    if (loop->slots == NULL || loop->freeSlots == NULL || loop->staging[0] == NULL || loop->staging[1] == NULL)
+    {
+        error("ERROR allocating the uring buffers");
+    }
+    for (int i = 0; i < URING_CONNECTIONS; i++)
+    {
+        loop->freeSlots[i] = URING_CONNECTIONS - 1 - i;
+    }
+    loop->numberOfFreeSlots = URING_CONNECTIONS;
+    struct iovec buffers[3] = {
+        {.iov_base = loop->staging[0], .iov_len = loop->stagingSize},
+        {.iov_base = loop->staging[1], .iov_len = loop->stagingSize},
+        {.iov_base = loop->slots, .iov_len = (size_t)URING_CONNECTIONS * loop->slotSize},
+    };
+    if (uringRegisterBuffers(&loop->ring, buffers, 3) != 0)
+    {
+        error("ERROR registering the uring buffers");
+    }
+    // The active segment is registered file 0
+    loop->stream = &logStreams[0];
+    if (openActiveLogFile(loop->stream) != 0 || uringRegisterFiles(&loop->ring, &loop->stream->fd, 1) != 0)
+    {
+        error("ERROR registering the log file");
+    }
+
+    loop->reactor.epollFd = -1;
+    loop->reactor.serverSocket = serverSocket;
+    loop->reactor.controlFd = STDIN_FILENO;
+    loop->reactor.uring = loop;
+    loop->writing = -1;
+    // io_uring waits for readiness itself; a non-blocking socket would make the accept fail with EAGAIN instead
+    fcntl(serverSocket, F_SETFL, fcntl(serverSocket, F_GETFL, 0) & ~O_NONBLOCK);
+    uringArmAccept(loop, 0);
+    loop->reactor.unixSocket = unixServerSocket;
+    if (unixServerSocket != -1)
+    {
+        fcntl(unixServerSocket, F_SETFL, fcntl(unixServerSocket, F_GETFL, 0) & ~O_NONBLOCK);
+        uringArmAccept(loop, 1);
+    }
+    // The datagram sockets stay non-blocking: a poll request tells when to drain them with recvmmsg()
+    openDatagramReceivers(loop->reactor.datagrams, 1);
+    for (int i = 0; i < DATAGRAM_SOCKETS; i++)
+    {
+        if (loop->reactor.datagrams[i] != NULL)
+        {
+            uringArmDatagrams(loop, i);
+        }
+    }
+    // So does the doorbell of the shared-memory ingest, rung by its waker thread
+    startIngestWaker(&loop->reactor);
+    if (loop->reactor.ingest != NULL)
+    {
+        uringArmIngest(loop);
+    }
+    // Like the epoll mode, stdin is only watched when it can signal the quit command
+    if (fstat(STDIN_FILENO, &st) == 0 && (S_ISFIFO(st.st_mode) || S_ISSOCK(st.st_mode) || isatty(STDIN_FILENO)))
+    {
+        uringArmControl(loop);
+    }
+    else
+    {
+        fprintf(stderr, "Warning: stdin cannot be watched\n");
+    }
+
+    while (!terminate)
+    {
+        // Records of the shared-memory ingest are staged with the others
+        int timeout = logSyncDueIn(loop->stream);
+        int ingestTimeout = (loop->reactor.ingest != NULL) ? sharedIngestTimeout(&loop->reactor) : -1;
+        if (ingestTimeout >= 0 && (timeout < 0 || ingestTimeout < timeout))
+        {
+            timeout = ingestTimeout;
+        }
+        uringFlush(loop);
+        // Sleep until a completion arrives or the interval fsync policy is due; a signal also wakes us up
+        if (uringSubmitAndWait(&loop->ring, timeout == 0 ? 0 : 1, timeout) < 0 && errno != EINTR && errno != ETIME)
+        {
+            perror("io_uring_enter error");
+        }
+        if (loop->reactor.ingest != NULL)
+        {
+            atomic_store(&loop->reactor.ingest->header->sleeping, 0);
+        }
+        checkStatsRequest();
+        if (loop->writing == -1 && logSyncDueIn(loop->stream) == 0)
+        {
+            syncLogSegment(loop->stream);
+        }
+
+        while (!terminate)
+        {
+            struct io_uring_cqe event;
+            struct io_uring_cqe *cqe;
+            if (loop->numberOfDeferred > 0)
+            {
+                event = loop->deferred[--loop->numberOfDeferred];
+            }
+            else if ((cqe = uringPeekCqe(&loop->ring)) != NULL)
+            {
+                event = *cqe;
+                uringCqeSeen(&loop->ring);
+            }
+            else
+            {
+                break;
+            }
+            uringHandleCompletion(loop, &event);
+        }
+    }
+
+    if (loop->reactor.ingest != NULL)
+    {
+        shmIngestClose(loop->reactor.ingest->header);
+        while (drainSharedIngest(&loop->reactor))
+        {
+        }
+    }
+    // Write out what is staged before the shutdown message
+    for (int i = 0; i < 2; i++)
+    {
+        uringWaitForWrite(loop);
+        uringFlush(loop);
+    }
+    uringWaitForWrite(loop);
+    if (FSYNC_POLICY != FSYNC_NONE)
+    {
+        syncLogSegment(loop->stream);
+    }
+    // Tearing the ring down cancels the reads still pending, then the connections can go
+    uringExit(&loop->ring);
+    stopIngestWaker(&loop->reactor);
+    while (loop->reactor.connections != NULL)
+    {
+        uringCloseConnection(loop, loop->reactor.connections);
+    }
+    freeReactorMemory(&loop->reactor);
+    free(loop->slots);
+    free(loop->freeSlots);
+    free(loop->staging[0]);
+    free(loop->staging[1]);
+    free(loop->deferred);
+    for (int i = 0; i < DATAGRAM_SOCKETS; i++)
+    {
+        closeDatagramReceiver(loop->reactor.datagrams[i]);
+    }
+    free(loop);
+
+    write(STDOUT_FILENO, "Server is closed.\n", 19);
+    // Clean up
+    sem_destroy(sem_ptr);
+    shutdown(serverSocket, SHUT_RDWR);
+    close(serverSocket);
+    sem_unlink(SEM_NAME);
+}
+
+// Function to get a submission entry, handing the queued ones to the kernel first when the queue is full
+struct io_uring_sqe *uringSqe(struct uringLoop *loop)
+{
+    struct io_uring_sqe *sqe;
+
+    while ((sqe = uringGetSqe(&loop->ring)) == NULL)
+    {
+        if (uringSubmitAndWait(&loop->ring, 0, -1) < 0 && errno != EINTR)
+        {
+            error("ERROR submitting to io_uring");
+        }
+    }
+    return sqe;
+}
+
+// Function to queue the accept of the next client
+void uringArmAccept(struct uringLoop *loop, int local)
+{
+    struct io_uring_sqe *sqe = uringSqe(loop);
+
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    // A local client has no address to keep, the kernel gives its credentials instead
+    if (local)
+    {
+        sqe->fd = loop->reactor.unixSocket;
+        sqe->user_data = URING_UNIX_ACCEPT;
+        return;
+    }
+    loop->clientLen = sizeof(loop->clientAddr);
+    sqe->fd = loop->reactor.serverSocket;
+    sqe->addr = (unsigned long)&loop->clientAddr;
+    sqe->addr2 = (unsigned long)&loop->clientLen;
+    sqe->user_data = URING_ACCEPT;
+}
+
+// Function to queue a read of stdin, where the quit command comes from
+void uringArmControl(struct uringLoop *loop)
+{
+    struct io_uring_sqe *sqe = uringSqe(loop);
+
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = STDIN_FILENO;
+    sqe->addr = (unsigned long)loop->control;
+    sqe->len = sizeof(loop->control);
+    sqe->user_data = URING_CONTROL;
+}
+
+// Function to queue a wait for datagrams on one of the datagram sockets
+void uringArmDatagrams(struct uringLoop *loop, int socket)
+{
+    struct io_uring_sqe *sqe = uringSqe(loop);
+
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = loop->reactor.datagrams[socket]->fd;
+    sqe->poll32_events = POLLIN;
+    sqe->user_data = URING_DATAGRAMS + socket;
+}
+
+// Function to queue a wait for the waker thread of the shared-memory ingest
+void uringArmIngest(struct uringLoop *loop)
+{
+    struct io_uring_sqe *sqe = uringSqe(loop);
+
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = loop->reactor.ingest->wakeFd;
+    sqe->poll32_events = POLLIN;
+    sqe->user_data = URING_SHM_INGEST;
+}
+
+// Function to queue a read into the free end of a connection buffer: a fixed read when the buffer is
+// one of the registered slots, a plain receive for the connections beyond uring_connections
+void uringArmRead(struct uringLoop *loop, struct connection *conn)
+{
+    struct io_uring_sqe *sqe = uringSqe(loop);
+    int registered = conn->buffer >= loop->slots && conn->buffer < loop->slots + (size_t)URING_CONNECTIONS * loop->slotSize;
+
+    sqe->opcode = registered ? IORING_OP_READ_FIXED : IORING_OP_RECV;
+    sqe->fd = conn->fd;
+    sqe->addr = (unsigned long)(conn->buffer + conn->bufferLength);
+    sqe->len = conn->bufferCapacity - conn->bufferLength;
+    sqe->buf_index = 2;
+    sqe->user_data = (unsigned long)conn;
+}
+
+// Function to dispatch one completion
+void uringHandleCompletion(struct uringLoop *loop, const struct io_uring_cqe *cqe)
+{
+    char *buffer = loop->control;
+
+    switch (cqe->user_data)
+    {
+    case URING_ACCEPT:
+    case URING_UNIX_ACCEPT:
+        uringAcceptDone(loop, cqe->res, cqe->user_data == URING_UNIX_ACCEPT);
+        break;
+    case URING_CONTROL:
+        // On stdin, ctrl+d perfomed or quit typed means the server has to quit
+        if (cqe->res <= 0 || strncmp(buffer, "quit", 4) == 0)
+        {
+            terminate = 1;
+        }
+        else
+        {
+            uringArmControl(loop);
+        }
+        break;
+    case URING_WRITE:
+        uringWriteDone(loop, cqe->res);
+        break;
+    case URING_DATAGRAMS + DATAGRAM_UDP:
+    case URING_DATAGRAMS + DATAGRAM_UNIX:
+        receiveDatagrams(&loop->reactor, loop->reactor.datagrams[cqe->user_data - URING_DATAGRAMS]);
+        uringArmDatagrams(loop, cqe->user_data - URING_DATAGRAMS);
+        break;
+    case URING_SHM_INGEST:
+    {
+        // The lanes are drained at the top of the loop
+        uint64_t count;
+        read(loop->reactor.ingest->wakeFd, &count, sizeof(count));
+        uringArmIngest(loop);
+        break;
+    }
+    default:
+        uringReadDone(loop, (struct connection *)(unsigned long)cqe->user_data, cqe->res);
+        break;
+    }
+}
+
+// Function to set up the connection of an accepted client and queue its first read
+void uringAcceptDone(struct uringLoop *loop, int clientSocket, int local)
+{
+    uringArmAccept(loop, local);
+    if (clientSocket < 0)
+    {
+        if (clientSocket != -EINTR && clientSocket != -EAGAIN)
+        {
+            errno = -clientSocket;
+            perror("ERROR on accept");
+        }
+        return;
+    }
+
+    struct connection *conn = allocateConnection(&loop->reactor);
+    if (conn == NULL)
+    {
+        close(clientSocket);
+        return;
+    }
+    // The accept and the reads are asynchronous: they are counted, not timed
+    statsStop(STATS_STAGE_ACCEPT, 0, 0);
+    conn->fd = clientSocket;
+    setConnectionPeer(conn, local ? NULL : &loop->clientAddr);
+    if (loop->numberOfFreeSlots > 0)
+    {
+        conn->buffer = loop->slots + (size_t)loop->freeSlots[--loop->numberOfFreeSlots] * loop->slotSize;
+        conn->bufferCapacity = loop->slotSize;
+    }
+    else
+    {
+        conn->bufferCapacity = MAX_LINE_LENGTH + TEXT_READ_SIZE;
+        conn->buffer = borrowBuffer(&loop->reactor, conn->bufferCapacity);
+        if (conn->buffer == NULL)
+        {
+            close(clientSocket);
+            conn->next = loop->reactor.freeConnections;
+            loop->reactor.freeConnections = conn;
+            return;
+        }
+    }
+    conn->next = loop->reactor.connections;
+    if (loop->reactor.connections != NULL)
+    {
+        loop->reactor.connections->prev = conn;
+    }
+    loop->reactor.connections = conn;
+    uringArmRead(loop, conn);
+}
+
+// Function to parse what a read brought in and queue the next one, or close the connection
+void uringReadDone(struct uringLoop *loop, struct connection *conn, int result)
+{
+    size_t requested = conn->bufferCapacity - conn->bufferLength;
+    int closing;
+
+    if (result == -EINTR || result == -EAGAIN)
+    {
+        uringArmRead(loop, conn);
+        return;
+    }
+    if (result < 0)
+    {
+        errno = -result;
+        perror("ERROR reading from client");
+        uringCloseConnection(loop, conn);
+        return;
+    }
+    statsStop(STATS_STAGE_READ, 0, result);
+    closing = receiveData(&loop->reactor, conn, result);
+    // A read that did not fill the buffer drained the socket: for legacy text clients that is a whole message
+    if (!closing && !conn->binary && (size_t)result < requested)
+    {
+        closing = processLines(&loop->reactor, conn, PARSE_DRAINED);
+    }
+    if (closing)
+    {
+        uringCloseConnection(loop, conn);
+        return;
+    }
+    uringArmRead(loop, conn);
+}
+
+// Function to close a connection of the uring mode, giving its registered buffer back
+void uringCloseConnection(struct uringLoop *loop, struct connection *conn)
+{
+    if (conn->buffer >= loop->slots && conn->buffer < loop->slots + (size_t)URING_CONNECTIONS * loop->slotSize)
+    {
+        loop->freeSlots[loop->numberOfFreeSlots++] = (conn->buffer - loop->slots) / loop->slotSize;
+        conn->buffer = NULL;
+    }
+    closeConnection(&loop->reactor, conn);
+}
+
+// Function to append a record to the staging buffer being filled. When it is full, the write in
+// flight is waited for and this buffer starts being written.
+void uringQueueRecord(struct uringLoop *loop, const struct iovec *slices, int count)
+{
+    size_t length = 0;
+    for (int i = 0; i < count; i++)
+    {
+        length += slices[i].iov_len;
+    }
+    if (loop->stagingLength[loop->filling] + length > loop->stagingSize)
+    {
+        uringWaitForWrite(loop);
+        uringFlush(loop);
+    }
+    if (length > loop->stagingSize)
+    {
+        length = loop->stagingSize; // Cannot happen: a record is at most a frame plus its prefix
+    }
+
+    char *p = loop->staging[loop->filling] + loop->stagingLength[loop->filling];
+    for (int i = 0; i < count && length > 0; i++)
+    {
+        size_t part = (slices[i].iov_len < length) ? slices[i].iov_len : length;
+        memcpy(p, slices[i].iov_base, part);
+        p += part;
+        length -= part;
+    }
+    loop->stagingLength[loop->filling] = p - loop->staging[loop->filling];
+    if (statsTracing != 0)
+    {
+        uringTraceRecord(loop, statsTracing);
+    }
+}
+
+// Function to have a traced record, just staged, followed through the write of its staging buffer
+void uringTraceRecord(struct uringLoop *loop, int trace)
+{
+    if (loop->numberOfTraces[loop->filling] == STATS_TRACE_PENDING)
+    {
+        statsTraceCancel(trace);
+        return;
+    }
+    statsTraceMark(trace, STATS_TRACE_ENQUEUED);
+    loop->traces[loop->filling][loop->numberOfTraces[loop->filling]++] = trace;
+}
+
+// Function to hand the traced records of a staging buffer to the stream, which follows them through their write
+void uringHandOverTraces(struct uringLoop *loop, int buffer)
+{
+    for (int i = 0; i < loop->numberOfTraces[buffer]; i++)
+    {
+        traceLogRecord(loop->stream, loop->traces[buffer][i]);
+    }
+    loop->numberOfTraces[buffer] = 0;
+}
+
+// Function to start writing the staging buffer being filled, if it holds records and no write is in flight.
+// Segments written through a mapping are simply copied to it, and binary segments are encoded and written
+// by writeLogBatch() as well.
+void uringFlush(struct uringLoop *loop)
+{
+    if (loop->writing != -1 || loop->stagingLength[loop->filling] == 0)
+    {
+        return;
+    }
+    if (MMAP_SEGMENTS || SEGMENT_FORMAT == SEGMENT_FORMAT_BINARY)
+    {
+        struct iovec iov = {.iov_base = loop->staging[loop->filling], .iov_len = loop->stagingLength[loop->filling]};
+        uringHandOverTraces(loop, loop->filling);
+        if (writeLogBatch(loop->stream, &iov, 1) != 0)
+        {
+            error("Error writing.");
+        }
+        loop->stagingLength[loop->filling] = 0;
+        return;
+    }
+    loop->writing = loop->filling;
+    loop->filling ^= 1;
+    loop->written = 0;
+    // Timed from submission to completion
+    loop->writeStarted = statsStart(STATS_STAGE_WRITE);
+    uringSubmitWrite(loop);
+}
+
+// Function to queue the write of what is left of the staging buffer being written.
+// It appends to the registered segment: offset -1 means the file position, and the file is in append mode.
+void uringSubmitWrite(struct uringLoop *loop)
+{
+    struct io_uring_sqe *sqe = uringSqe(loop);
+
+    sqe->opcode = IORING_OP_WRITE_FIXED;
+    sqe->flags = IOSQE_FIXED_FILE;
+    sqe->fd = 0;
+    sqe->off = (unsigned long long)-1;
+    sqe->addr = (unsigned long)(loop->staging[loop->writing] + loop->written);
+    sqe->len = loop->stagingLength[loop->writing] - loop->written;
+    sqe->buf_index = loop->writing;
+    sqe->user_data = URING_WRITE;
+}
+
+// Function to account a completed log write: retry a short write, then apply the fsync policy and rotate
+// the segment when it is full, like writeLogBatch()
+void uringWriteDone(struct uringLoop *loop, int result)
+{
+    if (result < 0 && result != -EINTR && result != -EAGAIN)
+    {
+        errno = -result;
+        error("Error writing.");
+    }
+    if (result > 0)
+    {
+        loop->written += result;
+        loop->stream->state->activeSize += result;
+    }
+    if (loop->written < loop->stagingLength[loop->writing])
+    {
+        uringSubmitWrite(loop);
+        return;
+    }
+    statsStop(STATS_STAGE_WRITE, loop->writeStarted, loop->written);
+    // Indexed once written, so a span never lists records of the other staging buffer
+    if (loop->stream->sidecar != NULL)
+    {
+        struct iovec written = {.iov_base = loop->staging[loop->writing], .iov_len = loop->stagingLength[loop->writing]};
+        sidecarObserve(loop->stream->sidecar, &written, 1);
+    }
+    loop->stagingLength[loop->writing] = 0;
+    uringHandOverTraces(loop, loop->writing);
+    logTracesWritten(loop->stream);
+    loop->writing = -1;
+    loop->stream->dirty = 1;
+
+    if (FSYNC_POLICY == FSYNC_BATCH || logSyncDueIn(loop->stream) == 0)
+    {
+        syncLogSegment(loop->stream);
+    }
+    if (loop->stream->sidecar != NULL && loop->stream->sidecar->records >= (uint32_t)INDEX_INTERVAL)
+    {
+        writeLogSidecar(loop->stream, 0);
+    }
+    if (loop->stream->state->activeSize > LOG_FILE_THRESHOLD)
+    {
+        long long rotateStarted = statsStart(STATS_STAGE_ROTATE);
+        if (FSYNC_POLICY != FSYNC_NONE)
+        {
+            syncLogSegment(loop->stream);
+        }
+        writeLogSidecar(loop->stream, 1);
+        closeLogSegment(loop->stream);
+        rotateLog(loop->stream);
+        if (uringUpdateFile(&loop->ring, 0, loop->stream->fd) < 0)
+        {
+            error("ERROR registering the log file");
+        }
+        statsStop(STATS_STAGE_ROTATE, rotateStarted, 0);
+    }
+}
+
+// Function to wait until no log write is in flight. Other completions that arrive meanwhile are
+// set aside for the main loop.
+void uringWaitForWrite(struct uringLoop *loop)
+{
+    while (loop->writing != -1)
+    {
+        if (uringSubmitAndWait(&loop->ring, 1, -1) < 0 && errno != EINTR)
+        {
+            error("ERROR waiting for io_uring");
+        }
+        struct io_uring_cqe *cqe;
+        while ((cqe = uringPeekCqe(&loop->ring)) != NULL)
+        {
+            struct io_uring_cqe event = *cqe;
+            uringCqeSeen(&loop->ring);
+            if (event.user_data == URING_WRITE)
+            {
+                uringWriteDone(loop, event.res);
+                continue;
+            }
+            if (loop->numberOfDeferred == loop->deferredCapacity)
+            {
+                int capacity = (loop->deferredCapacity > 0) ? loop->deferredCapacity * 2 : 64;
+                struct io_uring_cqe *deferred = realloc(loop->deferred, capacity * sizeof(struct io_uring_cqe));
+                if (deferred == NULL)
+                {
+                    error("ERROR allocating deferred completions");
+                }
+                loop->deferred = deferred;
+                loop->deferredCapacity = capacity;
+            }
+            loop->deferred[loop->numberOfDeferred++] = event;
+        }
+    }
+}
+
+// Function to hand a formatted message to the log
+void submitLogMessage(struct reactor *reactor, int stream, const char *logMessage)
+{
+    struct iovec slice = {.iov_base = (void *)logMessage, .iov_len = strlen(logMessage)};
+    submitLogSlices(reactor, stream, &slice, 1);
+}
+
+// Function to hand a record made of slices to the log: written directly to the given stream, or gathered
+// into a slot of the reactor's ring to the writer of that stream. 'slices' may be modified.
+void submitLogSlices(struct reactor *reactor, int stream, struct iovec *slices, int count)
+{
+    if (reactor->uring != NULL)
+    {
+        uringQueueRecord(reactor->uring, slices, count);
+        return;
+    }
+    if (reactor->rings == NULL)
+    {
+        logHandlerSlices(&logStreams[stream], slices, count);
+        return;
+    }
+    pushLogRecord(&reactor->writers[stream], reactor->rings[stream], slices, count);
+}
+
+// Function to publish a record to one of the writer stage's rings.
+// Producers never touch the disk; when the ring is full ring_full_policy decides between waiting and discarding.
+void pushLogRecord(struct writerStage *writer, struct recordRing *ring, const struct iovec *slices, int count)
+{
+    int trace = statsTracing;
+    int waited = 0;
+    long long waitStarted = 0;
+
+    // A traced record is stamped before it is published: the writer may take it at once
+    statsTraceMark(trace, STATS_TRACE_ENQUEUED);
+    while (recordRingPushTagged(ring, slices, count, trace) != 0)
+    {
+        if (RING_FULL_POLICY == RING_FULL_COUNT)
+        {
+            atomic_fetch_add(&writer->dropped, 1);
+        }
+        if (RING_FULL_POLICY != RING_FULL_BLOCK)
+        {
+            statsTraceCancel(trace);
+            return;
+        }
+        // Only a full ring is timed, the common case costs nothing
+        if (!waited)
+        {
+            waited = 1;
+            waitStarted = statsStart(STATS_STAGE_RING_WAIT);
+        }
+        wakeWriter(writer);
+        sched_yield();
+        statsTraceMark(trace, STATS_TRACE_ENQUEUED);
+    }
+    if (waited)
+    {
+        statsStop(STATS_STAGE_RING_WAIT, waitStarted, 0);
+    }
+    wakeWriter(writer);
+}
+
+// Function to fork the log writer processes of the fork mode, one per stream. It sets the writer of each stream,
+// so logHandlerSlices() feeds its ring. They share one lifeline, which hangs up once every producer has exited.
+void startWriterProcesses(void)
+{
+    int lifeline[2];
+
+    if (RING_SLOTS < 2 || (RING_SLOTS & (RING_SLOTS - 1)) != 0)
+    {
+        fprintf(stderr, "ring_slots must be a power of two, using 1024.\n");
+        RING_SLOTS = 1024;
+    }
+    // Set before any client process is forked, so they all split lines at the same length
+    fitLinesToRing();
+    if (pipe(lifeline) < 0)
+    {
+        error("ERROR setting up the writer process");
+    }
+
+    for (int i = 0; i < SHARDS; i++)
+    {
+        // The ring and the stage live in shared mappings so every client process forked later publishes into them
+        struct writerStage *writer = allocateShared(sizeof(struct writerStage));
+        struct recordRing *ring = allocateShared(recordRingSize(RING_SLOTS));
+        recordRingInit(ring, RING_SLOTS);
+        writer->rings = calloc(1, sizeof(struct recordRing *));
+        writer->wakeFd = eventfd(0, 0);
+        if (writer->rings == NULL || writer->wakeFd < 0)
+        {
+            error("ERROR setting up the writer process");
+        }
+        writer->rings[0] = ring;
+        writer->numberOfRings = 1;
+        writer->stream = &logStreams[i];
+        writer->lifelineFd = lifeline[0];
+
+        pid_t id = fork();
+        if (id == -1)
+        {
+            error("ERROR forking the writer process");
+        }
+        if (id == 0)
+        {
+            // Like client processes, the writer leaves SIGUSR1 and SIGINT to the parent; SIGUSR2 stays ignored
+            // so it keeps draining while the clients shut down.
+            signal(SIGUSR1, SIG_IGN);
+            signal(SIGINT, SIG_IGN);
+            close(lifeline[1]);
+            writerThread(writer);
+            exit(EXIT_SUCCESS);
+        }
+        logStreams[i].writer = writer;
+    }
+
+    close(lifeline[0]);
+    lifelineWriteFd = lifeline[1];
+}
+
+// Function to have the record of a text line fit a ring of the writer stage whole: max_line_length is capped
+// to what the ring holds, so a longer line is split into several records like any line over the limit
+void fitLinesToRing(void)
+{
+    int slots = (RING_SLOTS < RECORD_MAX_SLOTS) ? RING_SLOTS : RECORD_MAX_SLOTS;
+    int holds = slots * RECORD_SLOT_SIZE - RECORD_PREFIX_ROOM;
+
+    if (MAX_LINE_LENGTH > holds)
+    {
+        fprintf(stderr, "max_line_length is more than a log ring holds, using %d.\n", holds);
+        MAX_LINE_LENGTH = holds;
+    }
+}
+
+// Function to wake the writer stage if it is sleeping
+void wakeWriter(struct writerStage *writer)
+{
+    // Pairs with the fence in writerThread(): either the writer sees the new record or we see it sleeping
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&writer->sleeping, memory_order_relaxed))
+    {
+        uint64_t one = 1;
+        write(writer->wakeFd, &one, sizeof(one));
+    }
+}
+
+// Function run by the writer stage: it is the only one writing the log segment while reactors are running
+void *writerThread(void *arg)
+{
+    struct writerStage *writer = arg;
+    struct pollfd wake[2] = {{.fd = writer->wakeFd, .events = POLLIN}, {.fd = writer->lifelineFd, .events = POLLIN}};
+    struct iovec iov[IOV_MAX];
+    unsigned long *pending = calloc(writer->numberOfRings, sizeof(unsigned long)); // Records of each ring in the batch
+    int traced[STATS_TRACE_PENDING]; // Traces of the records of the batch
+    int numberOfTraced = 0;
+    int maxRecords = (BATCH_RECORDS > 0 && BATCH_RECORDS < IOV_MAX) ? BATCH_RECORDS : IOV_MAX;
+    int records = 0;
+    int parts = 0; // Entries of 'iov', a record taking several slots has one per slot
+    size_t bytes = 0;
+    long long deadline = 0;
+    uint64_t count;
+
+    if (pending == NULL)
+    {
+        error("ERROR allocating writer batch");
+    }
+    statsAttach("writer");
+
+    while (1)
+    {
+        // Gather published records into the batch. They stay in their slots until the batch is written, so no copy is made.
+        int added = 0;
+        int ringFull = 0;
+        for (int i = 0; i < writer->numberOfRings; i++)
+        {
+            struct recordSlot *slot;
+            while (records < maxRecords && bytes < (size_t)BATCH_BYTES && parts + RECORD_MAX_SLOTS <= IOV_MAX &&
+                   (slot = recordRingPeek(writer->rings[i], pending[i])) != NULL)
+            {
+                int slots = recordRingParts(writer->rings[i], pending[i], iov + parts);
+                if (slot->tag != 0 && numberOfTraced < STATS_TRACE_PENDING)
+                {
+                    traced[numberOfTraced++] = slot->tag;
+                }
+                else if (slot->tag != 0)
+                {
+                    statsTraceCancel(slot->tag);
+                }
+                records++;
+                parts += slots;
+                bytes += slot->length;
+                pending[i] += slots;
+                added++;
+            }
+            // Producers, of a long record at least, cannot make progress until this batch is written. A ring
+            // smaller than the longest record is only full when every slot is taken: that record is cut to fit it.
+            unsigned long headroom = (writer->rings[i]->mask < RECORD_MAX_SLOTS) ? 1 : RECORD_MAX_SLOTS;
+            if (pending[i] + headroom > writer->rings[i]->mask + 1)
+            {
+                ringFull = 1;
+            }
+        }
+        if (records > 0 && deadline == 0)
+        {
+            deadline = currentTimeMillis() + FLUSH_INTERVAL_MS;
+        }
+
+        // Group commit: one writev() for the whole batch
+        int batchFull = records >= maxRecords || bytes >= (size_t)BATCH_BYTES || parts + RECORD_MAX_SLOTS > IOV_MAX || ringFull;
+        if (records > 0 && (batchFull || atomic_load(&writer->stop) || (added == 0 && currentTimeMillis() >= deadline)))
+        {
+            for (int i = 0; i < numberOfTraced; i++)
+            {
+                traceLogRecord(writer->stream, traced[i]);
+            }
+            numberOfTraced = 0;
+            if (writeLogBatch(writer->stream, iov, parts) != 0)
+            {
+                error("Error writing.");
+            }
+            for (int i = 0; i < writer->numberOfRings; i++)
+            {
+                recordRingRelease(writer->rings[i], pending[i]);
+                pending[i] = 0;
+            }
+            records = 0;
+            parts = 0;
+            bytes = 0;
+            deadline = 0;
+            continue;
+        }
+        if (added > 0)
+        {
+            continue;
+        }
+
+        unsigned long dropped = atomic_exchange(&writer->dropped, 0);
+        if (dropped > 0)
+        {
+            char droppedMessage[256];
+            char timeStr[128];
+            getCurrentTime(timeStr);
+            int length = snprintf(droppedMessage, sizeof(droppedMessage), "[%s] %lu records dropped, log ring full.\n", timeStr, dropped);
+            writeLogRecord(writer->stream, droppedMessage, length);
+        }
+        unsigned long truncated = 0;
+        for (int i = 0; i < writer->numberOfRings; i++)
+        {
+            truncated += atomic_exchange(&writer->rings[i]->truncated, 0);
+        }
+        if (truncated > 0)
+        {
+            char truncatedMessage[256];
+            char timeStr[128];
+            getCurrentTime(timeStr);
+            int length = snprintf(truncatedMessage, sizeof(truncatedMessage), "[%s] %lu records truncated, longer than a log ring holds.\n",
+                                  timeStr, truncated);
+            writeLogRecord(writer->stream, truncatedMessage, length);
+        }
+        // The interval fsync policy is due and no write is coming to trigger it
+        if (logSyncDueIn(writer->stream) == 0)
+        {
+            syncLogSegment(writer->stream);
+        }
+        // Every ring was empty and no producer is left
+        if (records == 0 && atomic_load(&writer->stop))
+        {
+            break;
+        }
+
+        // Sleep until a record arrives, the batch deadline passes or the interval sync is due
+        int timeout = logSyncDueIn(writer->stream);
+        if (records > 0)
+        {
+            int left = (int)(deadline - currentTimeMillis());
+            left = (left > 0) ? left : 0;
+            timeout = (timeout < 0 || left < timeout) ? left : timeout;
+        }
+
+        // Announce we are going to sleep, then look once more so a record pushed meanwhile is not missed
+        atomic_store_explicit(&writer->sleeping, 1, memory_order_relaxed);
+        atomic_thread_fence(memory_order_seq_cst);
+        int ready = atomic_load(&writer->stop);
+        for (int i = 0; i < writer->numberOfRings && !ready; i++)
+        {
+            ready = recordRingPeek(writer->rings[i], pending[i]) != NULL;
+        }
+        // A negative lifelineFd is ignored by poll(), only the writer process has one
+        if (!ready && poll(wake, 2, timeout) > 0)
+        {
+            if (wake[0].revents & POLLIN)
+            {
+                read(writer->wakeFd, &count, sizeof(count));
+            }
+            if (wake[1].revents & (POLLIN | POLLHUP))
+            {
+                wake[1].fd = -1;
+                atomic_store(&writer->stop, 1);
+            }
+        }
+        atomic_store_explicit(&writer->sleeping, 0, memory_order_relaxed);
+    }
+
+    // Whatever the policy, the last records are made durable on a clean shutdown
+    if (FSYNC_POLICY != FSYNC_NONE)
+    {
+        syncLogSegment(writer->stream);
+    }
+    free(pending);
+    statsDetach();
+    return NULL;
+}
+
+// Function for handling errors and exiting the program.
+void error(const char *msg)
+{
+    perror(msg); // Print the error message passed to the function along with the system error message.
+    exit(1);     // Exit the program with a non-zero status, indicating that an error occurred.
+}
+
+// Function to get the size of a file.
+off_t getFileSize(const char *filename)
+{
+    struct stat st; // Declare a stat struct to store file information.
+
+    // Call 'stat' on the filename. If successful, 'stat' fills in 'st' with file details.
+    if (stat(filename, &st) == 0)
+    {
+        return st.st_size; // Return the size of the file (in bytes)
+    }
+    else
+    {
+        return -1; // Error occurred
+    }
+}
+
+// Function to read server configuration from a file.
+int readConfig(int *port, char *directory)
+{
+    // Open the configuration file in read-only mode.
+    int fd = open("config.txt", O_RDONLY);
+    struct stat st;
+    char *buffer;
+    ssize_t bytes_read = 0;
+    char *line;
+    char key[MAX_CONFIG_LINE_LENGTH];
+    char value[MAX_CONFIG_LINE_LENGTH];
+
+    // Check if the file was successfully opened.
+    if (fd < 0)
+    {
+        error("Error opening config file");
+    }
+
+    // Read the whole file into 'buffer', sized from the file so no key is left out
+    if (fstat(fd, &st) < 0 || (buffer = malloc(st.st_size + 1)) == NULL)
+    {
+        close(fd);
+        error("Error reading config file");
+    }
+    while (bytes_read < st.st_size)
+    {
+        ssize_t n = read(fd, buffer + bytes_read, st.st_size - bytes_read);
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n <= 0)
+        {
+            break;
+        }
+        bytes_read += n;
+    }
+
+    // Check if the read operation was successful.
+    if (bytes_read <= 0)
+    {
+        close(fd);
+        error("Error reading config file");
+    }
+
+    buffer[bytes_read] = '\0'; // Null-terminate the buffer to create a valid C string.
+
+    line = strtok(buffer, "\n"); // Tokenize the buffer to read it line by line.
+
+    while (line != NULL)
+    {
+
+        // Parse key=value; a line longer than MAX_CONFIG_LINE_LENGTH is cut
+        key[0] = '\0';
+        value[0] = '\0';
+        sscanf(line, "%999[^=]=%999s", key, value);
+        // If the key is "port", convert the value to integer and store it in 'port'.
+        if (strcmp(key, "port") == 0)
+        {
+            *port = atoi(value);
+        }
+        // If the key is "directory", copy the value to 'directory'
+        else if (strcmp(key, "directory") == 0)
+        {
+            strcpy(directory, value);
+        }
+        else if (strcmp(key, "log_file_threshold") == 0)
+        {
+            LOG_FILE_THRESHOLD = atoi(value);
+        }
+        else if (strcmp(key, "max_log_files") == 0)
+        {
+            MAX_LOG_FILES = atoi(value);
+        }
+        else if (strcmp(key, "server_mode") == 0)
+        {
+            if (strcmp(value, "epoll") == 0)
+            {
+                SERVER_MODE = SERVER_MODE_EPOLL;
+            }
+            else if (strcmp(value, "uring") == 0)
+            {
+                SERVER_MODE = SERVER_MODE_URING;
+            }
+            else
+            {
+                SERVER_MODE = SERVER_MODE_FORK;
+            }
+        }
+        else if (strcmp(key, "max_line_length") == 0)
+        {
+            MAX_LINE_LENGTH = atoi(value);
+            if (MAX_LINE_LENGTH < 1)
+            {
+                MAX_LINE_LENGTH = 1024;
+            }
+        }
+        else if (strcmp(key, "workers") == 0)
+        {
+            WORKERS = atoi(value);
+        }
+        else if (strcmp(key, "ring_slots") == 0)
+        {
+            RING_SLOTS = atoi(value);
+        }
+        else if (strcmp(key, "writer_process") == 0)
+        {
+            WRITER_PROCESS = atoi(value);
+        }
+        else if (strcmp(key, "mmap_segments") == 0)
+        {
+            MMAP_SEGMENTS = atoi(value);
+        }
+        else if (strcmp(key, "uring_connections") == 0)
+        {
+            URING_CONNECTIONS = atoi(value);
+        }
+        else if (strcmp(key, "batch_records") == 0)
+        {
+            BATCH_RECORDS = atoi(value);
+        }
+        else if (strcmp(key, "batch_bytes") == 0)
+        {
+            BATCH_BYTES = atoi(value);
+        }
+        else if (strcmp(key, "flush_interval_ms") == 0)
+        {
+            FLUSH_INTERVAL_MS = atoi(value);
+        }
+        else if (strcmp(key, "segment_format") == 0)
+        {
+            SEGMENT_FORMAT = (strcmp(value, "binary") == 0) ? SEGMENT_FORMAT_BINARY : SEGMENT_FORMAT_TEXT;
+        }
+        else if (strcmp(key, "compress_workers") == 0)
+        {
+            COMPRESS_WORKERS = atoi(value);
+        }
+        else if (strcmp(key, "compress_codec") == 0)
+        {
+            COMPRESS_CODEC = (strcmp(value, "zlib") == 0) ? CODEC_ZLIB : CODEC_LZ;
+        }
+        else if (strcmp(key, "index_interval") == 0)
+        {
+            INDEX_INTERVAL = atoi(value);
+        }
+        else if (strcmp(key, "max_log_bytes") == 0)
+        {
+            MAX_LOG_BYTES = atoll(value);
+        }
+        else if (strcmp(key, "shards") == 0)
+        {
+            SHARDS = atoi(value);
+        }
+        else if (strcmp(key, "udp_port") == 0)
+        {
+            UDP_PORT = atoi(value);
+        }
+        // Socket paths longer than sun_path are left out
+        else if (strcmp(key, "unix_socket") == 0 && strlen(value) < sizeof(UNIX_SOCKET))
+        {
+            strcpy(UNIX_SOCKET, value);
+        }
+        else if (strcmp(key, "unix_datagram_socket") == 0 && strlen(value) < sizeof(UNIX_DATAGRAM_SOCKET))
+        {
+            strcpy(UNIX_DATAGRAM_SOCKET, value);
+        }
+        else if (strcmp(key, "shm_ingest") == 0 && strlen(value) < sizeof(SHM_INGEST))
+        {
+            strcpy(SHM_INGEST, value);
+        }
+        else if (strcmp(key, "shm_ingest_lanes") == 0)
+        {
+            SHM_INGEST_LANES = atoi(value);
+        }
+        else if (strcmp(key, "shm_ingest_slots") == 0)
+        {
+            SHM_INGEST_SLOTS = atoi(value);
+        }
+        else if (strcmp(key, "stats_file") == 0 && strlen(value) < sizeof(STATS_FILE))
+        {
+            strcpy(STATS_FILE, value);
+        }
+        else if (strcmp(key, "fsync_policy") == 0)
+        {
+            if (strcmp(value, "batch") == 0)
+            {
+                FSYNC_POLICY = FSYNC_BATCH;
+            }
+            else if (strcmp(value, "interval") == 0)
+            {
+                FSYNC_POLICY = FSYNC_INTERVAL;
+            }
+            else
+            {
+                FSYNC_POLICY = FSYNC_NONE;
+            }
+        }
+        else if (strcmp(key, "fsync_interval_ms") == 0)
+        {
+            FSYNC_INTERVAL_MS = atoi(value);
+        }
+        else if (strcmp(key, "ring_full_policy") == 0)
+        {
+            if (strcmp(value, "drop") == 0)
+            {
+                RING_FULL_POLICY = RING_FULL_DROP;
+            }
+            else if (strcmp(value, "count") == 0)
+            {
+                RING_FULL_POLICY = RING_FULL_COUNT;
+            }
+            else
+            {
+                RING_FULL_POLICY = RING_FULL_BLOCK;
+            }
+        }
+        line = strtok(NULL, "\n"); // Move to the next line.
+    }
+
+    // Close the file descriptor.
+    free(buffer);
+    close(fd);
+
+    return 0;
+}
+
+// Function to create a new log file in the directory of a stream.It returns a file descriptor to the opened log file.
+// The segment is journaled in the manifest before it is created, so a crash never leaves a segment the index does not know.
+int createLogFile(struct logStream *stream)
+{
+    struct segmentIndex *segments = stream->state->segments;
+    char baseName[40];
+    char filename[SEGMENT_NAME_LENGTH];
+    char filepath[512];
+    struct tm tm_info;
+
+    // Get the current time.
+    time_t now = time(NULL);
+    localtime_r(&now, &tm_info);
+
+    // Format the log file name with the current timestamp.
+    strftime(baseName, sizeof(baseName), "server_log_%Y-%m-%d|%H:%M:%S", &tm_info);
+
+    // Segments created within the same second are numbered after the newest one, so each gets its own file
+    const char *newest = segmentIndexNewest(segments);
+    size_t baseLength = strlen(baseName);
+    int sequence = 0;
+    if (newest != NULL && strncmp(newest, baseName, baseLength) == 0)
+    {
+        sscanf(newest + baseLength, ".%d.txt", &sequence);
+        sequence++;
+    }
+    if (sequence == 0)
+    {
+        snprintf(filename, sizeof(filename), "%s.txt", baseName);
+    }
+    else
+    {
+        snprintf(filename, sizeof(filename), "%s.%d.txt", baseName, sequence);
+    }
+
+    if (manifestRecord(segments, stream->directory, NULL, filename, FSYNC_POLICY != FSYNC_NONE) != 0)
+    {
+        perror("Error updating the segment manifest");
+    }
+    segmentIndexAppend(segments, filename);
+    // Compact the journal once it is mostly deleted segments
+    if (segments->journalEntries > 2 * segments->count + 64 && manifestRewrite(segments, stream->directory) != 0)
+    {
+        perror("Error rewriting the segment manifest");
+    }
+
+    // Construct the full path to the log file.
+    snprintf(filepath, sizeof(filepath), "%s/%s", stream->directory, filename);
+
+    // Open the log file for writing; create it if it doesn't exist; append if it does. Reading is needed to map it.
+    int log_fd = open(filepath, O_RDWR | O_CREAT | O_APPEND, 0644);
+    if (log_fd < 0)
+    {
+        error("Error opening log file");
+    }
+    setActiveLogFile(stream, log_fd, filename);
+    return log_fd;
+}
+
+// Function to make a freshly opened segment the active one in the shared state.
+// A segment created twice within the same second is reopened in append mode, so its size is taken from the file.
+void setActiveLogFile(struct logStream *stream, int log_fd, const char *fileName)
+{
+    struct stat st;
+
+    strncpy(stream->state->activeFile, fileName, sizeof(stream->state->activeFile) - 1);
+    stream->state->activeSize = (fstat(log_fd, &st) == 0) ? st.st_size : 0;
+    stream->state->preallocatedSize = 0;
+    stream->state->generation++;
+    if (stream->sidecar != NULL)
+    {
+        sidecarReset(stream->sidecar, stream->state->activeSize);
+    }
+    stream->fd = log_fd;
+    stream->fdGeneration = stream->state->generation;
+}
+
+// Function to set up the streams of the log. A single stream writes to the log directory itself;
+// with shards=N stream i writes to its shard-<i> subdirectory, created when missing.
+void initLogStreams(const char *directory)
+{
+    char shard[32];
+
+    SHARDS = (SHARDS > 0) ? SHARDS : 1;
+    logStreams = calloc(SHARDS, sizeof(struct logStream));
+    if (logStreams == NULL)
+    {
+        error("Error allocating the log streams");
+    }
+    for (int i = 0; i < SHARDS; i++)
+    {
+        struct logStream *stream = &logStreams[i];
+        stream->number = i;
+        stream->fd = -1;
+        if (SHARDS == 1)
+        {
+            snprintf(stream->directory, sizeof(stream->directory), "%s", directory);
+        }
+        else
+        {
+            snprintf(shard, sizeof(shard), SHARD_DIRECTORY, i);
+            snprintf(stream->directory, sizeof(stream->directory), "%s/%s", directory, shard);
+            if (mkdir(stream->directory, 0755) != 0 && errno != EEXIST)
+            {
+                error("Error creating a shard directory");
+            }
+        }
+        initLogSegmentState(stream);
+        // The first stream keeps the named semaphore, the others have one in their shared state
+        stream->sem = sem_ptr;
+        if (i > 0)
+        {
+            stream->sem = &stream->state->lock;
+            if (sem_init(stream->sem, 1, 1) != 0)
+            {
+                error("Semaphore initialization failed");
+            }
+        }
+    }
+}
+
+// Function to set up the shared segment state and the segment index of a stream. The index comes from the manifest;
+// the directory is only scanned when there is no manifest yet, and never again afterwards.
+void initLogSegmentState(struct logStream *stream)
+{
+    int rebuilt = 0;
+
+    stream->state = allocateShared(sizeof(struct logSegmentState));
+    if (SEGMENT_FORMAT == SEGMENT_FORMAT_BINARY)
+    {
+        stream->dictionary = allocateShared(sizeof(struct binaryDictionary));
+    }
+    if (INDEX_INTERVAL > 0)
+    {
+        stream->sidecar = allocateShared(sizeof(struct sidecarState));
+    }
+
+    long long scanStarted = statsStart(STATS_STAGE_SCAN);
+    struct segmentIndex *loaded = manifestLoad(stream->directory, &rebuilt);
+    statsStop(STATS_STAGE_SCAN, scanStarted, 0);
+    if (loaded == NULL)
+    {
+        error("Error loading the segment index");
+    }
+    // Room for every segment found plus the next one: retention keeps the count from growing further
+    unsigned long keep = (MAX_LOG_FILES > 0) ? MAX_LOG_FILES : 1;
+    unsigned long capacity = ((loaded->count > keep) ? loaded->count : keep) + 1;
+    stream->state->segments = allocateShared(segmentIndexSize(capacity));
+    segmentIndexCopy(stream->state->segments, capacity, loaded);
+    free(loaded);
+    if ((rebuilt || stream->state->segments->journalEntries > 2 * stream->state->segments->count + 64) &&
+        manifestRewrite(stream->state->segments, stream->directory) != 0)
+    {
+        perror("Error writing the segment manifest");
+    }
+
+    const char *mostRecentFile = segmentIndexNewest(stream->state->segments);
+    if (mostRecentFile != NULL)
+    {
+        char filePath[512];
+        snprintf(filePath, sizeof(filePath), "%s/%s", stream->directory, mostRecentFile);
+        recoverSegmentEnd(stream, filePath);
+        int log_fd = open(filePath, O_RDWR | O_CREAT | O_APPEND, 0644);
+        struct stat st;
+        // Formats are never mixed within a segment: after a change of segment_format a new one is started.
+        // A compressed segment is never appended to either.
+        if (log_fd >= 0 && fstat(log_fd, &st) == 0 && st.st_size > 0 &&
+            (compressedSegmentIsCompressed(log_fd) || binarySegmentIsBinary(log_fd) != (SEGMENT_FORMAT == SEGMENT_FORMAT_BINARY)))
+        {
+            close(log_fd);
+            createLogFile(stream);
+            return;
+        }
+        if (log_fd >= 0)
+        {
+            setActiveLogFile(stream, log_fd, mostRecentFile);
+            // recoverSegmentEnd() loaded the connections the segment already defines
+            if (stream->dictionary != NULL)
+            {
+                stream->dictionary->generation = stream->state->generation;
+            }
+            // The index goes on after what the segment holds, with the clients it already lists
+            if (stream->sidecar != NULL)
+            {
+                char indexPath[512];
+                sidecarPath(indexPath, sizeof(indexPath), stream->directory, mostRecentFile);
+                sidecarResume(stream->sidecar, indexPath);
+            }
+            return;
+        }
+        perror("Error opening most recent log file");
+    }
+    createLogFile(stream);
+}
+
+// Function to perform log rotation. Retention removes the oldest segments from the front of the index,
+// so neither needs to look at the directory. It keeps at most max_log_files segments and, with max_log_bytes,
+// leaves room for a full segment next to the rotated ones, counted at their compressed size.
+int rotateLog(struct logStream *stream)
+{
+    struct segmentIndex *segments = stream->state->segments;
+
+    int forgotten = 0;
+
+    // The segment just closed is now a rotated one, and from now on the compression workers' business
+    atomic_fetch_add(&stream->state->storedBytes, stream->state->activeSize);
+    queueCompression(stream, stream->state->activeFile);
+
+    while (segments->count > 0 &&
+           (segments->count >= (unsigned long)MAX_LOG_FILES ||
+            (MAX_LOG_BYTES > 0 && atomic_load(&stream->state->storedBytes) + LOG_FILE_THRESHOLD > MAX_LOG_BYTES)))
+    {
+        char filePath[512];
+        const char *oldestFile = segmentIndexName(segments, 0);
+        snprintf(filePath, sizeof(filePath), "%s/%s", stream->directory, oldestFile);
+        // A segment removed by hand is simply forgotten
+        off_t removed = removeSegmentFile(filePath);
+        if (removed < 0 && errno != ENOENT)
+        {
+            perror("Error deleting oldest file");
+        }
+        if (removed > 0)
+        {
+            atomic_fetch_sub(&stream->state->storedBytes, removed);
+        }
+        forgotten |= (removed < 0);
+        sidecarPath(filePath, sizeof(filePath), stream->directory, oldestFile);
+        unlink(filePath);
+        if (manifestRecord(segments, stream->directory, oldestFile, NULL, FSYNC_POLICY != FSYNC_NONE) != 0)
+        {
+            perror("Error updating the segment manifest");
+        }
+        segmentIndexRemoveOldest(segments);
+    }
+    // The size of a segment that could not be removed is unknown, count the others again
+    if (forgotten)
+    {
+        atomic_store(&stream->state->storedBytes, rotatedSegmentBytes(stream));
+    }
+    int log_fd = createLogFile(stream);
+    return log_fd;
+}
+
+// Function to total the bytes of the rotated segments of a stream, every segment of its index but the active one
+long long rotatedSegmentBytes(struct logStream *stream)
+{
+    struct segmentIndex *segments = stream->state->segments;
+    long long total = 0;
+    long long started = statsStart(STATS_STAGE_SCAN);
+
+    for (unsigned long i = 0; i < segments->count; i++)
+    {
+        char filePath[512];
+        const char *fileName = segmentIndexName(segments, i);
+        snprintf(filePath, sizeof(filePath), "%s/%s", stream->directory, fileName);
+        off_t size = getFileSize(filePath);
+        if (strcmp(fileName, stream->state->activeFile) != 0 && size > 0)
+        {
+            total += size;
+        }
+    }
+    statsStop(STATS_STAGE_SCAN, started, 0);
+    return total;
+}
+
+// Function to delete a segment file. The file is locked first so it is never deleted while a compression
+// worker swaps in its compressed copy; if the swap won the race the compressed copy is deleted instead.
+// It returns the bytes the deleted file held, or -1 with errno set.
+off_t removeSegmentFile(const char *filePath)
+{
+    struct stat st;
+
+    while (1)
+    {
+        int fd = open(filePath, O_RDONLY);
+        if (fd < 0)
+        {
+            return -1;
+        }
+        flock(fd, LOCK_EX);
+        if (fstat(fd, &st) != 0)
+        {
+            close(fd);
+            return -1;
+        }
+        // Replaced between open() and flock(): this descriptor holds the original, look again
+        if (st.st_nlink == 0)
+        {
+            close(fd);
+            continue;
+        }
+        int result = unlink(filePath);
+        close(fd);
+        return (result == 0) ? st.st_size : -1;
+    }
+}
+
+// Function to fork the compression workers and queue the rotated segments left uncompressed, by an earlier
+// run without workers or one stopped before they were done. It also totals the rotated segments for max_log_bytes.
+// The workers serve every stream.
+void startCompressionWorkers(void)
+{
+    int queue[2];
+
+    for (int i = 0; i < SHARDS; i++)
+    {
+        atomic_store(&logStreams[i].state->storedBytes, rotatedSegmentBytes(&logStreams[i]));
+    }
+    if (COMPRESS_WORKERS <= 0)
+    {
+        return;
+    }
+    if (!compressedCodecAvailable(COMPRESS_CODEC))
+    {
+        fprintf(stderr, "compress_codec=zlib needs a server built with -DHAVE_ZLIB -lz, using lz.\n");
+        COMPRESS_CODEC = CODEC_LZ;
+    }
+
+    // Each queue entry is one fixed size write, which a pipe keeps whole. The writers never wait on the queue:
+    // when it is full the segment stays uncompressed until the next start.
+    compressionWorkers = calloc(COMPRESS_WORKERS, sizeof(pid_t));
+    if (compressionWorkers == NULL || pipe(queue) < 0)
+    {
+        error("ERROR setting up the compression workers");
+    }
+    fcntl(queue[1], F_SETPIPE_SZ, 1048576);
+    fcntl(queue[1], F_SETFL, fcntl(queue[1], F_GETFL, 0) | O_NONBLOCK);
+
+    for (int i = 0; i < COMPRESS_WORKERS; i++)
+    {
+        compressionWorkers[i] = fork();
+        if (compressionWorkers[i] == -1)
+        {
+            error("ERROR forking a compression worker");
+        }
+        if (compressionWorkers[i] == 0)
+        {
+            close(queue[1]);
+            compressionWorker(queue[0], i);
+            exit(EXIT_SUCCESS);
+        }
+    }
+    close(queue[0]);
+    compressionQueueFd = queue[1];
+
+    for (int i = 0; i < SHARDS; i++)
+    {
+        struct logStream *stream = &logStreams[i];
+        for (unsigned long j = 0; j < stream->state->segments->count; j++)
+        {
+            const char *fileName = segmentIndexName(stream->state->segments, j);
+            if (strcmp(fileName, stream->state->activeFile) != 0)
+            {
+                queueCompression(stream, fileName);
+            }
+        }
+    }
+}
+
+// Function to stop the compression workers. A segment being compressed stays as it was.
+void stopCompressionWorkers(void)
+{
+    if (compressionWorkers == NULL)
+    {
+        return;
+    }
+    // The workers are reaped here, not reported by handleSigchild() as clients
+    signal(SIGCHLD, SIG_DFL);
+    close(compressionQueueFd);
+    compressionQueueFd = -1;
+    for (int i = 0; i < COMPRESS_WORKERS; i++)
+    {
+        kill(compressionWorkers[i], SIGTERM);
+    }
+    for (int i = 0; i < COMPRESS_WORKERS; i++)
+    {
+        while (waitpid(compressionWorkers[i], NULL, 0) == -1 && errno == EINTR)
+        {
+        }
+    }
+    free(compressionWorkers);
+    compressionWorkers = NULL;
+}
+
+// Function to hand a rotated segment of a stream to the compression workers, without ever waiting for them
+void queueCompression(struct logStream *stream, const char *fileName)
+{
+    struct compressionEntry entry = {.stream = stream->number};
+
+    if (compressionQueueFd == -1)
+    {
+        return;
+    }
+    strncpy(entry.name, fileName, sizeof(entry.name) - 1);
+    if (write(compressionQueueFd, &entry, sizeof(entry)) != sizeof(entry))
+    {
+        fprintf(stderr, "Compression queue full, %s stays uncompressed.\n", fileName);
+    }
+}
+
+// Function run by a compression worker process: it compresses the segments queued until it is stopped.
+// Workers never take the log semaphore, so they never hold up the processes writing the active segment.
+void compressionWorker(int queueFd, int number)
+{
+    struct compressionEntry entry;
+    char tempPath[512] = "";
+    struct sigaction sigTermAction = {0};
+
+    // Like the writer process, a worker leaves SIGUSR1 and SIGINT to the parent and keeps SIGUSR2 ignored.
+    // SIGTERM interrupts the read of the queue or the segment being compressed; no SA_RESTART on purpose.
+    signal(SIGUSR1, SIG_IGN);
+    signal(SIGINT, SIG_IGN);
+    sigTermAction.sa_handler = &handleSigTerm;
+    sigaction(SIGTERM, &sigTermAction, NULL);
+    prctl(PR_SET_PDEATHSIG, SIGTERM);
+    if (getppid() == 1)
+    {
+        return;
+    }
+
+    while (!compressionStop)
+    {
+        ssize_t n = read(queueFd, &entry, sizeof(entry));
+        if (n == 0 || (n < 0 && errno != EINTR))
+        {
+            break;
+        }
+        if (n == sizeof(entry) && entry.stream >= 0 && entry.stream < SHARDS)
+        {
+            // Next to the segment, so the rename stays within its directory. Hidden from the segment scan
+            // of manifestLoad(); the same name is reused by the worker with this number next time.
+            struct logStream *stream = &logStreams[entry.stream];
+            snprintf(tempPath, sizeof(tempPath), "%s/.compress.%d.tmp", stream->directory, number);
+            entry.name[sizeof(entry.name) - 1] = '\0';
+            compressSegmentFile(stream, entry.name, tempPath);
+        }
+    }
+    if (tempPath[0] != '\0')
+    {
+        unlink(tempPath);
+    }
+}
+
+// Function to compress one rotated segment into a temporary file, then rename it over the segment.
+// The rename happens under the lock removeSegmentFile() takes, and only if retention did not delete the segment meanwhile.
+void compressSegmentFile(struct logStream *stream, const char *fileName, const char *tempPath)
 {
-    char buffer[1024];
-    char connectionMessage[1024];
-    char logMessage[2048];
-    char clientName[256];
-    char timeStr[128];
-    int bytesRead;
-    int sem_wait_ret;
-    fd_set s_rd;
-    char log_entry_string[1150] = {'\0'};
+    char filePath[512];
+    struct stat st;
 
-    int client_disconnected = 0;
-    // Get client IP address
-    char clientIP[INET_ADDRSTRLEN];
-    inet_ntop(AF_INET, &clientAddr.sin_addr, clientIP, INET_ADDRSTRLEN);
+    snprintf(filePath, sizeof(filePath), "%s/%s", stream->directory, fileName);
+    int in = open(filePath, O_RDONLY);
+    if (in < 0)
+    {
+        return;
+    }
+    if (fstat(in, &st) != 0 || st.st_size == 0 || compressedSegmentIsCompressed(in))
+    {
+        close(in);
+        return;
+    }
+    int out = open(tempPath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (out < 0)
+    {
+        perror("Error creating a compressed segment");
+        close(in);
+        return;
+    }
+    long long compressedSize = compressedSegmentWrite(in, out, COMPRESS_CODEC, &compressionStop);
+    // The rotated segment was durable, its replacement must be too before it takes its place
+    if (compressedSize >= 0 && FSYNC_POLICY != FSYNC_NONE && fsync(out) != 0)
+    {
+        compressedSize = -1;
+    }
+    close(out);
 
-    buffer[strcspn(buffer, "\n")] = 0;
-    bytesRead = read(clientSocket, clientName, sizeof(clientName) - 1);
-    if (bytesRead <= 0)
+    flock(in, LOCK_EX);
+    if (compressedSize >= 0 && fstat(in, &st) == 0 && st.st_nlink > 0 && rename(tempPath, filePath) == 0)
     {
-        perror("ERROR in Reading from client.\n");
+        atomic_fetch_add(&stream->state->storedBytes, compressedSize - st.st_size);
     }
-    clientName[bytesRead] = '\0'; // Null-terminate the string
-    getCurrentTime(timeStr);
+    else
+    {
+        unlink(tempPath);
+    }
+    close(in);
+}
+
+// Function to handle new clients
+void clientHandler(int clientSocket, const struct sockaddr_in *clientAddr)
+{
+    struct reactor sink = {0}; // No ring: records go through logHandlerSlices()
+    char prefix[CONNECTION_PREFIX_SIZE];
+    struct connection conn = {.fd = clientSocket, .prefix = prefix};
+    fd_set s_rd;
+    int bytesAvailable = 0;
+    int closing = 0;
 
-    // Log client name
-    snprintf(connectionMessage, sizeof(connectionMessage), "[%s] Client (IP: %s, name: %s) is connected.\n", timeStr, clientIP, clientName);
+    // Get client IP address, or the credentials of a local client
+    setConnectionPeer(&conn, clientAddr);
+    statsAttach("client");
 
-    logHandler(connectionMessage, directory);
-    while (husr2)
+    // The same parser as the epoll mode, fed by blocking reads
+    conn.bufferCapacity = MAX_LINE_LENGTH + TEXT_READ_SIZE;
+    conn.buffer = malloc(conn.bufferCapacity);
+    if (conn.buffer == NULL)
+    {
+        perror("ERROR allocating connection buffer");
+        close(clientSocket);
+        exit(EXIT_FAILURE);
+    }
+
+    while (husr2 && !closing)
     {
+        FD_ZERO(&s_rd);
         FD_SET(clientSocket, &s_rd);
         int select_socket_fd = select(clientSocket + 1, &s_rd, NULL, NULL, NULL);
         if (select_socket_fd == -1)
@@ -572,94 +4083,499 @@ void clientHandler(int clientSocket, struct sockaddr_in clientAddr, const char *
             {
                 perror("Select failure");
             }
+            continue;
         }
-        else if (select_socket_fd)
+
+        long long readStarted = statsStart(STATS_STAGE_READ);
+        ssize_t bytesRead = read(clientSocket, conn.buffer + conn.bufferLength, conn.bufferCapacity - conn.bufferLength);
+        if (bytesRead < 0)
         {
+            if (errno != EINTR)
+            {
+                perror("ERROR reading from client");
+                break;
+            }
+            continue;
+        }
+        statsStop(STATS_STAGE_READ, readStarted, bytesRead);
+        closing = receiveData(&sink, &conn, bytesRead);
 
-            bytesRead = read(clientSocket, buffer, 1023);
-            buffer[bytesRead] = '\0';
-            getCurrentTime(timeStr);
+        // Nothing else is queued on the socket: for legacy text clients what we have is a whole message
+        if (!closing && !conn.binary && ioctl(clientSocket, FIONREAD, &bytesAvailable) == 0 && bytesAvailable == 0)
+        {
+            closing = processLines(&sink, &conn, PARSE_DRAINED);
+        }
+    }
 
-            buffer[strcspn(buffer, "\n")] = 0;
+    free(conn.buffer);
+    freeReactorMemory(&sink);
+    close(clientSocket);
+    // The syncs of what this process wrote are left to the others
+    statsTraceCancel(conn.trace);
+    for (int i = 0; i < SHARDS; i++)
+    {
+        cancelLogTraces(&logStreams[i]);
+    }
+    statsDetach();
+    exit(EXIT_SUCCESS);
+}
 
-            if (strcmp(buffer, "quit") == 0)
-            {
-                // Construct the log message for "quit" command
-                char quitLogMessage[1024];
-                snprintf(quitLogMessage, sizeof(quitLogMessage), "[%s] Client (IP: %s, name: %s) sent quit command.\n", timeStr, clientIP, clientName);
+// Function to manage writing on log file
+void logHandler(struct logStream *stream, const char *logMessage)
+{
+    struct iovec slice = {.iov_base = (void *)logMessage, .iov_len = strlen(logMessage)};
+    logHandlerSlices(stream, &slice, 1);
+}
 
-                logHandler(quitLogMessage, directory);
-                close(clientSocket);
+// Function to write one record made of slices to a stream of the log. 'slices' may be modified.
+void logHandlerSlices(struct logStream *stream, struct iovec *slices, int count)
+{
+    // A writer process owns the segment: publish the record and never wait on disk I/O
+    if (stream->writer != NULL)
+    {
+        pushLogRecord(stream->writer, stream->writer->rings[0], slices, count);
+        return;
+    }
 
-                // Terminate the child process
-                exit(0);
-            }
-            // Construct the log message
-            snprintf(logMessage, sizeof(logMessage), "[%s] Client (%s) - %s: %s\n", timeStr, clientIP, clientName, buffer);
-            logHandler(logMessage, directory);
-            if (bytesRead == 0)
-            {
-                husr2 = 0;
-            }
+    // Wait on the stream's semaphore to gain access to the critical section; a signal must not let us in
+    long long waitStarted = statsStart(STATS_STAGE_LOCK_WAIT);
+    while (sem_wait(stream->sem) != 0 && errno == EINTR)
+    {
+    }
+    statsStop(STATS_STAGE_LOCK_WAIT, waitStarted, 0);
+    if (statsTracing != 0)
+    {
+        statsTraceMark(statsTracing, STATS_TRACE_ENQUEUED);
+        traceLogRecord(stream, statsTracing);
+    }
+    if (writeLogBatch(stream, slices, count) != 0)
+    {
+        sem_post(stream->sem);
+        error("Error writing.");
+    }
+    sem_post(stream->sem); // Signal semaphore
+}
+
+// Function to append one record to the active segment of a stream and rotate it when it is full.
+// The caller must be the only writer: it either holds the stream's semaphore or is its writer stage. It returns -1 on failure.
+int writeLogRecord(struct logStream *stream, const char *record, size_t length)
+{
+    struct iovec iov = {.iov_base = (void *)record, .iov_len = length};
+    return writeLogBatch(stream, &iov, 1);
+}
+
+// Function to make sure the stream's descriptor is this process' one of its active segment: another process
+// may have rotated the segment since we last wrote. It returns -1 on failure.
+int openActiveLogFile(struct logStream *stream)
+{
+    if (stream->fd != -1 && stream->fdGeneration == stream->state->generation)
+    {
+        return 0;
+    }
+    char activeLogFilePath[512];
+    if (stream->map != NULL)
+    {
+        munmap(stream->map, stream->mapLength);
+        stream->map = NULL;
+    }
+    if (stream->fd != -1)
+    {
+        close(stream->fd);
+    }
+    snprintf(activeLogFilePath, sizeof(activeLogFilePath), "%s/%s", stream->directory, stream->state->activeFile);
+    stream->fd = open(activeLogFilePath, O_RDWR | O_CREAT | O_APPEND, 0644);
+    if (stream->fd < 0)
+    {
+        return -1;
+    }
+    stream->fdGeneration = stream->state->generation;
+    return 0;
+}
+
+// Function to append a batch of records to the active segment with writev(), apply the fsync policy
+// and rotate the segment when it is full. A segment may exceed the threshold by at most one batch.
+// The caller must be the only writer and 'iov' is modified. It returns -1 on failure.
+int writeLogBatch(struct logStream *stream, struct iovec *iov, int count)
+{
+    long long started = statsStart(STATS_STAGE_WRITE);
+    long long sizeBefore = stream->state->activeSize;
+
+    if (openActiveLogFile(stream) != 0)
+    {
+        return -1;
+    }
+    // Indexed from the text records, before they are encoded and before the loop below consumes 'iov'
+    if (stream->sidecar != NULL)
+    {
+        sidecarObserve(stream->sidecar, iov, count);
+    }
+    if (SEGMENT_FORMAT == SEGMENT_FORMAT_BINARY && encodeBinaryBatch(stream, &iov, &count) != 0)
+    {
+        return -1;
+    }
+
+    if (MMAP_SEGMENTS && copyToMappedSegment(stream, iov, count) != 0)
+    {
+        return -1;
+    }
+    while (!MMAP_SEGMENTS && count > 0)
+    {
+        ssize_t w = writev(stream->fd, iov, count);
+        if (w < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (w <= 0)
+        {
+            close(stream->fd);
+            stream->fd = -1;
+            return -1;
+        }
+        stream->state->activeSize += w;
+
+        // Short write: skip what was written and retry with the rest
+        while (count > 0 && (size_t)w >= iov->iov_len)
+        {
+            w -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0)
+        {
+            iov->iov_base = (char *)iov->iov_base + w;
+            iov->iov_len -= w;
+        }
+    }
+    stream->dirty = 1;
+    if (stream->numberOfTraces > stream->writtenTraces)
+    {
+        logTracesWritten(stream);
+    }
+
+    if (FSYNC_POLICY == FSYNC_BATCH || logSyncDueIn(stream) == 0)
+    {
+        syncLogSegment(stream);
+    }
+    if (stream->sidecar != NULL && stream->sidecar->records >= (uint32_t)INDEX_INTERVAL)
+    {
+        writeLogSidecar(stream, 0);
+    }
+    statsStop(STATS_STAGE_WRITE, started, stream->state->activeSize - sizeBefore);
+
+    // Check log file size and rotate if necessary
+    if (stream->state->activeSize > LOG_FILE_THRESHOLD)
+    {
+        long long rotateStarted = statsStart(STATS_STAGE_ROTATE);
+        // A rotated segment is complete, make it durable unless durability is off
+        if (FSYNC_POLICY != FSYNC_NONE)
+        {
+            syncLogSegment(stream);
+        }
+        writeLogSidecar(stream, 1);
+        closeLogSegment(stream);
+        rotateLog(stream);
+        statsStop(STATS_STAGE_ROTATE, rotateStarted, 0);
+    }
+    return 0;
+}
+
+// Function to encode a batch of text records as one block of the binary format, preceded by the segment
+// magic when the segment is still empty. '*iov' and '*count' are replaced by the block, which stays valid
+// until the next call from this thread. The caller must be the only writer. It returns -1 when out of memory.
+int encodeBinaryBatch(struct logStream *stream, struct iovec **iov, int *count)
+{
+    static __thread struct binaryBuffer text;
+    static __thread struct binaryBuffer block;
+    static __thread struct iovec encoded;
+
+    text.length = 0;
+    for (int i = 0; i < *count; i++)
+    {
+        if (binaryBufferReserve(&text, (*iov)[i].iov_len) != 0)
+        {
+            return -1;
+        }
+        memcpy(text.data + text.length, (*iov)[i].iov_base, (*iov)[i].iov_len);
+        text.length += (*iov)[i].iov_len;
+    }
+
+    // The dictionary belongs to one segment and starts over after a rotation
+    if (stream->dictionary->generation != stream->state->generation)
+    {
+        binaryDictionaryReset(stream->dictionary);
+        stream->dictionary->generation = stream->state->generation;
+    }
+    block.length = 0;
+    if (stream->state->activeSize == 0)
+    {
+        if (binaryBufferReserve(&block, BINARY_SEGMENT_MAGIC_LENGTH) != 0)
+        {
+            return -1;
+        }
+        memcpy(block.data, BINARY_SEGMENT_MAGIC, BINARY_SEGMENT_MAGIC_LENGTH);
+        block.length = BINARY_SEGMENT_MAGIC_LENGTH;
+    }
+    if (binaryEncodeBlock(stream->dictionary, text.data, text.length, &block) != 0)
+    {
+        return -1;
+    }
+    encoded.iov_base = block.data;
+    encoded.iov_len = block.length;
+    *iov = &encoded;
+    *count = 1;
+    return 0;
+}
+
+// Function to copy a batch into the mapped active segment. The segment is preallocated with fallocate()
+// to log_file_threshold on its first write, and grown the same way in the rare case a batch does not fit.
+// Every process maps it for itself and remaps when the preallocated size changed. It returns -1 on failure.
+int copyToMappedSegment(struct logStream *stream, const struct iovec *iov, int count)
+{
+    size_t length = 0;
+    for (int i = 0; i < count; i++)
+    {
+        length += iov[i].iov_len;
+    }
+
+    off_t needed = stream->state->activeSize + length;
+    if (needed > stream->state->preallocatedSize)
+    {
+        off_t size = ((needed > LOG_FILE_THRESHOLD) ? needed : LOG_FILE_THRESHOLD) + SEGMENT_HEADROOM;
+        // File systems without fallocate() get a sparse file instead
+        if (fallocate(stream->fd, 0, 0, size) != 0 && (errno != EOPNOTSUPP || ftruncate(stream->fd, size) != 0))
+        {
+            return -1;
+        }
+        stream->state->preallocatedSize = size;
+    }
+    if (stream->map == NULL || stream->mapLength != (size_t)stream->state->preallocatedSize)
+    {
+        if (stream->map != NULL)
+        {
+            munmap(stream->map, stream->mapLength);
+        }
+        stream->mapLength = stream->state->preallocatedSize;
+        stream->map = mmap(NULL, stream->mapLength, PROT_READ | PROT_WRITE, MAP_SHARED, stream->fd, 0);
+        if (stream->map == MAP_FAILED)
+        {
+            stream->map = NULL;
+            return -1;
+        }
+    }
+
+    char *p = stream->map + stream->state->activeSize;
+    for (int i = 0; i < count; i++)
+    {
+        memcpy(p, iov[i].iov_base, iov[i].iov_len);
+        p += iov[i].iov_len;
+    }
+    stream->state->activeSize += length;
+    return 0;
+}
+
+// Function to close this process' view of the active segment. A preallocated segment is first
+// truncated to the bytes actually written, on rotation and on a clean shutdown.
+void closeLogSegment(struct logStream *stream)
+{
+    if (stream->fd != -1 && stream->fdGeneration == stream->state->generation && stream->state->preallocatedSize > stream->state->activeSize)
+    {
+        if (ftruncate(stream->fd, stream->state->activeSize) != 0)
+        {
+            perror("Error truncating log file");
+        }
+        stream->state->preallocatedSize = 0;
+    }
+    if (stream->map != NULL)
+    {
+        munmap(stream->map, stream->mapLength);
+        stream->map = NULL;
+    }
+    if (stream->fd != -1)
+    {
+        close(stream->fd);
+        stream->fd = -1;
+    }
+}
+
+// Function to append the span gathered so far to the index of the active segment. 'final' also writes the
+// Bloom filter of its clients, when the segment is about to be closed. The caller must be the only writer.
+void writeLogSidecar(struct logStream *stream, int final)
+{
+    char indexPath[512];
+
+    if (stream->sidecar == NULL)
+    {
+        return;
+    }
+    sidecarPath(indexPath, sizeof(indexPath), stream->directory, stream->state->activeFile);
+    if (sidecarWrite(stream->sidecar, indexPath, stream->state->activeSize, final) != 0)
+    {
+        perror("Error writing the segment index");
+    }
+}
+
+// Function to find the true end of a segment left preallocated by a crash, and cut the file there.
+// Preallocated space reads as zeros and every record ends with '\n', so the data ends at the last newline
+// before the trailing zeros; a record torn by the crash is dropped. Files that do not end with zeros are left alone.
+// A binary segment is cut after its last intact block instead, and the connections it defines are loaded into the dictionary of the stream.
+void recoverSegmentEnd(struct logStream *stream, const char *filePath)
+{
+    char block[65536];
+    struct stat st;
+    char last;
 
-            do
+    int fd = open(filePath, O_RDWR);
+    if (fd < 0)
+    {
+        return;
+    }
+    long binaryEnd = binarySegmentScan(fd, stream->dictionary);
+    if (binaryEnd >= 0)
+    {
+        if (fstat(fd, &st) == 0 && binaryEnd < st.st_size)
+        {
+            if (ftruncate(fd, binaryEnd) != 0)
             {
-                sem_wait_ret = sem_wait(sem_ptr);
-            } while (sem_wait_ret == -1 && errno == EINTR);
-            int stout_w = write(STDOUT_FILENO, log_entry_string, strlen(log_entry_string));
-            if (bytesRead == 0)
+                perror("Error recovering log file");
+            }
+            else
             {
-
-                logHandler(log_entry_string, directory);
+                printf("Recovered log file %s: %ld bytes.\n", filePath, binaryEnd);
             }
+        }
+        close(fd);
+        return;
+    }
+    if (fstat(fd, &st) != 0 || st.st_size == 0 || pread(fd, &last, 1, st.st_size - 1) != 1 || last != '\0')
+    {
+        close(fd);
+        return;
+    }
 
-            sem_post(sem_ptr);
+    // Unwritten preallocated space is reported as a hole by most file systems, which skips most of it
+    off_t end = lseek(fd, 0, SEEK_HOLE);
+    if (end < 0 || end > st.st_size)
+    {
+        end = st.st_size;
+    }
+    // Walk back over the zeros, then over a torn record, to the last newline
+    int seenData = 0;
+    while (end > 0)
+    {
+        off_t start = (end > (off_t)sizeof(block)) ? end - (off_t)sizeof(block) : 0;
+        ssize_t n = pread(fd, block, end - start, start);
+        if (n != end - start)
+        {
+            break;
         }
-        memset(log_entry_string, 0, sizeof(log_entry_string));
-        memset(buffer, 0, sizeof(buffer));
-        FD_ZERO(&s_rd);
+        while (n > 0 && (block[n - 1] == '\0' && !seenData))
+        {
+            n--;
+        }
+        if (n > 0)
+        {
+            seenData = 1;
+        }
+        while (n > 0 && block[n - 1] != '\n')
+        {
+            n--;
+        }
+        if (n > 0)
+        {
+            end = start + n;
+            break;
+        }
+        end = start;
     }
 
-    close(clientSocket);
-    exit(EXIT_SUCCESS);
+    if (ftruncate(fd, end) != 0)
+    {
+        perror("Error recovering log file");
+    }
+    else
+    {
+        printf("Recovered log file %s: %lld bytes.\n", filePath, (long long)end);
+    }
+    close(fd);
 }
 
-// Function to manage writing on log file
-void logHandler(const char *logMessage, const char *directory)
+// Function to flush this process' writes to the active segment to disk
+void syncLogSegment(struct logStream *stream)
 {
-    // Wait on the semaphore to gain access to the critical section
-    sem_wait(sem_ptr);
-    int bytesRead, log_fd = -1;
-    char recentLogFile[128];
-    char recentLogFilePath[256];
-    log_fd = openMostRecentLogFile(directory);
-    if (log_fd == -1)
+    if (stream->dirty && stream->fd != -1 && fdatasync(stream->fd) != 0)
     {
-        log_fd = createLogFile(directory);
+        perror("Error syncing log file");
     }
+    stream->dirty = 0;
+    stream->lastSync = currentTimeMillis();
 
-    int w = write(log_fd, logMessage, strlen(logMessage));
-    if (w <= 0)
+    // Traced records written before are durable now
+    for (int i = 0; i < stream->writtenTraces; i++)
     {
-        close(log_fd);
-        error("Error writing.");
+        statsTraceEnd(stream->traces[i], 1);
     }
+    memmove(stream->traces, stream->traces + stream->writtenTraces, (stream->numberOfTraces - stream->writtenTraces) * sizeof(int));
+    stream->numberOfTraces -= stream->writtenTraces;
+    stream->writtenTraces = 0;
+}
 
-    // Check log file size and rotate if necessary
-    findMostRecentLogFile(directory, recentLogFile, sizeof(recentLogFile));
-    snprintf(recentLogFilePath, sizeof(recentLogFilePath), "%s/%s", directory, recentLogFile);
+// Function to have a traced record followed through the next batch written to a stream, then its sync.
+// The caller must be the only writer. A stream holding too many is not traced.
+void traceLogRecord(struct logStream *stream, int trace)
+{
+    if (stream->numberOfTraces == STATS_TRACE_PENDING)
+    {
+        statsTraceCancel(trace);
+        return;
+    }
+    stream->traces[stream->numberOfTraces++] = trace;
+}
+
+// Function to stamp the traced records of the batch just written to a stream. Without a fsync_policy they are as
+// durable as they get, otherwise they wait for the sync.
+void logTracesWritten(struct logStream *stream)
+{
+    for (int i = stream->writtenTraces; i < stream->numberOfTraces; i++)
+    {
+        statsTraceMark(stream->traces[i], STATS_TRACE_WRITTEN);
+        if (FSYNC_POLICY == FSYNC_NONE)
+        {
+            statsTraceEnd(stream->traces[i], 0);
+        }
+    }
+    stream->writtenTraces = (FSYNC_POLICY == FSYNC_NONE) ? 0 : stream->numberOfTraces;
+    stream->numberOfTraces = stream->writtenTraces;
+}
 
-    if (getFileSize(recentLogFilePath) > LOG_FILE_THRESHOLD)
+// Function to give up the traces of a stream, in a process that will not sync it again
+void cancelLogTraces(struct logStream *stream)
+{
+    for (int i = 0; i < stream->numberOfTraces; i++)
     {
-        close(log_fd);
-        log_fd = rotateLog(directory);
+        statsTraceCancel(stream->traces[i]);
     }
+    stream->numberOfTraces = 0;
+    stream->writtenTraces = 0;
+}
 
-    if (log_fd != -1)
+// Function to get the milliseconds left before the interval fsync policy must sync the segment.
+// It returns -1 when no sync is pending.
+int logSyncDueIn(struct logStream *stream)
+{
+    if (FSYNC_POLICY != FSYNC_INTERVAL || !stream->dirty)
     {
-        close(log_fd);
+        return -1;
     }
-    sem_post(sem_ptr); // Signal semaphore
+    long long left = stream->lastSync + FSYNC_INTERVAL_MS - currentTimeMillis();
+    return (left > 0) ? (int)left : 0;
+}
+
+// Function to get a monotonic time in milliseconds
+long long currentTimeMillis(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
 }
 
 // Function to handle the quit signals that are coming from the clients
@@ -692,6 +4608,16 @@ void handleSigUser2(int sig)
 {
     husr2 = 0;
 }
+// Signal handler of the compression workers: they stop between blocks
+void handleSigTerm(int sig)
+{
+    compressionStop = 1;
+}
+// Signal handler asking for a snapshot of the stats
+void handleSigHup(int sig)
+{
+    statsRequested = 1;
+}
 // Signale handler for Ctrl+C
 void handleSigINT(int sig)
 {
@@ -702,9 +4628,34 @@ void handleSigINT(int sig)
 // Function to get the current time as a formatted string
 void getCurrentTime(char *timeStr)
 {
-    time_t now = time(NULL);               // Get the system time
-    struct tm *timeinfo = localtime(&now); // Convert to local time
+    formatTime(timeStr, time(NULL)); // Get the system time
+}
+
+// Function to format a given time like getCurrentTime()
+void formatTime(char *timeStr, time_t t)
+{
+    struct tm timeinfo;
+    localtime_r(&t, &timeinfo); // Convert to local time, thread-safe for the worker threads
 
     // Format the time string
-    strftime(timeStr, 100, "[%Y-%m-%d %H:%M:%S]", timeinfo);
+    strftime(timeStr, 100, "[%Y-%m-%d %H:%M:%S]", &timeinfo);
+}
+
+// Function to get the "[[date time]] " opening of a record for a given time. The text is regenerated
+// only when the second changes; the cache is per thread so the worker threads need no locking.
+const char *cachedTimestamp(time_t t, size_t *length)
+{
+    static __thread time_t cachedSecond = -1;
+    static __thread char cachedText[128];
+    static __thread size_t cachedLength;
+
+    if (t != cachedSecond)
+    {
+        char timeStr[100];
+        formatTime(timeStr, t);
+        cachedLength = snprintf(cachedText, sizeof(cachedText), "[%s] ", timeStr);
+        cachedSecond = t;
+    }
+    *length = cachedLength;
+    return cachedText;
 }
\ No newline at end of file
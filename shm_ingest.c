@@ -0,0 +1,265 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include "shm_ingest.h"
+
+static size_t laneHeadSize(void);
+static void objectName(char *buffer, size_t size, const char *name);
+
+// Function to create the shared memory object, replacing one a previous run left behind, and map it.
+// 'slots' must be a power of two. It returns NULL with errno set when the object cannot be created.
+struct shmIngestHeader *shmIngestCreate(const char *name, unsigned int lanes, unsigned int slots, size_t *size)
+{
+    char path[NAME_MAX];
+    size_t laneSize = (laneHeadSize() + recordRingSize(slots) + 63) & ~(size_t)63;
+
+    objectName(path, sizeof(path), name);
+    shm_unlink(path);
+    // Only processes of the server's user may attach, unless the object is given wider permissions
+    int fd = shm_open(path, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+    if (fd < 0)
+    {
+        return NULL;
+    }
+    *size = sizeof(struct shmIngestHeader) + lanes * laneSize;
+    if (ftruncate(fd, *size) != 0)
+    {
+        close(fd);
+        shm_unlink(path);
+        return NULL;
+    }
+    struct shmIngestHeader *header = mmap(NULL, *size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (header == MAP_FAILED)
+    {
+        shm_unlink(path);
+        return NULL;
+    }
+
+    header->lanes = lanes;
+    header->slots = slots;
+    header->laneSize = laneSize;
+    atomic_init(&header->sleeping, 0);
+    atomic_init(&header->doorbell, 0);
+    atomic_init(&header->closed, 0);
+    for (unsigned int i = 0; i < lanes; i++)
+    {
+        struct shmIngestLane *lane = shmIngestLane(header, i);
+        atomic_init(&lane->state, SHM_LANE_FREE);
+        atomic_init(&lane->owner, 0);
+        recordRingInit(shmIngestRing(lane), slots);
+    }
+    // Producers check the magic number last
+    header->version = SHM_INGEST_VERSION;
+    atomic_thread_fence(memory_order_release);
+    header->magic = SHM_INGEST_MAGIC;
+    return header;
+}
+
+// Function to remove the shared memory object, once the server is done with it. Processes still attached keep their mapping.
+void shmIngestRemove(const char *name)
+{
+    char path[NAME_MAX];
+
+    objectName(path, sizeof(path), name);
+    shm_unlink(path);
+}
+
+// Function to map the shared memory object of a running server. It returns NULL with errno set when there is none,
+// or ENOPROTOOPT when it is not laid out as this file expects.
+struct shmIngestHeader *shmIngestOpen(const char *name, size_t *size)
+{
+    char path[NAME_MAX];
+    struct stat st;
+
+    objectName(path, sizeof(path), name);
+    int fd = shm_open(path, O_RDWR | O_CLOEXEC, 0);
+    if (fd < 0)
+    {
+        return NULL;
+    }
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(struct shmIngestHeader))
+    {
+        close(fd);
+        errno = ENOPROTOOPT;
+        return NULL;
+    }
+    *size = st.st_size;
+    struct shmIngestHeader *header = mmap(NULL, *size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (header == MAP_FAILED)
+    {
+        return NULL;
+    }
+    if (header->magic != SHM_INGEST_MAGIC || header->version != SHM_INGEST_VERSION ||
+        sizeof(struct shmIngestHeader) + header->lanes * header->laneSize > *size)
+    {
+        munmap(header, *size);
+        errno = ENOPROTOOPT;
+        return NULL;
+    }
+    atomic_thread_fence(memory_order_acquire);
+    return header;
+}
+
+// Function to find a lane in the mapping
+struct shmIngestLane *shmIngestLane(struct shmIngestHeader *header, unsigned int lane)
+{
+    return (struct shmIngestLane *)((char *)(header + 1) + lane * header->laneSize);
+}
+
+// Function to find the ring of a lane, right after its head
+struct recordRing *shmIngestRing(struct shmIngestLane *lane)
+{
+    return (struct recordRing *)((char *)lane + laneHeadSize());
+}
+
+// Function to claim a free lane for the calling process under the given name. It returns the lane,
+// or -1 with errno EBUSY when every lane is taken and EPIPE when the server has shut down.
+int shmIngestAttach(struct shmIngestHeader *header, const char *name, size_t length)
+{
+    if (atomic_load(&header->closed))
+    {
+        errno = EPIPE;
+        return -1;
+    }
+    if (length > PROTOCOL_MAX_NAME)
+    {
+        length = PROTOCOL_MAX_NAME;
+    }
+    for (unsigned int i = 0; i < header->lanes; i++)
+    {
+        struct shmIngestLane *lane = shmIngestLane(header, i);
+        int expected = SHM_LANE_FREE;
+        if (!atomic_compare_exchange_strong(&lane->state, &expected, SHM_LANE_CLAIMED))
+        {
+            continue;
+        }
+        atomic_store(&lane->owner, getpid());
+        memcpy(lane->name, name, length);
+        lane->name[length] = '\0';
+        lane->nameLength = length;
+        // The server only looks at the name once the lane is attached
+        atomic_store(&lane->state, SHM_LANE_ATTACHED);
+        shmIngestWake(header);
+        return i;
+    }
+    errno = EBUSY;
+    return -1;
+}
+
+// Function to append a record to a lane and wake the server if it sleeps. It returns -1 with errno EAGAIN
+// when the ring of the lane is full, EMSGSIZE when the record does not fit in a slot, and EPIPE when the
+// server has shut down.
+int shmIngestPush(struct shmIngestHeader *header, int lane, const struct iovec *slices, int count)
+{
+    size_t length = 0;
+
+    if (atomic_load_explicit(&header->closed, memory_order_relaxed))
+    {
+        errno = EPIPE;
+        return -1;
+    }
+    for (int i = 0; i < count; i++)
+    {
+        length += slices[i].iov_len;
+    }
+    if (length > RECORD_SLOT_SIZE)
+    {
+        errno = EMSGSIZE;
+        return -1;
+    }
+    if (recordRingPushSlices(shmIngestRing(shmIngestLane(header, lane)), slices, count) != 0)
+    {
+        errno = EAGAIN;
+        return -1;
+    }
+    // Pairs with the fence of shmIngestSleep(): either the server sees the record, or we see it sleeping
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&header->sleeping, memory_order_relaxed))
+    {
+        shmIngestWake(header);
+    }
+    return 0;
+}
+
+// Function to leave a lane. The server logs what is left in it, then frees it.
+void shmIngestDetach(struct shmIngestHeader *header, int lane)
+{
+    atomic_store(&shmIngestLane(header, lane)->state, SHM_LANE_DETACHED);
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load(&header->sleeping))
+    {
+        shmIngestWake(header);
+    }
+}
+
+// Function run by the server when it shuts down: producers are turned away, and a server thread or process waiting
+// on the doorbell wakes up
+void shmIngestClose(struct shmIngestHeader *header)
+{
+    atomic_store(&header->closed, 1);
+    atomic_fetch_add(&header->doorbell, 1);
+    syscall(SYS_futex, &header->doorbell, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+// Function to ring the doorbell. Only the producer that clears 'sleeping' makes the system call.
+void shmIngestWake(struct shmIngestHeader *header)
+{
+    if (atomic_exchange(&header->sleeping, 0) == 0)
+    {
+        return;
+    }
+    atomic_fetch_add(&header->doorbell, 1);
+    syscall(SYS_futex, &header->doorbell, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+// Function run by the server before it waits: announce it sleeps, then look at the lanes once more.
+// It returns 1 when the server may wait, 0 when a record or a detached lane came in meanwhile.
+int shmIngestSleep(struct shmIngestHeader *header)
+{
+    atomic_store(&header->sleeping, 1);
+    atomic_thread_fence(memory_order_seq_cst);
+    for (unsigned int i = 0; i < header->lanes; i++)
+    {
+        struct shmIngestLane *lane = shmIngestLane(header, i);
+        int state = atomic_load_explicit(&lane->state, memory_order_acquire);
+        if (state == SHM_LANE_DETACHED || (state == SHM_LANE_ATTACHED && recordRingPeek(shmIngestRing(lane), 0) != NULL))
+        {
+            atomic_store(&header->sleeping, 0);
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Function to wait until the doorbell moves on from 'seen', read before shmIngestSleep(), or for at most timeoutMs.
+// It returns the doorbell.
+unsigned int shmIngestWait(struct shmIngestHeader *header, unsigned int seen, int timeoutMs)
+{
+    struct timespec timeout = {timeoutMs / 1000, (timeoutMs % 1000) * 1000000L};
+
+    syscall(SYS_futex, &header->doorbell, FUTEX_WAIT, seen, &timeout, NULL, 0);
+    return atomic_load(&header->doorbell);
+}
+
+// Function to get the size of a lane head, rounded up so the ring starts on a cache line
+static size_t laneHeadSize(void)
+{
+    return (sizeof(struct shmIngestLane) + 63) & ~(size_t)63;
+}
+
+// Function to turn a configured name into a shared memory object name, which starts with a slash
+static void objectName(char *buffer, size_t size, const char *name)
+{
+    snprintf(buffer, size, "%s%s", (name[0] == '/') ? "" : "/", name);
+}
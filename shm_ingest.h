@@ -0,0 +1,65 @@
+#ifndef SHM_INGEST_H
+#define SHM_INGEST_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+#include "record_ring.h"
+#include "protocol.h"
+
+// Shared-memory ingest: a POSIX shared memory object the server creates with shm_open(), in /dev/shm next to its
+// semaphore, for producers on the same host. It holds a number of lanes, each a record ring of record_ring.h.
+// A process attaches by claiming a free lane with its pid and name, then appends records, laid out as in
+// protocol.h, to that lane with no system call. The server drains the lanes and attributes their records to the
+// process that claimed them. When the server has found every lane empty and is about to sleep it sets 'sleeping';
+// the producer that sees it rings 'doorbell', a futex, so only a write to an idle server costs a wakeup.
+// A record takes one slot, RECORD_SLOT_SIZE bytes with its header: the LOG_MAX_RECORD of logclient.h. With the
+// prefix the server gives it, it takes more than one slot of a writer ring, which holds it whole all the same.
+
+#define SHM_INGEST_MAGIC 0x4c475348 // "LGSH"
+#define SHM_INGEST_VERSION 1
+
+// States of a lane
+#define SHM_LANE_FREE 0
+#define SHM_LANE_CLAIMED 1  // Taken by a process that is still filling in its name
+#define SHM_LANE_ATTACHED 2 // Drained by the server
+#define SHM_LANE_DETACHED 3 // Left by its process, or its process died: freed once drained
+
+struct shmIngestHeader
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t lanes;
+    uint32_t slots;           // Slots of the ring of each lane
+    uint64_t laneSize;        // Bytes from one lane to the next
+    atomic_int sleeping;      // Set by the server while it waits for records
+    atomic_uint doorbell;     // Futex word: bumped by a producer that found the server sleeping
+    atomic_int closed;        // Set when the server shuts down
+    char pad[28];             // The lanes start on a cache line of their own
+};
+
+// Head of a lane, followed by its ring
+struct shmIngestLane
+{
+    atomic_int state;
+    atomic_int owner; // pid of the process that claimed the lane
+    uint16_t nameLength;
+    char name[PROTOCOL_MAX_NAME + 1];
+    char pad[54];
+};
+
+struct shmIngestHeader *shmIngestCreate(const char *name, unsigned int lanes, unsigned int slots, size_t *size);
+void shmIngestRemove(const char *name);
+struct shmIngestHeader *shmIngestOpen(const char *name, size_t *size);
+struct shmIngestLane *shmIngestLane(struct shmIngestHeader *header, unsigned int lane);
+struct recordRing *shmIngestRing(struct shmIngestLane *lane);
+int shmIngestAttach(struct shmIngestHeader *header, const char *name, size_t length);
+int shmIngestPush(struct shmIngestHeader *header, int lane, const struct iovec *slices, int count);
+void shmIngestDetach(struct shmIngestHeader *header, int lane);
+void shmIngestClose(struct shmIngestHeader *header);
+void shmIngestWake(struct shmIngestHeader *header);
+int shmIngestSleep(struct shmIngestHeader *header);
+unsigned int shmIngestWait(struct shmIngestHeader *header, unsigned int seen, int timeoutMs);
+
+#endif
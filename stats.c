@@ -0,0 +1,561 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include "stats.h"
+
+struct statsRegion *statsRegion;
+__thread struct statsSlot *statsCurrentSlot;
+__thread unsigned int statsTicks[STATS_STAGES];
+__thread int statsTracing;
+
+static const char *stageNames[STATS_STAGES] = {"accept", "read", "format", "lock_wait", "ring_wait", "write", "rotate", "scan"};
+static const char *traceStageNames[STATS_TRACE_STAGES] = {"send_to_receive", "receive_to_enqueue", "enqueue_to_write",
+                                                          "write_to_sync", "send_to_durable"};
+
+static long long epochMillis(void);
+static void addCount(struct statsSlot *slot, atomic_ulong *counter, unsigned long value);
+static void mergeSlot(struct statsSlot *into, struct statsSlot *from);
+static void raiseMax(atomic_ulong *max, unsigned long value);
+static void countLatency(struct statsSlot *slot, struct statsHistogram *h, long long elapsed);
+static void keepSlowest(const struct statsSlowTrace *slow);
+static void writeLatency(FILE *out, unsigned long counts[STATS_BUCKETS][STATS_SUB_BUCKETS], unsigned long total,
+                         unsigned long sum, unsigned long max);
+static const char *clientLabel(int client);
+static unsigned long histogramPercentile(unsigned long counts[STATS_BUCKETS][STATS_SUB_BUCKETS], unsigned long total,
+                                         unsigned long max, double percentile);
+static void writeString(FILE *out, const char *text);
+
+// Function to turn the instrumentation on: map the region shared with the processes forked afterwards.
+// It returns -1 when it cannot be mapped.
+int statsInit(void)
+{
+    struct statsRegion *mapped = mmap(NULL, sizeof(struct statsRegion), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (mapped == MAP_FAILED)
+    {
+        return -1;
+    }
+    mapped->started = epochMillis();
+    snprintf(mapped->shared.role, sizeof(mapped->shared.role), "shared");
+    snprintf(mapped->retired.role, sizeof(mapped->retired.role), "retired");
+    snprintf(mapped->others.label, sizeof(mapped->others.label), "others");
+    mapped->others.firstSeen = mapped->started;
+    atomic_store(&mapped->others.ready, 1);
+    statsRegion = mapped;
+    return 0;
+}
+
+// Function to tell whether the instrumentation is on
+int statsEnabled(void)
+{
+    return statsRegion != NULL;
+}
+
+// Function to give the calling thread or process a slot of its own, under the given role
+void statsAttach(const char *role)
+{
+    if (statsRegion == NULL)
+    {
+        return;
+    }
+    int tid = (int)syscall(SYS_gettid);
+    statsCurrentSlot = &statsRegion->shared;
+    for (int i = 0; i < STATS_SLOTS; i++)
+    {
+        int expected = 0;
+        if (atomic_compare_exchange_strong(&statsRegion->slots[i].owner, &expected, tid))
+        {
+            statsCurrentSlot = &statsRegion->slots[i];
+            statsCurrentSlot->pid = getpid();
+            snprintf(statsCurrentSlot->role, sizeof(statsCurrentSlot->role), "%s", role);
+            break;
+        }
+    }
+    memset(statsTicks, 0, sizeof(statsTicks));
+}
+
+// Function to fold the slot of the calling thread or process into the retired counts and free it, before it goes away
+void statsDetach(void)
+{
+    if (statsRegion == NULL || statsCurrentSlot == NULL || statsCurrentSlot == &statsRegion->shared)
+    {
+        return;
+    }
+    mergeSlot(&statsRegion->retired, statsCurrentSlot);
+    // The owner frees it last: a thread attaching meanwhile starts from zero
+    memset((char *)statsCurrentSlot + sizeof(statsCurrentSlot->owner), 0, sizeof(*statsCurrentSlot) - sizeof(statsCurrentSlot->owner));
+    atomic_store(&statsCurrentSlot->owner, 0);
+    statsCurrentSlot = &statsRegion->shared;
+}
+
+// Function to read the monotonic clock in nanoseconds
+long long statsClock(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long)now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+// Function to count an event in the shared slot, for a thread that found no slot of its own or never attached,
+// such as a process forked from a thread that had none
+void statsStopShared(int stage, long long started, unsigned long bytes)
+{
+    struct statsSlot *slot = &statsRegion->shared;
+
+    atomic_fetch_add_explicit(&slot->events[stage], 1, memory_order_relaxed);
+    if (bytes > 0)
+    {
+        atomic_fetch_add_explicit(&slot->bytes[stage], bytes, memory_order_relaxed);
+    }
+    if (started != 0)
+    {
+        statsRecordLatency(slot, stage, started);
+    }
+}
+
+// Function to count the latency of an event timed since 'started' in the histogram of its stage
+void statsRecordLatency(struct statsSlot *slot, int stage, long long started)
+{
+    countLatency(slot, &slot->latency[stage], statsClock() - started);
+}
+
+// Function to find the entry of a client by its label, claiming a free one for a new client.
+// It returns NULL while the instrumentation is off.
+struct statsClient *statsFindClient(const char *label, size_t length)
+{
+    unsigned long key = 14695981039346656037UL;
+
+    if (statsRegion == NULL)
+    {
+        return NULL;
+    }
+    // FNV-1a, never 0 so a free entry is never matched
+    for (size_t i = 0; i < length; i++)
+    {
+        key = (key ^ (unsigned char)label[i]) * 1099511628211UL;
+    }
+    key = (key != 0) ? key : 1;
+
+    for (int probe = 0; probe < STATS_CLIENTS; probe++)
+    {
+        struct statsClient *client = &statsRegion->clients[(key + probe) % STATS_CLIENTS];
+        unsigned long expected = 0;
+        if (atomic_load(&client->key) == key)
+        {
+            return client;
+        }
+        if (atomic_compare_exchange_strong(&client->key, &expected, key))
+        {
+            client->firstSeen = epochMillis();
+            snprintf(client->label, sizeof(client->label), "%.*s", (int)length, label);
+            atomic_store(&client->ready, 1);
+            return client;
+        }
+        // Claimed meanwhile by the same client
+        if (expected == key)
+        {
+            return client;
+        }
+    }
+    return &statsRegion->others;
+}
+
+// Function to count records of a client and the bytes they came in
+void statsCountClient(struct statsClient *client, unsigned long records, unsigned long bytes)
+{
+    if (client == NULL)
+    {
+        return;
+    }
+    if (records > 0)
+    {
+        atomic_fetch_add_explicit(&client->records, records, memory_order_relaxed);
+    }
+    if (bytes > 0)
+    {
+        atomic_fetch_add_explicit(&client->bytes, bytes, memory_order_relaxed);
+    }
+}
+
+// Function to start tracing a record of a client, sent at 'sent' by the client's monotonic clock and received now.
+// It returns the trace, or 0 when the instrumentation is off or too many records are being traced.
+int statsTraceBegin(struct statsClient *client, unsigned long sequence, long long sent)
+{
+    if (statsRegion == NULL)
+    {
+        return 0;
+    }
+    unsigned int start = atomic_fetch_add_explicit(&statsRegion->nextTrace, 1, memory_order_relaxed);
+    for (int probe = 0; probe < STATS_TRACES; probe++)
+    {
+        int index = (start + probe) % STATS_TRACES;
+        struct statsTrace *trace = &statsRegion->traces[index];
+        int expected = 0;
+        if (atomic_load_explicit(&trace->busy, memory_order_relaxed) == 0 &&
+            atomic_compare_exchange_strong(&trace->busy, &expected, 1))
+        {
+            trace->client = (client != NULL && client != &statsRegion->others) ? (int)(client - statsRegion->clients) : -1;
+            trace->sequence = sequence;
+            memset(trace->at, 0, sizeof(trace->at));
+            trace->at[STATS_TRACE_SENT] = sent;
+            trace->at[STATS_TRACE_RECEIVED] = statsClock();
+            return index + 1;
+        }
+    }
+    atomic_fetch_add_explicit(&statsRegion->untraced, 1, memory_order_relaxed);
+    return 0;
+}
+
+// Function to stamp a point of a traced record with the time now
+void statsTraceStamp(int trace, int point)
+{
+    statsRegion->traces[trace - 1].at[point] = statsClock();
+}
+
+// Function to finish the trace of a record that became durable: once written, or once synced as well when 'synced'
+// is set. The time of each stage goes to its histogram and the record is kept if it is among the slowest.
+void statsTraceEnd(int trace, int synced)
+{
+    struct statsTrace *entry;
+    struct statsSlowTrace slow;
+
+    if (trace == 0)
+    {
+        return;
+    }
+    entry = &statsRegion->traces[trace - 1];
+    if (synced)
+    {
+        entry->at[STATS_TRACE_SYNCED] = statsClock();
+    }
+    long long durable = entry->at[synced ? STATS_TRACE_SYNCED : STATS_TRACE_WRITTEN];
+
+    slow.client = entry->client;
+    slow.synced = synced;
+    slow.sequence = entry->sequence;
+    for (int stage = 0; stage < STATS_TRACE_STAGES - 1; stage++)
+    {
+        slow.stages[stage] = entry->at[stage + 1] - entry->at[stage];
+    }
+    slow.stages[STATS_TRACE_STAGES - 1] = durable - entry->at[STATS_TRACE_SENT];
+    for (int stage = 0; stage < STATS_TRACE_STAGES; stage++)
+    {
+        // Without a sync there is no stage from the write to it
+        if (synced || stage != STATS_TRACE_SYNCED - 1)
+        {
+            countLatency(&statsRegion->shared, &statsRegion->traceLatency[stage], slow.stages[stage]);
+        }
+    }
+    atomic_fetch_add_explicit(&statsRegion->traced, 1, memory_order_relaxed);
+    keepSlowest(&slow);
+    atomic_store(&entry->busy, 0);
+}
+
+// Function to give up the trace of a record that will not be written, or whose sync will not be seen
+void statsTraceCancel(int trace)
+{
+    if (trace == 0)
+    {
+        return;
+    }
+    atomic_fetch_add_explicit(&statsRegion->untraced, 1, memory_order_relaxed);
+    atomic_store(&statsRegion->traces[trace - 1].busy, 0);
+}
+
+// Function to write a snapshot of every counter as one JSON object: the stages summed over every thread and process
+// with their latency percentiles, the events of each thread or process, and the records of each client.
+void statsWrite(FILE *out)
+{
+    static unsigned long counts[STATS_BUCKETS][STATS_SUB_BUCKETS];
+    struct statsSlot *all[STATS_SLOTS + 2];
+    int numberOfSlots = 0;
+    long long now = epochMillis();
+
+    if (statsRegion == NULL)
+    {
+        return;
+    }
+    all[numberOfSlots++] = &statsRegion->shared;
+    all[numberOfSlots++] = &statsRegion->retired;
+    for (int i = 0; i < STATS_SLOTS; i++)
+    {
+        if (atomic_load(&statsRegion->slots[i].owner) != 0)
+        {
+            all[numberOfSlots++] = &statsRegion->slots[i];
+        }
+    }
+
+    fprintf(out, "{\"time_ms\":%lld,\"uptime_ms\":%lld,\"sample_every\":%d,\"stages\":{", now, now - statsRegion->started,
+            STATS_SAMPLE_EVERY);
+    for (int stage = 0; stage < STATS_STAGES; stage++)
+    {
+        unsigned long events = 0, bytes = 0, total = 0, sum = 0, max = 0;
+        memset(counts, 0, sizeof(counts));
+        for (int i = 0; i < numberOfSlots; i++)
+        {
+            struct statsHistogram *h = &all[i]->latency[stage];
+            events += atomic_load_explicit(&all[i]->events[stage], memory_order_relaxed);
+            bytes += atomic_load_explicit(&all[i]->bytes[stage], memory_order_relaxed);
+            sum += atomic_load_explicit(&h->sum, memory_order_relaxed);
+            unsigned long slotMax = atomic_load_explicit(&h->max, memory_order_relaxed);
+            max = (slotMax > max) ? slotMax : max;
+            for (int bucket = 0; bucket < STATS_BUCKETS; bucket++)
+            {
+                for (int sub = 0; sub < STATS_SUB_BUCKETS; sub++)
+                {
+                    unsigned long count = atomic_load_explicit(&h->counts[bucket][sub], memory_order_relaxed);
+                    counts[bucket][sub] += count;
+                    total += count;
+                }
+            }
+        }
+        fprintf(out, "%s\"%s\":{\"events\":%lu,\"bytes\":%lu,\"timed\":%lu,", (stage > 0) ? "," : "", stageNames[stage],
+                events, bytes, total);
+        writeLatency(out, counts, total, sum, max);
+    }
+
+    fprintf(out, "},\"threads\":[");
+    for (int i = 0; i < numberOfSlots; i++)
+    {
+        fprintf(out, "%s{\"role\":", (i > 0) ? "," : "");
+        writeString(out, all[i]->role);
+        fprintf(out, ",\"pid\":%d,\"tid\":%d,\"events\":{", all[i]->pid, atomic_load(&all[i]->owner));
+        for (int stage = 0; stage < STATS_STAGES; stage++)
+        {
+            fprintf(out, "%s\"%s\":%lu", (stage > 0) ? "," : "", stageNames[stage],
+                    atomic_load_explicit(&all[i]->events[stage], memory_order_relaxed));
+        }
+        fprintf(out, "}}");
+    }
+
+    fprintf(out, "],\"clients\":[");
+    int first = 1;
+    for (int i = 0; i <= STATS_CLIENTS; i++)
+    {
+        struct statsClient *client = (i < STATS_CLIENTS) ? &statsRegion->clients[i] : &statsRegion->others;
+        unsigned long records = atomic_load_explicit(&client->records, memory_order_relaxed);
+        if (!atomic_load(&client->ready) || (client == &statsRegion->others && records == 0))
+        {
+            continue;
+        }
+        long long elapsed = now - client->firstSeen;
+        fprintf(out, "%s{\"client\":", first ? "" : ",");
+        writeString(out, client->label);
+        fprintf(out, ",\"records\":%lu,\"bytes\":%lu,\"first_seen_ms\":%lld,\"records_per_s\":%.1f}", records,
+                atomic_load_explicit(&client->bytes, memory_order_relaxed), client->firstSeen,
+                (elapsed > 0) ? records * 1000.0 / elapsed : 0.0);
+        first = 0;
+    }
+
+    fprintf(out, "],\"traces\":{\"traced\":%lu,\"untraced\":%lu,\"stages\":{",
+            atomic_load_explicit(&statsRegion->traced, memory_order_relaxed),
+            atomic_load_explicit(&statsRegion->untraced, memory_order_relaxed));
+    for (int stage = 0; stage < STATS_TRACE_STAGES; stage++)
+    {
+        struct statsHistogram *h = &statsRegion->traceLatency[stage];
+        unsigned long total = 0;
+        for (int bucket = 0; bucket < STATS_BUCKETS; bucket++)
+        {
+            for (int sub = 0; sub < STATS_SUB_BUCKETS; sub++)
+            {
+                counts[bucket][sub] = atomic_load_explicit(&h->counts[bucket][sub], memory_order_relaxed);
+                total += counts[bucket][sub];
+            }
+        }
+        fprintf(out, "%s\"%s\":{\"records\":%lu,", (stage > 0) ? "," : "", traceStageNames[stage], total);
+        writeLatency(out, counts, total, atomic_load_explicit(&h->sum, memory_order_relaxed),
+                     atomic_load_explicit(&h->max, memory_order_relaxed));
+    }
+
+    // Copied under the lock, so each record is seen whole
+    struct statsSlowTrace slowest[STATS_TRACE_SLOWEST];
+    while (atomic_flag_test_and_set_explicit(&statsRegion->slowestLock, memory_order_acquire))
+    {
+    }
+    int numberOfSlowest = statsRegion->numberOfSlowest;
+    memcpy(slowest, statsRegion->slowest, numberOfSlowest * sizeof(struct statsSlowTrace));
+    atomic_flag_clear_explicit(&statsRegion->slowestLock, memory_order_release);
+
+    fprintf(out, "},\"slowest\":[");
+    for (int i = 0; i < numberOfSlowest; i++)
+    {
+        fprintf(out, "%s{\"client\":", (i > 0) ? "," : "");
+        writeString(out, clientLabel(slowest[i].client));
+        fprintf(out, ",\"sequence\":%lu", slowest[i].sequence);
+        for (int stage = 0; stage < STATS_TRACE_STAGES; stage++)
+        {
+            if (slowest[i].synced || stage != STATS_TRACE_SYNCED - 1)
+            {
+                fprintf(out, ",\"%s_ns\":%lld", traceStageNames[stage], slowest[i].stages[stage]);
+            }
+        }
+        fprintf(out, "}");
+    }
+    fprintf(out, "]}}\n");
+}
+
+// Function to read the wall clock in milliseconds
+static long long epochMillis(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    return (long long)now.tv_sec * 1000LL + now.tv_nsec / 1000000;
+}
+
+// Function to add to a counter of a slot as statsStop() does: the shared slot is the only one that needs an atomic add
+static void addCount(struct statsSlot *slot, atomic_ulong *counter, unsigned long value)
+{
+    if (slot == &statsRegion->shared)
+    {
+        atomic_fetch_add_explicit(counter, value, memory_order_relaxed);
+        return;
+    }
+    atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + value, memory_order_relaxed);
+}
+
+// Function to add the counts of one slot to another
+static void mergeSlot(struct statsSlot *into, struct statsSlot *from)
+{
+    for (int stage = 0; stage < STATS_STAGES; stage++)
+    {
+        struct statsHistogram *to = &into->latency[stage];
+        struct statsHistogram *h = &from->latency[stage];
+        atomic_fetch_add(&into->events[stage], atomic_load(&from->events[stage]));
+        atomic_fetch_add(&into->bytes[stage], atomic_load(&from->bytes[stage]));
+        atomic_fetch_add(&to->sum, atomic_load(&h->sum));
+        raiseMax(&to->max, atomic_load(&h->max));
+        for (int bucket = 0; bucket < STATS_BUCKETS; bucket++)
+        {
+            for (int sub = 0; sub < STATS_SUB_BUCKETS; sub++)
+            {
+                unsigned long count = atomic_load_explicit(&h->counts[bucket][sub], memory_order_relaxed);
+                if (count > 0)
+                {
+                    atomic_fetch_add(&to->counts[bucket][sub], count);
+                }
+            }
+        }
+    }
+}
+
+// Function to raise a maximum shared by several updaters
+static void raiseMax(atomic_ulong *max, unsigned long value)
+{
+    unsigned long seen = atomic_load_explicit(max, memory_order_relaxed);
+
+    while (value > seen && !atomic_compare_exchange_weak_explicit(max, &seen, value, memory_order_relaxed, memory_order_relaxed))
+    {
+    }
+}
+
+// Function to count a latency in nanoseconds in a histogram of a slot, or a shared one with the shared slot.
+// A negative latency, from a client clock behind ours, counts as 0.
+static void countLatency(struct statsSlot *slot, struct statsHistogram *h, long long elapsed)
+{
+    unsigned long value = (elapsed > 0) ? elapsed : 0;
+    int bucket = 0;
+
+    // Values below STATS_SUB_BUCKETS are exact; above, each power of two is split into STATS_SUB_BUCKETS
+    while ((value >> bucket) >= STATS_SUB_BUCKETS && bucket < STATS_BUCKETS - 1)
+    {
+        bucket++;
+    }
+    addCount(slot, &h->counts[bucket][(value >> bucket) & (STATS_SUB_BUCKETS - 1)], 1);
+    addCount(slot, &h->sum, value);
+    raiseMax(&h->max, value);
+}
+
+// Function to keep a traced record among the slowest if it took longer, from its send to when it was durable,
+// than the quickest of them
+static void keepSlowest(const struct statsSlowTrace *slow)
+{
+    long long total = slow->stages[STATS_TRACE_STAGES - 1];
+
+    while (atomic_flag_test_and_set_explicit(&statsRegion->slowestLock, memory_order_acquire))
+    {
+    }
+    int quickest = 0;
+    for (int i = 1; i < statsRegion->numberOfSlowest; i++)
+    {
+        if (statsRegion->slowest[i].stages[STATS_TRACE_STAGES - 1] < statsRegion->slowest[quickest].stages[STATS_TRACE_STAGES - 1])
+        {
+            quickest = i;
+        }
+    }
+    if (statsRegion->numberOfSlowest < STATS_TRACE_SLOWEST)
+    {
+        statsRegion->slowest[statsRegion->numberOfSlowest++] = *slow;
+    }
+    else if (total > statsRegion->slowest[quickest].stages[STATS_TRACE_STAGES - 1])
+    {
+        statsRegion->slowest[quickest] = *slow;
+    }
+    atomic_flag_clear_explicit(&statsRegion->slowestLock, memory_order_release);
+}
+
+// Function to write the latency summary of merged histogram counts, closing the object the caller opened
+static void writeLatency(FILE *out, unsigned long counts[STATS_BUCKETS][STATS_SUB_BUCKETS], unsigned long total,
+                         unsigned long sum, unsigned long max)
+{
+    fprintf(out, "\"mean_ns\":%lu,\"p50_ns\":%lu,\"p90_ns\":%lu,\"p99_ns\":%lu,\"p999_ns\":%lu,\"max_ns\":%lu}",
+            (total > 0) ? sum / total : 0, histogramPercentile(counts, total, max, 50), histogramPercentile(counts, total, max, 90),
+            histogramPercentile(counts, total, max, 99), histogramPercentile(counts, total, max, 99.9), max);
+}
+
+// Function to get the label of a client by its index in 'clients', -1 for 'others'
+static const char *clientLabel(int client)
+{
+    return (client >= 0) ? statsRegion->clients[client].label : statsRegion->others.label;
+}
+
+// Function to get the value below which the given percentage of the values of merged histogram counts fall
+static unsigned long histogramPercentile(unsigned long counts[STATS_BUCKETS][STATS_SUB_BUCKETS], unsigned long total,
+                                         unsigned long max, double percentile)
+{
+    unsigned long target = (unsigned long)(total * percentile / 100.0);
+    unsigned long seen = 0;
+
+    if (total == 0)
+    {
+        return 0;
+    }
+    for (int bucket = 0; bucket < STATS_BUCKETS; bucket++)
+    {
+        for (int sub = 0; sub < STATS_SUB_BUCKETS; sub++)
+        {
+            seen += counts[bucket][sub];
+            if (seen > target)
+            {
+                return (unsigned long)sub << bucket;
+            }
+        }
+    }
+    return max;
+}
+
+// Function to write a string as a JSON string: client names may hold any byte
+static void writeString(FILE *out, const char *text)
+{
+    fputc('"', out);
+    for (const unsigned char *p = (const unsigned char *)text; *p != '\0'; p++)
+    {
+        if (*p == '"' || *p == '\\')
+        {
+            fprintf(out, "\\%c", *p);
+        }
+        else if (*p < 0x20 || *p >= 0x7f)
+        {
+            fprintf(out, "\\u%04x", *p);
+        }
+        else
+        {
+            fputc(*p, out);
+        }
+    }
+    fputc('"', out);
+}
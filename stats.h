@@ -0,0 +1,190 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdio.h>
+
+// Hot-path instrumentation of the server: counters and latency histograms for each stage a record goes through.
+// They live in one MAP_SHARED region set up before anything forks, so client processes, writer processes and threads
+// all count into it. Every thread or process attaches to a slot of its own and is the only one updating it, with
+// relaxed loads and stores and no locked instruction; a snapshot sums the slots as they are, without stopping anyone. A slot
+// left by a thread or process is folded into 'retired' so its counts survive it. When every slot is taken, the others
+// share one, which stays correct, only slower.
+//
+// Every event is counted, but only one in STATS_SAMPLE_EVERY of the frequent ones of a thread is timed, so the
+// instrumentation costs one clock read per few reads or writes. Latencies are kept in log-linear histograms in
+// nanoseconds, like the ones of loadgen: values within 1/32 of their size.
+//
+// Records a client asks to have traced (FRAME_TRACE of protocol.h) are followed from its send to the disk: the
+// server stamps when it received each one, handed it to the log, wrote it and synced it, in an entry of 'traces'
+// that travels with the record, through a ring of the writer stage in the slot's tag. Once the record is durable
+// the time between each of those points goes to a histogram, and the slowest records are kept with theirs.
+
+#define STATS_STAGE_ACCEPT 0    // accept() of a connection
+#define STATS_STAGE_READ 1      // read() from a client socket
+#define STATS_STAGE_FORMAT 2    // Parsing what a read brought in into records and handing them on
+#define STATS_STAGE_LOCK_WAIT 3 // Waiting on the semaphore of a stream to write it directly
+#define STATS_STAGE_RING_WAIT 4 // Waiting for a free slot of a full writer ring
+#define STATS_STAGE_WRITE 5     // Writing a record or batch to the active segment
+#define STATS_STAGE_ROTATE 6    // Closing a full segment, applying retention and starting the next one
+#define STATS_STAGE_SCAN 7      // Loading the segment index, or listing and sizing the segments, of a stream
+#define STATS_STAGES 8
+
+#define STATS_SAMPLE_EVERY 256 // Frequent stages time one event in this many, a power of two
+#define STATS_FREQUENT_STAGES ((1 << STATS_STAGE_READ) | (1 << STATS_STAGE_FORMAT) | (1 << STATS_STAGE_LOCK_WAIT) | (1 << STATS_STAGE_WRITE))
+#define STATS_SLOTS 64         // Threads and processes with a slot of their own
+#define STATS_CLIENTS 256      // Clients whose records are counted separately, the others are counted together
+#define STATS_ROLE_LENGTH 16
+#define STATS_LABEL_LENGTH 320 // "Client (IP) - name" at its longest
+#define STATS_SUB_BUCKETS 32
+#define STATS_BUCKETS 40
+
+// Points of a traced record, in order
+#define STATS_TRACE_SENT 0     // The client sent it, by the client's monotonic clock
+#define STATS_TRACE_RECEIVED 1 // It was parsed out of a read
+#define STATS_TRACE_ENQUEUED 2 // It was handed to the log: the semaphore of the stream taken, or pushed to a ring or staged
+#define STATS_TRACE_WRITTEN 3  // The write holding it returned
+#define STATS_TRACE_SYNCED 4   // The fdatasync() after it returned, with a fsync_policy
+#define STATS_TRACE_POINTS 5
+#define STATS_TRACE_STAGES 5    // From each point to the next, then from the send to when it was durable
+#define STATS_TRACES 1024       // Records traced at once, more are not traced
+#define STATS_TRACE_SLOWEST 16  // Slowest records kept
+#define STATS_TRACE_PENDING 256 // Traced records a stream holds between their write and their sync, more are not traced
+
+struct statsHistogram
+{
+    atomic_ulong counts[STATS_BUCKETS][STATS_SUB_BUCKETS];
+    atomic_ulong sum;
+    atomic_ulong max;
+};
+
+// Counts of one thread or process
+struct statsSlot
+{
+    atomic_int owner; // Thread id of its owner, 0 when free
+    int pid;
+    char role[STATS_ROLE_LENGTH];
+    atomic_ulong events[STATS_STAGES];
+    atomic_ulong bytes[STATS_STAGES];
+    struct statsHistogram latency[STATS_STAGES];
+};
+
+// Records of one client, found by the hash of its label
+struct statsClient
+{
+    atomic_ulong key;   // 0 when free
+    atomic_int ready;   // Set once the label is filled in
+    long long firstSeen; // Milliseconds since the epoch
+    atomic_ulong records;
+    atomic_ulong bytes;
+    char label[STATS_LABEL_LENGTH];
+};
+
+// A record being traced, owned by whoever holds the record
+struct statsTrace
+{
+    atomic_int busy;
+    int client; // Index in 'clients', -1 for 'others'
+    unsigned long sequence;
+    long long at[STATS_TRACE_POINTS]; // Monotonic nanoseconds
+};
+
+// A traced record among the slowest, with the nanoseconds of each stage
+struct statsSlowTrace
+{
+    int client;
+    int synced;
+    unsigned long sequence;
+    long long stages[STATS_TRACE_STAGES];
+};
+
+struct statsRegion
+{
+    long long started; // Milliseconds since the epoch
+    struct statsSlot shared;  // Used by whoever found no free slot
+    struct statsSlot retired; // Counts of the threads and processes that are gone
+    struct statsSlot slots[STATS_SLOTS];
+    struct statsClient others; // Clients that found no free entry
+    struct statsClient clients[STATS_CLIENTS];
+    atomic_ulong traced;    // Traced records that became durable
+    atomic_ulong untraced;  // Records asked to be traced that were not: no free entry, dropped or never written
+    atomic_uint nextTrace;  // Where the search for a free entry starts
+    atomic_flag slowestLock;
+    int numberOfSlowest;
+    struct statsSlowTrace slowest[STATS_TRACE_SLOWEST];
+    struct statsHistogram traceLatency[STATS_TRACE_STAGES];
+    struct statsTrace traces[STATS_TRACES];
+};
+
+// The hot path is inlined below, and only reaches into stats.c for a timed event
+extern struct statsRegion *statsRegion;                // NULL while the instrumentation is off
+extern __thread struct statsSlot *statsCurrentSlot;    // Slot of the calling thread, NULL until it attaches
+extern __thread unsigned int statsTicks[STATS_STAGES]; // Events of the calling thread, to pick the ones to time
+extern __thread int statsTracing;                      // Trace of the record the calling thread hands to the log, 0 for none
+
+int statsInit(void);
+int statsEnabled(void);
+void statsAttach(const char *role);
+void statsDetach(void);
+long long statsClock(void);
+void statsStopShared(int stage, long long started, unsigned long bytes);
+void statsRecordLatency(struct statsSlot *slot, int stage, long long started);
+struct statsClient *statsFindClient(const char *label, size_t length);
+void statsCountClient(struct statsClient *client, unsigned long records, unsigned long bytes);
+int statsTraceBegin(struct statsClient *client, unsigned long sequence, long long sent);
+void statsTraceStamp(int trace, int point);
+void statsTraceEnd(int trace, int synced);
+void statsTraceCancel(int trace);
+void statsWrite(FILE *out);
+
+// Function to start timing an event of a stage. It returns 0 when the event is not timed: rare stages time every event.
+static inline long long statsStart(int stage)
+{
+    unsigned int mask = ((STATS_FREQUENT_STAGES >> stage) & 1) ? STATS_SAMPLE_EVERY - 1 : 0;
+
+    if (statsRegion == NULL || (statsTicks[stage]++ & mask) != 0)
+    {
+        return 0;
+    }
+    return statsClock();
+}
+
+// Function to count an event of a stage and the bytes it moved, and its latency when statsStart() timed it.
+// The owner of a slot is the only one writing it, so a plain load and store do, at the cost of an increment.
+static inline void statsStop(int stage, long long started, unsigned long bytes)
+{
+    struct statsSlot *slot = statsCurrentSlot;
+
+    if (statsRegion == NULL)
+    {
+        return;
+    }
+    if (slot == NULL || slot == &statsRegion->shared)
+    {
+        statsStopShared(stage, started, bytes);
+        return;
+    }
+    atomic_store_explicit(&slot->events[stage], atomic_load_explicit(&slot->events[stage], memory_order_relaxed) + 1,
+                          memory_order_relaxed);
+    if (bytes > 0)
+    {
+        atomic_store_explicit(&slot->bytes[stage], atomic_load_explicit(&slot->bytes[stage], memory_order_relaxed) + bytes,
+                              memory_order_relaxed);
+    }
+    if (started != 0)
+    {
+        statsRecordLatency(slot, stage, started);
+    }
+}
+
+// Function to stamp a point of a traced record, if the record is traced
+static inline void statsTraceMark(int trace, int point)
+{
+    if (trace != 0)
+    {
+        statsTraceStamp(trace, point);
+    }
+}
+
+#endif
@@ -0,0 +1,182 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include "uring.h"
+
+// The kernel and this process share the ring indexes, so they are read and written with acquire/release ordering
+#define loadAcquire(p) atomic_load_explicit((_Atomic unsigned *)(p), memory_order_acquire)
+#define storeRelease(p, v) atomic_store_explicit((_Atomic unsigned *)(p), (v), memory_order_release)
+
+// Function to set up a ring with room for 'entries' submissions. It returns -1, with errno set,
+// when io_uring is missing or forbidden on this system, so the caller can fall back.
+int uringInit(struct uring *ring, unsigned entries)
+{
+    struct io_uring_params params;
+
+    memset(ring, 0, sizeof(*ring));
+    memset(&params, 0, sizeof(params));
+    ring->fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (ring->fd < 0)
+    {
+        return -1;
+    }
+    ring->features = params.features;
+
+    ring->sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqRing = mmap(NULL, ring->sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    ring->cqRing = mmap(NULL, ring->cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+    ring->sqes = mmap(NULL, ring->sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqRing == MAP_FAILED || ring->cqRing == MAP_FAILED || ring->sqes == MAP_FAILED)
+    {
+        int saved = errno;
+        uringExit(ring);
+        errno = saved;
+        return -1;
+    }
+
+    char *sq = ring->sqRing;
+    ring->sqHead = (unsigned *)(sq + params.sq_off.head);
+    ring->sqTail = (unsigned *)(sq + params.sq_off.tail);
+    ring->sqMask = *(unsigned *)(sq + params.sq_off.ring_mask);
+    ring->sqArray = (unsigned *)(sq + params.sq_off.array);
+    ring->sqLocalTail = *ring->sqTail;
+    ring->sqSubmitted = ring->sqLocalTail;
+    char *cq = ring->cqRing;
+    ring->cqHead = (unsigned *)(cq + params.cq_off.head);
+    ring->cqTail = (unsigned *)(cq + params.cq_off.tail);
+    ring->cqMask = *(unsigned *)(cq + params.cq_off.ring_mask);
+    ring->cqEntries = params.cq_entries;
+    ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+    return 0;
+}
+
+// Function to tear a ring down. Requests still in flight are cancelled by the kernel.
+void uringExit(struct uring *ring)
+{
+    if (ring->sqes != NULL && ring->sqes != MAP_FAILED)
+    {
+        munmap(ring->sqes, ring->sqesSize);
+    }
+    if (ring->cqRing != NULL && ring->cqRing != MAP_FAILED)
+    {
+        munmap(ring->cqRing, ring->cqRingSize);
+    }
+    if (ring->sqRing != NULL && ring->sqRing != MAP_FAILED)
+    {
+        munmap(ring->sqRing, ring->sqRingSize);
+    }
+    if (ring->fd >= 0)
+    {
+        close(ring->fd);
+    }
+    ring->fd = -1;
+}
+
+// Function to check that the kernel implements every given operation. It returns 1 if it does.
+int uringSupports(struct uring *ring, const int *ops, int count)
+{
+    size_t size = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = calloc(1, size);
+    int supported = 0;
+
+    if (probe != NULL && syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PROBE, probe, 256) == 0)
+    {
+        supported = 1;
+        for (int i = 0; i < count; i++)
+        {
+            if (ops[i] > probe->last_op || !(probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED))
+            {
+                supported = 0;
+            }
+        }
+    }
+    free(probe);
+    return supported;
+}
+
+// Function to get a cleared submission entry to fill in. It returns NULL when the submission queue is full.
+struct io_uring_sqe *uringGetSqe(struct uring *ring)
+{
+    if (ring->sqLocalTail - loadAcquire(ring->sqHead) > ring->sqMask)
+    {
+        return NULL;
+    }
+    unsigned index = ring->sqLocalTail & ring->sqMask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sqArray[index] = index;
+    ring->sqLocalTail++;
+    return sqe;
+}
+
+// Function to hand the filled entries to the kernel and wait until at least 'waitFor' completions are ready,
+// or 'timeoutMs' passed when it is not negative. Everything happens in one io_uring_enter() call.
+// It returns -1 with errno set on failure; EINTR and ETIME are normal wake ups.
+int uringSubmitAndWait(struct uring *ring, unsigned waitFor, int timeoutMs)
+{
+    struct __kernel_timespec timeout = {.tv_sec = timeoutMs / 1000, .tv_nsec = (long long)(timeoutMs % 1000) * 1000000};
+    struct io_uring_getevents_arg arg = {.ts = (unsigned long)&timeout};
+    unsigned flags = (waitFor > 0) ? IORING_ENTER_GETEVENTS : 0;
+
+    storeRelease(ring->sqTail, ring->sqLocalTail);
+    unsigned toSubmit = ring->sqLocalTail - ring->sqSubmitted;
+    if (toSubmit == 0 && waitFor == 0)
+    {
+        return 0;
+    }
+    if (waitFor > 0 && timeoutMs >= 0)
+    {
+        flags |= IORING_ENTER_EXT_ARG;
+    }
+    int result = syscall(__NR_io_uring_enter, ring->fd, toSubmit, waitFor, flags,
+                         (flags & IORING_ENTER_EXT_ARG) ? (void *)&arg : NULL, sizeof(arg));
+    if (result >= 0)
+    {
+        ring->sqSubmitted += result;
+    }
+    return result;
+}
+
+// Function to look at the oldest completion without consuming it. It returns NULL when there is none.
+struct io_uring_cqe *uringPeekCqe(struct uring *ring)
+{
+    unsigned head = *ring->cqHead;
+
+    if (head == loadAcquire(ring->cqTail))
+    {
+        return NULL;
+    }
+    return &ring->cqes[head & ring->cqMask];
+}
+
+// Function to release the completion returned by uringPeekCqe()
+void uringCqeSeen(struct uring *ring)
+{
+    storeRelease(ring->cqHead, *ring->cqHead + 1);
+}
+
+// Function to register buffers for the *_FIXED operations, which then skip pinning the pages on every request
+int uringRegisterBuffers(struct uring *ring, const struct iovec *buffers, unsigned count)
+{
+    return syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_BUFFERS, buffers, count);
+}
+
+// Function to register files, then used by index with IOSQE_FIXED_FILE instead of being looked up on every request
+int uringRegisterFiles(struct uring *ring, const int *fds, unsigned count)
+{
+    return syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_FILES, fds, count);
+}
+
+// Function to replace one registered file, e.g. the log segment after a rotation
+int uringUpdateFile(struct uring *ring, unsigned index, int fd)
+{
+    struct io_uring_files_update update = {.offset = index, .fds = (unsigned long)&fd};
+    return syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_FILES_UPDATE, &update, 1);
+}
@@ -0,0 +1,47 @@
+#ifndef URING_H
+#define URING_H
+
+#include <stddef.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+// Minimal io_uring wrapper over the raw system calls: ring set up, submission and completion queues,
+// registered buffers and files. It covers what the uring server mode needs and nothing more.
+struct uring
+{
+    int fd;
+    unsigned features;
+    // Submission queue, shared with the kernel
+    unsigned *sqHead;
+    unsigned *sqTail;
+    unsigned sqMask;
+    unsigned *sqArray;
+    struct io_uring_sqe *sqes;
+    unsigned sqLocalTail; // SQEs filled but not handed to the kernel yet end here
+    unsigned sqSubmitted; // Tail the kernel has been told about
+    // Completion queue, shared with the kernel
+    unsigned *cqHead;
+    unsigned *cqTail;
+    unsigned cqMask;
+    unsigned cqEntries;
+    struct io_uring_cqe *cqes;
+    // Mappings to release
+    void *sqRing;
+    size_t sqRingSize;
+    void *cqRing;
+    size_t cqRingSize;
+    size_t sqesSize;
+};
+
+int uringInit(struct uring *ring, unsigned entries);
+void uringExit(struct uring *ring);
+int uringSupports(struct uring *ring, const int *ops, int count);
+struct io_uring_sqe *uringGetSqe(struct uring *ring);
+int uringSubmitAndWait(struct uring *ring, unsigned waitFor, int timeoutMs);
+struct io_uring_cqe *uringPeekCqe(struct uring *ring);
+void uringCqeSeen(struct uring *ring);
+int uringRegisterBuffers(struct uring *ring, const struct iovec *buffers, unsigned count);
+int uringRegisterFiles(struct uring *ring, const int *fds, unsigned count);
+int uringUpdateFile(struct uring *ring, unsigned index, int fd);
+
+#endif